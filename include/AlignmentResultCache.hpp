@@ -0,0 +1,85 @@
+#ifndef __ALIGNMENT_RESULT_CACHE_HPP__
+#define __ALIGNMENT_RESULT_CACHE_HPP__
+
+#include <cstdint>
+#include <vector>
+
+#include "Util.hpp"
+#include "parallel_hashmap/phmap.h"
+
+/**
+ * A bounded map from a 64-bit key to an alignment result that, unlike the
+ * per-read alignment caches of PuffAligner, lives across reads.  Once it
+ * holds `capacity` entries, inserting evicts an entry chosen by the CLOCK
+ * policy (an approximation of LRU): entries are kept in a ring, each with
+ * a bit that is set whenever it is found, and the clock hand evicts the
+ * first entry whose bit is clear, clearing the bits it passes over.
+ *
+ * It is not thread-safe; each mapping thread owns its own cache.
+ */
+class AlignmentResultCache {
+public:
+  using AlignmentResult = pufferfish::util::AlignmentResult;
+
+  explicit AlignmentResultCache(uint32_t capacity = 0) { resize(capacity); }
+
+  void resize(uint32_t capacity) {
+    capacity_ = capacity;
+    slots_.clear();
+    slots_.reserve(capacity);
+    index_.clear();
+    index_.reserve(capacity);
+    hand_ = 0;
+  }
+
+  bool enabled() const { return capacity_ > 0; }
+
+  // Returns the cached result for key, or nullptr if there is none.
+  const AlignmentResult* find(uint64_t key) {
+    auto it = index_.find(key);
+    if (it == index_.end()) { return nullptr; }
+    auto& slot = slots_[it->second];
+    slot.referenced = true;
+    return &slot.result;
+  }
+
+  void insert(uint64_t key, const AlignmentResult& result) {
+    if (capacity_ == 0) { return; }
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      slots_[it->second].result = result;
+      slots_[it->second].referenced = true;
+      return;
+    }
+    if (slots_.size() < capacity_) {
+      index_[key] = static_cast<uint32_t>(slots_.size());
+      slots_.push_back({key, result, false});
+      return;
+    }
+    // advance the clock hand to the first entry that was not used since the hand last passed it
+    while (slots_[hand_].referenced) {
+      slots_[hand_].referenced = false;
+      hand_ = (hand_ + 1 == capacity_) ? 0 : hand_ + 1;
+    }
+    auto& victim = slots_[hand_];
+    index_.erase(victim.key);
+    victim.key = key;
+    victim.result = result;
+    index_[key] = hand_;
+    hand_ = (hand_ + 1 == capacity_) ? 0 : hand_ + 1;
+  }
+
+private:
+  struct Slot {
+    uint64_t key;
+    AlignmentResult result;
+    bool referenced;
+  };
+
+  uint32_t capacity_{0};
+  uint32_t hand_{0};
+  std::vector<Slot> slots_;
+  phmap::flat_hash_map<uint64_t, uint32_t> index_;
+};
+
+#endif // __ALIGNMENT_RESULT_CACHE_HPP__
@@ -0,0 +1,378 @@
+#ifndef __BAM_WRITER_HPP__
+#define __BAM_WRITER_HPP__
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <vector>
+
+#include "SAMWriter.hpp"
+
+// Writers for BAM output.  They produce the same records as the SAM writers
+// in SAMWriter.hpp, encoded as (uncompressed) BAM; the OutputWriter puts the
+// BGZF compression around them.  Read names are cut at the first space, and
+// a trailing /1 or /2 is removed from paired read names, as in the SAM output.
+namespace bam {
+
+// The 4-bit code of each base ("=ACMGRSVTWYHKDBN"); anything else is an N.
+inline uint8_t baseCode(char c) {
+  static const struct Table {
+    uint8_t code[256];
+    Table() {
+      std::memset(code, 15, sizeof(code));
+      const char* bases = "=ACMGRSVTWYHKDBN";
+      for (uint8_t i = 0; i < 16; ++i) {
+        code[static_cast<uint8_t>(bases[i])] = i;
+        code[static_cast<uint8_t>(std::tolower(bases[i]))] = i;
+      }
+    }
+  } table;
+  return table.code[static_cast<uint8_t>(c)];
+}
+
+// The code of the complement of a 4-bit base code: its bits, reversed.
+inline uint8_t complementCode(uint8_t code) {
+  static const uint8_t comp[16] = {0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15};
+  return comp[code];
+}
+
+// The BAI bin of the 0-based, half-open interval [beg, end), as in the SAM spec.
+inline uint16_t reg2bin(int32_t beg, int32_t end) {
+  --end;
+  if (beg >> 14 == end >> 14) { return ((1 << 15) - 1) / 7 + (beg >> 14); }
+  if (beg >> 17 == end >> 17) { return ((1 << 12) - 1) / 7 + (beg >> 17); }
+  if (beg >> 20 == end >> 20) { return ((1 << 9) - 1) / 7 + (beg >> 20); }
+  if (beg >> 23 == end >> 23) { return ((1 << 6) - 1) / 7 + (beg >> 23); }
+  if (beg >> 26 == end >> 26) { return ((1 << 3) - 1) / 7 + (beg >> 26); }
+  return 0;
+}
+
+// Encodes a text CIGAR into ops and returns the number of reference bases it spans.
+inline int32_t parseCigar(const char* cigar, std::vector<uint32_t>& ops) {
+  static const char* opNames = "MIDNSHP=X";
+  ops.clear();
+  int32_t refLen{0};
+  uint32_t len{0};
+  for (const char* c = cigar; *c != '\0' and *c != '*'; ++c) {
+    if (*c >= '0' and *c <= '9') {
+      len = len * 10 + static_cast<uint32_t>(*c - '0');
+      continue;
+    }
+    const char* op = std::strchr(opNames, *c);
+    if (op == nullptr) {
+      std::cerr << "ERROR!! UNKNOWN CIGAR OPERATION " << *c << " IN " << cigar << "\n";
+      std::exit(1);
+    }
+    uint32_t code = static_cast<uint32_t>(op - opNames);
+    ops.push_back(len << 4 | code);
+    // M, D, N, = and X consume the reference
+    if (code == 0 or code == 2 or code == 3 or code == 7 or code == 8) { refLen += len; }
+    len = 0;
+  }
+  return refLen;
+}
+
+inline size_t intTagSize(int64_t v) {
+  if (v >= 0) { return 3 + (v <= 0xff ? 1 : (v <= 0xffff ? 2 : 4)); }
+  return 3 + (v >= -0x80 ? 1 : (v >= -0x8000 ? 2 : 4));
+}
+
+// Writes an integer tag using the smallest type that holds it, as samtools does.
+inline char* putIntTag(char* p, const char* tag, int64_t v) {
+  p[0] = tag[0];
+  p[1] = tag[1];
+  p += 2;
+  if (v >= 0) {
+    if (v <= 0xff) {
+      *p++ = 'C';
+      *p++ = static_cast<char>(v);
+    } else if (v <= 0xffff) {
+      uint16_t x = static_cast<uint16_t>(v);
+      *p++ = 'S';
+      std::memcpy(p, &x, sizeof(x));
+      p += sizeof(x);
+    } else {
+      uint32_t x = static_cast<uint32_t>(v);
+      *p++ = 'I';
+      std::memcpy(p, &x, sizeof(x));
+      p += sizeof(x);
+    }
+  } else {
+    if (v >= -0x80) {
+      *p++ = 'c';
+      *p++ = static_cast<char>(static_cast<int8_t>(v));
+    } else if (v >= -0x8000) {
+      int16_t x = static_cast<int16_t>(v);
+      *p++ = 's';
+      std::memcpy(p, &x, sizeof(x));
+      p += sizeof(x);
+    } else {
+      int32_t x = static_cast<int32_t>(v);
+      *p++ = 'i';
+      std::memcpy(p, &x, sizeof(x));
+      p += sizeof(x);
+    }
+  }
+  return p;
+}
+
+template <typename T>
+inline char* put(char* p, T v) {
+  std::memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+/**
+ * Appends one BAM record, with the NH, HI and AS tags, to out.  The
+ * sequence is packed straight from seq, reverse complemented on the fly
+ * if revComp is set; a CIGAR of "*" (or "") leaves the record without one.
+ * The record carries no qualities, as the SAM output does.
+ */
+inline void appendRecord(BinWriter& out, fmt::StringRef name, uint16_t flag, int32_t refID, int32_t pos,
+                         uint8_t mapq, const char* cigar, int32_t nextRefID, int32_t nextPos, int32_t tlen,
+                         const std::string& seq, bool revComp, int64_t nh, int64_t hi, int64_t score,
+                         std::vector<uint32_t>& cigarOps) {
+  int32_t refLen = parseCigar(cigar, cigarOps);
+  int32_t end = pos + std::max(refLen, 1);
+  size_t nameLen = std::min<size_t>(name.size(), 254);
+  int32_t seqLen = static_cast<int32_t>(seq.length());
+  size_t tagLen = intTagSize(nh) + intTagSize(hi) + intTagSize(score);
+  size_t recordLen = 32 + nameLen + 1 + 4 * cigarOps.size() + (seqLen + 1) / 2 + seqLen + tagLen;
+
+  char* p = out.extend(4 + recordLen);
+  p = put(p, static_cast<int32_t>(recordLen));
+  p = put(p, refID);
+  p = put(p, pos);
+  p = put(p, static_cast<uint8_t>(nameLen + 1));
+  p = put(p, mapq);
+  p = put(p, reg2bin(pos, end));
+  p = put(p, static_cast<uint16_t>(cigarOps.size()));
+  p = put(p, flag);
+  p = put(p, seqLen);
+  p = put(p, nextRefID);
+  p = put(p, nextPos);
+  p = put(p, tlen);
+  std::memcpy(p, name.data(), nameLen);
+  p[nameLen] = '\0';
+  p += nameLen + 1;
+  if (!cigarOps.empty()) {
+    std::memcpy(p, cigarOps.data(), 4 * cigarOps.size());
+    p += 4 * cigarOps.size();
+  }
+  // two bases per byte, the first in the high nibble
+  for (int32_t i = 0; i < seqLen; i += 2) {
+    uint8_t hiCode = revComp ? complementCode(baseCode(seq[seqLen - 1 - i])) : baseCode(seq[i]);
+    uint8_t loCode{0};
+    if (i + 1 < seqLen) {
+      loCode = revComp ? complementCode(baseCode(seq[seqLen - 2 - i])) : baseCode(seq[i + 1]);
+    }
+    *p++ = static_cast<char>(hiCode << 4 | loCode);
+  }
+  std::memset(p, 0xff, seqLen);
+  p += seqLen;
+  p = putIntTag(p, "NH", nh);
+  p = putIntTag(p, "HI", hi);
+  putIntTag(p, "AS", score);
+}
+
+} // namespace bam
+
+// The BAM header lists every reference of the index, in index order, so that
+// reference ids can be written as they are (filtered references included).
+template <typename IndexT>
+inline void writeBAMHeader(IndexT& pfi, OutputWriter& out) {
+  fmt::MemoryWriter hd;
+  hd.write("@HD\tVN:1.0\tSO:unknown\n");
+
+  auto& txpNames = pfi.getFullRefNames();
+  auto& txpLens = pfi.getFullRefLengthsComplete();
+
+  auto numRef = txpNames.size();
+  for (size_t i = 0; i < numRef; ++i) {
+    hd.write("@SQ\tSN:{}\tLN:{:d}\n", txpNames[i], txpLens[i]);
+  }
+  hd.write("@PG\tID:pufferfish\tPN:pufferfish\tVN:{}\n", pufferfish::version);
+
+  BinWriter bw(hd.size() + 100000);
+  char* p = bw.extend(8 + hd.size());
+  std::memcpy(p, "BAM\1", 4);
+  p = bam::put(p + 4, static_cast<int32_t>(hd.size()));
+  std::memcpy(p, hd.data(), hd.size());
+  p = bw.extend(4);
+  bam::put(p, static_cast<int32_t>(numRef));
+  for (size_t i = 0; i < numRef; ++i) {
+    p = bw.extend(4 + txpNames[i].size() + 1 + 4);
+    p = bam::put(p, static_cast<int32_t>(txpNames[i].size() + 1));
+    std::memcpy(p, txpNames[i].c_str(), txpNames[i].size() + 1);
+    p += txpNames[i].size() + 1;
+    bam::put(p, static_cast<int32_t>(txpLens[i]));
+  }
+  out.write(bw.data(), bw.size());
+}
+
+inline uint32_t writeUnalignedPairToBAM(fastx_parser::ReadPair& r, BinWriter& bstream,
+                                        std::vector<uint32_t>& cigarOps) {
+  constexpr uint16_t flags1 = 0x1 | 0x4 | 0x8 | 0x40;
+  constexpr uint16_t flags2 = 0x1 | 0x4 | 0x8 | 0x80;
+
+  auto processReadName = [](const std::string& name) -> fmt::StringRef {
+    nonstd::string_view readNameView(name);
+    size_t splitPos = readNameView.find(' ');
+    if (splitPos < readNameView.length()) {
+      readNameView.remove_suffix(readNameView.length() - splitPos);
+    } else {
+      splitPos = readNameView.length();
+    }
+    if (splitPos > 2 and readNameView[splitPos - 2] == '/') { readNameView.remove_suffix(2); }
+    return fmt::StringRef(readNameView.data(), readNameView.size());
+  };
+
+  bam::appendRecord(bstream, processReadName(r.first.name), flags1, -1, -1, 255, "*", -1, -1, 0,
+                    r.first.seq, false, 0, 0, 0, cigarOps);
+  bam::appendRecord(bstream, processReadName(r.second.name), flags2, -1, -1, 255, "*", -1, -1, 0,
+                    r.second.seq, false, 0, 0, 0, cigarOps);
+  return 0;
+}
+
+inline uint32_t writeUnalignedSingleToBAM(fastx_parser::ReadSeq& r, BinWriter& bstream,
+                                          std::vector<uint32_t>& cigarOps) {
+  constexpr uint16_t flags = 0x4;
+
+  nonstd::string_view readNameViewSV(r.name);
+  size_t splitPos = readNameViewSV.find(' ');
+  if (splitPos < readNameViewSV.length()) {
+    readNameViewSV.remove_suffix(readNameViewSV.size() - splitPos);
+  }
+  fmt::StringRef readNameView(readNameViewSV.data(), readNameViewSV.size());
+
+  bam::appendRecord(bstream, readNameView, flags, -1, -1, 255, "*", -1, -1, 0, r.seq, false, 0, 0, 0,
+                    cigarOps);
+  return 0;
+}
+
+template <typename ReadT, typename IndexT>
+inline uint32_t writeAlignmentsToBAMSingle(
+    ReadT& r, PairedAlignmentFormatter<IndexT>& formatter,
+    std::vector<pufferfish::util::QuasiAlignment>& jointHits, BinWriter& bstream,
+    bool tidsAlreadyDecoded = false) {
+  auto& cigarStr = formatter.cigarStr1;
+  uint16_t flags;
+
+  nonstd::string_view readNameViewSV(r.name);
+  size_t splitPos = readNameViewSV.find(' ');
+  if (splitPos < readNameViewSV.length()) {
+    readNameViewSV.remove_suffix(readNameViewSV.size() - splitPos);
+  }
+  fmt::StringRef readNameView(readNameViewSV.data(), readNameViewSV.size());
+
+  uint32_t alnCtr{0};
+  size_t i{0};
+  auto* fullRefLengths = tidsAlreadyDecoded ? &formatter.index->getFullRefLengths() : nullptr;
+  for (auto& qa : jointHits) {
+    ++i;
+    int32_t refID = static_cast<int32_t>(tidsAlreadyDecoded ? qa.tid : formatter.index->getRefId(qa.tid));
+    uint32_t txpLen = tidsAlreadyDecoded ? (*fullRefLengths)[qa.tid] : formatter.index->refLength(qa.tid);
+    getSamFlags(qa, flags);
+    if (alnCtr != 0) { flags |= 0x100; }
+    adjustOverhang(qa.pos, qa.readLen, txpLen, cigarStr);
+    bam::appendRecord(bstream, readNameView, flags, refID, qa.pos, 255,
+                      qa.cigar.empty() ? cigarStr.c_str() : qa.cigar.c_str(), -1, -1,
+                      static_cast<int32_t>(qa.fragLen), r.seq, !qa.fwd, jointHits.size(), i, qa.score,
+                      formatter.cigarOps);
+    ++alnCtr;
+  }
+  return 0;
+}
+
+template <typename ReadPairT, typename IndexT>
+inline uint32_t writeAlignmentsToBAM(
+    ReadPairT& r, PairedAlignmentFormatter<IndexT>& formatter,
+    std::vector<pufferfish::util::QuasiAlignment>& jointHits, BinWriter& bstream,
+    bool writeOrphans,
+    bool tidsAlreadyDecoded = false) {
+  auto& cigarStr1 = formatter.cigarStr1;
+  auto& cigarStr2 = formatter.cigarStr2;
+  auto& cigarOps = formatter.cigarOps;
+
+  uint16_t flags1, flags2;
+
+  auto processReadName = [](const std::string& name) -> fmt::StringRef {
+    nonstd::string_view readNameView(name);
+    size_t splitPos = readNameView.find(' ');
+    if (splitPos < readNameView.length()) {
+      readNameView.remove_suffix(readNameView.length() - splitPos);
+    } else {
+      splitPos = readNameView.length();
+    }
+    if (splitPos > 2 and readNameView[splitPos - 2] == '/') { readNameView.remove_suffix(2); }
+    return fmt::StringRef(readNameView.data(), readNameView.size());
+  };
+
+  auto readNameView = processReadName(r.first.name);
+  auto mateNameView = processReadName(r.second.name);
+
+  cigarStr1.clear();
+  cigarStr2.clear();
+  cigarStr1.write("{}M", r.first.seq.length());
+  cigarStr2.write("{}M", r.second.seq.length());
+
+  uint32_t alnCtr{0};
+  size_t i{0};
+  auto* fullRefLengths = tidsAlreadyDecoded ? &formatter.index->getFullRefLengths() : nullptr;
+
+  for (auto& qa : jointHits) {
+    ++i;
+    int32_t refID = static_cast<int32_t>(tidsAlreadyDecoded ? qa.tid : formatter.index->getRefId(qa.tid));
+    uint32_t txpLen = tidsAlreadyDecoded ? (*fullRefLengths)[qa.tid] : formatter.index->refLength(qa.tid);
+    if (qa.isPaired) {
+      getSamFlags(qa, true, flags1, flags2);
+      if (alnCtr != 0) {
+        flags1 |= 0x100;
+        flags2 |= 0x100;
+      }
+      adjustOverhang(qa, txpLen, cigarStr1, cigarStr2);
+
+      // If the fragment overhangs the right end of the transcript
+      // adjust fragLen (overhanging the left end is already handled).
+      int32_t read1Pos = qa.pos;
+      int32_t read2Pos = qa.matePos;
+      const bool read1First{read1Pos < read2Pos};
+      const int32_t minPos = read1First ? read1Pos : read2Pos;
+      if ((minPos + static_cast<int32_t>(qa.fragLen)) > static_cast<int32_t>(txpLen)) { qa.fragLen = txpLen - minPos; }
+      const int32_t fragLen = static_cast<int32_t>(qa.fragLen);
+
+      bam::appendRecord(bstream, readNameView, flags1, refID, qa.pos, 1,
+                        qa.cigar.empty() ? cigarStr1.c_str() : qa.cigar.c_str(), refID, qa.matePos,
+                        read1First ? fragLen : -fragLen, r.first.seq, !qa.fwd, jointHits.size(), i, qa.score,
+                        cigarOps);
+      bam::appendRecord(bstream, mateNameView, flags2, refID, qa.matePos, 1,
+                        qa.mateCigar.empty() ? cigarStr2.c_str() : qa.mateCigar.c_str(), refID, qa.pos,
+                        read1First ? -fragLen : fragLen, r.second.seq, !qa.mateIsFwd, jointHits.size(), i,
+                        qa.mateScore, cigarOps);
+    } else if (writeOrphans) {
+      getSamFlags(qa, true, flags1, flags2);
+      if (alnCtr != 0) {
+        flags1 |= 0x100;
+        flags2 |= 0x100;
+      }
+      adjustOverhang(qa, txpLen, cigarStr1, cigarStr2);
+
+      bool leftAligned = qa.mateStatus == pufferfish::util::MateStatus::PAIRED_END_LEFT;
+      auto* cigarStr = leftAligned ? &formatter.cigarStr1 : &formatter.cigarStr2;
+      cigarStr->clear();
+      cigarStr->write("{}M", leftAligned ? r.first.seq.length() : r.second.seq.length());
+
+      bam::appendRecord(bstream, leftAligned ? readNameView : mateNameView, leftAligned ? flags1 : flags2,
+                        refID, qa.pos, 1, qa.cigar.empty() ? cigarStr->c_str() : qa.cigar.c_str(), refID,
+                        qa.pos, 0, leftAligned ? r.first.seq : r.second.seq, !qa.fwd, jointHits.size(), i,
+                        qa.score, cigarOps);
+      bam::appendRecord(bstream, leftAligned ? mateNameView : readNameView, leftAligned ? flags2 : flags1,
+                        refID, qa.pos, 0, "*", refID, qa.pos, 0, leftAligned ? r.second.seq : r.first.seq,
+                        false, jointHits.size(), i, qa.mateScore, cigarOps);
+    }
+    ++alnCtr;
+  }
+  return 0;
+}
+
+#endif // __BAM_WRITER_HPP__
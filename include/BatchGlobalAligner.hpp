@@ -0,0 +1,71 @@
+#ifndef __BATCH_GLOBAL_ALIGNER_HPP__
+#define __BATCH_GLOBAL_ALIGNER_HPP__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Score-only global alignment of many short, independent sequence pairs at
+ * once.  Instead of vectorizing within one alignment (as KSW2 does, which
+ * leaves most SIMD lanes idle for the short windows between MEMs), pairs are
+ * grouped `lanes` at a time and the DP matrices of a group are laid out
+ * structure-of-arrays, so that every cell update is one vector operation
+ * over the group (the inter-sequence scheme of e.g. SSW / parasail).
+ *
+ * The scoring is the same as KSW2Aligner's GLOBAL mode: `match` / `mismatch`
+ * for A,C,G,T, 0 for anything involving an N, and a gap of length L costs
+ * gapo + L * gape.
+ *
+ * With SSE2 (AVX2 when the build targets it), a group is filled with 16-bit
+ * saturating vector operations, as ksw2 does; groups whose scores could leave
+ * the 16-bit range, and builds without SSE2, use the 32-bit scalar loop.
+ */
+class BatchGlobalAligner {
+public:
+  static constexpr const uint32_t lanes = 16;
+
+  BatchGlobalAligner(int32_t match, int32_t mismatch, int32_t gapo, int32_t gape);
+
+  // Queue the alignment of query against target (both are copied);
+  // returns the index under which its score is available after run().
+  size_t add(const char* query, uint32_t qlen, const char* target, uint32_t tlen);
+  // Align everything that has been queued.
+  void run();
+  int32_t score(size_t i) const { return scores_[i]; }
+  size_t size() const { return tasks_.size(); }
+  void clear();
+
+private:
+  struct Task {
+    uint32_t qoff;
+    uint32_t qlen;
+    uint32_t toff;
+    uint32_t tlen;
+  };
+
+  void alignGroup(const uint32_t* ids, uint32_t n);
+  // the DP of a transposed group of at most Q x T cells, in 16 or 32 bits
+  void fillGroup16(const uint32_t* ids, uint32_t n, uint32_t Q, uint32_t T, const uint32_t* qlen, const uint32_t* tlen);
+  void fillGroup32(const uint32_t* ids, uint32_t n, uint32_t Q, uint32_t T, const uint32_t* qlen, const uint32_t* tlen);
+
+  int32_t match_;
+  int32_t mismatch_;
+  int32_t gapo_;
+  int32_t gape_;
+
+  std::vector<Task> tasks_;
+  std::vector<int32_t> scores_;
+  std::vector<uint32_t> order_;
+  // the 2-bit (plus N) codes of all queued sequences, back to back
+  std::vector<uint8_t> seqs_;
+  // structure-of-arrays work space; entry [pos * lanes + lane]
+  std::vector<uint8_t> q_;
+  std::vector<uint8_t> t_;
+  std::vector<int32_t> H_;
+  std::vector<int32_t> E_;
+  std::vector<int16_t> H16_;
+  std::vector<int16_t> E16_;
+};
+
+#endif // __BATCH_GLOBAL_ALIGNER_HPP__
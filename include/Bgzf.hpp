@@ -0,0 +1,47 @@
+#ifndef __BGZF_HPP__
+#define __BGZF_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <zlib.h>
+
+/**
+ * Compresses data into BGZF blocks: gzip members of at most 64KB that
+ * carry their own compressed size (the "BC" extra field), as used by BAM
+ * and bgzip.  Since each block is compressed independently, blocks can be
+ * compressed by different threads, and their concatenation is both a valid
+ * BGZF file and a valid (multi-member) gzip file.
+ *
+ * A deflater is not thread-safe; each compressing thread owns one.
+ */
+class BgzfDeflater {
+public:
+  // The most uncompressed bytes put into a single block.
+  static constexpr const size_t maxBlockInput = 0xff00;
+  // The most bytes a compressed block may occupy.
+  static constexpr const size_t maxBlockSize = 0x10000;
+
+  explicit BgzfDeflater(int level = Z_DEFAULT_COMPRESSION);
+  ~BgzfDeflater();
+
+  BgzfDeflater(const BgzfDeflater&) = delete;
+  BgzfDeflater& operator=(const BgzfDeflater&) = delete;
+
+  // Appends data[0..len) to out as one or more BGZF blocks.
+  void compress(const char* data, size_t len, std::string& out);
+
+  // The empty block that marks the end of a BGZF file.
+  static const std::string& eofBlock();
+
+private:
+  // Compresses up to len bytes of data into a block appended to out, and
+  // returns how many were consumed.
+  size_t compressBlock(const char* data, size_t len, std::string& out);
+
+  z_stream zs_;
+  int level_;
+};
+
+#endif // __BGZF_HPP__
@@ -109,6 +109,15 @@ class BinWriter
         }
 
     uint64_t getBytes() { return _bin_data.size(); }
+    const char* data() const { return _bin_data.data(); }
+    size_t size() const { return _bin_data.size(); }
+    // Grows the record by len bytes, to be filled in through the returned pointer
+    // (valid until the next write).
+    char* extend(size_t len) {
+        size_t offset = _bin_data.size();
+        _bin_data.resize(offset + len);
+        return _bin_data.data() + offset;
+    }
         //support for logging directly from spdlog
         template<typename OStream>
         friend OStream& operator<<(OStream& os, const BinWriter &bin_record)
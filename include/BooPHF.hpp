@@ -19,6 +19,9 @@
 #include <string.h>
 #include <memory> // for make_shared
 #include <unistd.h>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
 
 
 
@@ -772,6 +775,21 @@ we need this 2-functors scheme because HashFunctors won't work with unordered_ma
 
 
 
+		// back the 2MiB-aligned part of the bit array with transparent huge pages
+		bool advise_huge_pages()
+		{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+			const uintptr_t huge_page_size = 2 * 1024 * 1024;
+			uintptr_t beg = reinterpret_cast<uintptr_t>(_bitArray);
+			uintptr_t abeg = (beg + huge_page_size - 1) & ~(huge_page_size - 1);
+			uintptr_t aend = (beg + _nchar * sizeof(uint64_t)) & ~(huge_page_size - 1);
+			if (_bitArray == nullptr || aend <= abeg) return false;
+			return madvise(reinterpret_cast<void*>(abeg), aend - abeg, MADV_HUGEPAGE) == 0;
+#else
+			return false;
+#endif
+		}
+
 		void save(std::ostream& os) const
 		{
 			os.write(reinterpret_cast<char const*>(&_size), sizeof(_size));
@@ -782,11 +800,13 @@ we need this 2-functors scheme because HashFunctors won't work with unordered_ma
 			os.write(reinterpret_cast<char const*>(_ranks.data()), (std::streamsize)(sizeof(_ranks[0]) * _ranks.size()));
 		}
 
-		void load(std::istream& is)
+		void load(std::istream& is, bool huge_pages = false)
 		{
 			is.read(reinterpret_cast<char*>(&_size), sizeof(_size));
 			is.read(reinterpret_cast<char*>(&_nchar), sizeof(_nchar));
 			this->resize(_size);
+			// ask for 2MiB pages before the read below first touches the array
+			if (huge_pages) { advise_huge_pages(); }
 			is.read(reinterpret_cast<char *>(_bitArray), (std::streamsize)(sizeof(uint64_t) * _nchar));
 
 			size_t sizer;
@@ -1198,7 +1218,7 @@ we need this 2-functors scheme because HashFunctors won't work with unordered_ma
 
 		}
 
-		void load(std::istream& is)
+		void load(std::istream& is, bool huge_pages = false)
 		{
 
 			is.read(reinterpret_cast<char*>(&_gamma), sizeof(_gamma));
@@ -1212,7 +1232,7 @@ we need this 2-functors scheme because HashFunctors won't work with unordered_ma
 			for(int ii=0; ii<_nb_levels; ii++)
 			{
 				//_levels[ii].bitset = new bitVector();
-				_levels[ii].bitset.load(is);
+				_levels[ii].bitset.load(is, huge_pages);
 			}
 
 
@@ -0,0 +1,68 @@
+#ifndef __DUPLICATE_READ_WINDOW_HPP__
+#define __DUPLICATE_READ_WINDOW_HPP__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "parallel_hashmap/phmap.h"
+#include "xxhash.h"
+
+/**
+ * Remembers the outcome of mapping the last `windowSize` distinct reads (or
+ * read pairs) a thread has seen, so that an exact duplicate that follows
+ * closely in the input can be given the same outcome instead of being mapped
+ * again.  Reads are looked up by an xxhash of their sequence(s), and matches
+ * are verified against the stored sequences, so hash collisions are harmless.
+ * The oldest read is forgotten first.
+ */
+template <typename OutcomeT>
+class DuplicateReadWindow {
+public:
+  explicit DuplicateReadWindow(uint32_t windowSize) : slots_(windowSize) { index_.reserve(windowSize); }
+
+  bool enabled() const { return !slots_.empty(); }
+
+  // For single-end reads, seq2 is empty.
+  static uint64_t hashReads(const std::string& seq1, const std::string& seq2) {
+    uint64_t h = XXH64(seq1.data(), seq1.length(), 0);
+    return seq2.empty() ? h : XXH64(seq2.data(), seq2.length(), h);
+  }
+
+  const OutcomeT* find(uint64_t key, const std::string& seq1, const std::string& seq2) const {
+    auto it = index_.find(key);
+    if (it == index_.end()) { return nullptr; }
+    auto& slot = slots_[it->second];
+    return (slot.seq1 == seq1 and slot.seq2 == seq2) ? &slot.outcome : nullptr;
+  }
+
+  void insert(uint64_t key, const std::string& seq1, const std::string& seq2, const OutcomeT& outcome) {
+    auto& slot = slots_[next_];
+    if (slot.used) {
+      auto it = index_.find(slot.key);
+      if (it != index_.end() and it->second == next_) { index_.erase(it); }
+    }
+    slot.used = true;
+    slot.key = key;
+    slot.seq1 = seq1;
+    slot.seq2 = seq2;
+    slot.outcome = outcome;
+    index_[key] = next_;
+    next_ = (next_ + 1 == slots_.size()) ? 0 : next_ + 1;
+  }
+
+private:
+  struct Slot {
+    bool used{false};
+    uint64_t key{0};
+    std::string seq1;
+    std::string seq2;
+    OutcomeT outcome;
+  };
+
+  std::vector<Slot> slots_;
+  uint32_t next_{0};
+  phmap::flat_hash_map<uint64_t, uint32_t> index_;
+};
+
+#endif // __DUPLICATE_READ_WINDOW_HPP__
@@ -4,9 +4,12 @@
 #include "fcntl.h"
 #include "unistd.h"
 #include <atomic>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <iostream>
+#include <limits>
+#include <mutex>
 #include <thread>
 #include <vector>
 
@@ -14,6 +17,7 @@ extern "C" {
 #include "kseq.h"
 }
 
+#include "FastxParserThreadUtils.hpp"
 #include "concurrentqueue.h"
 
 #ifndef __FASTX_PARSER_PRECXX14_MAKE_UNIQUE__
@@ -91,38 +95,88 @@ public:
   T& operator[](size_t i) { return group_[i]; }
   typename std::vector<T>::iterator begin() { return group_.begin(); }
   typename std::vector<T>::iterator end() { return group_.begin() + have_; }
+  // The number of reads of the chunk that consumers have yet to finish; the
+  // chunk goes back to the parser when it drops to 0.
+  std::atomic<size_t>& pending() { return pending_; }
+  // The number of reads queued ahead of this chunk.
+  inline uint64_t firstRead() const { return firstRead_; }
+  inline void firstRead(uint64_t n) { firstRead_ = n; }
 
 private:
   std::vector<T> group_;
   size_t want_;
   size_t have_;
+  std::atomic<size_t> pending_{0};
+  uint64_t firstRead_{0};
 };
 
+template <typename T> class FastxParser;
+
+// The reads a consumer is working on: a run [begin(), end()) of the reads
+// of one chunk.  Without adaptive scheduling (see
+// FastxParser::setAdaptiveScheduling) the run is always a whole chunk.
 template <typename T> class ReadGroup {
 public:
-  ReadGroup(moodycamel::ProducerToken&& pt, moodycamel::ConsumerToken&& ct)
-      : pt_(std::move(pt)), ct_(std::move(ct)) {}
+  ReadGroup(moodycamel::ProducerToken&& pt, moodycamel::ConsumerToken&& ct, uint32_t worker)
+      : pt_(std::move(pt)), ct_(std::move(ct)), worker_(worker) {}
   moodycamel::ConsumerToken& consumerToken() { return ct_; }
   moodycamel::ProducerToken& producerToken() { return pt_; }
-  // get a reference to the chunk this ReadGroup owns
-  std::unique_ptr<ReadChunk<T>>& chunkPtr() { return chunk_; }
-  // get a *moveable* reference to the chunk this ReadGroup owns
-  std::unique_ptr<ReadChunk<T>>&& takeChunkPtr() { return std::move(chunk_); }
-  inline void have(size_t num) { chunk_->have(num); }
-  inline size_t size() { return chunk_->size(); }
-  inline size_t want() const { return chunk_->want(); }
-  T& operator[](size_t i) { return (*chunk_)[i]; }
-  typename std::vector<T>::iterator begin() { return chunk_->begin(); }
-  typename std::vector<T>::iterator end() {
-    return chunk_->begin() + chunk_->size();
-  }
-  void setChunkEmpty() { chunk_.release(); }
-  bool empty() const { return chunk_.get() == nullptr; }
+  inline size_t size() { return end_ - begin_; }
+  // The position of the first read of the group among all of the reads
+  // parsed; with one parsing thread, that is its position in the input.
+  inline uint64_t firstRead() const { return chunk_->firstRead() + begin_; }
+  T& operator[](size_t i) { return (*chunk_)[begin_ + i]; }
+  typename std::vector<T>::iterator begin() { return chunk_->begin() + begin_; }
+  typename std::vector<T>::iterator end() { return chunk_->begin() + end_; }
+  bool empty() const { return chunk_ == nullptr; }
 
 private:
-  std::unique_ptr<ReadChunk<T>> chunk_{nullptr};
+  friend class FastxParser<T>;
+  void assign(ReadChunk<T>* chunk, size_t begin, size_t end) {
+    chunk_ = chunk;
+    begin_ = begin;
+    end_ = end;
+  }
+
+  // not owned; the chunk lives until all of its reads are finished
+  ReadChunk<T>* chunk_{nullptr};
+  size_t begin_{0};
+  size_t end_{0};
   moodycamel::ProducerToken pt_;
   moodycamel::ConsumerToken ct_;
+  // the index of this consumer's WorkRange, if it has one
+  uint32_t worker_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Sizes the chunks the parsers fill, and the runs of reads consumers take
+// from them, from the time consumers have been taking per read (see
+// FastxParser::setAdaptiveScheduling).
+class ChunkSizer {
+public:
+  // Records that a consumer took ns nanoseconds over reads reads.
+  void record(size_t reads, double ns);
+  // The number of reads (at most capacity) to put in the next chunk, when
+  // queuedChunks filled chunks are waiting for numConsumers consumers.
+  size_t chunkReads(size_t capacity, size_t queuedChunks, size_t numConsumers);
+  // The number of reads a consumer should take from its chunk at a time.
+  size_t runReads() const;
+  double nsPerRead() const { return nsPerRead_.load(std::memory_order_relaxed); }
+
+private:
+  // a moving average; 0 until the first run is recorded
+  std::atomic<double> nsPerRead_{0};
+  std::atomic<size_t> lastChunk_{0};
+};
+
+// The reads of a chunk that one consumer has yet to take: the consumer takes
+// runs from the front, and a consumer with nothing else to do steals the
+// back half.
+template <typename T> struct WorkRange {
+  std::mutex mut;
+  ReadChunk<T>* chunk{nullptr};
+  size_t next{0};
+  size_t end{0};
 };
 
 template <typename T> class FastxParser {
@@ -134,6 +188,37 @@ public:
               uint32_t numConsumers, uint32_t numParsers = 1,
               uint32_t chunkSize = 1000);
   ~FastxParser();
+  // The number of threads decompressing each BGZF input file (default 1);
+  // must be set before start().  Plain gzip input is decompressed ahead of
+  // the parser by one thread, whatever the setting.
+  void setDecompressionThreads(uint32_t n) { decompressionThreads_ = n; }
+  // Schedules reads by their cost (default off); must be set before start().
+  // Parsers then size each chunk (up to chunkSize reads) to take consumers
+  // about 10ms, going smaller while few chunks are waiting, so that the
+  // first reads, and all of a small input, spread over every consumer.
+  // Consumers take their chunk about a millisecond of reads at a time, and
+  // one that finds no chunk waiting steals the back half of the untaken
+  // reads of another, so that no consumer is left with a long tail of reads
+  // while the others sit idle.
+  void setAdaptiveScheduling(bool on) { adaptive_ = on; }
+  // Hands consumers only reads before *oldest + window (see
+  // ReadGroup::firstRead); must be set before start(), and turns adaptive
+  // scheduling on.  Consumers take the oldest untaken reads first, wherever
+  // they are, and one with none it may take sleeps until *oldest moves,
+  // which has to be reported with windowMoved().
+  // With oldest the first record whose output an OutputWriter is waiting
+  // for (OutputWriter::nextRecord), this bounds the output held for its
+  // turn.  Chunks must be taken in the order of their reads, so there must
+  // be one parsing thread.
+  void setReadWindow(const std::atomic<uint64_t>* oldest, uint64_t window) {
+    oldest_ = oldest;
+    window_ = window;
+    adaptive_ = true;
+  }
+  // Wakes the consumers waiting for *oldest to move (see setReadWindow).
+  void windowMoved() { readsReady_.notifyAll(); }
+  // The number of times a consumer stole reads from another.
+  uint64_t numSteals() const { return numSteals_.load(); }
   bool start();
   bool stop();
   ReadGroup<T> getReadGroup();
@@ -143,10 +228,31 @@ public:
 private:
   moodycamel::ProducerToken getProducerToken_();
   moodycamel::ConsumerToken getConsumerToken_();
+  bool takeRun_(ReadGroup<T>& rg, WorkRange<T>& range,
+                uint64_t limit = std::numeric_limits<uint64_t>::max());
+  void publishRange_(ReadGroup<T>& rg, WorkRange<T>& range, ReadChunk<T>* chunk, size_t begin,
+                     size_t end, size_t runReads);
+  bool steal_(ReadGroup<T>& rg);
+  bool takeChunk_(ReadGroup<T>& rg, uint64_t limit = std::numeric_limits<uint64_t>::max());
+  bool refillInWindow_(ReadGroup<T>& rg);
+  bool takeOldestRun_(ReadGroup<T>& rg, uint64_t limit);
 
   std::vector<std::string> inputStreams_;
   std::vector<std::string> inputStreams2_;
   uint32_t numParsers_;
+  uint32_t numConsumers_;
+  uint32_t decompressionThreads_{1};
+  bool adaptive_{false};
+  ChunkSizer sizer_;
+  // with a read window, what it starts from and its size
+  const std::atomic<uint64_t>* oldest_{nullptr};
+  uint64_t window_{0};
+  // the number of reads queued so far, by all parsers
+  std::atomic<uint64_t> numQueued_{0};
+  // one per consumer, when scheduling adaptively
+  std::vector<std::unique_ptr<WorkRange<T>>> ranges_;
+  std::atomic<uint32_t> numGroups_{0};
+  std::atomic<uint64_t> numSteals_{0};
   std::atomic<uint32_t> numParsing_;
 
   // NOTE: Would like to use std::future<int> here instead, but that
@@ -163,6 +269,11 @@ private:
   moodycamel::ConcurrentQueue<std::unique_ptr<ReadChunk<T>>> readQueue_,
       seqContainerQueue_;
 
+  // Wake consumers when a chunk of reads is queued (or a parser finishes),
+  // and parsers when an empty chunk is given back.
+  thread_utils::EventCount readsReady_;
+  thread_utils::EventCount chunksFree_;
+
   // holds the indices of files (file-pairs) to be processed
   moodycamel::ConcurrentQueue<uint32_t> workQueue_;
 
@@ -1,8 +1,12 @@
 #ifndef FASTX_PARSER_THREAD_UTILS_HPP
 #define FASTX_PARSER_THREAD_UTILS_HPP
 
+#include <atomic>
 #include <cassert>
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
 #include <pthread.h>
 #include <random>
 #include <thread>
@@ -45,6 +49,56 @@ ALWAYS_INLINE void backoffOrYield(size_t& curMaxDelay) {
   backoffExp(curMaxDelay);
 }
 
+/**
+ * An event count: lets a thread sleep until a condition it polls (e.g. a
+ * lock-free queue being non-empty) may have changed, without the notifying
+ * side paying for a lock or a syscall when nobody is asleep.  A waiter does
+ *
+ *   auto key = ec.prepareWait();
+ *   if (condition holds) { ec.cancelWait(); } else { ec.wait(key); }
+ *
+ * and a notifier makes the condition true and then calls notifyOne() or
+ * notifyAll().  A notification after prepareWait() is never lost.
+ */
+class EventCount {
+public:
+  uint64_t prepareWait() {
+    waiters_.fetch_add(1);
+    return epoch_.load();
+  }
+
+  void cancelWait() { waiters_.fetch_sub(1); }
+
+  void wait(uint64_t key) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this, key]() { return epoch_.load() != key; });
+    }
+    waiters_.fetch_sub(1);
+  }
+
+  void notifyOne() { notify(false); }
+  void notifyAll() { notify(true); }
+
+private:
+  void notify(bool all) {
+    epoch_.fetch_add(1);
+    if (waiters_.load() == 0) { return; }
+    // taking the lock orders this with a waiter between its check and its sleep
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (all) {
+      cv_.notify_all();
+    } else {
+      cv_.notify_one();
+    }
+  }
+
+  std::atomic<uint64_t> epoch_{0};
+  std::atomic<uint32_t> waiters_{0};
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
 } // namespace thread_utils
 } // namespace fastx_parser
 
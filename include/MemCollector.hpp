@@ -20,9 +20,9 @@
 
 
 template <typename PufferfishIndexT> class MemCollector {
+public:
 enum class ExpansionTerminationType : uint8_t { MISMATCH = 0, CONTIG_END, READ_END };  
 
-public:
   explicit MemCollector(PufferfishIndexT* pfi) : pfi_(pfi) { k = pfi_->k(); }
 
   size_t expandHitEfficient(pufferfish::util::ProjectedHits& hit,
@@ -0,0 +1,89 @@
+#ifndef __PUFFERFISH_NUMA_UTILS_HPP__
+#define __PUFFERFISH_NUMA_UTILS_HPP__
+
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace pufferfish {
+namespace numa {
+
+// The NUMA layout of the machine; nodeCpus[n] holds the ids of the
+// cpus that belong to node n and that the process may run on (see
+// taskset and cgroup cpusets), so nodes left with no cpu are dropped.  On
+// systems where the layout can not be determined, this is a single node
+// holding every cpu the process may run on.
+struct Topology {
+  std::vector<std::vector<uint32_t>> nodeCpus;
+  inline uint32_t numNodes() const { return static_cast<uint32_t>(nodeCpus.size()); }
+};
+
+// Where a worker thread should run.  A negative cpu means "don't pin".
+struct ThreadPlacement {
+  int32_t cpu{-1};
+  int32_t node{-1};
+};
+
+Topology detectTopology();
+
+// Spread nthreads threads evenly across the nodes of topo (thread i
+// goes to node i % numNodes) and give each one its own cpu on that node
+// as long as there are enough of them.
+std::vector<ThreadPlacement> planThreadPlacement(const Topology& topo, uint32_t nthreads);
+
+// Pin the calling thread to a single cpu / to all of the cpus of a node.
+// Return false (and warn) if the affinity could not be changed.
+bool pinCurrentThread(uint32_t cpu);
+bool pinCurrentThreadToNode(const Topology& topo, uint32_t node);
+
+// While an object of this type is alive, the calling thread runs on the
+// cpus of one node; the affinity it had before is restored on destruction.
+class ScopedNodeAffinity {
+public:
+  ScopedNodeAffinity(const Topology& topo, uint32_t node);
+  ~ScopedNodeAffinity();
+  ScopedNodeAffinity(const ScopedNodeAffinity&) = delete;
+  ScopedNodeAffinity& operator=(const ScopedNodeAffinity&) = delete;
+
+private:
+  std::vector<uint32_t> saved_;
+};
+
+// While an object of this type is alive, new memory allocated by the
+// calling thread (including page cache for files it reads or maps) is
+// interleaved page-by-page across all nodes of the machine.  The
+// default (first-touch) policy is restored on destruction.
+class ScopedInterleavePolicy {
+public:
+  explicit ScopedInterleavePolicy(const Topology& topo);
+  ~ScopedInterleavePolicy();
+  ScopedInterleavePolicy(const ScopedInterleavePolicy&) = delete;
+  ScopedInterleavePolicy& operator=(const ScopedInterleavePolicy&) = delete;
+  bool active() const { return active_; }
+
+private:
+  bool active_{false};
+};
+
+// Make one copy of the read-only vector v per NUMA node.  Each copy is
+// made by a thread pinned to the target node, so that first-touch
+// places its pages in that node's local memory.
+template <typename VecT>
+std::vector<std::unique_ptr<VecT>> replicatePerNode(const VecT& v, const Topology& topo) {
+  std::vector<std::unique_ptr<VecT>> replicas(topo.numNodes());
+  std::vector<std::thread> copiers;
+  for (uint32_t n = 0; n < topo.numNodes(); ++n) {
+    copiers.emplace_back([&replicas, &v, &topo, n]() {
+      pinCurrentThreadToNode(topo, n);
+      replicas[n].reset(new VecT(v));
+    });
+  }
+  for (auto& t : copiers) { t.join(); }
+  return replicas;
+}
+
+} // namespace numa
+} // namespace pufferfish
+
+#endif // __PUFFERFISH_NUMA_UTILS_HPP__
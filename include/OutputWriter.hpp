@@ -0,0 +1,176 @@
+#ifndef __OUTPUT_WRITER_HPP__
+#define __OUTPUT_WRITER_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include "FastxParserThreadUtils.hpp"
+#include "concurrentqueue.h"
+
+/**
+ * The output stage of the mapper.  Mapping threads format their records
+ * into a private buffer and hand full buffers to a single writer thread
+ * through a lock-free queue; the writer returns each buffer, emptied but
+ * with its capacity intact, to a free list from which it is reused.
+ *
+ * A fixed number of buffers exists, so when the output can not keep up,
+ * acquire() waits for the writer to release one (backpressure) instead of
+ * letting queued output grow without bound.  The buffers that are ready
+ * are written to the file descriptor with a single writev.
+ *
+ * With compression enabled, a pool of threads compresses every buffer into
+ * BGZF blocks (see Bgzf.hpp), and the writer puts the compressed buffers
+ * back in submission order before writing them, so the output is a BGZF
+ * (and gzip) file.  Buffers are written in the order they were submitted,
+ * so those of one thread keep their order, but those of different threads
+ * may interleave.
+ *
+ * Output can instead be put back in the order of the input records it was
+ * made from: submitInOrder() takes, with each buffer, the range of records
+ * it holds the output of, and a buffer that arrives ahead of its turn is
+ * held until the buffers of all of the records before it have come.  No
+ * submitting thread waits for another: the thread whose buffer completes
+ * the run releases the run.  While any are held, acquire() makes a new
+ * buffer rather than wait for one, since the buffer the held ones wait on
+ * may never be submitted otherwise; what is held is bounded by keeping the
+ * producers within a window of records past nextRecord() (see
+ * FastxParser::setReadWindow).
+ */
+class OutputWriter {
+public:
+  // If closeFd is set, fd is closed when the writer is closed.  If
+  // compressionThreads is 0, the output is not compressed.
+  OutputWriter(int fd, bool closeFd, uint32_t numBuffers, size_t bufferCapacity,
+               uint32_t compressionThreads = 0, int compressionLevel = -1);
+  ~OutputWriter();
+
+  OutputWriter(const OutputWriter&) = delete;
+  OutputWriter& operator=(const OutputWriter&) = delete;
+
+  // Returns an empty buffer, waiting until one is free if all are in flight.
+  std::string acquire();
+  // Queues a buffer obtained from acquire() for writing.
+  void submit(std::string&& buffer);
+  // Copies len bytes of data into a buffer and submits it.
+  void write(const char* data, size_t len);
+  // Queues a buffer obtained from acquire() holding the output of records
+  // [first, first + count) of the input, to be written after the output of
+  // all of the records before first (from 0); every record must be in the
+  // range of exactly one buffer, possibly an empty one, and count must be
+  // positive.  A range that breaks that is a fatal error.  Buffers submitted
+  // with submit() are written as they come, so those belong before the
+  // first record, or after the last.
+  void submitInOrder(std::string&& buffer, uint64_t first, uint64_t count);
+  // Copies len bytes of data (possibly none) into a buffer and submits it
+  // in order.
+  void writeInOrder(const char* data, size_t len, uint64_t first, uint64_t count);
+  // Blocks until every buffer submitted before the call has been written.
+  void flush();
+  // Writes everything still queued (and the BGZF end-of-file block), stops the
+  // threads and closes the descriptor, if it is owned.  Producers must be done.
+  void close();
+
+  // The number of times acquire() had to wait for a free buffer.
+  uint64_t numStalls() const { return stalls_; }
+  // The number of buffers made, beyond those given to the constructor, while
+  // output was held for its turn.
+  uint64_t numExtraBuffers() const { return extraBuffers_; }
+  // The most buffers held for their turn at once.
+  uint64_t maxHeld() const { return maxHeld_; }
+  // The first record whose output has not been queued for writing.
+  const std::atomic<uint64_t>& nextRecord() const { return nextRecord_; }
+  // Has onAdvance called, by the submitting thread, each time nextRecord()
+  // moves (e.g. FastxParser::windowMoved); must be set before anything is
+  // submitted in order.
+  void setOnAdvance(std::function<void()> onAdvance) { onAdvance_ = std::move(onAdvance); }
+  uint32_t numCompressionThreads() const { return static_cast<uint32_t>(compressors_.size()); }
+  // Bytes submitted, and bytes written to the descriptor.
+  uint64_t bytesIn() const { return bytesIn_; }
+  uint64_t bytesOut() const { return bytesOut_; }
+  // Time spent compressing, summed over the compression threads.
+  double compressionSeconds() const { return compressionNanos_ * 1e-9; }
+  // The file offset at which each buffer written so far starts, in the order
+  // written (uncompressed output only); call flush() first.
+  const std::vector<uint64_t>& bufferOffsets() const { return offsets_; }
+
+private:
+  // The most buffers handed to one writev call.
+  static constexpr const size_t maxBatch = 64;
+
+  // A submitted buffer, and what it compressed to.
+  struct Block {
+    uint64_t seq{0};
+    std::string data;
+    std::string compressed;
+  };
+
+  // Output of a range of records that may have to wait for its turn.
+  struct Held {
+    uint64_t count{0};
+    std::string data;
+    // whether data came from acquire(), and so goes back to the free list
+    bool pooled{true};
+  };
+
+  void enqueue(std::string&& buffer);
+  void holdInOrder(uint64_t first, Held&& held);
+  // Queues held output; orderMutex_ must be held.
+  void release(Held&& held);
+  void run();
+  void compressLoop(int level);
+  // Moves the run of compressed blocks that continues the output into batch.
+  size_t takeInOrder(Block* batch);
+  void writeToFd(std::vector<iovec>& iov);
+
+  int fd_{-1};
+  bool closeFd_{false};
+  moodycamel::ConcurrentQueue<Block> full_;
+  moodycamel::ConcurrentQueue<Block> compressed_;
+  moodycamel::ConcurrentQueue<std::string> free_;
+  moodycamel::ConcurrentQueue<std::string> freeCompressed_;
+  // compressed blocks that arrived ahead of their turn, and the next to write
+  std::map<uint64_t, Block> pending_;
+  uint64_t nextSeq_{0};
+  // output held for its turn, by its first record, and the first record
+  // whose output has not been queued
+  std::mutex orderMutex_;
+  std::map<uint64_t, Held> held_;
+  std::atomic<uint64_t> nextRecord_{0};
+  std::function<void()> onAdvance_;
+  std::atomic<uint64_t> numHeld_{0};
+  uint64_t maxHeld_{0};
+  std::atomic<uint64_t> extraBuffers_{0};
+  // owned by the writer thread
+  std::vector<uint64_t> offsets_;
+  // buffers submitted (in order or not), and the sequence number of the next
+  // buffer queued for writing
+  std::atomic<uint64_t> submitted_{0};
+  std::atomic<uint64_t> queued_{0};
+  std::atomic<uint64_t> written_{0};
+  std::atomic<uint64_t> stalls_{0};
+  std::atomic<uint64_t> bytesIn_{0};
+  std::atomic<uint64_t> bytesOut_{0};
+  std::atomic<uint64_t> compressionNanos_{0};
+  std::atomic<bool> done_{false};
+  std::atomic<uint32_t> activeCompressors_{0};
+  // Idle threads sleep on these rather than poll: the compressors (or the
+  // writer, without compression) for a full buffer or done_, the writer for
+  // a compressed block or a compressor to finish, and acquire() and flush()
+  // for a buffer to be written, freed or held.
+  fastx_parser::thread_utils::EventCount fullReady_;
+  fastx_parser::thread_utils::EventCount compressedReady_;
+  fastx_parser::thread_utils::EventCount progress_;
+  bool closed_{false};
+  std::vector<std::thread> compressors_;
+  std::thread writer_;
+};
+
+#endif // __OUTPUT_WRITER_HPP__
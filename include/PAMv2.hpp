@@ -0,0 +1,117 @@
+#ifndef __PAM_V2_HPP__
+#define __PAM_V2_HPP__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Version 2 of the PAM (--pam) mapping format.
+ *
+ * A file is a header, a sequence of independently compressed blocks (one
+ * per output chunk of a mapping thread), and an index of the blocks:
+ *
+ *   header   "PAM\2", flags (u8: paired, read names), refCount (u64), then
+ *            per reference its name (u8 length + bytes) and length (u32)
+ *   block    rawSize (u32), compressedSize (u32), numReads (u32), then the
+ *            zlib-compressed payload
+ *   index    numBlocks (u64), the file offset (u64) of every block, then
+ *            the offset of the index itself (u64) and "PAMI"
+ *
+ * Within a block, the reads are stored column by column, each column
+ * prefixed by its length in bytes, and integers are varints:
+ *
+ *   mapping counts | read lengths (left, and right if paired) |
+ *   name lengths | name bytes | reference ids (zigzag delta from the previous
+ *   mapping) | interval counts (left, and right if paired) | scores |
+ *   positions (zigzag delta from the previous position) | strands (a byte each)
+ *
+ * A score, position and strand are present for each end whose interval
+ * count is not zero, as in version 1.  Scores are the (fractional) chain
+ * scores of version 1, stored as they are: 8-byte little-endian IEEE
+ * doubles.  Since the block index gives the
+ * offset of every block, blocks can be read and decoded in parallel.
+ */
+namespace pam2 {
+
+constexpr const char magic[4] = {'P', 'A', 'M', '\2'};
+constexpr const char indexMagic[4] = {'P', 'A', 'M', 'I'};
+constexpr const uint8_t pairedFlag = 0x1;
+constexpr const uint8_t readNamesFlag = 0x2;
+constexpr const size_t blockHeaderSize = 12;
+
+// One mapping of a read; positions carry the strand in their high bit, as
+// in version 1.
+struct Mapping {
+  uint32_t refId{0};
+  uint32_t leftIntervals{0};
+  uint32_t rightIntervals{0};
+  double leftScore{0};
+  double rightScore{0};
+  uint32_t leftPos{0};
+  uint32_t rightPos{0};
+};
+
+class BlockEncoder {
+public:
+  BlockEncoder(bool paired, bool readNames) : paired_(paired), readNames_(readNames) {}
+
+  // A read is added, followed by its numMappings mappings.
+  void addRead(const char* name, size_t nameLen, uint32_t leftLen, uint32_t rightLen, uint32_t numMappings);
+  void addMapping(const Mapping& m);
+
+  uint32_t numReads() const { return numReads_; }
+
+  // Appends the compressed block to out and starts a new, empty one.
+  void finish(std::string& out);
+
+private:
+  bool paired_;
+  bool readNames_;
+  uint32_t numReads_{0};
+  uint32_t prevRefId_{0};
+  uint32_t prevPos_{0};
+  std::string counts_;
+  std::string lengths_;
+  std::string nameLengths_;
+  std::string names_;
+  std::string refIds_;
+  std::string intervals_;
+  std::string scores_;
+  std::string positions_;
+  std::string strands_;
+  std::string payload_;
+};
+
+class BlockDecoder {
+public:
+  BlockDecoder(bool paired, bool readNames) : paired_(paired), readNames_(readNames) {}
+
+  // Decodes the block (header included) in block[0..size); returns false if
+  // it is malformed.
+  bool decode(const char* block, size_t size);
+
+  bool hasNext() const { return readsLeft_ > 0; }
+  // Reads the next read; name is only filled in if the file has names.
+  // Its mappings follow, to be read with nextMapping.
+  void nextRead(std::string& name, uint32_t& numMappings, uint32_t& leftLen, uint32_t& rightLen);
+  void nextMapping(Mapping& m);
+
+private:
+  struct Column {
+    const char* p{nullptr};
+    const char* end{nullptr};
+  };
+
+  bool paired_;
+  bool readNames_;
+  uint32_t readsLeft_{0};
+  uint32_t prevRefId_{0};
+  uint32_t prevPos_{0};
+  std::string raw_;
+  Column counts_, lengths_, nameLengths_, names_, refIds_, intervals_, scores_, positions_, strands_;
+};
+
+} // namespace pam2
+
+#endif // __PAM_V2_HPP__
@@ -46,6 +46,8 @@ struct PairedAlignmentFormatter {
   char buff2[1000];
   pufferfish::util::FixedWriter cigarStr1;
   pufferfish::util::FixedWriter cigarStr2;
+  // the encoded CIGAR of the BAM record being written
+  std::vector<uint32_t> cigarOps;
 };
 
 #endif //__PAIR_ALIGNMENT_FORMATTER_HPP__
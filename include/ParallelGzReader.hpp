@@ -0,0 +1,108 @@
+#ifndef __PARALLEL_GZ_READER_HPP__
+#define __PARALLEL_GZ_READER_HPP__
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fastx_parser {
+
+/**
+ * Reads a (possibly gzip-compressed) file on background threads, so that
+ * decompression runs ahead of, and concurrently with, the parser.  It is a
+ * drop-in replacement for gzopen / gzread as the source of kseq.
+ *
+ * The format is detected from the first bytes of the file:
+ *
+ *  - BGZF (as written by bgzip): a reader thread cuts the file into batches
+ *    of whole BGZF blocks, which a pool of threads inflates in parallel; the
+ *    batches are handed to read() in file order.
+ *  - plain gzip: one thread inflates the stream (all of its members) into
+ *    chunks ahead of the parser.
+ *  - anything else is passed through uncompressed, as gzread does.
+ *
+ * At most a fixed number of chunks are in flight, so memory stays bounded
+ * when the parser falls behind.
+ */
+class ParallelGzReader {
+public:
+  // numThreads is the number of threads inflating BGZF blocks; other inputs
+  // use the single reading thread.
+  ParallelGzReader(const std::string& path, uint32_t numThreads);
+  ~ParallelGzReader();
+
+  ParallelGzReader(const ParallelGzReader&) = delete;
+  ParallelGzReader& operator=(const ParallelGzReader&) = delete;
+
+  // Copies up to len bytes of the decompressed input into buf.  Like gzread,
+  // returns the number of bytes copied, 0 at the end of the input and -1 on
+  // an error (which has been reported on stderr).
+  int read(void* buf, unsigned len);
+
+private:
+  // A piece of the input, compressed (in) and decompressed (out).
+  struct Chunk {
+    uint64_t seq{0};
+    std::string in;
+    std::string out;
+  };
+
+  void produce();
+  void passThrough(std::string& head);
+  void inflateStream(std::string& head);
+  void splitBgzf(std::string& head);
+  void inflateBgzfBatches();
+
+  // Appends up to len bytes of the file to buf; returns 1 if some were read,
+  // 0 at the end of the file and -1 on an error.
+  int readInput(std::string& buf, size_t len);
+  // Waits for room for another chunk, and numbers it; false when stopping.
+  bool reserveChunk(Chunk& chunk);
+  // Numbers a decompressed chunk and hands it to read(); false when stopping.
+  bool emit(Chunk& chunk);
+  void publish(Chunk&& chunk);
+  void fail(const std::string& msg);
+  void finishProducing();
+  std::string spare(std::vector<std::string>& pool);
+  // Moves on to the next chunk in file order; returns 1, or 0 at the end of
+  // the input and -1 on an error.
+  int nextChunk();
+
+  std::string path_;
+  int fd_{-1};
+  uint32_t numThreads_;
+  size_t maxInFlight_;
+
+  std::mutex mutex_;
+  std::condition_variable readyCv_;
+  std::condition_variable workCv_;
+  std::condition_variable spaceCv_;
+  // BGZF batches waiting for a thread to inflate them
+  std::deque<Chunk> work_;
+  // decompressed chunks, by sequence number, that read() has not reached yet
+  std::map<uint64_t, Chunk> ready_;
+  std::vector<std::string> spareIn_;
+  std::vector<std::string> spareOut_;
+  uint64_t numChunks_{0};
+  uint64_t consumed_{0};
+  bool producerDone_{false};
+  bool stop_{false};
+  bool error_{false};
+
+  // owned by read()
+  std::string cur_;
+  size_t curPos_{0};
+  bool haveCur_{false};
+
+  std::thread producer_;
+  std::vector<std::thread> inflaters_;
+};
+
+} // namespace fastx_parser
+
+#endif // __PARALLEL_GZ_READER_HPP__
@@ -0,0 +1,158 @@
+#ifndef __PERF_TIMERS_HPP__
+#define __PERF_TIMERS_HPP__
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Per-thread stage timers for the mapper (--perf-report).
+ *
+ * A mapping thread points threadPerf() at its own ThreadPerf; a StageTimer
+ * then adds the time (in ticks of the time stamp counter) from its
+ * construction to its destruction to the histogram of its stage, and
+ * count() adds to the per-read counts.  With no ThreadPerf set, timers and
+ * counts do nothing but test a thread-local pointer, and building with
+ * PUFFERFISH_NO_PERF_TIMERS (cmake -DNO_PERF_TIMERS=TRUE) removes them
+ * altogether.  The threads' ThreadPerfs are merged and written as JSON by
+ * writePerfReport once mapping is done.
+ */
+namespace pufferfish {
+namespace perf {
+
+enum class Stage : uint32_t {
+  KmerLookup = 0,
+  MemExpansion,
+  FindChains,
+  JoinReads,
+  OrphanRecovery,
+  Alignment,
+  AlignCacheHit,
+  AlignGapFill,
+  AlignExtension,
+  Formatting,
+  OutputQueue,
+  NumStages
+};
+
+constexpr const size_t numStages = static_cast<size_t>(Stage::NumStages);
+// bucket i of a histogram counts durations of [2^i, 2^(i+1)) ticks
+constexpr const size_t numBuckets = 48;
+
+const char* stageName(Stage s);
+
+struct StageStats {
+  uint64_t count{0};
+  uint64_t ticks{0};
+  uint64_t maxTicks{0};
+  uint64_t histogram[numBuckets] = {};
+
+  void add(uint64_t t) {
+    ++count;
+    ticks += t;
+    if (t > maxTicks) { maxTicks = t; }
+    size_t b = t == 0 ? 0 : 63 - static_cast<size_t>(__builtin_clzll(t));
+    ++histogram[b < numBuckets ? b : numBuckets - 1];
+  }
+  void merge(const StageStats& other);
+};
+
+// What one mapping thread recorded.
+struct ThreadPerf {
+  StageStats stages[numStages];
+  uint64_t numReads{0};
+  uint64_t numLookups{0};
+  uint64_t numAnchors{0};
+  uint64_t numAlignments{0};
+
+  void merge(const ThreadPerf& other);
+};
+
+// The ThreadPerf the calling thread records into, or null.
+inline ThreadPerf*& threadPerf() {
+  static thread_local ThreadPerf* perf = nullptr;
+  return perf;
+}
+
+inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                   std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+#ifndef PUFFERFISH_NO_PERF_TIMERS
+class StageTimer {
+public:
+  explicit StageTimer(Stage s) : perf_(threadPerf()), stage_(s) {
+    if (perf_) { start_ = ticks(); }
+  }
+  ~StageTimer() { stop(); }
+  // Records the time so far now, rather than on destruction.
+  void stop() {
+    if (perf_) {
+      perf_->stages[static_cast<size_t>(stage_)].add(ticks() - start_);
+      perf_ = nullptr;
+    }
+  }
+  // Records the time so far under another stage instead.
+  void stopAs(Stage s) {
+    stage_ = s;
+    stop();
+  }
+  // Records nothing.
+  void cancel() { perf_ = nullptr; }
+
+private:
+  ThreadPerf* perf_;
+  Stage stage_;
+  uint64_t start_{0};
+};
+
+inline void count(uint64_t ThreadPerf::*field, uint64_t n) {
+  if (auto* p = threadPerf()) { p->*field += n; }
+}
+#else
+class StageTimer {
+public:
+  explicit StageTimer(Stage) {}
+  void stop() {}
+  void stopAs(Stage) {}
+  void cancel() {}
+};
+
+inline void count(uint64_t ThreadPerf::*, uint64_t) {}
+#endif // PUFFERFISH_NO_PERF_TIMERS
+
+// Measures the rate of ticks() against the steady clock over its lifetime.
+class TickCalibration {
+public:
+  TickCalibration() : startTicks_(ticks()), startTime_(std::chrono::steady_clock::now()) {}
+  double ticksPerSecond() const {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime_;
+    return elapsed.count() > 0 ? (ticks() - startTicks_) / elapsed.count() : 1e9;
+  }
+  double seconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime_).count();
+  }
+
+private:
+  uint64_t startTicks_;
+  std::chrono::steady_clock::time_point startTime_;
+};
+
+// Writes the merged statistics of numThreads threads, mapping for
+// wallSeconds, to path as JSON; returns false if it can not be written.
+bool writePerfReport(const std::string& path, const ThreadPerf& total, uint32_t numThreads, double ticksPerSecond,
+                     double wallSeconds);
+
+} // namespace perf
+} // namespace pufferfish
+
+#endif // __PERF_TIMERS_HPP__
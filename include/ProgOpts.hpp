@@ -49,11 +49,19 @@ public:
     std::string indexDir;
 };
 
+class WarmOptions {
+public:
+  std::string indexDir;
+  uint32_t numThreads{4};
+};
+
 class ValidateOptions {
 public:
   std::string indexDir;
   std::string refFile;
   std::string gfaFileName ;
+  bool useHugePages{false};
+  bool runtimeK{false};
 };
 
 class AlignmentOpts{
@@ -83,10 +91,18 @@ public:
   bool justMap{false};
   bool krakOut{false};
   bool salmonOut{false};
+  bool bamOut{false};
+  bool pamV2{false};
+  bool pamNoNames{false};
   bool noDiscordant{false};
   bool noOrphan{false};
   bool noDovetail{false};
   bool compressedOutput{false};
+  uint32_t compressionThreads{0};
+  uint32_t decompressionThreads{0};
+  std::string perfReport;
+  bool fixedChunks{false};
+  bool orderedOutput{false};
   bool verbose{false};
   bool validateMappings{true};
   bool bestStrata{false};
@@ -114,7 +130,15 @@ public:
   bool allowOverhangSoftclip{false};
   bool allowSoftclip{false};
   bool useAlignmentCache{true};
+  bool batchAlignment{false};
+  uint32_t crossReadCacheSize{0};
+  uint32_t duplicateWindow{0};
   uint32_t alignmentStreamLimit{10000};
+  bool pinThreads{false};
+  bool numaInterleave{false};
+  bool numaReplicateRefSeq{false};
+  bool useHugePages{false};
+  bool backgroundPageIn{false};
 };
 }
 
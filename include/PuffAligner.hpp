@@ -1,6 +1,8 @@
 #ifndef _PUFFALIGNER_
 #define _PUFFALIGNER_
 
+#include <cstring>
+
 #include "tsl/hopscotch_map.h"
 #include "metro/metrohash64.h"
 
@@ -8,6 +10,8 @@
 #include "Util.hpp"
 #include "compact_vector/compact_vector.hpp"
 #include "ksw2pp/KSW2Aligner.hpp"
+#include "BatchGlobalAligner.hpp"
+#include "AlignmentResultCache.hpp"
 #include "edlib.h"
 
 #include "parallel_hashmap/phmap.h"
@@ -26,12 +30,105 @@ using HitCounters = pufferfish::util::HitCounters;
 using AlignmentResult = pufferfish::util::AlignmentResult;
 using AlnCacheMap = phmap::flat_hash_map<uint64_t, AlignmentResult, PassthroughHash>;
 
+// Identifies one between-MEM gap: the window of the (oriented) read and
+// the window of the reference that have to be globally aligned.
+struct GapKey {
+  uint32_t readNum; // which read (pair) of the batch
+  uint64_t refPos; // global position in the concatenated reference
+  uint32_t readOffset;
+  uint32_t gapRead;
+  uint32_t gapRef;
+  bool isFw;
+  bool isRight;
+  bool operator==(const GapKey& o) const {
+    return readNum == o.readNum and refPos == o.refPos and readOffset == o.readOffset and gapRead == o.gapRead and
+           gapRef == o.gapRef and isFw == o.isFw and isRight == o.isRight;
+  }
+};
+
+struct GapKeyHash {
+  std::size_t operator()(GapKey const& k) const {
+    uint64_t h = (k.refPos + k.readNum) * 0x9E3779B97F4A7C15ULL;
+    h ^= (static_cast<uint64_t>(k.readOffset) << 32 | k.gapRead) + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    h ^= (static_cast<uint64_t>(k.gapRef) << 2 | k.isFw << 1 | k.isRight) + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    return h;
+  }
+};
+
+using GapScoreMap = phmap::flat_hash_map<GapKey, int32_t, GapKeyHash>;
+
+namespace pufferfish {
+
+// The score of aligning a[0..len) to b[0..len) without gaps, under the scoring ksw2 uses
+// (anything involving an N scores 0); the number of mismatches is returned in `mismatches`.
+// Eight bases are compared at a time: a byte of (a ^ b) & 0xDF is zero where the bases
+// match up to case, and one of a & 0xDF (or b & 0xDF) equals 'N' where there is an N.
+inline int32_t ungappedScore(const char* a, const char* b, int32_t len, int32_t match, int32_t mismatch,
+                             int32_t& mismatches) {
+  constexpr uint64_t caseMask = 0xDFDFDFDFDFDFDFDFULL;
+  constexpr uint64_t lows = 0x7F7F7F7F7F7F7F7FULL;
+  constexpr uint64_t highs = 0x8080808080808080ULL;
+  constexpr uint64_t ns = 0x4E4E4E4E4E4E4E4EULL;
+  // the number of bytes of x (in which only high bits are set) with their high bit set;
+  // the build does not assume POPCNT, and a multiply sums the (at most 8) flags
+  auto bytesSet = [](uint64_t x) -> int32_t { return static_cast<int32_t>(((x >> 7) * 0x0101010101010101ULL) >> 56); };
+  int32_t nmatch{0}, nmismatch{0};
+  // `valid` selects the (high bits of the) bytes to count
+  auto count = [&](uint64_t wa, uint64_t wb, uint64_t valid) {
+    // the high bit of each byte of the result is set iff that byte of x is nonzero
+    auto nonZero = [](uint64_t x) -> uint64_t { return (((x & lows) + lows) | x) & highs; };
+    uint64_t neq = nonZero((wa ^ wb) & caseMask);
+    uint64_t notN = nonZero((wa & caseMask) ^ ns) & nonZero((wb & caseMask) ^ ns) & valid;
+    nmismatch += bytesSet(neq & notN);
+    nmatch += bytesSet(~neq & notN);
+  };
+  uint64_t wa{0}, wb{0};
+  if (len <= 0) {
+    mismatches = 0;
+    return 0;
+  } else if (len < 8) {
+    std::memcpy(&wa, a, len);
+    std::memcpy(&wb, b, len);
+    count(wa, wb, highs >> (8 * (8 - len)));
+  } else {
+    int32_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+      std::memcpy(&wa, a + i, sizeof(wa));
+      std::memcpy(&wb, b + i, sizeof(wb));
+      count(wa, wb, highs);
+    }
+    // the last (len - i) bases, as the high bytes of the word ending at len
+    if (i < len) {
+      std::memcpy(&wa, a + len - 8, sizeof(wa));
+      std::memcpy(&wb, b + len - 8, sizeof(wb));
+      count(wa, wb, highs << (8 * (8 - (len - i))));
+    }
+  }
+  mismatches = nmismatch;
+  return match * nmatch + mismatch * nmismatch;
+}
+
+// Whether an ungapped alignment of `len` bases scoring `ungapped` is provably optimal, so
+// that the DP can be skipped: no alignment containing a gap can score as high.  For a window
+// of equal read and reference length, that needs an insertion and a deletion and loses at
+// least one aligned base; for an end extension (isEnd), where the reference end is free, a
+// single gap is enough.
+inline bool ungappedIsOptimal(int32_t ungapped, int32_t len, bool isEnd, int32_t match, int32_t gapOpen,
+                              int32_t gapExtend) {
+  const int32_t gapOE = gapOpen + gapExtend;
+  return isEnd ? ungapped >= match * len - gapOE : ungapped >= match * (len - 1) - 2 * gapOE;
+}
+
+} // namespace pufferfish
+
 class PuffAligner {
 public:
   PuffAligner(compact::vector<uint64_t, 2>& ar, std::vector<uint64_t>& ral, uint32_t k_, 
               pufferfish::util::AlignmentConfig& m, ksw2pp::KSW2Aligner& a) : 
     allRefSeq(ar), refAccumLengths(ral), k(k_), 
-    mopts(m), aligner(a) {
+    mopts(m), aligner(a),
+    batchAligner_(m.matchScore, m.mismatchScore, m.gapOpenPenalty, m.gapExtendPenalty),
+    crossReadCache_(m.crossReadCacheSize) {
     ksw_reset_extz(&ez);
 		alnCacheLeft.reserve(32);
 		alnCacheRight.reserve(32);
@@ -58,6 +155,28 @@ public:
 
   bool alignRead(std::string& read, std::string& read_rc, const std::vector<pufferfish::util::MemInfo>& mems, uint64_t queryChainHash, bool perfectChain, bool isFw, size_t tid, AlnCacheMap& alnCache, HitCounters& hctr, AlignmentResult& arOut, bool verbose);
 
+  // An upper bound on the score alignRead can assign to `clust`, computed from the MEM chain alone
+  // (every base outside the MEMs matches, and gaps cost no more than the length difference forces).
+  int32_t alignmentScoreUpperBound(const pufferfish::util::MemCluster& clust, uint32_t readLen) const;
+  // The same bound for the (paired or orphan) hit, or invalid if a mate can not reach its minimum score.
+  int32_t alignmentScoreUpperBound(pufferfish::util::JointMems& jointHit, uint32_t leftLen, uint32_t rightLen) const;
+  // A lower bound on the score of the hit that needs no alignment: the exact score of a hit whose
+  // chains are all perfect, and invalid for any other hit.
+  int32_t alignmentScoreLowerBound(pufferfish::util::JointMems& jointHit, uint32_t leftLen, uint32_t rightLen) const;
+
+  // The scores of the between-MEM gaps of the hits of a batch of reads are computed up front, all
+  // at once, so that alignRead can look them up instead of aligning each gap on its own.
+  // clearGapBatch() starts a batch, queueGapAlignments() adds the gaps of the hits `hitIdxs` of
+  // the read (pair) `readNum` of it, runGapBatch() scores them, and useGapBatchRead() tells
+  // alignRead which of the reads it is aligning.
+  void clearGapBatch();
+  void queueGapAlignments(uint32_t readNum, std::string& rl, std::string& rr,
+                          std::vector<pufferfish::util::JointMems>& jointHits, const std::vector<size_t>& hitIdxs);
+  void queueGapAlignments(uint32_t readNum, std::string& read,
+                          std::vector<pufferfish::util::JointMems>& jointHits, const std::vector<size_t>& hitIdxs);
+  void runGapBatch();
+  void useGapBatchRead(uint32_t readNum) { gapBatchRead_ = readNum; }
+
   bool recoverSingleOrphan(std::string& rl, std::string& rr, pufferfish::util::MemCluster& clust, std::vector<pufferfish::util::MemCluster> &recoveredMemClusters, uint32_t tid, bool anchorIsLeft, bool verbose);
 
   void clearAlnCaches() {alnCacheLeft.clear(); alnCacheRight.clear();}
@@ -72,6 +191,18 @@ private:
   ksw2pp::KSW2Aligner& aligner;
   ksw_extz_t ez;
 
+  void queueClusterGaps(uint32_t readNum, std::string& read, std::string& read_rc,
+                        const pufferfish::util::MemCluster& clust, uint32_t tid, bool isRight);
+
+  BatchGlobalAligner batchAligner_;
+  // unlike alnCacheLeft / alnCacheRight, this one is not emptied by clear()
+  AlignmentResultCache crossReadCache_;
+  // the scores of the queued gaps of every read of the batch (see clearGapBatch)
+  GapScoreMap gapScores_;
+  std::vector<GapKey> gapKeys_;
+  uint32_t gapBatchRead_{0};
+  std::string gapReadLeftRc_;
+  std::string gapReadRightRc_;
   pufferfish::util::CIGARGenerator cigarGen_;
   std::string rc1_;
   std::string rc2_;
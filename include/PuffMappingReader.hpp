@@ -4,10 +4,19 @@
 #define __MAPPINGS_H__
 
 #include "spdlog/spdlog.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "Taxa.h"
+#include "PAMv2.hpp"
 
 class Chunk {
 public:
@@ -74,10 +83,26 @@ public:
             logger->error("Invalid header for mapping output file.");
             std::exit(1);
         }
+        if (version == 2) { loadBlockIndex(mfileName); }
+    }
+    ~PAMReader() {
+        if (fd_ >= 0) { ::close(fd_); }
     }
     bool readHeader() {
+        char magic[sizeof(pam2::magic)];
+        inFile.read(magic, sizeof(magic));
+        if (inFile and std::equal(magic, magic + sizeof(magic), pam2::magic)) {
+            version = 2;
+            uint8_t flags;
+            inFile.read(reinterpret_cast<char *>(&flags), sizeof(flags));
+            isPaired = flags & pam2::pairedFlag;
+            hasReadNames = flags & pam2::readNamesFlag;
+        } else {
+            inFile.clear();
+            inFile.seekg(0);
+            inFile.read(reinterpret_cast<char *>(&isPaired), sizeof(bool));
+        }
         size_t refCount;
-        inFile.read(reinterpret_cast<char *>(&isPaired), sizeof(bool));
         inFile.read(reinterpret_cast<char *>(&refCount), sizeof(size_t));
         logger->info("Total # of References: {}", refCount);
         refLengths.resize(refCount);
@@ -95,6 +120,64 @@ public:
             refLengths[i] = refLen;
 //            std::cerr << refName << " " << refLen << "\n";
         }
+        blocksBegin_ = static_cast<uint64_t>(inFile.tellg());
+        return static_cast<bool>(inFile);
+    }
+
+    // Finds where the blocks of a version 2 file start, from the index at its
+    // end or, if the file has none (e.g. it was cut short), by walking the blocks.
+    void loadBlockIndex(const std::string& mfileName) {
+        fd_ = ::open(mfileName.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd_ < 0 or fstat(fd_, &st) != 0) {
+            logger->error("Could not open mapping file {}", mfileName);
+            std::exit(1);
+        }
+        uint64_t fileSize = static_cast<uint64_t>(st.st_size);
+        char tail[sizeof(uint64_t) + sizeof(pam2::indexMagic)];
+        uint64_t indexOffset{0}, numBlocks{0};
+        bool haveIndex = fileSize >= blocksBegin_ + sizeof(tail) and
+                         preadAll(tail, sizeof(tail), fileSize - sizeof(tail)) and
+                         std::equal(tail + sizeof(uint64_t), tail + sizeof(tail), pam2::indexMagic);
+        if (haveIndex) {
+            std::memcpy(&indexOffset, tail, sizeof(indexOffset));
+            haveIndex = indexOffset >= blocksBegin_ and indexOffset + sizeof(uint64_t) <= fileSize and
+                        preadAll(reinterpret_cast<char *>(&numBlocks), sizeof(numBlocks), indexOffset) and
+                        indexOffset + (numBlocks + 2) * sizeof(uint64_t) + sizeof(pam2::indexMagic) == fileSize;
+        }
+        if (haveIndex) {
+            blockOffsets_.resize(numBlocks);
+            preadAll(reinterpret_cast<char *>(blockOffsets_.data()), numBlocks * sizeof(uint64_t),
+                     indexOffset + sizeof(uint64_t));
+            blocksEnd_ = indexOffset;
+        } else {
+            logger->warn("The mapping file has no block index; scanning its blocks");
+            uint64_t offset = blocksBegin_;
+            char header[pam2::blockHeaderSize];
+            while (offset + sizeof(header) <= fileSize and preadAll(header, sizeof(header), offset)) {
+                uint32_t compressedSize;
+                std::memcpy(&compressedSize, header + 4, sizeof(compressedSize));
+                if (offset + sizeof(header) + compressedSize > fileSize) { break; }
+                blockOffsets_.push_back(offset);
+                offset += sizeof(header) + compressedSize;
+            }
+            blocksEnd_ = offset;
+        }
+        logger->info("Mapping file has {} blocks", blockOffsets_.size());
+    }
+
+    // Reads and decodes the next block of a version 2 file that no thread has
+    // claimed yet; threads can do this concurrently.
+    bool readBlock(pam2::BlockDecoder& decoder, std::vector<char>& buffer) {
+        size_t i = nextBlock_++;
+        if (i >= blockOffsets_.size()) { return false; }
+        uint64_t begin = blockOffsets_[i];
+        uint64_t end = (i + 1 < blockOffsets_.size()) ? blockOffsets_[i + 1] : blocksEnd_;
+        buffer.resize(end - begin);
+        if (!preadAll(buffer.data(), buffer.size(), begin) or !decoder.decode(buffer.data(), buffer.size())) {
+            logger->error("Block {} of the mapping file is corrupt", i);
+            std::exit(1);
+        }
         return true;
     }
 
@@ -116,11 +199,32 @@ public:
 
 
     std::ifstream inFile;
+    uint32_t version{1};
     bool isPaired = true;
+    bool hasReadNames{true};
     std::vector<refLenType> refLengths;
     std::vector<std::string> refNames;
     std::shared_ptr<spdlog::logger> logger;
 
+private:
+    bool preadAll(char *buf, size_t len, uint64_t offset) {
+        while (len > 0) {
+            ssize_t r = ::pread(fd_, buf, len, static_cast<off_t>(offset));
+            if (r < 0 and errno == EINTR) { continue; }
+            if (r <= 0) { return false; }
+            buf += r;
+            len -= static_cast<size_t>(r);
+            offset += static_cast<uint64_t>(r);
+        }
+        return true;
+    }
+
+    // version 2 only
+    int fd_{-1};
+    uint64_t blocksBegin_{0};
+    uint64_t blocksEnd_{0};
+    std::vector<uint64_t> blockOffsets_;
+    std::atomic<size_t> nextBlock_{0};
 };
 
 class PuffMappingReader {
@@ -162,6 +266,7 @@ public:
     }
 
     bool nextRead(ReadInfo &rinf, std::mutex& iomutex, bool needReadName = false) {
+        if (pamReader->version == 2) { return nextReadV2(rinf, needReadName); }
         if (!chunk.hasNext()) {// try to read a new chunk from file
             if (!pamReader->readChunk(chunk, iomutex)) // if nothing left to process return false
                 return false;
@@ -252,6 +357,44 @@ public:
         return true;
     }
 
+    // Version 2 blocks are claimed and decoded by the calling thread, without locking.
+    bool nextReadV2(ReadInfo &rinf, bool needReadName) {
+        if (!block) { block.reset(new pam2::BlockDecoder(pamReader->isPaired, pamReader->hasReadNames)); }
+        while (!block->hasNext()) {
+            if (!pamReader->readBlock(*block, blockBuffer)) { return false; }
+        }
+        rinf.mappings.clear();
+        uint32_t mcnt, llen, rlen;
+        block->nextRead(readName, mcnt, llen, rlen);
+        if (needReadName) {
+            rinf.rid = readName;
+        }
+        rinf.cnt = mcnt;
+        rinf.len = llen + rlen;
+        rinf.mappings.reserve(rinf.cnt);
+
+        pam2::Mapping m;
+        for (size_t mappingCntr = 0; mappingCntr < rinf.cnt; mappingCntr++) {
+            block->nextMapping(m);
+            rinf.mappings.emplace_back(m.refId);
+            TaxaNode *taxaPtr = &rinf.mappings.back();
+            if (m.leftIntervals) {
+                taxaPtr->setFw(m.leftPos & PuffMappingReader::HighBitMask, ReadEnd::LEFT);
+                taxaPtr->setPos(m.leftPos & PuffMappingReader::LowBitsMask, ReadEnd::LEFT);
+            }
+            if (pamReader->isPaired and m.rightIntervals) {
+                // as in version 1, an orphan mapping is always seen as the LEFT end
+                ReadEnd currRe = m.leftIntervals ? ReadEnd::RIGHT : ReadEnd::LEFT;
+                taxaPtr->setFw(m.rightPos & PuffMappingReader::HighBitMask, currRe);
+                taxaPtr->setPos(m.rightPos & PuffMappingReader::LowBitsMask, currRe);
+            }
+            taxaPtr->cleanIntervals(ReadEnd::LEFT);
+            taxaPtr->cleanIntervals(ReadEnd::RIGHT);
+            taxaPtr->setScore(m.leftScore + m.rightScore);
+        }
+        return true;
+    }
+
     const std::string &refName(size_t id) { return pamReader->refNames[id]; }
 
     size_t refLength(size_t id) { return pamReader->refLengths[id]; }
@@ -263,6 +406,9 @@ public:
 private:
 
     Chunk chunk;
+    std::unique_ptr<pam2::BlockDecoder> block;
+    std::vector<char> blockBuffer;
+    std::string readName;
     PAMReader* pamReader;
     std::shared_ptr<spdlog::logger> logger;
     static constexpr const refLenType HighBitMask = 1u << (sizeof(refLenType) * 8 - 1);
@@ -30,6 +30,15 @@ protected:
       return core::range<std::vector<pufferfish::util::Position>::iterator>(startIt, endIt);
     }
 
+  // The 2k-bit word of the k-mer starting at position pos of the contig
+  // sequence.  For K != 0, K must equal k() and the read is specialized
+  // for it; K == 0 uses the runtime k.
+  template <uint32_t K>
+  inline uint64_t kmerWordAt(uint64_t pos) {
+    return K ? underlying().seq_.template get_int_fixed<2 * K>(2 * pos)
+             : underlying().seq_.get_int(2 * pos, 2 * underlying().k_);
+  }
+
   using pos_vector_t = compact::vector<uint64_t>;
   using seq_vector_t = compact::vector<uint64_t, 2>;
   using edge_vector_t = compact::vector<uint64_t, 8>;
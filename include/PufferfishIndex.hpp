@@ -54,6 +54,13 @@ private:
   size_t lastSeqPos_{std::numeric_limits<size_t>::max()};
   uint64_t numDecoys_{0};
   uint64_t firstDecoyIndex_{0};
+  // k used to select the specialized lookup path (0 => runtime k)
+  uint32_t lookupK_{0};
+
+  template <uint32_t K>
+  auto getRefPosImpl_(CanonicalKmer& mer) -> pufferfish::util::ProjectedHits;
+  template <uint32_t K>
+  auto getRefPosImpl_(CanonicalKmer& mer, pufferfish::util::QueryCache& qc) -> pufferfish::util::ProjectedHits;
 
 public:
   PufferfishIndex();
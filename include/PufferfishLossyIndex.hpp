@@ -57,6 +57,13 @@ private:
 
   std::unique_ptr<boophf_t> hash_{nullptr};
   boophf_t* hash_raw_{nullptr};
+  // k used to select the specialized lookup path (0 => runtime k)
+  uint32_t lookupK_{0};
+
+  template <uint32_t K>
+  auto getRefPosImpl_(CanonicalKmer& mer) -> pufferfish::util::ProjectedHits;
+  template <uint32_t K>
+  auto getRefPosImpl_(CanonicalKmer& mer, pufferfish::util::QueryCache& qc) -> pufferfish::util::ProjectedHits;
 
 public:
   compact::vector<uint64_t, 2> refseq_;
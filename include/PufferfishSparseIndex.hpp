@@ -61,6 +61,8 @@ private:
   std::unique_ptr<boophf_t> hash_{nullptr};
   uint64_t numDecoys_{0};
   uint64_t firstDecoyIndex_{0};
+  // k used to select the specialized lookup path (0 => runtime k)
+  uint32_t lookupK_{0};
 
   static const constexpr uint64_t shiftTable_[] = {
     0x0, 0x7, 0x38, 0x1c0, 0xe00, 0x7000, 0x38000, 0x1c0000,
@@ -87,7 +89,9 @@ public:
   auto getRefPos(CanonicalKmer mer, pufferfish::util::QueryCache& qc) -> pufferfish::util::ProjectedHits;
 
 private:
+  template <uint32_t K>
   auto getRefPosHelper_(CanonicalKmer& mer, uint64_t pos, bool didWalk = false) -> pufferfish::util::ProjectedHits;
+  template <uint32_t K>
   auto getRefPosHelper_(CanonicalKmer& mer, uint64_t pos, pufferfish::util::QueryCache& qc, bool didWalk = false) -> pufferfish::util::ProjectedHits;
 
 };
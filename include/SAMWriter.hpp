@@ -7,6 +7,8 @@
 #include "PufferfishSparseIndex.hpp"
 #include "Util.hpp"
 #include "BinWriter.hpp"
+#include "OutputWriter.hpp"
+#include "PAMv2.hpp"
 #include "parallel_hashmap/phmap.h"
 #include "nonstd/string_view.hpp"
 
@@ -89,7 +91,7 @@ inline void getSamFlags(const pufferfish::util::QuasiAlignment& qaln, bool peInp
 }
 
 template <typename IndexT>
-inline void writeKrakOutHeader(IndexT& pfi, std::shared_ptr<spdlog::logger> out, pufferfish::AlignmentOpts* mopts) {
+inline void writeKrakOutHeader(IndexT& pfi, OutputWriter& out, pufferfish::AlignmentOpts* mopts) {
   BinWriter bw(100000);
   bw << !mopts->singleEnd; // isPaired (bool)
   auto& txpNames = pfi.getFullRefNames();
@@ -103,10 +105,41 @@ inline void writeKrakOutHeader(IndexT& pfi, std::shared_ptr<spdlog::logger> out,
   for (size_t i = 0; i < numRef; ++i) {
     bw << txpNames[i] << txpLens[i]; //txpName (string) , txpLength (size_t)
   }
-  out->info("{}",bw);
+  out.write(bw.data(), bw.size());
 }
 
 
+template <typename IndexT>
+inline void writePAMv2Header(IndexT& pfi, OutputWriter& out, pufferfish::AlignmentOpts* mopts) {
+  BinWriter bw(100000);
+  char* p = bw.extend(sizeof(pam2::magic));
+  std::memcpy(p, pam2::magic, sizeof(pam2::magic));
+  uint8_t flags = (mopts->singleEnd ? 0 : pam2::pairedFlag) | (mopts->pamNoNames ? 0 : pam2::readNamesFlag);
+  bw << flags;
+  auto& txpNames = pfi.getFullRefNames();
+  auto& txpLens = pfi.getFullRefLengths();
+  auto numRef = txpNames.size();
+  bw << static_cast<uint64_t>(numRef);
+  for (size_t i = 0; i < numRef; ++i) {
+    bw << txpNames[i] << txpLens[i];
+  }
+  out.write(bw.data(), bw.size());
+}
+
+// Ends a PAM v2 file with the index of its blocks.  Every buffer written after
+// the header holds exactly one block.
+inline void writePAMv2Index(OutputWriter& out) {
+  out.flush();
+  auto& offsets = out.bufferOffsets();
+  uint64_t numBlocks = offsets.empty() ? 0 : offsets.size() - 1;
+  BinWriter bw(8 * (numBlocks + 2) + sizeof(pam2::indexMagic));
+  bw << numBlocks;
+  for (size_t i = 1; i < offsets.size(); ++i) { bw << offsets[i]; }
+  bw << out.bytesOut();
+  char* p = bw.extend(sizeof(pam2::indexMagic));
+  std::memcpy(p, pam2::indexMagic, sizeof(pam2::indexMagic));
+  out.write(bw.data(), bw.size());
+}
 template <typename IndexT>
 inline void writeSAMHeader(IndexT& pfi, std::shared_ptr<spdlog::logger> out) {
   fmt::MemoryWriter hd;
@@ -146,7 +179,7 @@ inline void writeSAMHeader(IndexT& pfi, std::ostream& outStream) {
 }
 
 template <typename IndexT>
-inline void writeSAMHeader(IndexT& pfi, std::shared_ptr<spdlog::logger> out,
+inline void writeSAMHeader(IndexT& pfi, OutputWriter& out,
         bool filterGenomics,
         phmap::flat_hash_set<std::string> gene_names,
         phmap::flat_hash_set<std::string> rrna_names) {
@@ -172,10 +205,7 @@ inline void writeSAMHeader(IndexT& pfi, std::shared_ptr<spdlog::logger> out,
   // will think about it later
   std::string version = "1.0.0";
   hd.write("@PG\tID:pufferfish\tPN:pufferfish\tVN:{}\n", pufferfish::version);
-  std::string headerStr(hd.str());
-  // Don't include the last '\n', since the logger will do it for us.
-  headerStr.pop_back();
-  out->info(headerStr);
+  out.write(hd.data(), hd.size());
 }
 
 // Declarations for functions dealing with SAM formatting and output
@@ -373,6 +403,65 @@ inline uint32_t writeAlignmentsToKrakenDump(ReadT& r,
 
 }
 
+// The PAM v2 counterparts of writeAlignmentsToKrakenDump (as used for --pam,
+// i.e. without the intervals themselves).
+template <typename ReadT, typename IndexT>
+inline uint32_t writeAlignmentsToPAMv2(ReadT& r,
+                                       PairedAlignmentFormatter<IndexT>& formatter,
+                                       std::vector<pufferfish::util::JointMems>& validJointHits,
+                                       pam2::BlockEncoder& block,
+                                       bool justMap) {
+  if (validJointHits.empty()) return 0;
+  nonstd::string_view readName(r.first.name);
+  size_t splitPos = std::min(readName.find(' '), readName.length());
+  if (splitPos > 2 and readName[splitPos - 2] == '/') { splitPos -= 2; }
+  block.addRead(readName.data(), splitPos, r.first.seq.length(), r.second.seq.length(), validJointHits.size());
+
+  pam2::Mapping m;
+  for (auto& qa : validJointHits) {
+    auto& clustLeft = qa.leftClust;
+    auto& clustRight = qa.rightClust;
+    m.refId = static_cast<uint32_t>(formatter.index->getRefId(qa.tid));
+    m.leftIntervals = qa.isLeftAvailable() ? clustLeft->mems.size() : 0;
+    m.rightIntervals = qa.isRightAvailable() ? clustRight->mems.size() : 0;
+    if (qa.isLeftAvailable()) {
+      refLenType pos = clustLeft->getTrFirstHitPos() < 0 ? 0 : clustLeft->getTrFirstHitPos();
+      m.leftPos = pos | (static_cast<refLenType>(clustLeft->isFw) << (sizeof(refLenType)*8-1));
+      m.leftScore = justMap ? qa.alignmentScore : clustLeft->coverage;
+    }
+    if (qa.isRightAvailable()) {
+      refLenType pos = clustRight->getTrFirstHitPos() < 0 ? 0 : clustRight->getTrFirstHitPos();
+      m.rightPos = pos | (static_cast<refLenType>(clustRight->isFw) << (sizeof(refLenType)*8-1));
+      m.rightScore = justMap ? qa.mateAlignmentScore : clustRight->coverage;
+    }
+    block.addMapping(m);
+  }
+  return 0;
+}
+
+template <typename ReadT, typename IndexT>
+inline uint32_t writeAlignmentsToPAMv2(ReadT& r,
+                                       PairedAlignmentFormatter<IndexT>& formatter,
+                                       std::vector<std::pair<uint32_t, std::vector<pufferfish::util::MemCluster>::iterator>>& validHits,
+                                       pam2::BlockEncoder& block) {
+  if (validHits.empty()) return 0;
+  nonstd::string_view readName(r.name);
+  size_t splitPos = std::min(readName.find(' '), readName.length());
+  if (splitPos > 2 and readName[splitPos - 2] == '/') { splitPos -= 2; }
+  block.addRead(readName.data(), splitPos, r.seq.length(), 0, validHits.size());
+
+  pam2::Mapping m;
+  for (auto& qa : validHits) {
+    auto& clust = qa.second;
+    m.refId = static_cast<uint32_t>(formatter.index->getRefId(qa.first));
+    m.leftIntervals = clust->mems.size();
+    m.leftPos = clust->getTrFirstHitPos() | (static_cast<refLenType>(clust->isFw) << (sizeof(refLenType)*8-1));
+    m.leftScore = clust->coverage;
+    block.addMapping(m);
+  }
+  return 0;
+}
+
 inline uint32_t writeUnalignedPairToStream(fastx_parser::ReadPair& r,
                                           fmt::MemoryWriter& sstream) {
         constexpr uint16_t flags1 = 0x1 | 0x4 | 0x8 | 0x40;
@@ -3,6 +3,7 @@
 
 #include "core/range.hpp"
 #include "string_view.hpp"
+#include <atomic>
 #include <cmath>
 #include <fstream>
 #include <iostream>
@@ -89,8 +90,36 @@ namespace pufferfish {
         bool try_loading_eqclasses{false};
         bool try_loading_edges{false};
         bool try_loading_ref_seqs{true};
+        // back the large index arrays (sequence, positions, mphf
+        // bitsets, reference sequence) with 2MiB pages when possible
+        bool use_huge_pages{false};
+        // use the lookup code compiled for the index's k (if it is one of
+        // the specialized sizes, see dispatchOnK) rather than the runtime-k
+        // fallback
+        bool fixed_k_lookup{true};
       };
 
+      // The k-mer sizes for which the index lookup paths are compiled
+      // with k as a constant.
+      inline bool isSpecializedK(uint32_t k) {
+        return k == 19 or k == 23 or k == 25 or k == 27 or k == 31;
+      }
+
+      // Calls f(std::integral_constant<uint32_t, K>()) with K == k if k is
+      // one of the specialized sizes, and with K == 0, meaning "read k at
+      // runtime", otherwise.
+      template <typename F>
+      inline auto dispatchOnK(uint32_t k, F&& f) -> decltype(f(std::integral_constant<uint32_t, 0>())) {
+        switch (k) {
+          case 19: return f(std::integral_constant<uint32_t, 19>());
+          case 23: return f(std::integral_constant<uint32_t, 23>());
+          case 25: return f(std::integral_constant<uint32_t, 25>());
+          case 27: return f(std::integral_constant<uint32_t, 27>());
+          case 31: return f(std::integral_constant<uint32_t, 31>());
+          default: return f(std::integral_constant<uint32_t, 0>());
+        }
+      }
+
         enum ReadEnd : uint8_t {
             LEFT, RIGHT
         };
@@ -675,17 +704,17 @@ Compile-time selection between list-like and map-like printing.
             MateStatus mateStatus;
             bool recovered{false};
 
-            bool isLeftAvailable() {
+            bool isLeftAvailable() const {
                 return mateStatus == MateStatus::PAIRED_END_PAIRED ||
                        mateStatus == MateStatus::PAIRED_END_LEFT;
             }
 
-            bool isRightAvailable() {
+            bool isRightAvailable() const {
                 return mateStatus == MateStatus::PAIRED_END_PAIRED ||
                        mateStatus == MateStatus::PAIRED_END_RIGHT;
             }
 
-            bool isOrphan() { return !isLeftAvailable() || !isRightAvailable(); }
+            bool isOrphan() const { return !isLeftAvailable() || !isRightAvailable(); }
 
           // NOTE: needed for vector compatibility, should not be used.
           JointMems() {
@@ -708,13 +737,13 @@ Compile-time selection between list-like and map-like printing.
                 //if (rightClust->mems.size() == 0) mateStatus = MateStatus::PAIRED_END_LEFT;
             }
 
-            double coverage() {
+            double coverage() const {
                 return (isLeftAvailable() ? leftClust->coverage : 0) + (isRightAvailable() ? rightClust->coverage : 0);
             }
 
-            double leftCoverage() { return isLeftAvailable() ? leftClust->coverage : 0; }
+            double leftCoverage() const { return isLeftAvailable() ? leftClust->coverage : 0; }
 
-            double rightCoverage() { return isRightAvailable() ? rightClust->coverage : 0; }
+            double rightCoverage() const { return isRightAvailable() ? rightClust->coverage : 0; }
 
             // FIXME : what if the mapping is not orphan? who takes care of this function not being called from outside?
             std::vector<pufferfish::util::MemCluster>::iterator orphanClust() {
@@ -836,6 +865,7 @@ Compile-time selection between list-like and map-like printing.
         int32_t refExtendLength{20};
         bool fullAlignment{false};
         int16_t matchScore;
+        int16_t mismatchScore{-4};
         int16_t gapExtendPenalty;
         int16_t gapOpenPenalty;
         double minScoreFraction{0.0};
@@ -846,6 +876,8 @@ Compile-time selection between list-like and map-like printing.
         bool useAlignmentCache{true};
         bool noDovetail{false};
         uint32_t maxFragmentLength{1000};
+        bool batchGapAlignment{false};
+        uint32_t crossReadCacheSize{0};
         PuffAlignmentMode alignmentMode{PuffAlignmentMode::SCORE_ONLY};
       };
 
@@ -887,6 +919,8 @@ Compile-time selection between list-like and map-like printing.
 
             QuasiAlignment &operator=(QuasiAlignment &) = default;
 
+            QuasiAlignment &operator=(const QuasiAlignment &) = default;
+
             QuasiAlignment &operator=(QuasiAlignment &&o) = default;
 
             QuasiAlignment(const QuasiAlignment &o) = default;
@@ -1187,26 +1221,104 @@ Compile-time selection between list-like and map-like printing.
             bool isFW;
         };
 
+        // A counter that one thread updates and any thread may read.  An
+        // update is a relaxed load and store instead of a locked
+        // read-modify-write, so it costs what an ordinary increment does.
+        class ThreadCounter {
+        public:
+            ThreadCounter(uint64_t v = 0) : v_(v) {}
+            ThreadCounter& operator=(uint64_t v) { store(v); return *this; }
+            ThreadCounter& operator+=(uint64_t v) { store(load() + v); return *this; }
+            ThreadCounter& operator++() { return *this += 1; }
+            void operator++(int) { *this += 1; }
+            operator uint64_t() const { return load(); }
+            uint64_t load() const { return v_.load(std::memory_order_relaxed); }
+            void store(uint64_t v) { v_.store(v, std::memory_order_relaxed); }
+
+        private:
+            std::atomic<uint64_t> v_;
+        };
+
+        // The counters of one mapping thread (see ShardedHitCounters).
         struct HitCounters {
-            std::atomic<uint64_t> numMapped{0};
-            std::atomic<uint64_t> numMappedAtLeastAKmer{0};
-            std::atomic<uint64_t> numOfOrphans{0};
-            std::atomic<uint64_t> peHits{0};
-            std::atomic<uint64_t> seHits{0};
-            std::atomic<uint64_t> trueHits{0};
-            std::atomic<uint64_t> totHits{0};
-            std::atomic<uint64_t> numReads{0};
-            std::atomic<uint64_t> tooManyHits{0};
+            ThreadCounter numMapped{0};
+            ThreadCounter numMappedAtLeastAKmer{0};
+            ThreadCounter numOfOrphans{0};
+            ThreadCounter peHits{0};
+            ThreadCounter seHits{0};
+            ThreadCounter trueHits{0};
+            ThreadCounter totHits{0};
+            ThreadCounter numReads{0};
+            ThreadCounter tooManyHits{0};
+            ThreadCounter totAlignment{0};
+            ThreadCounter correctAlignment{0};
+            ThreadCounter maxMultimapping{0};
+            ThreadCounter numDovetails{0};
+
+            ThreadCounter skippedAlignments_byCache{0};
+            ThreadCounter skippedAlignments_byCov{0};
+            ThreadCounter skippedAlignments_byBound{0};
+            ThreadCounter skippedDP_gaps{0};
+            ThreadCounter skippedDP_ends{0};
+            ThreadCounter crossReadCacheHits{0};
+            ThreadCounter crossReadCacheMisses{0};
+            ThreadCounter duplicateReads{0};
+            ThreadCounter totalAlignmentAttempts{0};
+            ThreadCounter cigar_fixed_count{0};
+
+            // Adds the counts of other, keeping the larger maxMultimapping.
+            void add(const HitCounters& other) {
+                numMapped += other.numMapped;
+                numMappedAtLeastAKmer += other.numMappedAtLeastAKmer;
+                numOfOrphans += other.numOfOrphans;
+                peHits += other.peHits;
+                seHits += other.seHits;
+                trueHits += other.trueHits;
+                totHits += other.totHits;
+                numReads += other.numReads;
+                tooManyHits += other.tooManyHits;
+                totAlignment += other.totAlignment;
+                correctAlignment += other.correctAlignment;
+                if (other.maxMultimapping > maxMultimapping) { maxMultimapping = other.maxMultimapping.load(); }
+                numDovetails += other.numDovetails;
+                skippedAlignments_byCache += other.skippedAlignments_byCache;
+                skippedAlignments_byCov += other.skippedAlignments_byCov;
+                skippedAlignments_byBound += other.skippedAlignments_byBound;
+                skippedDP_gaps += other.skippedDP_gaps;
+                skippedDP_ends += other.skippedDP_ends;
+                crossReadCacheHits += other.crossReadCacheHits;
+                crossReadCacheMisses += other.crossReadCacheMisses;
+                duplicateReads += other.duplicateReads;
+                totalAlignmentAttempts += other.totalAlignmentAttempts;
+                cigar_fixed_count += other.cigar_fixed_count;
+            }
+        };
+
+        // The HitCounters of every mapping thread.  Each is padded to cache
+        // lines of its own, so counting a read never touches a line that
+        // another thread writes; totals are summed when they are needed.
+        class ShardedHitCounters {
+        public:
+            explicit ShardedHitCounters(size_t numThreads) : shards_(numThreads) {}
+
+            HitCounters& shard(size_t i) { return shards_[i].counters; }
+            // Adds the counters of all threads to total; they may still be counting.
+            void sum(HitCounters& total) const {
+                for (auto& s : shards_) { total.add(s.counters); }
+            }
+
+            // The number of reads seen when progress was last printed.
             std::atomic<uint64_t> lastPrint{0};
-            std::atomic<uint64_t> totAlignment{0};
-            std::atomic<uint64_t> correctAlignment{0};
-            std::atomic<uint64_t> maxMultimapping{0};
-            std::atomic<uint64_t> numDovetails{0};
-
-            std::atomic<uint64_t> skippedAlignments_byCache{0};
-            std::atomic<uint64_t> skippedAlignments_byCov{0};
-            std::atomic<uint64_t> totalAlignmentAttempts{0};
-            std::atomic<uint64_t> cigar_fixed_count{0};
+
+        private:
+            static constexpr const size_t cacheLineSize = 64;
+            // padded on both sides, since the allocation need not be line-aligned
+            struct Shard {
+                char before[cacheLineSize];
+                HitCounters counters;
+                char after[cacheLineSize];
+            };
+            std::vector<Shard> shards_;
         };
 
         struct ContigBlock {
@@ -9,7 +9,11 @@
 #include "mio.hpp"
 #include "compact_iterator.hpp"
 #include <bitset>
+#include <algorithm>
 #include <iostream>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
 
 namespace compact {
   
@@ -36,6 +40,29 @@ namespace compact {
         return bits_per_element;
     }
 
+    /**
+     * Ask the kernel to back the 2MiB-aligned part of [mem, mem + nbytes)
+     * with (transparent) huge pages, so that random accesses into large
+     * arrays do not miss the TLB on every lookup.  For anonymous memory
+     * this has the most effect when called before the memory is first
+     * touched; khugepaged may still collapse already-populated ranges.
+     * Returns false if the range is too small or the kernel refused.
+     */
+    inline bool advise_huge_pages(void *mem, size_t nbytes) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        constexpr const uintptr_t huge_page_size = 2 * 1024 * 1024;
+        auto beg = reinterpret_cast<uintptr_t>(mem);
+        auto abeg = (beg + huge_page_size - 1) & ~(huge_page_size - 1);
+        auto aend = (beg + nbytes) & ~(huge_page_size - 1);
+        if (mem == nullptr or aend <= abeg) { return false; }
+        return madvise(reinterpret_cast<void *>(abeg), aend - abeg, MADV_HUGEPAGE) == 0;
+#else
+        (void) mem;
+        (void) nbytes;
+        return false;
+#endif
+    }
+
     namespace vector_imp {
         inline int clz(unsigned int x) { return __builtin_clz(x); }
 
@@ -233,7 +260,7 @@ namespace compact {
                 //std::cerr << "wrote " << bytes() << " bytes of data at the end\n";
             }
 
-            void deserialize(const std::string &fname, bool mmap) {
+            void deserialize(const std::string &fname, bool mmap, bool huge_pages = false) {
                 std::error_code error;
                 if (mmap) {
                     // load the vector *read only* by mmap
@@ -260,6 +287,7 @@ namespace compact {
                     data += sizeof(w_capacity);
                     m_allocator.deallocate(m_mem, elements_to_words(m_capacity, bits()));
                     m_mem = reinterpret_cast<W *>(const_cast<char *>(data));
+                    if (huge_pages) { advise_huge_pages(); }
                 } else {
                     // load the vector by reading from file
                     std::ifstream ifile(fname, std::ios::binary);
@@ -284,11 +312,58 @@ namespace compact {
                     m_allocator.deallocate(m_mem, elements_to_words(m_capacity, bits()));
                     m_mem = m_allocator.allocate(elements_to_words(m_capacity, bits()));
                     if (m_mem == nullptr) throw std::bad_alloc();
+                    // must happen before the read below first touches the pages
+                    if (huge_pages) { advise_huge_pages(); }
                     ifile.read(reinterpret_cast<char *>(m_mem), sizeof(W) * elements_to_words(m_size, bits()));
                 }
 
             }
 
+            bool advise_huge_pages() { return compact::advise_huge_pages(m_mem, bytes()); }
+
+            bool is_mmapped() const { return ro_mmap.is_mapped(); }
+
+            /**
+             * Read one word from every page backing the vector so that, if it
+             * is mmapped, the whole file is faulted in.  Unlike touch_all_pages
+             * this is quiet and does not depend on the element width.
+             * Returns a value that depends on every word read (so the loop is
+             * not optimized away).
+             */
+            uint64_t touch_pages() const {
+#if defined(__linux__) && defined(MADV_WILLNEED)
+                if (ro_mmap.is_mapped()) {
+                    madvise(const_cast<char *>(ro_mmap.data()), ro_mmap.size(), MADV_WILLNEED);
+                }
+#endif
+                const size_t words_per_page = std::max<size_t>(mio::page_size() / sizeof(W), 1);
+                const size_t nwords = bytes() / sizeof(W);
+                uint64_t sum{0};
+                for (size_t i = 0; i < nwords; i += words_per_page) { sum += m_mem[i]; }
+                return sum;
+            }
+
+            /**
+             * Same as get_int(from, LEN) but with the length fixed at compile
+             * time and without any bounds checking; the caller guarantees that
+             * from + LEN does not pass the end of the vector.  Both words a value
+             * may straddle are always read (the last word twice, at the end of the
+             * vector) and combined without a branch, since whether a k-mer
+             * straddles a word boundary is as good as random.
+             */
+            template <unsigned LEN>
+            uint64_t get_int_fixed(uint64_t from) const {
+                static_assert(LEN <= 64, "get_int_fixed reads at most 64 bits");
+                const uint64_t idx = from / UB;
+                const uint64_t idxInWrd = from % UB;
+                const uint64_t lastIdx = elements_to_words(m_size, BITS ? BITS : bits()) - 1;
+                const uint64_t nextIdx = idx < lastIdx ? idx + 1 : idx;
+                // two shifts, as a shift by UB is undefined; the high bits are masked off
+                // when the value fits in word idx
+                uint64_t res = (m_mem[idx] >> idxInWrd) | ((m_mem[nextIdx] << 1) << (UB - 1 - idxInWrd));
+                return res & masks[LEN];
+            }
+
             void touch_all_pages(uint64_t bits_per_element) {
                 uint64_t sum = 0;
                 std::cerr << "number of elements:" << this->size() << "\n";
@@ -0,0 +1,244 @@
+#!/usr/bin/env python3
+"""
+Generates a synthetic, reproducible mapping workload: a transcriptome with
+repeat families, decoy sequences, and paired-end reads simulated from it.
+
+Written to the output directory:
+  ref.fa            the transcripts followed by the decoys (decoys go last,
+                    as `pufferfish index --decoys` expects)
+  decoys.txt        the names of the decoy sequences
+  reads_1.fq[.gz]   the left ends
+  reads_2.fq[.gz]   the right ends
+  truth.tsv         the number of fragments drawn from each sequence
+  workload.json     the parameters, so that a workload can be recreated
+
+The same parameters (including --seed) always give the same files.  Only
+the python standard library is needed.
+"""
+
+import argparse
+import gzip
+import json
+import math
+import os
+import random
+
+BASES = "ACGT"
+COMPLEMENT = str.maketrans("ACGTN", "TGCAN")
+
+
+def revcomp(seq):
+    return seq.translate(COMPLEMENT)[::-1]
+
+
+def random_seq(rng, n):
+    return "".join(rng.choices(BASES, k=n))
+
+
+def error_positions(rng, n, rate):
+    """The positions, in [0, n), hit by an event of probability rate each."""
+    if rate <= 0:
+        return []
+    positions = []
+    log_q = math.log(1.0 - rate)
+    pos = -1
+    while True:
+        pos += 1 + int(math.log(1.0 - rng.random()) / log_q)
+        if pos >= n:
+            return positions
+        positions.append(pos)
+
+
+def mutate(rng, seq, sub_rate, indel_rate=0.0):
+    """Substitutions at sub_rate and 1-3 base indels at indel_rate per base."""
+    s = list(seq)
+    for p in error_positions(rng, len(s), sub_rate):
+        s[p] = rng.choice(BASES.replace(s[p], "") if s[p] in BASES else BASES)
+    # indels from the end, so that earlier positions stay valid
+    for p in reversed(error_positions(rng, len(s), indel_rate)):
+        size = rng.randint(1, 3)
+        if rng.random() < 0.5:
+            del s[p:p + size]
+        else:
+            s[p:p] = rng.choices(BASES, k=size)
+    return "".join(s)
+
+
+def make_transcriptome(rng, args):
+    """Genes of one or more isoforms (sharing exons), into some of which
+    diverged copies of a repeat family's consensus have been inserted."""
+    families = [random_seq(rng, rng.randint(args.repeat_min_len, args.repeat_max_len))
+                for _ in range(args.repeat_families)]
+    transcripts = []
+    gene = 0
+    while len(transcripts) < args.transcripts:
+        length = rng.randint(args.min_len, args.max_len)
+        num_exons = rng.randint(1, 8)
+        cuts = sorted(rng.sample(range(1, length), num_exons - 1)) if num_exons > 1 else []
+        bounds = [0] + cuts + [length]
+        exons = [random_seq(rng, bounds[i + 1] - bounds[i]) for i in range(num_exons)]
+        num_isoforms = 1 if num_exons < 3 or rng.random() >= args.isoform_fraction else rng.randint(2, 4)
+        for iso in range(num_isoforms):
+            if len(transcripts) >= args.transcripts:
+                break
+            # every isoform keeps the first and last exon
+            kept = [e for i, e in enumerate(exons)
+                    if iso == 0 or i in (0, num_exons - 1) or rng.random() < 0.6]
+            seq = "".join(kept)
+            if families and rng.random() < args.repeat_fraction:
+                fam = families[rng.randrange(len(families))]
+                pos = rng.randrange(len(seq) + 1)
+                seq = seq[:pos] + mutate(rng, fam, args.repeat_divergence) + seq[pos:]
+            transcripts.append(("gene{}.iso{}".format(gene, iso), seq))
+        gene += 1
+    return transcripts
+
+
+def make_decoys(rng, args, transcripts):
+    """Genome-like sequences holding diverged copies of transcript pieces
+    (processed pseudogenes), which attract spurious mappings."""
+    decoys = []
+    for d in range(args.decoys):
+        parts = []
+        length = 0
+        while length < args.decoy_len:
+            if rng.random() < args.decoy_copy_fraction:
+                _, t = transcripts[rng.randrange(len(transcripts))]
+                start = rng.randrange(len(t))
+                piece = mutate(rng, t[start:start + rng.randint(200, 2000)], args.decoy_divergence, 0.001)
+            else:
+                piece = random_seq(rng, rng.randint(500, 5000))
+            parts.append(piece)
+            length += len(piece)
+        decoys.append(("decoy{}".format(d), "".join(parts)[:args.decoy_len]))
+    return decoys
+
+
+def write_fasta(path, records):
+    with open(path, "w") as out:
+        for name, seq in records:
+            out.write(">{}\n".format(name))
+            for i in range(0, len(seq), 80):
+                out.write(seq[i:i + 80])
+                out.write("\n")
+
+
+def open_out(path, compress):
+    return gzip.open(path, "wt", compresslevel=6) if compress else open(path, "w")
+
+
+def simulate_reads(rng, args, refs, out_dir):
+    """Paired-end reads from fragments of log-normally expressed references;
+    a fraction are exact (PCR) duplicates of an earlier pair."""
+    weights = []
+    for name, seq in refs:
+        eligible = len(seq) >= args.frag_mean + 3 * args.frag_sd
+        weights.append(rng.lognormvariate(0.0, args.expression_sigma) if eligible else 0.0)
+    decoy_weight = sum(w for (n, _), w in zip(refs, weights) if n.startswith("decoy"))
+    txp_weight = sum(weights) - decoy_weight
+    # rescale, so that decoys get decoy_read_fraction of the fragments
+    if decoy_weight > 0 and txp_weight > 0:
+        scale = args.decoy_read_fraction * txp_weight / ((1.0 - args.decoy_read_fraction) * decoy_weight)
+        weights = [w * scale if n.startswith("decoy") else w for (n, _), w in zip(refs, weights)]
+    if sum(weights) == 0:
+        raise SystemExit("no reference is long enough for fragments of {} +- {} bases".format(
+            args.frag_mean, args.frag_sd))
+
+    ext = ".fq.gz" if args.gzip else ".fq"
+    counts = [0] * len(refs)
+    recent = []
+    qual = "I" * args.read_len
+    with open_out(os.path.join(out_dir, "reads_1" + ext), args.gzip) as out1, \
+         open_out(os.path.join(out_dir, "reads_2" + ext), args.gzip) as out2:
+        batch = 10000
+        for first in range(0, args.reads, batch):
+            picks = rng.choices(range(len(refs)), weights=weights, k=min(batch, args.reads - first))
+            for j, ref in enumerate(picks):
+                n = first + j
+                if recent and rng.random() < args.duplicate_rate:
+                    r1, r2, ref = recent[rng.randrange(len(recent))]
+                else:
+                    seq = refs[ref][1]
+                    frag_len = max(args.read_len, min(len(seq), int(rng.gauss(args.frag_mean, args.frag_sd))))
+                    start = rng.randint(0, len(seq) - frag_len)
+                    frag = seq[start:start + frag_len]
+                    if rng.random() < 0.5:
+                        frag = revcomp(frag)
+                    r1 = mutate(rng, frag[:args.read_len], args.error_rate, args.indel_rate)[:args.read_len]
+                    r2 = mutate(rng, revcomp(frag[-args.read_len:]), args.error_rate, args.indel_rate)[:args.read_len]
+                    recent.append((r1, r2, ref))
+                    if len(recent) > 1000:
+                        recent.pop(rng.randrange(len(recent)))
+                counts[ref] += 1
+                name = "sim.{}:{}".format(n, refs[ref][0])
+                out1.write("@{}/1\n{}\n+\n{}\n".format(name, r1, qual[:len(r1)]))
+                out2.write("@{}/2\n{}\n+\n{}\n".format(name, r2, qual[:len(r2)]))
+
+    with open(os.path.join(out_dir, "truth.tsv"), "w") as out:
+        out.write("name\tfragments\n")
+        for (name, _), c in zip(refs, counts):
+            out.write("{}\t{}\n".format(name, c))
+
+
+def parse_args(argv=None):
+    p = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    p.add_argument("-o", "--out-dir", required=True, help="directory the workload is written to")
+    p.add_argument("--seed", type=int, default=17)
+    g = p.add_argument_group("references")
+    g.add_argument("--transcripts", type=int, default=5000)
+    g.add_argument("--min-len", type=int, default=400)
+    g.add_argument("--max-len", type=int, default=4000)
+    g.add_argument("--isoform-fraction", type=float, default=0.3,
+                   help="fraction of multi-exon genes with alternative isoforms")
+    g.add_argument("--repeat-families", type=int, default=100)
+    g.add_argument("--repeat-min-len", type=int, default=150)
+    g.add_argument("--repeat-max-len", type=int, default=1500)
+    g.add_argument("--repeat-fraction", type=float, default=0.2,
+                   help="fraction of transcripts holding a copy of a repeat family")
+    g.add_argument("--repeat-divergence", type=float, default=0.02,
+                   help="substitution rate between the copies of a repeat family")
+    g.add_argument("--decoys", type=int, default=10, help="number of decoy sequences (0 for none)")
+    g.add_argument("--decoy-len", type=int, default=200000)
+    g.add_argument("--decoy-copy-fraction", type=float, default=0.3,
+                   help="fraction of a decoy made of diverged transcript pieces")
+    g.add_argument("--decoy-divergence", type=float, default=0.05)
+    g = p.add_argument_group("reads")
+    g.add_argument("--reads", type=int, default=1000000, help="number of read pairs")
+    g.add_argument("--read-len", type=int, default=100)
+    g.add_argument("--frag-mean", type=int, default=250)
+    g.add_argument("--frag-sd", type=int, default=25)
+    g.add_argument("--error-rate", type=float, default=0.005, help="substitution rate per base")
+    g.add_argument("--indel-rate", type=float, default=0.0005, help="indel rate per base")
+    g.add_argument("--duplicate-rate", type=float, default=0.1,
+                   help="fraction of pairs that are exact copies of an earlier pair")
+    g.add_argument("--expression-sigma", type=float, default=1.5,
+                   help="sigma of the log-normal expression of the references")
+    g.add_argument("--decoy-read-fraction", type=float, default=0.02,
+                   help="fraction of the fragments drawn from decoys")
+    g.add_argument("--gzip", action="store_true", help="gzip-compress the reads")
+    return p.parse_args(argv)
+
+
+def main(argv=None):
+    args = parse_args(argv)
+    os.makedirs(args.out_dir, exist_ok=True)
+    rng = random.Random(args.seed)
+
+    transcripts = make_transcriptome(rng, args)
+    decoys = make_decoys(rng, args, transcripts)
+    refs = transcripts + decoys
+    write_fasta(os.path.join(args.out_dir, "ref.fa"), refs)
+    with open(os.path.join(args.out_dir, "decoys.txt"), "w") as out:
+        for name, _ in decoys:
+            out.write(name + "\n")
+    simulate_reads(rng, args, refs, args.out_dir)
+
+    with open(os.path.join(args.out_dir, "workload.json"), "w") as out:
+        json.dump(vars(args), out, indent=2, sort_keys=True)
+        out.write("\n")
+    print("wrote {} transcripts, {} decoys and {} read pairs to {}".format(
+        len(transcripts), len(decoys), args.reads, args.out_dir))
+
+
+if __name__ == "__main__":
+    main()
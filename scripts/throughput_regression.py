@@ -0,0 +1,225 @@
+#!/usr/bin/env python3
+"""
+End-to-end throughput regression harness for pufferfish.
+
+For a synthetic workload (see simulate_workload.py; generated on the first
+run), builds a dense, a sparse and a lossy index and maps the reads with
+each of them at several thread counts.  For every run it records
+
+  index:  build time, peak RSS and size on disk
+  align:  wall time, reads/sec and peak RSS
+
+and writes the results as JSON.  Given --baseline (the results of an
+earlier run on the same workload), it reports every measure that got worse
+by more than --tolerance and exits with status 1 if there was any.
+
+Example:
+  scripts/throughput_regression.py --pufferfish build/src/pufferfish \\
+      --work-dir /tmp/puffbench --threads 1,4,8 --output new.json \\
+      --baseline baseline.json
+"""
+
+import argparse
+import gzip
+import json
+import os
+import platform
+import shutil
+import subprocess
+import sys
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+# the index flags of each index type
+INDEX_FLAGS = {
+    "dense": [],
+    "sparse": ["--sparse"],
+    "lossy": ["--lossy-rate", "5"],
+}
+
+# for each measure, whether a larger value is better
+MEASURES = {
+    "build_seconds": False,
+    "build_peak_rss_mb": False,
+    "index_mb": False,
+    "align_seconds": False,
+    "reads_per_second": True,
+    "align_peak_rss_mb": False,
+}
+
+
+def run_measured(cmd, log_path):
+    """Runs cmd, logging its output; returns (seconds, peak RSS in MB)."""
+    with open(log_path, "w") as log:
+        log.write(" ".join(cmd) + "\n")
+        log.flush()
+        start = time.monotonic()
+        proc = subprocess.Popen(cmd, stdout=log, stderr=subprocess.STDOUT)
+        # wait4 gives the resource usage of this child alone
+        _, status, usage = os.wait4(proc.pid, 0)
+        seconds = time.monotonic() - start
+    proc.returncode = os.WEXITSTATUS(status) if os.WIFEXITED(status) else -os.WTERMSIG(status)
+    if proc.returncode != 0:
+        raise SystemExit("command failed ({}), see {}: {}".format(proc.returncode, log_path, " ".join(cmd)))
+    # ru_maxrss is in kilobytes on Linux and in bytes on macOS
+    rss_mb = usage.ru_maxrss / (1024.0 * 1024.0 if sys.platform == "darwin" else 1024.0)
+    return seconds, rss_mb
+
+
+def dir_size_mb(path):
+    total = 0
+    for root, _, files in os.walk(path):
+        for f in files:
+            total += os.path.getsize(os.path.join(root, f))
+    return total / (1024.0 * 1024.0)
+
+
+def count_reads(path):
+    """The number of records in a (possibly gzipped) FASTQ file."""
+    opener = gzip.open if path.endswith(".gz") else open
+    with opener(path, "rt") as f:
+        return sum(1 for _ in f) // 4
+
+
+def ensure_workload(args):
+    workload = os.path.join(args.work_dir, "workload")
+    if not os.path.exists(os.path.join(workload, "workload.json")):
+        cmd = [sys.executable, os.path.join(HERE, "simulate_workload.py"), "-o", workload] + args.sim_args
+        print("generating the workload: " + " ".join(cmd))
+        subprocess.check_call(cmd)
+    reads = [os.path.join(workload, "reads_{}.fq{}".format(i, ext))
+             for ext in ("", ".gz") for i in (1, 2)]
+    reads = [r for r in reads if os.path.exists(r)][:2]
+    if len(reads) != 2:
+        raise SystemExit("no reads_1.fq / reads_2.fq in " + workload)
+    with open(os.path.join(workload, "workload.json")) as f:
+        params = json.load(f)
+    return workload, reads, params
+
+
+def benchmark(args):
+    workload, reads, params = ensure_workload(args)
+    num_pairs = count_reads(reads[0])
+    logs = os.path.join(args.work_dir, "logs")
+    os.makedirs(logs, exist_ok=True)
+    results = {
+        "workload": {k: v for k, v in params.items() if k != "out_dir"},
+        "read_pairs": num_pairs,
+        "host": platform.node(),
+        "pufferfish": os.path.abspath(args.pufferfish),
+        "runs": {},
+    }
+    for index_type in args.index_types:
+        if index_type not in INDEX_FLAGS:
+            raise SystemExit("unknown index type " + index_type)
+        index_dir = os.path.join(args.work_dir, "index_" + index_type)
+        shutil.rmtree(index_dir, ignore_errors=True)
+        cmd = [args.pufferfish, "index", "-r", os.path.join(workload, "ref.fa"), "-o", index_dir,
+               "-p", str(args.index_threads)] + INDEX_FLAGS[index_type]
+        if not args.no_decoys and os.path.getsize(os.path.join(workload, "decoys.txt")) > 0:
+            cmd += ["--decoys", os.path.join(workload, "decoys.txt")]
+        seconds, rss = run_measured(cmd, os.path.join(logs, "index_{}.log".format(index_type)))
+        index_run = {"build_seconds": seconds, "build_peak_rss_mb": rss, "index_mb": dir_size_mb(index_dir)}
+        results["runs"][index_type] = index_run
+        print("{:6s} index   : {:8.1f} s {:8.1f} MB RSS {:8.1f} MB on disk".format(
+            index_type, seconds, rss, index_run["index_mb"]))
+
+        for threads in args.threads:
+            best = None
+            for rep in range(args.repeats):
+                cmd = [args.pufferfish, "align", "-i", index_dir, "-1", reads[0], "-2", reads[1],
+                       "-t", str(threads), "-o", os.devnull] + args.align_args
+                log = os.path.join(logs, "align_{}_t{}_{}.log".format(index_type, threads, rep))
+                seconds, rss = run_measured(cmd, log)
+                # the fastest of the repeats is the least disturbed by the rest of the machine
+                if best is None or seconds < best[0]:
+                    best = (seconds, rss)
+            align_run = {"align_seconds": best[0], "reads_per_second": num_pairs / best[0],
+                         "align_peak_rss_mb": best[1]}
+            results["runs"]["{}/t{}".format(index_type, threads)] = align_run
+            print("{:6s} align t{:<3d}: {:8.1f} s {:10.0f} reads/s {:8.1f} MB RSS".format(
+                index_type, threads, best[0], align_run["reads_per_second"], best[1]))
+        if not args.keep_indices:
+            shutil.rmtree(index_dir, ignore_errors=True)
+    return results
+
+
+def compare(results, baseline, tolerance):
+    """The measures of results that are worse than in baseline by more than
+    tolerance (a fraction), as printable lines."""
+    regressions = []
+    if baseline.get("workload") != results.get("workload"):
+        print("warning: the baseline was measured on a different workload")
+    for key, run in sorted(results["runs"].items()):
+        base = baseline.get("runs", {}).get(key)
+        if base is None:
+            continue
+        for measure, higher_is_better in MEASURES.items():
+            if measure not in run or measure not in base or base[measure] <= 0:
+                continue
+            change = (run[measure] - base[measure]) / base[measure]
+            worse = -change if higher_is_better else change
+            line = "{:12s} {:18s} {:12.2f} -> {:12.2f} ({:+.1f}%)".format(
+                key, measure, base[measure], run[measure], 100.0 * change)
+            if worse > tolerance:
+                regressions.append(line)
+            print(("REGRESSION " if worse > tolerance else "           ") + line)
+    return regressions
+
+
+def parse_args(argv=None):
+    p = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    p.add_argument("--pufferfish", default=os.path.join(HERE, "..", "build", "src", "pufferfish"),
+                   help="the pufferfish executable to measure")
+    p.add_argument("--work-dir", required=True,
+                   help="where the workload, indices and logs go; the workload is reused across runs")
+    p.add_argument("--index-types", default="dense,sparse,lossy", type=lambda s: s.split(","))
+    p.add_argument("--threads", default="1,4,8", type=lambda s: [int(t) for t in s.split(",")],
+                   help="the mapping thread counts to measure")
+    p.add_argument("--index-threads", type=int, default=8)
+    p.add_argument("--repeats", type=int, default=1, help="map this many times per run and keep the fastest")
+    p.add_argument("--align-args", default="", type=lambda s: s.split(),
+                   help="extra arguments to `pufferfish align`, e.g. --align-args=\"--bam\"")
+    p.add_argument("--sim-args", default="", type=lambda s: s.split(),
+                   help="arguments to simulate_workload.py when the workload is generated, "
+                   "e.g. --sim-args=\"--reads 100000\"")
+    p.add_argument("--no-decoys", action="store_true", help="index the decoys as ordinary references")
+    p.add_argument("--keep-indices", action="store_true")
+    p.add_argument("--output", help="write the results (JSON) here")
+    p.add_argument("--baseline", help="results of an earlier run to compare against")
+    p.add_argument("--tolerance", type=float, default=0.10,
+                   help="the fraction by which a measure may get worse before it is flagged")
+    p.add_argument("--update-baseline", action="store_true",
+                   help="write the results to --baseline instead of comparing against it")
+    return p.parse_args(argv)
+
+
+def main(argv=None):
+    args = parse_args(argv)
+    if not os.access(args.pufferfish, os.X_OK):
+        raise SystemExit("can not run " + args.pufferfish + "; pass --pufferfish")
+    os.makedirs(args.work_dir, exist_ok=True)
+    results = benchmark(args)
+
+    outputs = [args.output] if args.output else []
+    if args.baseline and (args.update_baseline or not os.path.exists(args.baseline)):
+        outputs.append(args.baseline)
+    for path in outputs:
+        with open(path, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+            f.write("\n")
+
+    if args.baseline and not args.update_baseline and args.baseline not in outputs:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        regressions = compare(results, baseline, args.tolerance)
+        if regressions:
+            print("\n{} measure(s) regressed by more than {:.0f}%".format(len(regressions), 100 * args.tolerance))
+            return 1
+        print("\nno regressions")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
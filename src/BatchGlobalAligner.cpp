@@ -0,0 +1,240 @@
+#include "BatchGlobalAligner.hpp"
+
+#include <algorithm>
+#include <limits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+// small enough that subtracting a few gap penalties can not overflow
+constexpr const int32_t negInf = std::numeric_limits<int32_t>::min() / 4;
+// the same for the 16-bit kernel, whose adds and subtracts saturate
+constexpr const int16_t negInf16 = std::numeric_limits<int16_t>::min() / 2;
+// the 16-bit kernel is used for a group when no score of its DP can reach this
+constexpr const int32_t maxScore16 = std::numeric_limits<int16_t>::max() / 2;
+
+#if defined(__AVX2__)
+// all 16 lanes of a group in one vector of 16-bit scores
+using Vec = __m256i;
+constexpr const uint32_t vecLanes = 16;
+inline Vec splat(int32_t x) { return _mm256_set1_epi16(static_cast<int16_t>(x)); }
+inline Vec load(const int16_t* p) { return _mm256_loadu_si256(reinterpret_cast<const Vec*>(p)); }
+inline void store(int16_t* p, Vec v) { _mm256_storeu_si256(reinterpret_cast<Vec*>(p), v); }
+// widens the 2-bit (plus N) codes of 16 lanes
+inline Vec loadCodes(const uint8_t* p) {
+  return _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+inline Vec vmax(Vec a, Vec b) { return _mm256_max_epi16(a, b); }
+inline Vec vadds(Vec a, Vec b) { return _mm256_adds_epi16(a, b); }
+inline Vec vsubs(Vec a, Vec b) { return _mm256_subs_epi16(a, b); }
+inline Vec veq(Vec a, Vec b) { return _mm256_cmpeq_epi16(a, b); }
+inline Vec vand(Vec a, Vec b) { return _mm256_and_si256(a, b); }
+inline Vec vandnot(Vec a, Vec b) { return _mm256_andnot_si256(a, b); }
+inline Vec vor(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+#elif defined(__SSE2__)
+// a group is two vectors of 8 lanes of 16-bit scores
+using Vec = __m128i;
+constexpr const uint32_t vecLanes = 8;
+inline Vec splat(int32_t x) { return _mm_set1_epi16(static_cast<int16_t>(x)); }
+inline Vec load(const int16_t* p) { return _mm_loadu_si128(reinterpret_cast<const Vec*>(p)); }
+inline void store(int16_t* p, Vec v) { _mm_storeu_si128(reinterpret_cast<Vec*>(p), v); }
+// widens the 2-bit (plus N) codes of 8 lanes
+inline Vec loadCodes(const uint8_t* p) {
+  return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const Vec*>(p)), _mm_setzero_si128());
+}
+inline Vec vmax(Vec a, Vec b) { return _mm_max_epi16(a, b); }
+inline Vec vadds(Vec a, Vec b) { return _mm_adds_epi16(a, b); }
+inline Vec vsubs(Vec a, Vec b) { return _mm_subs_epi16(a, b); }
+inline Vec veq(Vec a, Vec b) { return _mm_cmpeq_epi16(a, b); }
+inline Vec vand(Vec a, Vec b) { return _mm_and_si128(a, b); }
+inline Vec vandnot(Vec a, Vec b) { return _mm_andnot_si128(a, b); }
+inline Vec vor(Vec a, Vec b) { return _mm_or_si128(a, b); }
+#endif
+
+inline uint8_t nt4(char c) {
+  switch (c) {
+    case 'A': case 'a': return 0;
+    case 'C': case 'c': return 1;
+    case 'G': case 'g': return 2;
+    case 'T': case 't': return 3;
+    default: return 4;
+  }
+}
+} // namespace
+
+BatchGlobalAligner::BatchGlobalAligner(int32_t match, int32_t mismatch, int32_t gapo, int32_t gape)
+    : match_(match < 0 ? -match : match), mismatch_(mismatch > 0 ? -mismatch : mismatch),
+      gapo_(gapo), gape_(gape) {}
+
+size_t BatchGlobalAligner::add(const char* query, uint32_t qlen, const char* target, uint32_t tlen) {
+  Task task{static_cast<uint32_t>(seqs_.size()), qlen, static_cast<uint32_t>(seqs_.size() + qlen), tlen};
+  for (uint32_t i = 0; i < qlen; ++i) { seqs_.push_back(nt4(query[i])); }
+  for (uint32_t j = 0; j < tlen; ++j) { seqs_.push_back(nt4(target[j])); }
+  tasks_.push_back(task);
+  return tasks_.size() - 1;
+}
+
+void BatchGlobalAligner::clear() {
+  tasks_.clear();
+  scores_.clear();
+  seqs_.clear();
+}
+
+void BatchGlobalAligner::run() {
+  scores_.assign(tasks_.size(), negInf);
+  // group pairs of similar shape so that little of each group is padding
+  order_.resize(tasks_.size());
+  for (uint32_t i = 0; i < order_.size(); ++i) { order_[i] = i; }
+  std::sort(order_.begin(), order_.end(), [this](uint32_t a, uint32_t b) {
+    return tasks_[a].qlen != tasks_[b].qlen ? tasks_[a].qlen < tasks_[b].qlen
+                                            : tasks_[a].tlen < tasks_[b].tlen;
+  });
+  for (size_t g = 0; g < order_.size(); g += lanes) {
+    alignGroup(order_.data() + g, static_cast<uint32_t>(std::min<size_t>(lanes, order_.size() - g)));
+  }
+}
+
+void BatchGlobalAligner::alignGroup(const uint32_t* ids, uint32_t n) {
+  uint32_t Q{0}, T{0};
+  uint32_t qlen[lanes], tlen[lanes];
+  for (uint32_t l = 0; l < lanes; ++l) {
+    qlen[l] = (l < n) ? tasks_[ids[l]].qlen : 0;
+    tlen[l] = (l < n) ? tasks_[ids[l]].tlen : 0;
+    Q = std::max(Q, qlen[l]);
+    T = std::max(T, tlen[l]);
+  }
+
+  // transpose the sequences of the group; padding is N, which scores 0
+  q_.assign((Q + 1) * lanes, 4);
+  t_.assign((T + 1) * lanes, 4);
+  for (uint32_t l = 0; l < n; ++l) {
+    auto& task = tasks_[ids[l]];
+    for (uint32_t i = 0; i < task.qlen; ++i) { q_[(i + 1) * lanes + l] = seqs_[task.qoff + i]; }
+    for (uint32_t j = 0; j < task.tlen; ++j) { t_[(j + 1) * lanes + l] = seqs_[task.toff + j]; }
+  }
+
+#if defined(__SSE2__)
+  // every score of the DP is within two gap opens plus (Q + T + 2) times the
+  // largest per-base score or penalty of 0
+  int32_t perBase = std::max(std::max(match_, -mismatch_), gape_);
+  if (static_cast<int64_t>(2) * gapo_ + static_cast<int64_t>(Q + T + 2) * perBase < maxScore16) {
+    fillGroup16(ids, n, Q, T, qlen, tlen);
+    return;
+  }
+#endif
+  fillGroup32(ids, n, Q, T, qlen, tlen);
+}
+
+#if defined(__SSE2__)
+void BatchGlobalAligner::fillGroup16(const uint32_t* ids, uint32_t n, uint32_t Q, uint32_t T,
+                                     const uint32_t* qlen, const uint32_t* tlen) {
+  constexpr const uint32_t nvec = lanes / vecLanes;
+  // row 0: aligning an empty query prefix
+  H16_.resize((T + 1) * lanes);
+  E16_.resize((T + 1) * lanes);
+  for (uint32_t j = 0; j <= T; ++j) {
+    int16_t h = j == 0 ? 0 : static_cast<int16_t>(-(gapo_ + static_cast<int32_t>(j) * gape_));
+    std::fill_n(&H16_[j * lanes], lanes, h);
+    std::fill_n(&E16_[j * lanes], lanes, negInf16);
+  }
+  for (uint32_t l = 0; l < n; ++l) {
+    if (qlen[l] == 0) { scores_[ids[l]] = H16_[tlen[l] * lanes + l]; }
+  }
+
+  const Vec vMatch = splat(match_);
+  const Vec vMismatch = splat(mismatch_);
+  const Vec vGape = splat(gape_);
+  const Vec vGapoe = splat(gapo_ + gape_);
+  const Vec vN = splat(4);
+  Vec qi[nvec], diag[nvec], F[nvec], hLeft[nvec];
+  for (uint32_t i = 1; i <= Q; ++i) {
+    for (uint32_t v = 0; v < nvec; ++v) {
+      qi[v] = loadCodes(&q_[i * lanes + v * vecLanes]);
+      diag[v] = load(&H16_[v * vecLanes]);
+      hLeft[v] = splat(-(gapo_ + static_cast<int32_t>(i) * gape_));
+      store(&H16_[v * vecLanes], hLeft[v]);
+      F[v] = splat(negInf16);
+    }
+    for (uint32_t j = 1; j <= T; ++j) {
+      int16_t* Hj = &H16_[j * lanes];
+      int16_t* Ej = &E16_[j * lanes];
+      const uint8_t* tj = &t_[j * lanes];
+      for (uint32_t v = 0; v < nvec; ++v) {
+        Vec tv = loadCodes(tj + v * vecLanes);
+        // an N (code 4) on either side scores 0
+        Vec isN = veq(vand(vor(qi[v], tv), vN), vN);
+        Vec eq = veq(qi[v], tv);
+        Vec s = vandnot(isN, vor(vand(eq, vMatch), vandnot(eq, vMismatch)));
+        Vec up = load(Hj + v * vecLanes);
+        Vec e = vmax(vsubs(load(Ej + v * vecLanes), vGape), vsubs(up, vGapoe));
+        Vec f = vmax(vsubs(F[v], vGape), vsubs(hLeft[v], vGapoe));
+        Vec h = vmax(vadds(diag[v], s), vmax(e, f));
+        diag[v] = up;
+        store(Hj + v * vecLanes, h);
+        store(Ej + v * vecLanes, e);
+        F[v] = f;
+        hLeft[v] = h;
+      }
+    }
+    for (uint32_t l = 0; l < n; ++l) {
+      if (qlen[l] == i) { scores_[ids[l]] = H16_[tlen[l] * lanes + l]; }
+    }
+  }
+}
+#endif
+
+void BatchGlobalAligner::fillGroup32(const uint32_t* ids, uint32_t n, uint32_t Q, uint32_t T,
+                                     const uint32_t* qlen, const uint32_t* tlen) {
+  // row 0: aligning an empty query prefix
+  H_.resize((T + 1) * lanes);
+  E_.resize((T + 1) * lanes);
+  for (uint32_t l = 0; l < lanes; ++l) {
+    H_[l] = 0;
+    E_[l] = negInf;
+  }
+  for (uint32_t j = 1; j <= T; ++j) {
+    for (uint32_t l = 0; l < lanes; ++l) {
+      H_[j * lanes + l] = -(gapo_ + static_cast<int32_t>(j) * gape_);
+      E_[j * lanes + l] = negInf;
+    }
+  }
+  for (uint32_t l = 0; l < n; ++l) {
+    if (qlen[l] == 0) { scores_[ids[l]] = H_[tlen[l] * lanes + l]; }
+  }
+
+  const int32_t gapoe = gapo_ + gape_;
+  int32_t diag[lanes], F[lanes];
+  for (uint32_t i = 1; i <= Q; ++i) {
+    const uint8_t* qi = &q_[i * lanes];
+    for (uint32_t l = 0; l < lanes; ++l) {
+      diag[l] = H_[l];
+      H_[l] = -(gapo_ + static_cast<int32_t>(i) * gape_);
+      F[l] = negInf;
+    }
+    for (uint32_t j = 1; j <= T; ++j) {
+      const uint8_t* tj = &t_[j * lanes];
+      int32_t* Hj = &H_[j * lanes];
+      int32_t* Ej = &E_[j * lanes];
+      const int32_t* Hleft = &H_[(j - 1) * lanes];
+      // this loop has no dependencies between lanes and vectorizes
+      for (uint32_t l = 0; l < lanes; ++l) {
+        int32_t s = (qi[l] > 3 or tj[l] > 3) ? 0 : (qi[l] == tj[l] ? match_ : mismatch_);
+        int32_t up = Hj[l];
+        int32_t e = std::max(Ej[l] - gape_, up - gapoe);
+        int32_t f = std::max(F[l] - gape_, Hleft[l] - gapoe);
+        int32_t h = std::max(diag[l] + s, std::max(e, f));
+        diag[l] = up;
+        Hj[l] = h;
+        Ej[l] = e;
+        F[l] = f;
+      }
+    }
+    for (uint32_t l = 0; l < n; ++l) {
+      if (qlen[l] == i) { scores_[ids[l]] = H_[tlen[l] * lanes + l]; }
+    }
+  }
+}
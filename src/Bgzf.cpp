@@ -0,0 +1,84 @@
+#include "Bgzf.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+namespace {
+constexpr const size_t headerSize = 18;
+constexpr const size_t footerSize = 8;
+
+inline void putLE16(unsigned char* p, uint32_t v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+}
+
+inline void putLE32(unsigned char* p, uint32_t v) {
+  putLE16(p, v & 0xffff);
+  putLE16(p + 2, v >> 16);
+}
+} // namespace
+
+// std::min takes its arguments by reference, so these need a definition (until C++17)
+constexpr const size_t BgzfDeflater::maxBlockInput;
+constexpr const size_t BgzfDeflater::maxBlockSize;
+
+BgzfDeflater::BgzfDeflater(int level) : level_(level) {
+  zs_.zalloc = Z_NULL;
+  zs_.zfree = Z_NULL;
+  zs_.opaque = Z_NULL;
+  // raw deflate; the gzip header and footer are written by hand
+  if (deflateInit2(&zs_, level_, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    std::cerr << "Error initializing the BGZF compressor\n";
+    std::exit(1);
+  }
+}
+
+BgzfDeflater::~BgzfDeflater() { deflateEnd(&zs_); }
+
+void BgzfDeflater::compress(const char* data, size_t len, std::string& out) {
+  while (len > 0) {
+    size_t used = compressBlock(data, std::min(len, maxBlockInput), out);
+    data += used;
+    len -= used;
+  }
+}
+
+size_t BgzfDeflater::compressBlock(const char* data, size_t len, std::string& out) {
+  size_t start = out.size();
+  out.resize(start + maxBlockSize);
+  auto* block = reinterpret_cast<unsigned char*>(&out[start]);
+  while (true) {
+    deflateReset(&zs_);
+    zs_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    zs_.avail_in = static_cast<uInt>(len);
+    zs_.next_out = block + headerSize;
+    zs_.avail_out = static_cast<uInt>(maxBlockSize - headerSize - footerSize);
+    int ret = deflate(&zs_, Z_FINISH);
+    if (ret == Z_STREAM_END) { break; }
+    if (ret != Z_OK and ret != Z_BUF_ERROR) {
+      std::cerr << "Error compressing a BGZF block\n";
+      std::exit(1);
+    }
+    // incompressible input did not fit; try again with less of it, as htslib does
+    len -= std::min<size_t>(len / 2, 1024);
+  }
+  size_t blockSize = headerSize + zs_.total_out + footerSize;
+
+  static const unsigned char header[headerSize] = {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff,
+                                                   6,    0,    'B', 'C', 2, 0, 0, 0};
+  std::copy(header, header + headerSize, block);
+  putLE16(block + 16, static_cast<uint32_t>(blockSize - 1));
+  uint32_t crc = crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(data), static_cast<uInt>(len));
+  putLE32(block + headerSize + zs_.total_out, crc);
+  putLE32(block + headerSize + zs_.total_out + 4, static_cast<uint32_t>(len));
+  out.resize(start + blockSize);
+  return len;
+}
+
+const std::string& BgzfDeflater::eofBlock() {
+  static const std::string eof("\x1f\x8b\x08\x04\x00\x00\x00\x00\x00\xff\x06\x00\x42\x43\x02\x00"
+                               "\x1b\x00\x03\x00\x00\x00\x00\x00\x00\x00\x00\x00",
+                               28);
+  return eof;
+}
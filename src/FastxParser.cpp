@@ -1,9 +1,11 @@
 #include "FastxParser.hpp"
 #include "FastxParserThreadUtils.hpp"
+#include "ParallelGzReader.hpp"
 
 #include "fcntl.h"
 #include "unistd.h"
 #include <sstream>
+#include <algorithm>
 #include <atomic>
 #include <cstdio>
 #include <cstdlib>
@@ -14,10 +16,53 @@
 #include <vector>
 #include <zlib.h>
 
-// STEP 1: declare the type of file handler and the read() function
-KSEQ_INIT(gzFile, gzread)
+// STEP 1: declare the type of file handler and the read() function; input is
+// decompressed ahead of the parser by a ParallelGzReader
+static inline int readInput(fastx_parser::ParallelGzReader* reader, void* buf, unsigned len) {
+  return reader->read(buf, len);
+}
+KSEQ_INIT(fastx_parser::ParallelGzReader*, readInput)
 
 namespace fastx_parser {
+namespace {
+// the work, in nanoseconds, that a chunk and a run of reads should hold
+constexpr double chunkNs = 10e6;
+constexpr double runNs = 1e6;
+// consumers steal from a chunk that is too small, so a small chunk buys
+// nothing but more hand-offs
+constexpr size_t minChunkReads = 256;
+constexpr size_t maxRunReads = 1024;
+// until a run has been timed
+constexpr size_t firstRunReads = 16;
+}
+
+void ChunkSizer::record(size_t reads, double ns) {
+  if (reads == 0) { return; }
+  double sample = ns / reads;
+  double avg = nsPerRead_.load(std::memory_order_relaxed);
+  // consumers race to update the average; an update lost now and then does no harm
+  nsPerRead_.store(avg == 0 ? sample : 0.875 * avg + 0.125 * sample, std::memory_order_relaxed);
+}
+
+size_t ChunkSizer::chunkReads(size_t capacity, size_t queuedChunks, size_t numConsumers) {
+  double ns = nsPerRead();
+  size_t reads = ns > 0 ? static_cast<size_t>(chunkNs / ns) : minChunkReads;
+  // grow at most twofold a chunk, so that a run of cheap reads can't make one huge chunk
+  size_t last = lastChunk_.load(std::memory_order_relaxed);
+  if (last > 0) { reads = std::min(reads, 2 * last); }
+  // consumers are about to run dry; hand them the next chunk sooner
+  if (queuedChunks < numConsumers) { reads /= 2; }
+  reads = std::min(capacity, std::max(minChunkReads, reads));
+  lastChunk_.store(reads, std::memory_order_relaxed);
+  return reads;
+}
+
+size_t ChunkSizer::runReads() const {
+  double ns = nsPerRead();
+  if (ns <= 0) { return firstRunReads; }
+  return std::max<size_t>(1, std::min<size_t>(maxRunReads, static_cast<size_t>(runNs / ns)));
+}
+
 template <typename T>
 FastxParser<T>::FastxParser(std::vector<std::string> files,
                             uint32_t numConsumers, uint32_t numParsers,
@@ -39,6 +84,10 @@ FastxParser<T>::FastxParser(std::vector<std::string> files,
     numParsers = files.size();
   }
   numParsers_ = numParsers;
+  numConsumers_ = numConsumers;
+  for (size_t i = 0; i < numConsumers; ++i) {
+    ranges_.emplace_back(new WorkRange<T>());
+  }
 
   // nobody is parsing yet
   numParsing_ = 0;
@@ -75,7 +124,7 @@ FastxParser<T>::FastxParser(std::vector<std::string> files,
 }
 
 template <typename T> ReadGroup<T> FastxParser<T>::getReadGroup() {
-  return ReadGroup<T>(getProducerToken_(), getConsumerToken_());
+  return ReadGroup<T>(getProducerToken_(), getConsumerToken_(), numGroups_++);
 }
 
 template <typename T>
@@ -146,37 +195,57 @@ inline void copyRecord(kseq_t* seq, ReadQual* s) {
     s->qual.assign(seq->qual.s, seq->qual.l);
 }
 
+// Takes an empty chunk to fill, sleeping until a consumer gives one back.
+template <typename T>
+inline void takeEmptyChunk(moodycamel::ConcurrentQueue<std::unique_ptr<ReadChunk<T>>>& seqContainerQueue_,
+                           moodycamel::ConsumerToken* cCont, std::unique_ptr<ReadChunk<T>>& local,
+                           thread_utils::EventCount& chunksFree) {
+  while (!seqContainerQueue_.try_dequeue(*cCont, local)) {
+    auto key = chunksFree.prepareWait();
+    if (seqContainerQueue_.try_dequeue(*cCont, local)) {
+      chunksFree.cancelWait();
+      return;
+    }
+    chunksFree.wait(key);
+  }
+}
+
+// Sets the number of reads to fill chunk with, if sizer is given; otherwise
+// chunks are filled to the size they have.
+template <typename T>
+inline void sizeChunk(ReadChunk<T>& chunk, ChunkSizer* sizer,
+                      moodycamel::ConcurrentQueue<std::unique_ptr<ReadChunk<T>>>& readQueue_,
+                      uint32_t numConsumers) {
+  if (sizer) { chunk.have(sizer->chunkReads(chunk.want(), readQueue_.size_approx(), numConsumers)); }
+}
 
 template <typename T>
 int parseReads(
     std::vector<std::string>& inputStreams, std::atomic<uint32_t>& numParsing,
-    moodycamel::ConsumerToken* cCont, moodycamel::ProducerToken* pRead,
+    uint32_t decompressionThreads, moodycamel::ConsumerToken* cCont, moodycamel::ProducerToken* pRead,
     moodycamel::ConcurrentQueue<uint32_t>& workQueue,
     moodycamel::ConcurrentQueue<std::unique_ptr<ReadChunk<T>>>&
         seqContainerQueue_,
-    moodycamel::ConcurrentQueue<std::unique_ptr<ReadChunk<T>>>& readQueue_) {
+    moodycamel::ConcurrentQueue<std::unique_ptr<ReadChunk<T>>>& readQueue_,
+    thread_utils::EventCount& readsReady, thread_utils::EventCount& chunksFree,
+    ChunkSizer* sizer, uint32_t numConsumers, std::atomic<uint64_t>& numQueued) {
 
-  using fastx_parser::thread_utils::MIN_BACKOFF_ITERS;
-  auto curMaxDelay = MIN_BACKOFF_ITERS;
   kseq_t* seq;
   T* s;
   uint32_t fn{0};
   while (workQueue.try_dequeue(fn)) {
     auto file = inputStreams[fn];
     std::unique_ptr<ReadChunk<T>> local;
-    while (!seqContainerQueue_.try_dequeue(*cCont, local)) {
-      fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
-      // Think of a way to do this that wouldn't be loud (or would allow a user-definable logging mechanism)
-      // std::cerr << "couldn't dequeue read chunk\n";
-    }
+    takeEmptyChunk(seqContainerQueue_, cCont, local, chunksFree);
+    sizeChunk(*local, sizer, readQueue_, numConsumers);
     size_t numObtained{local->size()};
     // open the file and init the parser
-    auto fp = gzopen(file.c_str(), "r");
+    std::unique_ptr<ParallelGzReader> fp(new ParallelGzReader(file, decompressionThreads));
 
     // The number of reads we have in the local vector
     size_t numWaiting{0};
 
-    seq = kseq_init(fp);
+    seq = kseq_init(fp.get());
     int ksv = kseq_read(seq);
 
     while (ksv >= 0) {
@@ -186,17 +255,14 @@ int parseReads(
 
       // If we've filled the local vector, then dump to the concurrent queue
       if (numWaiting == numObtained) {
-        curMaxDelay = MIN_BACKOFF_ITERS;
-        while (!readQueue_.try_enqueue(std::move(local))) {
-          fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
-        }
+        local->firstRead(numQueued.fetch_add(numWaiting));
+        readQueue_.enqueue(*pRead, std::move(local));
+        readsReady.notifyOne();
         numWaiting = 0;
         numObtained = 0;
         // And get more empty reads
-        curMaxDelay = MIN_BACKOFF_ITERS;
-        while (!seqContainerQueue_.try_dequeue(*cCont, local)) {
-          fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
-        }
+        takeEmptyChunk(seqContainerQueue_, cCont, local, chunksFree);
+        sizeChunk(*local, sizer, readQueue_, numConsumers);
         numObtained = local->size();
       }
       ksv = kseq_read(seq);
@@ -214,20 +280,16 @@ int parseReads(
     // then dump them here.
     if (numWaiting > 0) {
       local->have(numWaiting);
-      curMaxDelay = MIN_BACKOFF_ITERS;
-      while (!readQueue_.try_enqueue(*pRead, std::move(local))) {
-        fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
-      }
+      local->firstRead(numQueued.fetch_add(numWaiting));
+      readQueue_.enqueue(*pRead, std::move(local));
+      readsReady.notifyOne();
       numWaiting = 0;
     } else if (numObtained > 0){
-      curMaxDelay = MIN_BACKOFF_ITERS;
-      while (!seqContainerQueue_.try_enqueue(std::move(local))) {
-        fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
-      }
+      seqContainerQueue_.enqueue(std::move(local));
+      chunksFree.notifyOne();
     }
     // destroy the parser and close the file
     kseq_destroy(seq);
-    gzclose(fp);
   }
 
   --numParsing;
@@ -238,14 +300,14 @@ template <typename T>
 int parseReadPair(
     std::vector<std::string>& inputStreams,
     std::vector<std::string>& inputStreams2, std::atomic<uint32_t>& numParsing,
-    moodycamel::ConsumerToken* cCont, moodycamel::ProducerToken* pRead,
+    uint32_t decompressionThreads, moodycamel::ConsumerToken* cCont, moodycamel::ProducerToken* pRead,
     moodycamel::ConcurrentQueue<uint32_t>& workQueue,
     moodycamel::ConcurrentQueue<std::unique_ptr<ReadChunk<T>>>&
         seqContainerQueue_,
-    moodycamel::ConcurrentQueue<std::unique_ptr<ReadChunk<T>>>& readQueue_) {
+    moodycamel::ConcurrentQueue<std::unique_ptr<ReadChunk<T>>>& readQueue_,
+    thread_utils::EventCount& readsReady, thread_utils::EventCount& chunksFree,
+    ChunkSizer* sizer, uint32_t numConsumers, std::atomic<uint64_t>& numQueued) {
 
-  using fastx_parser::thread_utils::MIN_BACKOFF_ITERS;
-  size_t curMaxDelay = MIN_BACKOFF_ITERS;
   kseq_t* seq;
   kseq_t* seq2;
   T* s;
@@ -257,21 +319,18 @@ int parseReadPair(
     auto& file2 = inputStreams2[fn];
 
     std::unique_ptr<ReadChunk<T>> local;
-    while (!seqContainerQueue_.try_dequeue(*cCont, local)) {
-      fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
-      // Think of a way to do this that wouldn't be loud (or would allow a user-definable logging mechanism)
-      // std::cerr << "couldn't dequeue read chunk\n";
-    }
+    takeEmptyChunk(seqContainerQueue_, cCont, local, chunksFree);
+    sizeChunk(*local, sizer, readQueue_, numConsumers);
     size_t numObtained{local->size()};
     // open the file and init the parser
-    auto fp = gzopen(file.c_str(), "r");
-    auto fp2 = gzopen(file2.c_str(), "r");
+    std::unique_ptr<ParallelGzReader> fp(new ParallelGzReader(file, decompressionThreads));
+    std::unique_ptr<ParallelGzReader> fp2(new ParallelGzReader(file2, decompressionThreads));
 
     // The number of reads we have in the local vector
     size_t numWaiting{0};
 
-    seq = kseq_init(fp);
-    seq2 = kseq_init(fp2);
+    seq = kseq_init(fp.get());
+    seq2 = kseq_init(fp2.get());
 
     int ksv = kseq_read(seq);
     int ksv2 = kseq_read(seq2);
@@ -283,17 +342,14 @@ int parseReadPair(
 
       // If we've filled the local vector, then dump to the concurrent queue
       if (numWaiting == numObtained) {
-        curMaxDelay = MIN_BACKOFF_ITERS;
-        while (!readQueue_.try_enqueue(std::move(local))) {
-          fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
-        }
+        local->firstRead(numQueued.fetch_add(numWaiting));
+        readQueue_.enqueue(*pRead, std::move(local));
+        readsReady.notifyOne();
         numWaiting = 0;
         numObtained = 0;
         // And get more empty reads
-        curMaxDelay = MIN_BACKOFF_ITERS;
-        while (!seqContainerQueue_.try_dequeue(*cCont, local)) {
-          fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
-        }
+        takeEmptyChunk(seqContainerQueue_, cCont, local, chunksFree);
+        sizeChunk(*local, sizer, readQueue_, numConsumers);
         numObtained = local->size();
       }
       ksv = kseq_read(seq);
@@ -312,22 +368,17 @@ int parseReadPair(
     // then dump them here.
     if (numWaiting > 0) {
       local->have(numWaiting);
-      curMaxDelay = MIN_BACKOFF_ITERS;
-      while (!readQueue_.try_enqueue(*pRead, std::move(local))) {
-        fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
-      }
+      local->firstRead(numQueued.fetch_add(numWaiting));
+      readQueue_.enqueue(*pRead, std::move(local));
+      readsReady.notifyOne();
       numWaiting = 0;
     } else if (numObtained > 0){
-      curMaxDelay = MIN_BACKOFF_ITERS;
-      while (!seqContainerQueue_.try_enqueue(std::move(local))) {
-        fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
-      }
+      seqContainerQueue_.enqueue(std::move(local));
+      chunksFree.notifyOne();
     }
     // destroy the parser and close the file
     kseq_destroy(seq);
-    gzclose(fp);
     kseq_destroy(seq2);
-    gzclose(fp2);
   }
 
   --numParsing;
@@ -343,9 +394,14 @@ template <> bool FastxParser<ReadSeq>::start() {
       ++numParsing_;
       parsingThreads_.emplace_back(new std::thread([this, i]() {
         this->threadResults_[i] = parseReads(this->inputStreams_, this->numParsing_,
-                   this->consumeContainers_[i].get(),
+                   this->decompressionThreads_, this->consumeContainers_[i].get(),
                    this->produceReads_[i].get(), this->workQueue_,
-                   this->seqContainerQueue_, this->readQueue_);
+                   this->seqContainerQueue_, this->readQueue_,
+                   this->readsReady_, this->chunksFree_,
+                   this->adaptive_ ? &this->sizer_ : nullptr, this->numConsumers_,
+                   this->numQueued_);
+        // consumers waiting for reads must see that this parser is done
+        this->readsReady_.notifyAll();
       }));
     }
     return true;
@@ -378,9 +434,15 @@ template <> bool FastxParser<ReadPair>::start() {
       ++numParsing_;
       parsingThreads_.emplace_back(new std::thread([this, i]() {
             this->threadResults_[i] = parseReadPair(this->inputStreams_, this->inputStreams2_,
-                      this->numParsing_, this->consumeContainers_[i].get(),
+                      this->numParsing_, this->decompressionThreads_,
+                      this->consumeContainers_[i].get(),
                       this->produceReads_[i].get(), this->workQueue_,
-                      this->seqContainerQueue_, this->readQueue_);
+                      this->seqContainerQueue_, this->readQueue_,
+                   this->readsReady_, this->chunksFree_,
+                   this->adaptive_ ? &this->sizer_ : nullptr, this->numConsumers_,
+                   this->numQueued_);
+        // consumers waiting for reads must see that this parser is done
+        this->readsReady_.notifyAll();
       }));
     }
     return true;
@@ -398,9 +460,14 @@ template <> bool FastxParser<ReadQual>::start() {
       ++numParsing_;
       parsingThreads_.emplace_back(new std::thread([this, i]() {
         this->threadResults_[i] = parseReads(this->inputStreams_, this->numParsing_,
-                   this->consumeContainers_[i].get(),
+                   this->decompressionThreads_, this->consumeContainers_[i].get(),
                    this->produceReads_[i].get(), this->workQueue_,
-                   this->seqContainerQueue_, this->readQueue_);
+                   this->seqContainerQueue_, this->readQueue_,
+                   this->readsReady_, this->chunksFree_,
+                   this->adaptive_ ? &this->sizer_ : nullptr, this->numConsumers_,
+                   this->numQueued_);
+        // consumers waiting for reads must see that this parser is done
+        this->readsReady_.notifyAll();
       }));
     }
     return true;
@@ -433,9 +500,15 @@ template <> bool FastxParser<ReadQualPair>::start() {
       ++numParsing_;
       parsingThreads_.emplace_back(new std::thread([this, i]() {
             this->threadResults_[i] = parseReadPair(this->inputStreams_, this->inputStreams2_,
-                      this->numParsing_, this->consumeContainers_[i].get(),
+                      this->numParsing_, this->decompressionThreads_,
+                      this->consumeContainers_[i].get(),
                       this->produceReads_[i].get(), this->workQueue_,
-                      this->seqContainerQueue_, this->readQueue_);
+                      this->seqContainerQueue_, this->readQueue_,
+                   this->readsReady_, this->chunksFree_,
+                   this->adaptive_ ? &this->sizer_ : nullptr, this->numConsumers_,
+                   this->numQueued_);
+        // consumers waiting for reads must see that this parser is done
+        this->readsReady_.notifyAll();
       }));
     }
     return true;
@@ -447,21 +520,213 @@ template <> bool FastxParser<ReadQualPair>::start() {
 
 template <typename T> bool FastxParser<T>::refill(ReadGroup<T>& seqs) {
   finishedWithGroup(seqs);
-  auto curMaxDelay = fastx_parser::thread_utils::MIN_BACKOFF_ITERS;
+  if (window_ > 0 and seqs.worker_ < ranges_.size()) {
+    return refillInWindow_(seqs);
+  }
+  if (adaptive_ and seqs.worker_ < ranges_.size() and takeRun_(seqs, *ranges_[seqs.worker_])) {
+    return true;
+  }
   while (numParsing_ > 0) {
-    if (readQueue_.try_dequeue(seqs.consumerToken(), seqs.chunkPtr())) {
+    if (takeChunk_(seqs)) {
+      return true;
+    }
+    // sleep until a parser queues a chunk or finishes, or another consumer
+    // takes a chunk that can be shared
+    auto key = readsReady_.prepareWait();
+    if (takeChunk_(seqs) or (adaptive_ and steal_(seqs))) {
+      readsReady_.cancelWait();
+      return true;
+    }
+    if (numParsing_ == 0) {
+      readsReady_.cancelWait();
+      break;
+    }
+    readsReady_.wait(key);
+  }
+  return takeChunk_(seqs) or (adaptive_ and steal_(seqs));
+}
+
+// Refills seqs for a consumer that may only take reads before
+// *oldest_ + window_: with the oldest untaken reads, wherever they are, or
+// else with the first run of a new chunk.  A consumer with no reads it may
+// take sleeps until the window moves, a parser queues a chunk or finishes,
+// or another consumer takes a chunk; false once every read has been taken.
+template <typename T> bool FastxParser<T>::refillInWindow_(ReadGroup<T>& seqs) {
+  auto& own = *ranges_[seqs.worker_];
+  while (true) {
+    // before looking, so that a notification while we do is not lost
+    auto key = readsReady_.prepareWait();
+    // read before looking for reads, so that none are queued once it is 0
+    bool parsing = numParsing_ > 0;
+    uint64_t limit = oldest_->load() + window_;
+    if (takeOldestRun_(seqs, limit)) {
+      readsReady_.cancelWait();
+      return true;
+    }
+    bool ownEmpty{false};
+    {
+      std::lock_guard<std::mutex> lock(own.mut);
+      ownEmpty = own.next == own.end;
+    }
+    // a chunk taken past the window waits in this consumer's range
+    if (ownEmpty and takeChunk_(seqs, limit)) {
+      readsReady_.cancelWait();
       return true;
     }
-    fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
+    if (!parsing) {
+      bool anyLeft{false};
+      for (auto& r : ranges_) {
+        std::lock_guard<std::mutex> lock(r->mut);
+        anyLeft = anyLeft or r->next < r->end;
+      }
+      if (!anyLeft and readQueue_.size_approx() == 0) {
+        readsReady_.cancelWait();
+        return false;
+      }
+    }
+    readsReady_.wait(key);
+  }
+}
+
+// Gives seqs a run from the front of the range holding the oldest untaken
+// reads, if they are before limit.
+template <typename T> bool FastxParser<T>::takeOldestRun_(ReadGroup<T>& seqs, uint64_t limit) {
+  size_t numRanges = ranges_.size();
+  size_t oldestIdx = numRanges;
+  uint64_t oldest = limit;
+  for (size_t i = 0; i < numRanges; ++i) {
+    std::lock_guard<std::mutex> lock(ranges_[i]->mut);
+    auto& r = *ranges_[i];
+    if (r.next < r.end and r.chunk->firstRead() + r.next < oldest) {
+      oldest = r.chunk->firstRead() + r.next;
+      oldestIdx = i;
+    }
+  }
+  // another consumer may have taken them since
+  if (oldestIdx == numRanges or !takeRun_(seqs, *ranges_[oldestIdx], limit)) {
+    return false;
+  }
+  if (oldestIdx != seqs.worker_) {
+    ++numSteals_;
   }
-  return readQueue_.try_dequeue(seqs.consumerToken(), seqs.chunkPtr());
+  return true;
+}
+
+// Gives seqs the next run of reads of range, if there is one before limit.
+template <typename T>
+bool FastxParser<T>::takeRun_(ReadGroup<T>& seqs, WorkRange<T>& range, uint64_t limit) {
+  std::lock_guard<std::mutex> lock(range.mut);
+  if (range.next == range.end or range.chunk->firstRead() + range.next >= limit) {
+    return false;
+  }
+  size_t n = std::min(sizer_.runReads(), range.end - range.next);
+  n = static_cast<size_t>(std::min<uint64_t>(n, limit - (range.chunk->firstRead() + range.next)));
+  seqs.assign(range.chunk, range.next, range.next + n);
+  seqs.start_ = std::chrono::steady_clock::now();
+  range.next += n;
+  return true;
+}
+
+// Puts reads [begin, end) of chunk in the range of seqs (which is empty),
+// and gives seqs the first run of them (none, if runReads is 0).
+template <typename T>
+void FastxParser<T>::publishRange_(ReadGroup<T>& seqs, WorkRange<T>& range, ReadChunk<T>* chunk,
+                                   size_t begin, size_t end, size_t runReads) {
+  std::lock_guard<std::mutex> lock(range.mut);
+  size_t n = std::min(runReads, end - begin);
+  range.chunk = chunk;
+  range.next = begin + n;
+  range.end = end;
+  if (n > 0) {
+    seqs.assign(chunk, begin, begin + n);
+  }
+}
+
+// Takes a chunk off the queue, giving seqs the first run of it that is
+// before limit; the rest goes in the consumer's range.
+template <typename T> bool FastxParser<T>::takeChunk_(ReadGroup<T>& seqs, uint64_t limit) {
+  std::unique_ptr<ReadChunk<T>> local;
+  if (!readQueue_.try_dequeue(seqs.consumerToken(), local)) {
+    return false;
+  }
+  size_t n = local->size();
+  local->pending() = n;
+  // from here on, whoever finishes the last of its reads gives it back
+  auto* chunk = local.release();
+  if (!adaptive_ or seqs.worker_ >= ranges_.size()) {
+    seqs.assign(chunk, 0, n);
+  } else {
+    size_t runReads = sizer_.runReads();
+    uint64_t first = chunk->firstRead();
+    if (first >= limit) {
+      runReads = 0;
+    } else {
+      runReads = static_cast<size_t>(std::min<uint64_t>(runReads, limit - first));
+    }
+    publishRange_(seqs, *ranges_[seqs.worker_], chunk, 0, n, runReads);
+    // wake a consumer to share this chunk
+    if (n > runReads) {
+      readsReady_.notifyOne();
+    }
+  }
+  seqs.start_ = std::chrono::steady_clock::now();
+  return !seqs.empty();
+}
+
+// Takes the back half of the untaken reads of another consumer's range.
+template <typename T> bool FastxParser<T>::steal_(ReadGroup<T>& seqs) {
+  size_t numRanges = ranges_.size();
+  for (size_t i = 1; i <= numRanges; ++i) {
+    size_t victimIdx = (seqs.worker_ + i) % numRanges;
+    if (victimIdx == seqs.worker_) {
+      continue;
+    }
+    auto& victim = *ranges_[victimIdx];
+    ReadChunk<T>* chunk{nullptr};
+    size_t begin{0}, end{0};
+    {
+      std::lock_guard<std::mutex> lock(victim.mut);
+      size_t left = victim.end - victim.next;
+      if (left == 0) {
+        continue;
+      }
+      // the chunk can't be given back while these reads are unfinished
+      chunk = victim.chunk;
+      end = victim.end;
+      begin = end - (left + 1) / 2;
+      victim.end = begin;
+    }
+    ++numSteals_;
+    if (seqs.worker_ < numRanges) {
+      size_t runReads = sizer_.runReads();
+      publishRange_(seqs, *ranges_[seqs.worker_], chunk, begin, end, runReads);
+      if (end - begin > runReads) {
+        readsReady_.notifyOne();
+      }
+    } else {
+      seqs.assign(chunk, begin, end);
+    }
+    seqs.start_ = std::chrono::steady_clock::now();
+    return true;
+  }
+  return false;
 }
 
 template <typename T> void FastxParser<T>::finishedWithGroup(ReadGroup<T>& s) {
-  // If this read group is holding a valid chunk, then give it back
+  // If this read group is holding reads, then account for them, and give
+  // their chunk back if they were its last
   if (!s.empty()) {
-    seqContainerQueue_.enqueue(s.producerToken(), std::move(s.takeChunkPtr()));
-    s.setChunkEmpty();
+    size_t n = s.size();
+    auto* chunk = s.chunk_;
+    if (adaptive_) {
+      std::chrono::duration<double, std::nano> took = std::chrono::steady_clock::now() - s.start_;
+      sizer_.record(n, took.count());
+    }
+    s.assign(nullptr, 0, 0);
+    if (chunk->pending().fetch_sub(n) == n) {
+      seqContainerQueue_.enqueue(s.producerToken(), std::unique_ptr<ReadChunk<T>>(chunk));
+      chunksFree_.notifyOne();
+    }
   }
 }
 
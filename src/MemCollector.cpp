@@ -1,4 +1,5 @@
 #include "MemCollector.hpp"
+#include "PerfTimers.hpp"
 
 // using spp:sparse_hash_map;
 
@@ -150,15 +151,21 @@ bool MemCollector<PufferfishIndexT>::operator()(std::string &read,
   int32_t basesSinceLastHit{signedK};
   ExpansionTerminationType et {ExpansionTerminationType::MISMATCH};
 
+  uint64_t numLookups{0};
   while (kit1 != kit_end) {
+    pufferfish::perf::StageTimer lookupTimer(pufferfish::perf::Stage::KmerLookup);
     auto phits = pfi_->getRefPos(kit1->first, qc);
+    lookupTimer.stop();
+    ++numLookups;
     skip = (basesSinceLastHit >= signedK) ? 1 : altSkip;
     if (!phits.empty()) {
       // kit1 gets updated inside expandHitEfficient function
       // stamping the readPos
       // NOTE: expandHitEfficient advances kit1 by *at least* 1 base
       size_t readPosOld = kit1->second;
+      pufferfish::perf::StageTimer expandTimer(pufferfish::perf::Stage::MemExpansion);
       expandHitEfficient(phits, kit1, et);
+      expandTimer.stop();
 			if (verbose){
 			  std::cerr<<"after expansion\n";
 				std::cerr<<"readPosOld:"<<readPosOld<<" kmer:"<< kit1->first.to_str() <<"\n";
@@ -186,6 +193,8 @@ bool MemCollector<PufferfishIndexT>::operator()(std::string &read,
       }
     }
   }*/
+  pufferfish::perf::count(&pufferfish::perf::ThreadPerf::numLookups, numLookups);
+  pufferfish::perf::count(&pufferfish::perf::ThreadPerf::numAnchors, rawHits.size());
   return rawHits.size() != 0;
 }
 
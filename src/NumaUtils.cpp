@@ -0,0 +1,197 @@
+#include "NumaUtils.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "spdlog/spdlog.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace pufferfish {
+namespace numa {
+
+namespace {
+// Parse a kernel cpulist such as "0-3,8-11,16".
+std::vector<uint32_t> parseCpuList(const std::string& s) {
+  std::vector<uint32_t> cpus;
+  std::stringstream ss(s);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty() or range == "\n") { continue; }
+    auto dash = range.find('-');
+    try {
+      if (dash == std::string::npos) {
+        cpus.push_back(static_cast<uint32_t>(std::stoul(range)));
+      } else {
+        uint32_t lo = static_cast<uint32_t>(std::stoul(range.substr(0, dash)));
+        uint32_t hi = static_cast<uint32_t>(std::stoul(range.substr(dash + 1)));
+        for (uint32_t c = lo; c <= hi; ++c) { cpus.push_back(c); }
+      }
+    } catch (const std::exception&) {
+      // malformed entry; ignore it
+    }
+  }
+  return cpus;
+}
+
+#if defined(__linux__)
+// The cpus the calling thread may run on; empty if they can not be read.
+std::vector<uint32_t> getAffinity() {
+  std::vector<uint32_t> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+    for (uint32_t c = 0; c < CPU_SETSIZE; ++c) {
+      if (CPU_ISSET(c, &set)) { cpus.push_back(c); }
+    }
+  }
+  return cpus;
+}
+
+// Values from <linux/mempolicy.h>; we call the syscall directly so as
+// not to depend on libnuma.
+constexpr int kMpolDefault = 0;
+constexpr int kMpolInterleave = 3;
+constexpr unsigned long kMaxNodes = 1024;
+#endif
+} // namespace
+
+Topology detectTopology() {
+  Topology topo;
+  std::vector<uint32_t> allowed;
+#if defined(__linux__)
+  // called before any thread is pinned, this is what the process was given
+  allowed = getAffinity();
+  std::vector<bool> isAllowed;
+  for (auto c : allowed) {
+    if (c >= isAllowed.size()) { isAllowed.resize(c + 1, false); }
+    isAllowed[c] = true;
+  }
+  for (uint32_t n = 0; ; ++n) {
+    std::ifstream f("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+    if (!f.good()) { break; }
+    std::string line;
+    std::getline(f, line);
+    auto cpus = parseCpuList(line);
+    if (!allowed.empty()) {
+      cpus.erase(std::remove_if(cpus.begin(), cpus.end(),
+                                [&isAllowed](uint32_t c) { return c >= isAllowed.size() or !isAllowed[c]; }),
+                 cpus.end());
+    }
+    // memory-only nodes, and nodes we may not run on, have no cpus for us
+    if (!cpus.empty()) { topo.nodeCpus.push_back(cpus); }
+  }
+#endif
+  if (topo.nodeCpus.empty()) {
+    topo.nodeCpus.push_back(allowed);
+    if (allowed.empty()) {
+      uint32_t ncpu = std::thread::hardware_concurrency();
+      if (ncpu == 0) { ncpu = 1; }
+      for (uint32_t c = 0; c < ncpu; ++c) { topo.nodeCpus.back().push_back(c); }
+    }
+  }
+  return topo;
+}
+
+std::vector<ThreadPlacement> planThreadPlacement(const Topology& topo, uint32_t nthreads) {
+  std::vector<ThreadPlacement> plan(nthreads);
+  uint32_t nnodes = topo.numNodes();
+  if (nnodes == 0) { return plan; }
+  std::vector<uint32_t> nextCpu(nnodes, 0);
+  for (uint32_t i = 0; i < nthreads; ++i) {
+    uint32_t node = i % nnodes;
+    auto& cpus = topo.nodeCpus[node];
+    plan[i].node = static_cast<int32_t>(node);
+    // wrap around when we have more threads than cpus on the node
+    plan[i].cpu = static_cast<int32_t>(cpus[nextCpu[node] % cpus.size()]);
+    ++nextCpu[node];
+  }
+  return plan;
+}
+
+#if defined(__linux__)
+static bool setAffinity(const std::vector<uint32_t>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (auto c : cpus) {
+    if (c < CPU_SETSIZE) { CPU_SET(c, &set); }
+  }
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (rc != 0) {
+    std::string list;
+    for (auto c : cpus) { list += (list.empty() ? "" : ",") + std::to_string(c); }
+    if (auto log = spdlog::get("console")) {
+      log->warn("could not restrict a thread to cpu(s) {}: {}", list, std::strerror(rc));
+    } else {
+      std::cerr << "could not restrict a thread to cpu(s) " << list << ": " << std::strerror(rc) << "\n";
+    }
+  }
+  return rc == 0;
+}
+#endif
+
+bool pinCurrentThread(uint32_t cpu) {
+#if defined(__linux__)
+  return setAffinity({cpu});
+#else
+  (void)cpu;
+  return false;
+#endif
+}
+
+bool pinCurrentThreadToNode(const Topology& topo, uint32_t node) {
+  if (node >= topo.numNodes()) { return false; }
+#if defined(__linux__)
+  return setAffinity(topo.nodeCpus[node]);
+#else
+  return false;
+#endif
+}
+
+ScopedNodeAffinity::ScopedNodeAffinity(const Topology& topo, uint32_t node) {
+#if defined(__linux__)
+  saved_ = getAffinity();
+#endif
+  pinCurrentThreadToNode(topo, node);
+}
+
+ScopedNodeAffinity::~ScopedNodeAffinity() {
+#if defined(__linux__)
+  if (!saved_.empty()) { setAffinity(saved_); }
+#endif
+}
+
+ScopedInterleavePolicy::ScopedInterleavePolicy(const Topology& topo) {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+  // nothing to interleave across
+  if (topo.numNodes() < 2) { return; }
+  std::vector<unsigned long> mask(kMaxNodes / (8 * sizeof(unsigned long)), 0);
+  std::ifstream online("/sys/devices/system/node/online");
+  std::string line;
+  std::getline(online, line);
+  for (auto n : parseCpuList(line)) {
+    if (n < kMaxNodes) { mask[n / (8 * sizeof(unsigned long))] |= (1UL << (n % (8 * sizeof(unsigned long)))); }
+  }
+  active_ = syscall(SYS_set_mempolicy, kMpolInterleave, mask.data(), kMaxNodes) == 0;
+#else
+  (void)topo;
+#endif
+}
+
+ScopedInterleavePolicy::~ScopedInterleavePolicy() {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+  if (active_) { syscall(SYS_set_mempolicy, kMpolDefault, nullptr, 0); }
+#endif
+}
+
+} // namespace numa
+} // namespace pufferfish
@@ -0,0 +1,283 @@
+#include "OutputWriter.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "Bgzf.hpp"
+
+OutputWriter::OutputWriter(int fd, bool closeFd, uint32_t numBuffers, size_t bufferCapacity,
+                           uint32_t compressionThreads, int compressionLevel)
+    : fd_(fd), closeFd_(closeFd), full_(numBuffers), compressed_(numBuffers), free_(numBuffers) {
+  for (uint32_t i = 0; i < std::max(numBuffers, 1u); ++i) {
+    std::string buffer;
+    buffer.reserve(bufferCapacity);
+    free_.enqueue(std::move(buffer));
+  }
+  activeCompressors_ = compressionThreads;
+  for (uint32_t i = 0; i < compressionThreads; ++i) {
+    compressors_.emplace_back(&OutputWriter::compressLoop, this, compressionLevel);
+  }
+  writer_ = std::thread(&OutputWriter::run, this);
+}
+
+OutputWriter::~OutputWriter() { close(); }
+
+std::string OutputWriter::acquire() {
+  std::string buffer;
+  if (free_.try_dequeue(buffer)) { return buffer; }
+  ++stalls_;
+  while (true) {
+    auto key = progress_.prepareWait();
+    if (free_.try_dequeue(buffer)) {
+      progress_.cancelWait();
+      return buffer;
+    }
+    // the buffers may all be held waiting on the output this one is for
+    if (numHeld_.load() > 0) {
+      progress_.cancelWait();
+      ++extraBuffers_;
+      return buffer;
+    }
+    progress_.wait(key);
+  }
+}
+
+void OutputWriter::enqueue(std::string&& buffer) {
+  Block block;
+  block.seq = queued_++;
+  block.data = std::move(buffer);
+  full_.enqueue(std::move(block));
+  fullReady_.notifyOne();
+}
+
+void OutputWriter::submit(std::string&& buffer) {
+  bytesIn_ += buffer.size();
+  ++submitted_;
+  enqueue(std::move(buffer));
+}
+
+void OutputWriter::submitInOrder(std::string&& buffer, uint64_t first, uint64_t count) {
+  bytesIn_ += buffer.size();
+  ++submitted_;
+  Held held;
+  held.count = count;
+  held.data = std::move(buffer);
+  holdInOrder(first, std::move(held));
+}
+
+void OutputWriter::writeInOrder(const char* data, size_t len, uint64_t first, uint64_t count) {
+  if (len > 0) {
+    auto buffer = acquire();
+    buffer.append(data, len);
+    submitInOrder(std::move(buffer), first, count);
+    return;
+  }
+  // nothing to write, but the records must still be accounted for
+  ++submitted_;
+  Held held;
+  held.count = count;
+  held.pooled = false;
+  holdInOrder(first, std::move(held));
+}
+
+void OutputWriter::holdInOrder(uint64_t first, Held&& held) {
+  std::lock_guard<std::mutex> lock(orderMutex_);
+  // an empty range, or one whose output was already submitted, would make
+  // output go missing (or be written twice)
+  if (held.count == 0 or first < nextRecord_ or (first > nextRecord_ and held_.count(first) > 0)) {
+    std::cerr << "Error: the output of records [" << first << ", " << first + held.count
+              << ") does not follow the output submitted before it\n";
+    std::exit(1);
+  }
+  if (first != nextRecord_) {
+    held_.emplace(first, std::move(held));
+    maxHeld_ = std::max<uint64_t>(maxHeld_, ++numHeld_);
+    // a thread waiting in acquire() may now make a buffer
+    progress_.notifyAll();
+    return;
+  }
+  release(std::move(held));
+  // and whatever was waiting on it
+  auto it = held_.begin();
+  while (it != held_.end() and it->first == nextRecord_) {
+    release(std::move(it->second));
+    it = held_.erase(it);
+    --numHeld_;
+  }
+  if (onAdvance_) { onAdvance_(); }
+}
+
+void OutputWriter::release(Held&& held) {
+  nextRecord_ += held.count;
+  if (!held.data.empty()) {
+    enqueue(std::move(held.data));
+    return;
+  }
+  if (held.pooled) { free_.enqueue(std::move(held.data)); }
+  ++written_;
+  progress_.notifyAll();
+}
+
+void OutputWriter::write(const char* data, size_t len) {
+  auto buffer = acquire();
+  buffer.append(data, len);
+  submit(std::move(buffer));
+}
+
+void OutputWriter::flush() {
+  auto target = submitted_.load();
+  while (true) {
+    auto key = progress_.prepareWait();
+    if (written_.load() >= target) {
+      progress_.cancelWait();
+      return;
+    }
+    progress_.wait(key);
+  }
+}
+
+void OutputWriter::close() {
+  if (closed_) { return; }
+  closed_ = true;
+  {
+    // output still held is missing the output of some records before it;
+    // write it rather than lose it
+    std::lock_guard<std::mutex> lock(orderMutex_);
+    for (auto& h : held_) { release(std::move(h.second)); }
+    held_.clear();
+    numHeld_ = 0;
+  }
+  done_ = true;
+  fullReady_.notifyAll();
+  for (auto& t : compressors_) { t.join(); }
+  writer_.join();
+  if (fd_ >= 0 and closeFd_) { ::close(fd_); }
+}
+
+void OutputWriter::compressLoop(int level) {
+  BgzfDeflater deflater(level);
+  Block block;
+  while (true) {
+    auto key = fullReady_.prepareWait();
+    // once done is set no more buffers are coming, so an empty queue is final
+    bool finished = done_.load();
+    if (!full_.try_dequeue(block)) {
+      if (finished) {
+        fullReady_.cancelWait();
+        break;
+      }
+      fullReady_.wait(key);
+      continue;
+    }
+    fullReady_.cancelWait();
+    if (!freeCompressed_.try_dequeue(block.compressed)) { block.compressed.clear(); }
+    auto start = std::chrono::steady_clock::now();
+    deflater.compress(block.data.data(), block.data.size(), block.compressed);
+    compressionNanos_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::steady_clock::now() - start).count();
+    compressed_.enqueue(std::move(block));
+    compressedReady_.notifyOne();
+  }
+  --activeCompressors_;
+  compressedReady_.notifyOne();
+}
+
+size_t OutputWriter::takeInOrder(Block* batch) {
+  size_t n{0};
+  auto it = pending_.begin();
+  while (n < maxBatch and it != pending_.end() and it->first == nextSeq_) {
+    batch[n++] = std::move(it->second);
+    it = pending_.erase(it);
+    ++nextSeq_;
+  }
+  return n;
+}
+
+void OutputWriter::run() {
+  bool compressing = !compressors_.empty();
+  Block batch[maxBatch];
+  Block arrived[maxBatch];
+  std::vector<iovec> iov;
+  iov.reserve(maxBatch);
+  auto& ready = compressing ? compressedReady_ : fullReady_;
+  while (true) {
+    auto key = ready.prepareWait();
+    // checked before looking at the queue, so that an empty queue is final when it is set
+    bool finished = compressing ? activeCompressors_.load() == 0 : done_.load();
+    size_t got = compressing ? compressed_.try_dequeue_bulk(arrived, maxBatch) : full_.try_dequeue_bulk(arrived, maxBatch);
+    for (size_t i = 0; i < got; ++i) { pending_.emplace(arrived[i].seq, std::move(arrived[i])); }
+    // buffers (and the blocks compressed from them) may arrive out of their order
+    size_t n = takeInOrder(batch);
+    if (n == 0) {
+      if (got > 0) {
+        // more may have come with them; look again before sleeping
+        ready.cancelWait();
+        continue;
+      }
+      if (finished) {
+        ready.cancelWait();
+        break;
+      }
+      ready.wait(key);
+      continue;
+    }
+    ready.cancelWait();
+
+    iov.clear();
+    for (size_t i = 0; i < n; ++i) {
+      auto& out = compressing ? batch[i].compressed : batch[i].data;
+      if (!compressing) { offsets_.push_back(bytesOut_); }
+      if (out.empty()) { continue; }
+      iov.push_back({const_cast<char*>(out.data()), out.size()});
+      bytesOut_ += out.size();
+    }
+    writeToFd(iov);
+
+    for (size_t i = 0; i < n; ++i) {
+      batch[i].data.clear();
+      free_.enqueue(std::move(batch[i].data));
+      if (compressing) {
+        batch[i].compressed.clear();
+        freeCompressed_.enqueue(std::move(batch[i].compressed));
+      }
+    }
+    written_ += n;
+    progress_.notifyAll();
+  }
+
+  if (compressing) {
+    auto& eof = BgzfDeflater::eofBlock();
+    iov.assign(1, {const_cast<char*>(eof.data()), eof.size()});
+    bytesOut_ += eof.size();
+    writeToFd(iov);
+  }
+}
+
+void OutputWriter::writeToFd(std::vector<iovec>& iov) {
+  size_t first{0};
+  while (first < iov.size()) {
+    ssize_t w = ::writev(fd_, iov.data() + first, static_cast<int>(iov.size() - first));
+    if (w < 0) {
+      if (errno == EINTR) { continue; }
+      std::cerr << "Error writing the mapping output: " << std::strerror(errno) << "\n";
+      std::exit(1);
+    }
+    // skip what was written; a partially written buffer is resumed where it stopped
+    size_t left = static_cast<size_t>(w);
+    while (first < iov.size() and left >= iov[first].iov_len) {
+      left -= iov[first].iov_len;
+      ++first;
+    }
+    if (left > 0) {
+      iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + left;
+      iov[first].iov_len -= left;
+    }
+  }
+}
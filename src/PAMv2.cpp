@@ -0,0 +1,175 @@
+#include "PAMv2.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <zlib.h>
+
+namespace {
+inline void putVarint(std::string& out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back(static_cast<char>(v));
+}
+
+// Returns 0 past the end of the column, so a malformed block can not read out of bounds.
+inline uint64_t getVarint(const char*& p, const char* end) {
+  uint64_t v{0};
+  for (uint32_t shift = 0; p < end and shift < 64; shift += 7) {
+    uint8_t b = static_cast<uint8_t>(*p++);
+    v |= static_cast<uint64_t>(b & 0x7f) << shift;
+    if (b < 0x80) { break; }
+  }
+  return v;
+}
+
+inline uint64_t zigzag(int64_t v) { return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63); }
+inline int64_t unzigzag(uint64_t v) { return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1); }
+
+inline void putU32(std::string& out, uint32_t v) { out.append(reinterpret_cast<const char*>(&v), sizeof(v)); }
+
+// Doubles are stored as they are in memory, which is little-endian on every platform we build on.
+inline void putDouble(std::string& out, double v) { out.append(reinterpret_cast<const char*>(&v), sizeof(v)); }
+
+// Returns 0 past the end of the column.
+inline double getDouble(const char*& p, const char* end) {
+  double v{0};
+  if (end - p >= static_cast<std::ptrdiff_t>(sizeof(v))) {
+    std::memcpy(&v, p, sizeof(v));
+    p += sizeof(v);
+  } else {
+    p = end;
+  }
+  return v;
+}
+
+constexpr const uint32_t strandBit = 1u << 31;
+} // namespace
+
+namespace pam2 {
+
+void BlockEncoder::addRead(const char* name, size_t nameLen, uint32_t leftLen, uint32_t rightLen,
+                           uint32_t numMappings) {
+  ++numReads_;
+  putVarint(counts_, numMappings);
+  putVarint(lengths_, leftLen);
+  if (paired_) { putVarint(lengths_, rightLen); }
+  if (readNames_) {
+    putVarint(nameLengths_, nameLen);
+    names_.append(name, nameLen);
+  }
+}
+
+void BlockEncoder::addMapping(const Mapping& m) {
+  putVarint(refIds_, zigzag(static_cast<int64_t>(m.refId) - prevRefId_));
+  prevRefId_ = m.refId;
+  putVarint(intervals_, m.leftIntervals);
+  if (paired_) { putVarint(intervals_, m.rightIntervals); }
+  auto putEnd = [this](double score, uint32_t pos) {
+    putDouble(scores_, score);
+    uint32_t p = pos & ~strandBit;
+    putVarint(positions_, zigzag(static_cast<int64_t>(p) - prevPos_));
+    prevPos_ = p;
+    strands_.push_back((pos & strandBit) ? 1 : 0);
+  };
+  if (m.leftIntervals) { putEnd(m.leftScore, m.leftPos); }
+  if (paired_ and m.rightIntervals) { putEnd(m.rightScore, m.rightPos); }
+}
+
+void BlockEncoder::finish(std::string& out) {
+  payload_.clear();
+  for (auto* col : {&counts_, &lengths_, &nameLengths_, &names_, &refIds_, &intervals_, &scores_, &positions_,
+                    &strands_}) {
+    putVarint(payload_, col->size());
+    payload_.append(*col);
+    col->clear();
+  }
+
+  size_t start = out.size();
+  uLongf compressedSize = compressBound(payload_.size());
+  out.resize(start + blockHeaderSize + compressedSize);
+  if (compress2(reinterpret_cast<Bytef*>(&out[start + blockHeaderSize]), &compressedSize,
+                reinterpret_cast<const Bytef*>(payload_.data()), payload_.size(), Z_BEST_SPEED) != Z_OK) {
+    std::cerr << "Error compressing a PAM block\n";
+    std::exit(1);
+  }
+  out.resize(start + blockHeaderSize + compressedSize);
+  std::string header;
+  putU32(header, static_cast<uint32_t>(payload_.size()));
+  putU32(header, static_cast<uint32_t>(compressedSize));
+  putU32(header, numReads_);
+  std::memcpy(&out[start], header.data(), blockHeaderSize);
+
+  numReads_ = 0;
+  prevRefId_ = 0;
+  prevPos_ = 0;
+}
+
+bool BlockDecoder::decode(const char* block, size_t size) {
+  if (size < blockHeaderSize) { return false; }
+  uint32_t rawSize, compressedSize, numReads;
+  std::memcpy(&rawSize, block, 4);
+  std::memcpy(&compressedSize, block + 4, 4);
+  std::memcpy(&numReads, block + 8, 4);
+  if (blockHeaderSize + compressedSize > size) { return false; }
+
+  raw_.resize(rawSize);
+  uLongf destLen = rawSize;
+  if (uncompress(reinterpret_cast<Bytef*>(&raw_[0]), &destLen,
+                 reinterpret_cast<const Bytef*>(block + blockHeaderSize), compressedSize) != Z_OK or
+      destLen != rawSize) {
+    return false;
+  }
+
+  const char* p = raw_.data();
+  const char* end = p + raw_.size();
+  for (auto* col : {&counts_, &lengths_, &nameLengths_, &names_, &refIds_, &intervals_, &scores_, &positions_,
+                    &strands_}) {
+    uint64_t len = getVarint(p, end);
+    if (len > static_cast<uint64_t>(end - p)) { return false; }
+    col->p = p;
+    col->end = p + len;
+    p += len;
+  }
+  readsLeft_ = numReads;
+  prevRefId_ = 0;
+  prevPos_ = 0;
+  return true;
+}
+
+void BlockDecoder::nextRead(std::string& name, uint32_t& numMappings, uint32_t& leftLen, uint32_t& rightLen) {
+  --readsLeft_;
+  numMappings = static_cast<uint32_t>(getVarint(counts_.p, counts_.end));
+  leftLen = static_cast<uint32_t>(getVarint(lengths_.p, lengths_.end));
+  rightLen = paired_ ? static_cast<uint32_t>(getVarint(lengths_.p, lengths_.end)) : 0;
+  if (readNames_) {
+    size_t nameLen = getVarint(nameLengths_.p, nameLengths_.end);
+    nameLen = std::min<size_t>(nameLen, names_.end - names_.p);
+    name.assign(names_.p, nameLen);
+    names_.p += nameLen;
+  }
+}
+
+void BlockDecoder::nextMapping(Mapping& m) {
+  prevRefId_ = static_cast<uint32_t>(prevRefId_ + unzigzag(getVarint(refIds_.p, refIds_.end)));
+  m.refId = prevRefId_;
+  m.leftIntervals = static_cast<uint32_t>(getVarint(intervals_.p, intervals_.end));
+  m.rightIntervals = paired_ ? static_cast<uint32_t>(getVarint(intervals_.p, intervals_.end)) : 0;
+  auto getEnd = [this](double& score, uint32_t& pos) {
+    score = getDouble(scores_.p, scores_.end);
+    prevPos_ = static_cast<uint32_t>(prevPos_ + unzigzag(getVarint(positions_.p, positions_.end)));
+    bool fw = strands_.p < strands_.end and *strands_.p++;
+    pos = prevPos_ | (fw ? strandBit : 0);
+  };
+  m.leftScore = m.rightScore = 0;
+  m.leftPos = m.rightPos = 0;
+  if (m.leftIntervals) { getEnd(m.leftScore, m.leftPos); }
+  if (m.rightIntervals) { getEnd(m.rightScore, m.rightPos); }
+}
+
+} // namespace pam2
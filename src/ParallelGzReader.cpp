@@ -0,0 +1,373 @@
+#include "ParallelGzReader.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace {
+// How much is read from the file at a time, and the (compressed) size of a
+// batch of BGZF blocks; both well above the 64KB maximum of a BGZF block.
+constexpr const size_t inputBlockSize = 1 << 20;
+constexpr const size_t bgzfBatchSize = 1 << 20;
+// The size of the chunks of plain gzip or uncompressed input.
+constexpr const size_t outChunkSize = 1 << 20;
+// The fixed part of a gzip member header, up to and including XLEN.
+constexpr const size_t gzipHeaderSize = 12;
+
+inline uint16_t getU16(const char* p) {
+  return static_cast<uint16_t>(static_cast<uint8_t>(p[0]) | (static_cast<uint8_t>(p[1]) << 8));
+}
+
+inline bool isGzipMagic(const char* p) {
+  return static_cast<uint8_t>(p[0]) == 0x1f and static_cast<uint8_t>(p[1]) == 0x8b;
+}
+
+// The size of the BGZF block starting at p, 0 if the avail bytes do not hold
+// its header, and -1 if it is not a BGZF block (a gzip member with a "BC"
+// extra subfield giving the block size).
+int64_t bgzfBlockSize(const char* p, size_t avail) {
+  if (avail < gzipHeaderSize) { return 0; }
+  if (!isGzipMagic(p) or p[2] != 8 or !(p[3] & 0x4)) { return -1; }
+  size_t xlen = getU16(p + 10);
+  if (avail < gzipHeaderSize + xlen) { return 0; }
+  const char* sub = p + gzipHeaderSize;
+  const char* end = sub + xlen;
+  while (sub + 4 <= end) {
+    uint16_t slen = getU16(sub + 2);
+    if (sub[0] == 'B' and sub[1] == 'C' and slen == 2 and sub + 6 <= end) {
+      return static_cast<int64_t>(getU16(sub + 4)) + 1;
+    }
+    sub += 4 + slen;
+  }
+  return -1;
+}
+
+// Inflates the whole BGZF blocks in in, appending them to out, and checks
+// their sizes and CRCs.
+bool inflateBgzfBlocks(z_stream& zs, const std::string& in, std::string& out) {
+  size_t off{0};
+  while (off < in.size()) {
+    const char* p = in.data() + off;
+    size_t blockSize = static_cast<size_t>(bgzfBlockSize(p, in.size() - off));
+    size_t headerSize = gzipHeaderSize + getU16(p + 10);
+    if (blockSize < headerSize + 8) { return false; }
+    uint32_t crc, isize;
+    std::memcpy(&crc, p + blockSize - 8, 4);
+    std::memcpy(&isize, p + blockSize - 4, 4);
+
+    size_t start = out.size();
+    out.resize(start + isize);
+    inflateReset(&zs);
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(p + headerSize));
+    zs.avail_in = static_cast<uInt>(blockSize - headerSize - 8);
+    zs.next_out = reinterpret_cast<Bytef*>(&out[0] + start);
+    zs.avail_out = isize;
+    if (inflate(&zs, Z_FINISH) != Z_STREAM_END or zs.avail_out != 0) { return false; }
+    if (crc32(0, reinterpret_cast<const Bytef*>(out.data() + start), isize) != crc) { return false; }
+    off += blockSize;
+  }
+  return true;
+}
+} // namespace
+
+namespace fastx_parser {
+
+ParallelGzReader::ParallelGzReader(const std::string& path, uint32_t numThreads)
+    : path_(path), numThreads_(std::max(numThreads, 1u)), maxInFlight_(2 * numThreads_ + 2) {
+  fd_ = ::open(path.c_str(), O_RDONLY);
+  if (fd_ < 0) {
+    fail(std::strerror(errno));
+    return;
+  }
+  producer_ = std::thread(&ParallelGzReader::produce, this);
+}
+
+ParallelGzReader::~ParallelGzReader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  spaceCv_.notify_all();
+  workCv_.notify_all();
+  if (producer_.joinable()) { producer_.join(); }
+  for (auto& t : inflaters_) { t.join(); }
+  if (fd_ >= 0) { ::close(fd_); }
+}
+
+int ParallelGzReader::read(void* buf, unsigned len) {
+  while (curPos_ >= cur_.size()) {
+    int r = nextChunk();
+    if (r <= 0) { return r; }
+  }
+  size_t n = std::min(static_cast<size_t>(len), cur_.size() - curPos_);
+  std::memcpy(buf, cur_.data() + curPos_, n);
+  curPos_ += n;
+  return static_cast<int>(n);
+}
+
+int ParallelGzReader::nextChunk() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (haveCur_) {
+    spareOut_.push_back(std::move(cur_));
+    haveCur_ = false;
+  }
+  readyCv_.wait(lock, [this]() {
+    return error_ or ready_.count(consumed_) > 0 or (producerDone_ and consumed_ == numChunks_);
+  });
+  if (error_) { return -1; }
+  auto it = ready_.find(consumed_);
+  if (it == ready_.end()) { return 0; }
+  cur_ = std::move(it->second.out);
+  curPos_ = 0;
+  haveCur_ = true;
+  ready_.erase(it);
+  ++consumed_;
+  lock.unlock();
+  spaceCv_.notify_one();
+  return 1;
+}
+
+void ParallelGzReader::produce() {
+  // enough of the file to recognize its format
+  std::string head;
+  int r{1};
+  while (r > 0 and head.size() < 18) { r = readInput(head, 18 - head.size()); }
+  if (r >= 0) {
+    if (bgzfBlockSize(head.data(), head.size()) > 0) {
+      for (uint32_t i = 0; i < numThreads_; ++i) {
+        inflaters_.emplace_back(&ParallelGzReader::inflateBgzfBatches, this);
+      }
+      splitBgzf(head);
+    } else if (head.size() >= 2 and isGzipMagic(head.data())) {
+      inflateStream(head);
+    } else {
+      passThrough(head);
+    }
+  }
+  finishProducing();
+}
+
+void ParallelGzReader::passThrough(std::string& head) {
+  Chunk chunk;
+  chunk.out = std::move(head);
+  int r{1};
+  while (r > 0) {
+    while (r > 0 and chunk.out.size() < outChunkSize) { r = readInput(chunk.out, outChunkSize - chunk.out.size()); }
+    if (r < 0 or (!chunk.out.empty() and !emit(chunk))) { return; }
+    chunk.out = spare(spareOut_);
+    chunk.out.clear();
+  }
+}
+
+void ParallelGzReader::inflateStream(std::string& head) {
+  z_stream zs;
+  std::memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+    fail("could not initialize zlib");
+    return;
+  }
+  std::string in = std::move(head);
+  size_t inPos{0};
+  bool eof{false};
+  Chunk chunk;
+  chunk.out.resize(outChunkSize);
+  size_t have{0};
+
+  // refills the input, keeping what is left of it; false on an error
+  auto refill = [&]() {
+    in.erase(0, inPos);
+    inPos = 0;
+    int r = readInput(in, inputBlockSize);
+    eof = r == 0;
+    return r >= 0;
+  };
+
+  bool ok{true};
+  while (ok) {
+    if (inPos == in.size() and !eof and !(ok = refill())) { break; }
+    zs.next_in = reinterpret_cast<Bytef*>(&in[0] + inPos);
+    zs.avail_in = static_cast<uInt>(in.size() - inPos);
+    zs.next_out = reinterpret_cast<Bytef*>(&chunk.out[0] + have);
+    zs.avail_out = static_cast<uInt>(outChunkSize - have);
+    int ret = inflate(&zs, Z_NO_FLUSH);
+    inPos = in.size() - zs.avail_in;
+    have = outChunkSize - zs.avail_out;
+
+    if (have == outChunkSize) {
+      if (!(ok = emit(chunk))) { break; }
+      chunk.out = spare(spareOut_);
+      chunk.out.resize(outChunkSize);
+      have = 0;
+    }
+
+    if (ret == Z_STREAM_END) {
+      // another member may follow; anything else after the stream is
+      // ignored, as gzread does
+      while (in.size() - inPos < 2 and !eof and (ok = refill())) {}
+      if (ok and in.size() - inPos >= 2 and isGzipMagic(in.data() + inPos)) {
+        inflateReset(&zs);
+        continue;
+      }
+      break;
+    } else if (ret == Z_BUF_ERROR and inPos == in.size() and eof) {
+      fail("unexpected end of file");
+      ok = false;
+    } else if (ret != Z_OK and ret != Z_BUF_ERROR) {
+      fail("invalid compressed data");
+      ok = false;
+    }
+  }
+  inflateEnd(&zs);
+
+  if (ok and have > 0) {
+    chunk.out.resize(have);
+    emit(chunk);
+  }
+}
+
+void ParallelGzReader::splitBgzf(std::string& head) {
+  std::string carry = std::move(head);
+  bool eof{false};
+  while (true) {
+    std::string in = spare(spareIn_);
+    in.assign(carry);
+    while (!eof and in.size() < bgzfBatchSize) {
+      int r = readInput(in, inputBlockSize);
+      if (r < 0) { return; }
+      eof = r == 0;
+    }
+
+    // cut the batch after its last whole block
+    size_t off{0};
+    while (off < in.size()) {
+      int64_t blockSize = bgzfBlockSize(in.data() + off, in.size() - off);
+      if (blockSize < 0) {
+        fail("not a valid BGZF file");
+        return;
+      }
+      if (blockSize == 0 or off + blockSize > in.size()) { break; }
+      off += blockSize;
+    }
+    carry.assign(in, off, std::string::npos);
+    in.resize(off);
+
+    if (in.empty()) {
+      if (eof) {
+        if (!carry.empty()) { fail("unexpected end of file"); }
+        return;
+      }
+      continue;
+    }
+
+    Chunk chunk;
+    chunk.in = std::move(in);
+    if (!reserveChunk(chunk)) { return; }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      work_.push_back(std::move(chunk));
+    }
+    workCv_.notify_one();
+    if (eof and carry.empty()) { return; }
+  }
+}
+
+void ParallelGzReader::inflateBgzfBatches() {
+  z_stream zs;
+  std::memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, -15) != Z_OK) {
+    fail("could not initialize zlib");
+    return;
+  }
+  while (true) {
+    Chunk chunk;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      workCv_.wait(lock, [this]() { return stop_ or error_ or !work_.empty() or producerDone_; });
+      if (stop_ or error_ or work_.empty()) { break; }
+      chunk = std::move(work_.front());
+      work_.pop_front();
+    }
+    chunk.out = spare(spareOut_);
+    chunk.out.clear();
+    if (!inflateBgzfBlocks(zs, chunk.in, chunk.out)) {
+      fail("invalid BGZF block");
+      break;
+    }
+    publish(std::move(chunk));
+  }
+  inflateEnd(&zs);
+}
+
+int ParallelGzReader::readInput(std::string& buf, size_t len) {
+  size_t start = buf.size();
+  buf.resize(start + len);
+  ssize_t n;
+  do {
+    n = ::read(fd_, &buf[0] + start, len);
+  } while (n < 0 and errno == EINTR);
+  if (n < 0) {
+    buf.resize(start);
+    fail(std::strerror(errno));
+    return -1;
+  }
+  buf.resize(start + static_cast<size_t>(n));
+  return n > 0 ? 1 : 0;
+}
+
+bool ParallelGzReader::reserveChunk(Chunk& chunk) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  spaceCv_.wait(lock, [this]() { return stop_ or error_ or numChunks_ - consumed_ < maxInFlight_; });
+  if (stop_ or error_) { return false; }
+  chunk.seq = numChunks_++;
+  return true;
+}
+
+bool ParallelGzReader::emit(Chunk& chunk) {
+  if (!reserveChunk(chunk)) { return false; }
+  publish(std::move(chunk));
+  return true;
+}
+
+void ParallelGzReader::publish(Chunk&& chunk) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (chunk.in.capacity() > 0) { spareIn_.push_back(std::move(chunk.in)); }
+    ready_.emplace(chunk.seq, std::move(chunk));
+  }
+  readyCv_.notify_one();
+}
+
+void ParallelGzReader::fail(const std::string& msg) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!error_) { std::cerr << "Error reading " << path_ << ": " << msg << "\n"; }
+    error_ = true;
+  }
+  readyCv_.notify_all();
+  workCv_.notify_all();
+  spaceCv_.notify_all();
+}
+
+void ParallelGzReader::finishProducing() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    producerDone_ = true;
+  }
+  readyCv_.notify_all();
+  workCv_.notify_all();
+}
+
+std::string ParallelGzReader::spare(std::vector<std::string>& pool) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (pool.empty()) { return std::string(); }
+  std::string s = std::move(pool.back());
+  pool.pop_back();
+  return s;
+}
+
+} // namespace fastx_parser
@@ -0,0 +1,85 @@
+#include "PerfTimers.hpp"
+
+#include <algorithm>
+#include <fstream>
+
+namespace pufferfish {
+namespace perf {
+
+namespace {
+const char* stageNames[numStages] = {"kmer_lookup",     "mem_expansion",   "find_chains",     "join_reads",
+                                     "orphan_recovery", "alignment",       "align_cache_hit", "align_gap_fill",
+                                     "align_extension", "formatting",      "output_queue"};
+
+// The upper end, in ticks, of the bucket holding the q-th quantile.
+uint64_t quantileTicks(const StageStats& s, double q) {
+  uint64_t target = static_cast<uint64_t>(q * s.count);
+  uint64_t seen{0};
+  for (size_t b = 0; b < numBuckets; ++b) {
+    seen += s.histogram[b];
+    if (seen > target) { return std::min(s.maxTicks, (uint64_t(2) << b) - 1); }
+  }
+  return s.maxTicks;
+}
+} // namespace
+
+const char* stageName(Stage s) { return stageNames[static_cast<size_t>(s)]; }
+
+void StageStats::merge(const StageStats& other) {
+  count += other.count;
+  ticks += other.ticks;
+  maxTicks = std::max(maxTicks, other.maxTicks);
+  for (size_t b = 0; b < numBuckets; ++b) { histogram[b] += other.histogram[b]; }
+}
+
+void ThreadPerf::merge(const ThreadPerf& other) {
+  for (size_t i = 0; i < numStages; ++i) { stages[i].merge(other.stages[i]); }
+  numReads += other.numReads;
+  numLookups += other.numLookups;
+  numAnchors += other.numAnchors;
+  numAlignments += other.numAlignments;
+}
+
+bool writePerfReport(const std::string& path, const ThreadPerf& total, uint32_t numThreads, double ticksPerSecond,
+                     double wallSeconds) {
+  std::ofstream out(path);
+  if (!out) { return false; }
+  double nsPerTick = 1e9 / ticksPerSecond;
+  double reads = std::max<double>(total.numReads, 1);
+
+  out << "{\n";
+  out << "  \"threads\": " << numThreads << ",\n";
+  out << "  \"wall_seconds\": " << wallSeconds << ",\n";
+  out << "  \"ticks_per_second\": " << ticksPerSecond << ",\n";
+  out << "  \"reads\": " << total.numReads << ",\n";
+  out << "  \"reads_per_second\": " << (wallSeconds > 0 ? total.numReads / wallSeconds : 0) << ",\n";
+  out << "  \"lookups_per_read\": " << total.numLookups / reads << ",\n";
+  out << "  \"anchors_per_read\": " << total.numAnchors / reads << ",\n";
+  out << "  \"alignments_per_read\": " << total.numAlignments / reads << ",\n";
+  out << "  \"stages\": {\n";
+  for (size_t i = 0; i < numStages; ++i) {
+    auto& s = total.stages[i];
+    out << "    \"" << stageNames[i] << "\": {\n";
+    out << "      \"count\": " << s.count << ",\n";
+    // summed over the threads, so it can exceed the wall time
+    out << "      \"total_seconds\": " << s.ticks * nsPerTick * 1e-9 << ",\n";
+    out << "      \"mean_ns\": " << (s.count ? s.ticks * nsPerTick / s.count : 0) << ",\n";
+    out << "      \"p50_ns\": " << quantileTicks(s, 0.5) * nsPerTick << ",\n";
+    out << "      \"p90_ns\": " << quantileTicks(s, 0.9) * nsPerTick << ",\n";
+    out << "      \"p99_ns\": " << quantileTicks(s, 0.99) * nsPerTick << ",\n";
+    out << "      \"max_ns\": " << s.maxTicks * nsPerTick << ",\n";
+    // the number of durations in [2^b, 2^(b+1)) ticks, up to the last non-empty bucket
+    size_t last = numBuckets;
+    while (last > 0 and s.histogram[last - 1] == 0) { --last; }
+    out << "      \"histogram_log2_ticks\": [";
+    for (size_t b = 0; b < last; ++b) { out << (b ? ", " : "") << s.histogram[b]; }
+    out << "]\n";
+    out << "    }" << (i + 1 < numStages ? "," : "") << "\n";
+  }
+  out << "  }\n";
+  out << "}\n";
+  return static_cast<bool>(out);
+}
+
+} // namespace perf
+} // namespace pufferfish
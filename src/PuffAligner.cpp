@@ -1,5 +1,6 @@
 #include "nonstd/string_view.hpp"
 #include "PuffAligner.hpp"
+#include "PerfTimers.hpp"
 #include "Util.hpp"
 #include "libdivide/libdivide.h"
 
@@ -134,10 +135,15 @@ bool PuffAligner::alignRead(std::string& read, std::string& read_rc, const std::
                             bool isFw, size_t tid, AlnCacheMap &alnCache, HitCounters &hctr, AlignmentResult& arOut, bool /*verbose*/) {
 
   int32_t alignmentScore{std::numeric_limits<decltype(arOut.score)>::min()};
+  // arOut is reused across hits; don't let a soft clip of a previous hit leak into this one
+  arOut.softclip_start = 0;
   if (mems.empty()) {
     arOut.score = alignmentScore;
     return false;
   }
+  // recorded only if the alignment is answered by a cache; every other
+  // return cancels it
+  pufferfish::perf::StageTimer cacheTimer(pufferfish::perf::Stage::AlignCacheHit);
 
   int32_t refExtLength = static_cast<int32_t>(mopts.refExtendLength);
   // bool firstMem = true;
@@ -178,6 +184,7 @@ bool PuffAligner::alignRead(std::string& read, std::string& read_rc, const std::
 
   if (currHitStart_read < 0 or currHitStart_read >= (int32_t) readLen) {
     std::cerr << "[ERROR in PuffAligner::alignRead :] currHitStart_read is invalid; this hould not happen!\n";
+    cacheTimer.cancel();
     return false;
   }
 
@@ -207,11 +214,18 @@ bool PuffAligner::alignRead(std::string& read, std::string& read_rc, const std::
     arOut.score = std::numeric_limits<decltype(arOut.score)>::min();
     arOut.cigar = "";
     arOut.openGapLen = 0;
+    cacheTimer.cancel();
     return false;
   }
 
   auto& bandwidth = aligner.config().bandwidth;
 
+  const int32_t mismatchScore = -std::abs(static_cast<int32_t>(mopts.mismatchScore));
+  auto ungappedIsOptimal = [&](int32_t ungapped, int32_t len, bool isEnd) -> bool {
+    return pufferfish::ungappedIsOptimal(ungapped, len, isEnd, mopts.matchScore, mopts.gapOpenPenalty,
+                                         mopts.gapExtendPenalty);
+  };
+
   libdivide::divider<int32_t> gapExtDivisor(static_cast<int32_t>(mopts.gapExtendPenalty));
   const int32_t minAcceptedScore = mopts.minScoreFraction * mopts.matchScore * readLen;
   // compute the maximum gap length that would be allowed given the length of read aligned so far and the current 
@@ -270,6 +284,10 @@ bool PuffAligner::alignRead(std::string& read, std::string& read_rc, const std::
   if (!doFullAlignment) { tseq = refSeqBuffer_; }
 
   bool useAlnCache = mopts.useAlignmentCache and isMultimapping_ and !perfectChain and !overhangingEnd;
+  // the cross-read cache is also consulted for uniquely-mapping reads; its key adds the read itself
+  // to the per-read cache key
+  bool useCrossReadCache = crossReadCache_.enabled() and !perfectChain and !overhangingEnd;
+  uint64_t crossReadKey{0};
 
   // first, check if we can skip this by perfect chaining
   // if not, check if we can skip it via the alignment cache
@@ -299,6 +317,29 @@ bool PuffAligner::alignRead(std::string& read, std::string& read_rc, const std::
     }
   }
 
+  if (useCrossReadCache) {
+    if (!didHash) {
+      MetroHash64::Hash(reinterpret_cast<uint8_t *>(const_cast<char*>(refSeqBuffer_.data())), keyLen, reinterpret_cast<uint8_t *>(&hashKey), 0);
+      hashKey ^= queryChainHash;
+      didHash = true;
+    }
+    // the reference window is identified by its content, its length and where the chain starts in it
+    uint64_t keyParts[4] = {0, hashKey, (static_cast<uint64_t>(tpos - refStart) << 32) | static_cast<uint32_t>(keyLen), isFw};
+    MetroHash64::Hash(reinterpret_cast<const uint8_t *>(read.data()), read.length(), reinterpret_cast<uint8_t *>(&keyParts[0]), 0);
+    MetroHash64::Hash(reinterpret_cast<const uint8_t *>(keyParts), sizeof(keyParts), reinterpret_cast<uint8_t *>(&crossReadKey), 0);
+    auto* hit = crossReadCache_.find(crossReadKey);
+    if (hit != nullptr) {
+      hctr.crossReadCacheHits += 1;
+      arOut.score = hit->score;
+      if (computeCIGAR or approximateCIGAR) { arOut.cigar = hit->cigar; }
+      arOut.openGapLen = hit->openGapLen;
+      arOut.softclip_start = hit->softclip_start;
+      return true;
+    }
+    hctr.crossReadCacheMisses += 1;
+  }
+  cacheTimer.cancel();
+
   //auto logger_ = spdlog::get("console");
   //spdlog::set_level(spdlog::level::debug); // Set global log level to debug
   //logger_->set_pattern("%v");
@@ -316,9 +357,11 @@ bool PuffAligner::alignRead(std::string& read, std::string& read_rc, const std::
       // part of the read before the start of the reference
       decltype(readStart) readOffset = allowOverhangSoftclip ? readStart : 0;
       nonstd::string_view readSeq = readView.substr(readOffset);
+      pufferfish::perf::StageTimer extTimer(pufferfish::perf::Stage::AlignExtension);
       aligner(readSeq.data(), readSeq.length(), refSeqBuffer_.data(),
               refSeqBuffer_.length(), &ez,
               ksw2pp::EnumToType<ksw2pp::KSW2AlignmentType::EXTENSION>());
+      extTimer.stop();
       // if we allow softclipping of overhaning bases, then we only care about
       // the best score to the end of the query or the end of the reference.
       // Otherwise, we care about the best score all the way until the end of
@@ -370,9 +413,22 @@ bool PuffAligner::alignRead(std::string& read, std::string& read_rc, const std::
         fillRefSeqBufferReverse(allRefSeq, refAccPos, refWindowStart,
                                 refWindowLength, refSeqBuffer_);
 
-        if (refSeqBuffer_.length() > 0) {
-          auto readWindow = readView.substr(0, firstMemStart_read).to_string();
-          std::reverse(readWindow.begin(), readWindow.end());
+        auto readWindow = readView.substr(0, firstMemStart_read).to_string();
+        std::reverse(readWindow.begin(), readWindow.end());
+        // if the reference covers the whole read prefix and the ungapped extension is optimal
+        // (with soft clipping, only a perfect match is), the extension needs no DP
+        int32_t preMismatches{0};
+        int32_t preUngapped = (!computeCIGAR and refWindowLength >= firstMemStart_read)
+                                  ? pufferfish::ungappedScore(readWindow.data(), refSeqBuffer_.data(), firstMemStart_read,
+                                                              mopts.matchScore, mismatchScore, preMismatches)
+                                  : 0;
+        if (!computeCIGAR and refWindowLength >= firstMemStart_read and
+            ((preMismatches == 0 and preUngapped == mopts.matchScore * firstMemStart_read) or
+             (!allowOverhangSoftclip and ungappedIsOptimal(preUngapped, firstMemStart_read, true)))) {
+          hctr.skippedDP_ends += 1;
+          alignmentScore += preUngapped;
+          openGapLen = firstMemStart_read;
+        } else if (refSeqBuffer_.length() > 0) {
           SPDLOG_DEBUG(logger_,
                        "PRE:\nreadStartPosOnRef : {}\nrefWindowStart : {}",
                        readStartPosOnRef, refWindowStart);
@@ -380,9 +436,11 @@ bool PuffAligner::alignRead(std::string& read, std::string& read_rc, const std::
                        refWindowLength, readWindow, refSeqBuffer_);
           
           bandwidth = maxAllowedGaps(0, 0) + 1;
+          pufferfish::perf::StageTimer extTimer(pufferfish::perf::Stage::AlignExtension);
           aligner(readWindow.data(), readWindow.length(), refSeqBuffer_.data(),
                   refSeqBuffer_.length(), &ez,
                   ksw2pp::EnumToType<ksw2pp::KSW2AlignmentType::EXTENSION>());
+          extTimer.stop();
           
           // If we are doing approximate soft clipping, then we will retain the
           // higher of the two scores between extending the alignment before the
@@ -521,13 +579,38 @@ bool PuffAligner::alignRead(std::string& read, std::string& read_rc, const std::
                          "\t\t tseq was not long enough; need to fetch more!");
           }
           
-          bandwidth = maxAllowedGaps(prevMemEnd_read + 1, alignmentScore) + 1;
-          score += aligner(
-              readWindow.data(), readWindow.length(), refSeq1, gapRef, &ez,
-              ksw2pp::EnumToType<ksw2pp::KSW2AlignmentType::GLOBAL>());
-              
-          if (computeCIGAR) {
-            addCigar(cigarGen, ez, false);
+          // the gap may already have been scored by runGapBatch
+          // (only ever in score-only mode); GLOBAL alignment ignores the
+          // bandwidth, so the batched score is exactly what ksw2 would return.
+          decltype(gapScores_)::const_iterator batched = gapScores_.end();
+          if (!computeCIGAR and !gapScores_.empty()) {
+            GapKey gk{gapBatchRead_, static_cast<uint64_t>(refAccPos + prevMemEnd_ref + 1),
+                      static_cast<uint32_t>(prevMemEnd_read + 1),
+                      static_cast<uint32_t>(gapRead), static_cast<uint32_t>(gapRef),
+                      isFw, &read_rc == &read_right_rc_};
+            batched = gapScores_.find(gk);
+          }
+          int32_t gapMismatches{0};
+          int32_t gapUngapped = (gapRead == gapRef)
+                                    ? pufferfish::ungappedScore(readWindow.data(), refSeq1, gapRead, mopts.matchScore,
+                                                                mismatchScore, gapMismatches)
+                                    : 0;
+          if (gapRead == gapRef and ungappedIsOptimal(gapUngapped, gapRead, false)) {
+            hctr.skippedDP_gaps += 1;
+            score += gapUngapped;
+            if (computeCIGAR) { cigarGen.add_item(gapRead, 'M'); }
+          } else if (batched != gapScores_.end()) {
+            score += batched->second;
+          } else {
+            bandwidth = maxAllowedGaps(prevMemEnd_read + 1, alignmentScore) + 1;
+            pufferfish::perf::StageTimer gapTimer(pufferfish::perf::Stage::AlignGapFill);
+            score += aligner(
+                readWindow.data(), readWindow.length(), refSeq1, gapRef, &ez,
+                ksw2pp::EnumToType<ksw2pp::KSW2AlignmentType::GLOBAL>());
+            gapTimer.stop();
+            if (computeCIGAR) {
+              addCigar(cigarGen, ez, false);
+            }
           }
         } else if (it > mems.begin() and
                    ((currMemStart_read <= prevMemEnd_read) or
@@ -599,10 +682,23 @@ bool PuffAligner::alignRead(std::string& read, std::string& read_rc, const std::
                      "refTotalLength : {}",
                      gapRead, refLen, refSeqBuffer_.size(), refTotalLength);
 
-        if (refLen > 0) {
+        int32_t tailMismatches{0};
+        int32_t tailUngapped = (!computeCIGAR and refLen >= gapRead)
+                                   ? pufferfish::ungappedScore(readWindow.data(), refSeqBuffer_.data(), gapRead,
+                                                               mopts.matchScore, mismatchScore, tailMismatches)
+                                   : 0;
+        if (!computeCIGAR and refLen >= gapRead and
+            ((tailMismatches == 0 and tailUngapped == mopts.matchScore * gapRead) or
+             (!allowOverhangSoftclip and ungappedIsOptimal(tailUngapped, gapRead, true)))) {
+          // as for the read prefix, the ungapped extension is provably what ksw2 would find
+          hctr.skippedDP_ends += 1;
+          alignmentScore += tailUngapped;
+        } else if (refLen > 0) {
+          pufferfish::perf::StageTimer extTimer(pufferfish::perf::Stage::AlignExtension);
           aligner(readWindow.data(), readWindow.length(), refSeqBuffer_.data(),
                   refLen, &ez,
                   ksw2pp::EnumToType<ksw2pp::KSW2AlignmentType::EXTENSION>());
+          extTimer.stop();
           
           // we start out with the score we obtain if we extend all the
           // way to the end of the **query**.  This is the max score we can
@@ -697,6 +793,10 @@ bool PuffAligner::alignRead(std::string& read, std::string& read_rc, const std::
     aln.openGapLen = openGapLen;
     alnCache[hashKey] = aln;
   }
+  if (useCrossReadCache) {
+    crossReadCache_.insert(crossReadKey, AlignmentResult(isFw, alignmentScore, (computeCIGAR or approximateCIGAR) ? cigar : "",
+                                                         openGapLen, arOut.softclip_start));
+  }
   arOut.score = alignmentScore;
   arOut.cigar = cigar;
   arOut.openGapLen = openGapLen;
@@ -817,6 +917,190 @@ int32_t PuffAligner::calculateAlignments(std::string& read, pufferfish::util::Jo
     return jointHit.alignmentScore;
 }
 
+int32_t PuffAligner::alignmentScoreUpperBound(const pufferfish::util::MemCluster& clust, uint32_t readLen) const {
+  const auto& mems = clust.mems;
+  if (mems.empty()) { return std::numeric_limits<int32_t>::min(); }
+  int32_t matchScore = mopts.matchScore;
+  // perfect chains score exactly this, and the full alignment can not do better
+  if (clust.perfectChain or mopts.fullAlignment or mems.front().extendedlen == 1) {
+    return matchScore * static_cast<int32_t>(readLen);
+  }
+
+  bool isFw = clust.isFw;
+  int32_t rlen = static_cast<int32_t>(readLen);
+  const auto& frontMem = mems.front();
+  int32_t firstMemStart_read = isFw ? frontMem.rpos : rlen - (frontMem.rpos + frontMem.extendedlen);
+  // the extension before the first MEM matches every base at best
+  int32_t bound = matchScore * std::max(firstMemStart_read, 0);
+
+  int32_t prevMemEnd_read = firstMemStart_read;
+  int32_t prevMemEnd_ref = frontMem.tpos;
+  for (auto& mem : mems) {
+    int32_t memlen = mem.extendedlen;
+    int32_t score = matchScore * memlen;
+    int32_t currMemStart_ref = mem.tpos;
+    int32_t currMemStart_read = isFw ? mem.rpos : rlen - (mem.rpos + memlen);
+    int32_t gapRef = currMemStart_ref - prevMemEnd_ref - 1;
+    int32_t gapRead = currMemStart_read - prevMemEnd_read - 1;
+    if ((gapRef <= 0 or gapRead <= 0) and gapRef != gapRead) {
+      // scored without alignment in alignRead; this is the exact score
+      int32_t gapDiff = std::abs(gapRef - gapRead);
+      score += (-1 * mopts.gapOpenPenalty + -1 * mopts.gapExtendPenalty * gapDiff);
+      if (gapRead < 0) { score += matchScore * std::min(gapRead, gapRef); }
+    } else if (gapRead > 0 and gapRef > 0) {
+      // a global alignment of the gap has at most min(gapRead, gapRef) matches and
+      // at least |gapRead - gapRef| gapped bases
+      score += matchScore * std::min(gapRead, gapRef);
+      if (gapRead != gapRef) {
+        score -= mopts.gapOpenPenalty + mopts.gapExtendPenalty * std::abs(gapRead - gapRef);
+      }
+    }
+    prevMemEnd_read = currMemStart_read + memlen - 1;
+    prevMemEnd_ref = currMemStart_ref + memlen - 1;
+    bound += score;
+  }
+  // as for the start, the extension after the last MEM matches every base at best
+  int32_t tailLen = rlen - (prevMemEnd_read + 1);
+  bound += matchScore * std::max(tailLen, 0);
+  return bound;
+}
+
+int32_t PuffAligner::alignmentScoreUpperBound(pufferfish::util::JointMems& jointHit, uint32_t leftLen, uint32_t rightLen) const {
+  constexpr const auto invalidScore = std::numeric_limits<int32_t>::min();
+  // calculateAlignments only accepts a mate whose score is above this
+  auto threshold = [this] (uint64_t len) -> double {
+    return (!mopts.matchScore)?(-0.6+-0.6*len):mopts.minScoreFraction*mopts.matchScore*len;
+  };
+  if (jointHit.isOrphan()) {
+    uint32_t len = jointHit.isLeftAvailable() ? leftLen : rightLen;
+    int32_t bound = alignmentScoreUpperBound(*jointHit.orphanClust(), len);
+    return bound > threshold(len) ? bound : invalidScore;
+  }
+  int32_t leftBound = alignmentScoreUpperBound(*jointHit.leftClust, leftLen);
+  int32_t rightBound = alignmentScoreUpperBound(*jointHit.rightClust, rightLen);
+  if (leftBound <= threshold(leftLen) or rightBound <= threshold(rightLen)) { return invalidScore; }
+  return leftBound + rightBound;
+}
+
+int32_t PuffAligner::alignmentScoreLowerBound(pufferfish::util::JointMems& jointHit, uint32_t leftLen, uint32_t rightLen) const {
+  constexpr const auto invalidScore = std::numeric_limits<int32_t>::min();
+  auto threshold = [this] (uint64_t len) -> double {
+    return (!mopts.matchScore)?(-0.6+-0.6*len):mopts.minScoreFraction*mopts.matchScore*len;
+  };
+  // alignRead scores a perfect chain without alignment, unless it rejects it for overhanging the reference
+  auto perfectScore = [this, &threshold, invalidScore](const pufferfish::util::MemCluster& clust, uint32_t len) -> int32_t {
+    if (!clust.perfectChain or clust.mems.empty() or mopts.mimicBT2Strict) { return invalidScore; }
+    int32_t score = mopts.matchScore * static_cast<int32_t>(len);
+    return score > threshold(len) ? score : invalidScore;
+  };
+  if (jointHit.isOrphan()) {
+    return perfectScore(*jointHit.orphanClust(), jointHit.isLeftAvailable() ? leftLen : rightLen);
+  }
+  int32_t leftScore = perfectScore(*jointHit.leftClust, leftLen);
+  int32_t rightScore = perfectScore(*jointHit.rightClust, rightLen);
+  if (leftScore == invalidScore or rightScore == invalidScore) { return invalidScore; }
+  return leftScore + rightScore;
+}
+
+/**
+ *  Walk the MEM chain of `clust` exactly as alignRead does and queue (in `batchAligner_`) every
+ *  between-MEM gap that alignRead would align with ksw2; the key of each queued gap is appended to `gapKeys_`
+ *  (in the order the gaps were added).  Gaps that were already queued for an earlier hit are skipped.
+ **/
+void PuffAligner::queueClusterGaps(uint32_t readNum, std::string& read, std::string& read_rc,
+                                   const pufferfish::util::MemCluster& clust, uint32_t tid, bool isRight) {
+  const auto& mems = clust.mems;
+  // perfect chains have no gaps, and full / orphan-recovery alignments don't align between MEMs
+  if (mems.empty() or clust.perfectChain or mopts.fullAlignment or mems.front().extendedlen == 1) { return; }
+
+  bool isFw = clust.isFw;
+  if (!isFw and read_rc.empty()) { read_rc = pufferfish::util::reverseComplement(read); }
+  nonstd::string_view readView = (isFw) ? read : read_rc;
+  int32_t readLen = static_cast<int32_t>(read.length());
+  uint64_t refAccPos = tid > 0 ? refAccumLengths[tid - 1] : 0;
+
+  const auto& frontMem = mems.front();
+  int32_t prevMemEnd_read = isFw ? frontMem.rpos : readLen - (frontMem.rpos + frontMem.extendedlen);
+  int32_t prevMemEnd_ref = frontMem.tpos;
+  for (auto& mem : mems) {
+    int32_t memlen = mem.extendedlen;
+    int32_t currMemStart_ref = mem.tpos;
+    int32_t currMemStart_read = isFw ? mem.rpos : readLen - (mem.rpos + memlen);
+    int32_t gapRef = currMemStart_ref - prevMemEnd_ref - 1;
+    int32_t gapRead = currMemStart_read - prevMemEnd_read - 1;
+    if (gapRead > 0 and gapRef > 0) {
+      GapKey gk{readNum, refAccPos + prevMemEnd_ref + 1, static_cast<uint32_t>(prevMemEnd_read + 1),
+                static_cast<uint32_t>(gapRead), static_cast<uint32_t>(gapRef), isFw, isRight};
+      if (gapScores_.find(gk) == gapScores_.end()) {
+        fillRefSeqBuffer(allRefSeq, gk.refPos, 0, gapRef, refSeqBuffer_);
+        // alignRead scores windows whose ungapped alignment is optimal without any DP
+        if (gapRead == gapRef) {
+          int32_t mismatches{0};
+          int32_t ungapped = pufferfish::ungappedScore(readView.data() + gk.readOffset, refSeqBuffer_.data(), gapRead,
+                                                       mopts.matchScore, -std::abs(static_cast<int32_t>(mopts.mismatchScore)),
+                                                       mismatches);
+          if (pufferfish::ungappedIsOptimal(ungapped, gapRead, false, mopts.matchScore, mopts.gapOpenPenalty,
+                                            mopts.gapExtendPenalty)) {
+            prevMemEnd_read = currMemStart_read + memlen - 1;
+            prevMemEnd_ref = currMemStart_ref + memlen - 1;
+            continue;
+          }
+        }
+        gapScores_.emplace(gk, 0);
+        batchAligner_.add(readView.data() + gk.readOffset, gk.gapRead, refSeqBuffer_.data(), gk.gapRef);
+        gapKeys_.push_back(gk);
+      }
+    }
+    prevMemEnd_read = currMemStart_read + memlen - 1;
+    prevMemEnd_ref = currMemStart_ref + memlen - 1;
+  }
+}
+
+void PuffAligner::clearGapBatch() {
+  gapScores_.clear();
+  gapKeys_.clear();
+  batchAligner_.clear();
+}
+
+void PuffAligner::queueGapAlignments(uint32_t readNum, std::string& read_left, std::string& read_right,
+                                     std::vector<pufferfish::util::JointMems>& jointHits,
+                                     const std::vector<size_t>& hitIdxs) {
+  if (!mopts.batchGapAlignment or !(aligner.config().flag & KSW_EZ_SCORE_ONLY)) { return; }
+  gapReadLeftRc_.clear();
+  gapReadRightRc_.clear();
+  for (size_t idx : hitIdxs) {
+    auto& jointHit = jointHits[idx];
+    if (jointHit.isOrphan()) {
+      bool isLeft = jointHit.isLeftAvailable();
+      queueClusterGaps(readNum, isLeft ? read_left : read_right, isLeft ? gapReadLeftRc_ : gapReadRightRc_,
+                       *jointHit.orphanClust(), jointHit.tid, !isLeft);
+    } else {
+      queueClusterGaps(readNum, read_left, gapReadLeftRc_, *jointHit.leftClust, jointHit.tid, false);
+      queueClusterGaps(readNum, read_right, gapReadRightRc_, *jointHit.rightClust, jointHit.tid, true);
+    }
+  }
+}
+
+void PuffAligner::queueGapAlignments(uint32_t readNum, std::string& read,
+                                     std::vector<pufferfish::util::JointMems>& jointHits,
+                                     const std::vector<size_t>& hitIdxs) {
+  if (!mopts.batchGapAlignment or !(aligner.config().flag & KSW_EZ_SCORE_ONLY)) { return; }
+  gapReadLeftRc_.clear();
+  for (size_t idx : hitIdxs) {
+    auto& jointHit = jointHits[idx];
+    queueClusterGaps(readNum, read, gapReadLeftRc_, *jointHit.orphanClust(), jointHit.tid, false);
+  }
+}
+
+void PuffAligner::runGapBatch() {
+  if (gapKeys_.empty()) { return; }
+  {
+    pufferfish::perf::StageTimer gapTimer(pufferfish::perf::Stage::AlignGapFill);
+    batchAligner_.run();
+  }
+  for (size_t i = 0; i < gapKeys_.size(); ++i) { gapScores_[gapKeys_[i]] = batchAligner_.score(i); }
+}
+
 bool PuffAligner::recoverSingleOrphan(std::string& read_left, std::string& read_right, pufferfish::util::MemCluster& clust, std::vector<pufferfish::util::MemCluster> &recoveredMemClusters, uint32_t tid, bool anchorIsLeft, bool verbose) {
   int32_t anchorLen = anchorIsLeft ? read_left.length() : read_right.length();
   /*auto tpos = clust.mems[0].tpos;
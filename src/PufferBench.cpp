@@ -0,0 +1,1220 @@
+/**
+ * puffer_bench : microbenchmarks of the hot paths of the mapper.
+ *
+ * The benchmarks run on synthetic data generated from a fixed seed, so two
+ * runs with the same options do the same work.  The aligner, parser and
+ * output benchmarks need nothing else; given one or more indices (-i), reads are
+ * sampled (with substitution errors) from the indexed references, and the
+ * lookup, chaining, joining, alignment and SAM formatting paths are run
+ * against each index.  Results are written as JSON (see writeResults), one
+ * entry per benchmark and index, for regression tracking.
+ */
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "CLI/CLI.hpp"
+#include "cereal/archives/json.hpp"
+
+#include "BatchGlobalAligner.hpp"
+#include "Bgzf.hpp"
+#include "CanonicalKmer.hpp"
+#include "CanonicalKmerIterator.hpp"
+#include "FastxParser.hpp"
+#include "KSW2Aligner.hpp"
+#include "MemCollector.hpp"
+#include "OutputWriter.hpp"
+#include "PerfTimers.hpp"
+#include "ProgOpts.hpp"
+#include "PuffAligner.hpp"
+#include "PufferfishIndex.hpp"
+#include "PufferfishLossyIndex.hpp"
+#include "PufferfishSparseIndex.hpp"
+#include "SAMWriter.hpp"
+#include "Util.hpp"
+#include "edlib.h"
+
+namespace {
+
+using pufferfish::perf::ticks;
+using MemClusterMap = pufferfish::util::CachedVectorMap<size_t, std::vector<pufferfish::util::MemCluster>, std::hash<size_t>>;
+
+struct BenchOpts {
+  std::vector<std::string> indexDirs;
+  std::string output;
+  std::string filter;
+  std::string scratchDir{"/tmp"};
+  uint32_t numReads{20000};
+  uint32_t readLength{150};
+  uint32_t parserReads{200000};
+  double errorRate{0.01};
+  double minSeconds{1.0};
+  uint64_t seed{271828};
+  bool useHugePages{false};
+};
+
+// What one pass over a benchmark's input did; ticks counts only the
+// measured region, so that the set-up each item needs is left out.
+struct Pass {
+  uint64_t ops{0};
+  uint64_t items{0};
+  uint64_t ticks{0};
+  uint64_t checksum{0};
+  // the CPU time of the whole process over the measured region, for the
+  // benchmarks that run threads of their own (0 if not measured)
+  double cpuSeconds{0};
+};
+
+struct BenchResult {
+  std::string name;
+  std::string index;
+  std::string opUnit;
+  std::string itemUnit;
+  uint64_t passes{0};
+  uint64_t ops{0};
+  uint64_t items{0};
+  uint64_t checksum{0};
+  double seconds{0};
+  double cpuSeconds{0};
+};
+
+class BenchRunner {
+public:
+  explicit BenchRunner(const BenchOpts& opts) : opts_(opts) {
+    pufferfish::perf::TickCalibration calibration;
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    ticksPerSecond_ = calibration.ticksPerSecond();
+  }
+
+  // Runs pass once to warm up, then until minSeconds have passed, and
+  // records the totals under name.
+  template <typename PassFn>
+  void run(const std::string& name, const std::string& index, const std::string& opUnit,
+           const std::string& itemUnit, PassFn&& pass) {
+    if (!opts_.filter.empty() and name.find(opts_.filter) == std::string::npos) { return; }
+    BenchResult r;
+    r.name = name;
+    r.index = index;
+    r.opUnit = opUnit;
+    r.itemUnit = itemUnit;
+    r.checksum = pass().checksum;
+    uint64_t measured{0};
+    auto start = std::chrono::steady_clock::now();
+    do {
+      Pass p = pass();
+      r.ops += p.ops;
+      r.items += p.items;
+      measured += p.ticks;
+      r.cpuSeconds += p.cpuSeconds;
+      ++r.passes;
+    } while (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < opts_.minSeconds);
+    r.seconds = measured / ticksPerSecond_;
+    std::cerr << name << (index.empty() ? "" : " [" + index + "]") << " : "
+              << (r.ops ? r.seconds * 1e9 / r.ops : 0.0) << " ns/" << opUnit;
+    if (r.cpuSeconds > 0) { std::cerr << " (" << (r.seconds > 0 ? r.cpuSeconds / r.seconds : 0.0) << " cpus busy)"; }
+    std::cerr << "\n";
+    results_.push_back(r);
+  }
+
+  bool writeResults(std::ostream& out) const;
+
+private:
+  const BenchOpts& opts_;
+  double ticksPerSecond_{1e9};
+  std::vector<BenchResult> results_;
+};
+
+bool BenchRunner::writeResults(std::ostream& out) const {
+  out << "{\n";
+  out << "  \"seed\": " << opts_.seed << ",\n";
+  out << "  \"reads\": " << opts_.numReads << ",\n";
+  out << "  \"read_length\": " << opts_.readLength << ",\n";
+  out << "  \"error_rate\": " << opts_.errorRate << ",\n";
+  out << "  \"ticks_per_second\": " << ticksPerSecond_ << ",\n";
+  out << "  \"benchmarks\": [\n";
+  for (size_t i = 0; i < results_.size(); ++i) {
+    auto& r = results_[i];
+    out << "    {\n";
+    out << "      \"name\": \"" << r.name << "\",\n";
+    out << "      \"index\": \"" << r.index << "\",\n";
+    out << "      \"passes\": " << r.passes << ",\n";
+    out << "      \"ops\": " << r.ops << ",\n";
+    out << "      \"op_unit\": \"" << r.opUnit << "\",\n";
+    out << "      \"seconds\": " << r.seconds << ",\n";
+    out << "      \"ns_per_op\": " << (r.ops ? r.seconds * 1e9 / r.ops : 0) << ",\n";
+    out << "      \"ops_per_second\": " << (r.seconds > 0 ? r.ops / r.seconds : 0) << ",\n";
+    out << "      \"items\": " << r.items << ",\n";
+    out << "      \"item_unit\": \"" << r.itemUnit << "\",\n";
+    out << "      \"items_per_second\": " << (r.seconds > 0 ? r.items / r.seconds : 0) << ",\n";
+    if (r.cpuSeconds > 0) {
+      out << "      \"cpu_seconds\": " << r.cpuSeconds << ",\n";
+      out << "      \"cpus_busy\": " << (r.seconds > 0 ? r.cpuSeconds / r.seconds : 0) << ",\n";
+    }
+    // the same for the same input; a change means the benchmark did different work
+    out << "      \"checksum\": " << r.checksum << "\n";
+    out << "    }" << (i + 1 < results_.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n";
+  out << "}\n";
+  return static_cast<bool>(out);
+}
+
+//==========
+// Synthetic data
+//==========
+
+const char bases[] = {'A', 'C', 'G', 'T'};
+
+std::string randomSequence(size_t len, std::mt19937_64& gen) {
+  std::string s(len, 'A');
+  for (auto& c : s) { c = bases[gen() & 0x3]; }
+  return s;
+}
+
+// Substitutes a base at each position with probability errorRate.
+void addErrors(std::string& s, double errorRate, std::mt19937_64& gen) {
+  std::bernoulli_distribution err(errorRate);
+  for (auto& c : s) {
+    if (!err(gen)) { continue; }
+    char sub = c;
+    while (sub == c) { sub = bases[gen() & 0x3]; }
+    c = sub;
+  }
+}
+
+std::string reverseComplement(std::string& s) {
+  std::string rc;
+  pufferfish::util::reverseRead(s, rc);
+  return rc;
+}
+
+struct SyntheticReads {
+  std::vector<fastx_parser::ReadSeq> single;
+  std::vector<fastx_parser::ReadPair> pairs;
+};
+
+// Samples single-end reads and fragments of 250-400 bases for read pairs,
+// each from either strand, from the sequences fragment(len) returns.
+template <typename FragmentFn>
+SyntheticReads sampleReads(const BenchOpts& opts, std::mt19937_64& gen, FragmentFn&& fragment) {
+  SyntheticReads reads;
+  uint32_t L = opts.readLength;
+  std::uniform_int_distribution<uint32_t> fragLen(std::max(250u, L), std::max(400u, L));
+  reads.single.resize(opts.numReads);
+  reads.pairs.resize(opts.numReads);
+  for (uint32_t i = 0; i < opts.numReads; ++i) {
+    auto& r = reads.single[i];
+    r.name = "bench." + std::to_string(i);
+    r.seq = fragment(L);
+    if (gen() & 0x1) { r.seq = reverseComplement(r.seq); }
+    addErrors(r.seq, opts.errorRate, gen);
+
+    auto& p = reads.pairs[i];
+    std::string frag = fragment(fragLen(gen));
+    if (gen() & 0x1) { frag = reverseComplement(frag); }
+    p.first.name = p.second.name = "bench.pair." + std::to_string(i);
+    p.first.seq = frag.substr(0, L);
+    std::string tail = frag.substr(frag.size() - L);
+    p.second.seq = reverseComplement(tail);
+    addErrors(p.first.seq, opts.errorRate, gen);
+    addErrors(p.second.seq, opts.errorRate, gen);
+  }
+  return reads;
+}
+
+// A query and a target that differs from it by substitutions and, in about
+// a third of the pairs, a short indel; as between a read and its reference.
+struct AlignmentPair {
+  std::string query;
+  std::string target;
+};
+
+std::vector<AlignmentPair> alignmentPairs(size_t n, uint32_t minLen, uint32_t maxLen, double errorRate,
+                                          std::mt19937_64& gen) {
+  std::uniform_int_distribution<uint32_t> len(minLen, maxLen);
+  std::vector<AlignmentPair> pairs(n);
+  for (auto& p : pairs) {
+    p.target = randomSequence(len(gen), gen);
+    p.query = p.target;
+    addErrors(p.query, errorRate, gen);
+    if (gen() % 3 == 0 and p.query.size() > 4) {
+      size_t pos = gen() % (p.query.size() - 3);
+      size_t indel = 1 + gen() % 3;
+      if (gen() & 0x1) {
+        p.query.erase(pos, indel);
+      } else {
+        p.query.insert(pos, randomSequence(indel, gen));
+      }
+    }
+  }
+  return pairs;
+}
+
+void appendFastqRecord(const fastx_parser::ReadSeq& r, std::string& out) {
+  out.append("@").append(r.name).append("\n").append(r.seq).append("\n+\n");
+  out.append(r.seq.size(), 'I').append("\n");
+}
+
+// Writes reads, repeated up to numReads records, to a new FASTQ file in dir
+// (gzip-compressed if gzip is set); returns its path, or "" on an error.
+std::string writeFastq(const std::vector<fastx_parser::ReadSeq>& reads, uint32_t numReads, bool gzip,
+                       const std::string& dir) {
+  std::string path = dir + (gzip ? "/puffer_bench.XXXXXX.fq.gz" : "/puffer_bench.XXXXXX.fq");
+  int fd = mkstemps(&path[0], gzip ? 6 : 3);
+  if (fd < 0) { return ""; }
+  gzFile out = gzdopen(fd, gzip ? "wb6" : "wbT");
+  if (!out) {
+    ::close(fd);
+    return "";
+  }
+  std::string record;
+  for (uint32_t i = 0; i < numReads; ++i) {
+    record.clear();
+    appendFastqRecord(reads[i % reads.size()], record);
+    gzwrite(out, record.data(), static_cast<unsigned>(record.size()));
+  }
+  return gzclose(out) == Z_OK ? path : "";
+}
+
+// As writeFastq, but BGZF-compressed (as by bgzip).
+std::string writeBgzfFastq(const std::vector<fastx_parser::ReadSeq>& reads, uint32_t numReads,
+                           const std::string& dir) {
+  std::string path = dir + "/puffer_bench.XXXXXX.fq.gz";
+  int fd = mkstemps(&path[0], 6);
+  if (fd < 0) { return ""; }
+  FILE* out = fdopen(fd, "wb");
+  if (!out) {
+    ::close(fd);
+    return "";
+  }
+  BgzfDeflater deflater(6);
+  std::string text;
+  std::string blocks;
+  bool ok{true};
+  for (uint32_t i = 0; i < numReads and ok; ++i) {
+    appendFastqRecord(reads[i % reads.size()], text);
+    if (text.size() >= BgzfDeflater::maxBlockInput or i + 1 == numReads) {
+      blocks.clear();
+      deflater.compress(text.data(), text.size(), blocks);
+      ok = std::fwrite(blocks.data(), 1, blocks.size(), out) == blocks.size();
+      text.clear();
+    }
+  }
+  auto& eof = BgzfDeflater::eofBlock();
+  ok = ok and std::fwrite(eof.data(), 1, eof.size(), out) == eof.size();
+  return (std::fclose(out) == 0 and ok) ? path : "";
+}
+
+// The user and system CPU time of the process so far.
+double processCpuSeconds() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+}
+
+//==========
+// Benchmarks needing no index
+//==========
+
+// Configures aligner as the mapper does.
+void configureKSW2(ksw2pp::KSW2Aligner& aligner, const pufferfish::AlignmentOpts& mopts, bool scoreOnly) {
+  ksw2pp::KSW2Config config;
+  config.dropoff = -1;
+  config.gapo = mopts.gapOpenPenalty;
+  config.gape = mopts.gapExtendPenalty;
+  config.bandwidth = 15;
+  config.flag = KSW_EZ_RIGHT;
+  if (scoreOnly) { config.flag |= KSW_EZ_SCORE_ONLY; }
+  aligner.config() = config;
+}
+
+template <ksw2pp::KSW2AlignmentType T>
+Pass kswPass(ksw2pp::KSW2Aligner& aligner, ksw_extz_t& ez, std::vector<AlignmentPair>& pairs) {
+  Pass p;
+  uint64_t start = ticks();
+  for (auto& ap : pairs) {
+    aligner(ap.query.data(), static_cast<int>(ap.query.size()), ap.target.data(),
+            static_cast<int>(ap.target.size()), &ez, ksw2pp::EnumToType<T>());
+    p.checksum += static_cast<uint32_t>(T == ksw2pp::KSW2AlignmentType::GLOBAL ? ez.score : ez.max);
+    p.items += ap.query.size() * ap.target.size();
+  }
+  p.ticks = ticks() - start;
+  p.ops = pairs.size();
+  return p;
+}
+
+void benchAligners(BenchRunner& runner, const BenchOpts& opts, std::mt19937_64& gen) {
+  pufferfish::AlignmentOpts mopts;
+  auto readPairs = alignmentPairs(2000, opts.readLength - 10, opts.readLength + 10, opts.errorRate, gen);
+  // the windows between and around the MEMs of a read are mostly short
+  auto gapPairs = alignmentPairs(20000, 4, 40, opts.errorRate, gen);
+
+  ksw2pp::KSW2Aligner scoreOnly(mopts.matchScore, mopts.missMatchScore);
+  ksw2pp::KSW2Aligner withCigar(mopts.matchScore, mopts.missMatchScore);
+  configureKSW2(scoreOnly, mopts, true);
+  configureKSW2(withCigar, mopts, false);
+  // the CIGAR buffer of ez grows as needed, and is reused, as in PuffAligner
+  ksw_extz_t ez;
+  std::memset(&ez, 0, sizeof(ez));
+  using ksw2pp::KSW2AlignmentType;
+  runner.run("ksw2/global_score_only", "", "alignment", "cells",
+             [&]() { return kswPass<KSW2AlignmentType::GLOBAL>(scoreOnly, ez, readPairs); });
+  runner.run("ksw2/global_cigar", "", "alignment", "cells",
+             [&]() { return kswPass<KSW2AlignmentType::GLOBAL>(withCigar, ez, readPairs); });
+  runner.run("ksw2/extension_score_only", "", "alignment", "cells",
+             [&]() { return kswPass<KSW2AlignmentType::EXTENSION>(scoreOnly, ez, readPairs); });
+  runner.run("ksw2/extension_cigar", "", "alignment", "cells",
+             [&]() { return kswPass<KSW2AlignmentType::EXTENSION>(withCigar, ez, readPairs); });
+  runner.run("ksw2/global_gap_windows", "", "alignment", "cells",
+             [&]() { return kswPass<KSW2AlignmentType::GLOBAL>(scoreOnly, ez, gapPairs); });
+
+  BatchGlobalAligner batch(mopts.matchScore, mopts.missMatchScore, mopts.gapOpenPenalty, mopts.gapExtendPenalty);
+  // the batched scores have to be those of ksw2, for the short windows the 16-bit
+  // kernel takes and for windows long enough to need 32 bits
+  auto longPairs = alignmentPairs(40, 2200, 2600, opts.errorRate, gen);
+  for (auto* pairs : {&gapPairs, &readPairs, &longPairs}) {
+    batch.clear();
+    for (auto& ap : *pairs) {
+      batch.add(ap.query.data(), static_cast<uint32_t>(ap.query.size()), ap.target.data(),
+                static_cast<uint32_t>(ap.target.size()));
+    }
+    batch.run();
+    for (size_t i = 0; i < pairs->size(); ++i) {
+      auto& ap = (*pairs)[i];
+      scoreOnly(ap.query.data(), static_cast<int>(ap.query.size()), ap.target.data(),
+                static_cast<int>(ap.target.size()), &ez, ksw2pp::EnumToType<KSW2AlignmentType::GLOBAL>());
+      if (batch.score(i) != ez.score) {
+        std::cerr << "batch_global_aligner: score " << batch.score(i) << " where ksw2 has " << ez.score
+                  << " for\n  " << ap.query << "\n  " << ap.target << "\n";
+        std::exit(1);
+      }
+    }
+  }
+  withCigar.freeCIGAR(&ez);
+
+  runner.run("batch_global_aligner/gap_windows", "", "alignment", "cells", [&]() {
+    Pass p;
+    uint64_t start = ticks();
+    batch.clear();
+    for (auto& ap : gapPairs) {
+      batch.add(ap.query.data(), static_cast<uint32_t>(ap.query.size()), ap.target.data(),
+                static_cast<uint32_t>(ap.target.size()));
+      p.items += ap.query.size() * ap.target.size();
+    }
+    batch.run();
+    p.ticks = ticks() - start;
+    for (size_t i = 0; i < batch.size(); ++i) { p.checksum += static_cast<uint32_t>(batch.score(i)); }
+    p.ops = gapPairs.size();
+    return p;
+  });
+}
+
+// The check at the heart of every index lookup: read the k-mer word at the position
+// the hash gives (see PufferfishBaseIndex::kmerWordAt) and compare it with the query,
+// with k known at runtime (get_int) and at compile time (get_int_fixed).  The contig
+// sequence is small enough to stay in cache, so the difference is that of the code.
+volatile uint64_t kmerWordSink{0};
+
+void benchKmerWords(BenchRunner& runner, std::mt19937_64& gen) {
+  compact::vector<uint64_t, 2> seq(1 << 20);
+  for (size_t i = 0; i < seq.size(); ++i) { seq[i] = gen() & 0x3; }
+  for (uint32_t indexK : {23u, 31u}) {
+    // the k of an index is read from its info.json; keep the compiler from
+    // folding it into the runtime-k path here
+    volatile uint32_t loadedK = indexK;
+    uint32_t k = loadedK;
+    CanonicalKmer::k(k);
+    std::vector<uint64_t> positions(1 << 16);
+    std::vector<CanonicalKmer> mers(positions.size());
+    for (size_t i = 0; i < positions.size(); ++i) {
+      // the last k-mer of the sequence included
+      positions[i] = (i + 1 == positions.size()) ? seq.size() - k : gen() % (seq.size() - k);
+      // half of the queries are the k-mer at their position, as after a hash hit
+      mers[i].fromNum((i & 0x1) ? seq.get_int(2 * positions[i], 2 * k) : (gen() & ((1ULL << (2 * k)) - 1)));
+    }
+    // the specialized read has to give the same words
+    pufferfish::util::dispatchOnK(k, [&](auto kc) {
+      constexpr uint32_t K = decltype(kc)::value;
+      for (auto pos : positions) {
+        uint64_t fixed = K ? seq.template get_int_fixed<2 * K>(2 * pos) : seq.get_int(2 * pos, 2 * k);
+        if (fixed != seq.get_int(2 * pos, 2 * k)) {
+          std::cerr << "get_int_fixed<" << 2 * K << ">: wrong word at position " << pos << "\n";
+          std::exit(1);
+        }
+      }
+      return 0;
+    });
+    auto pass = [&](auto kc) {
+      constexpr uint32_t K = decltype(kc)::value;
+      Pass p;
+      uint64_t start = ticks();
+      for (size_t i = 0; i < positions.size(); ++i) {
+        uint64_t fk = K ? seq.template get_int_fixed<2 * K>(2 * positions[i]) : seq.get_int(2 * positions[i], 2 * k);
+        p.checksum += static_cast<uint64_t>(mers[i].isEquivalent(fk));
+      }
+      // the loop has no side effects, so without this it may be moved past the clock read
+      kmerWordSink = p.checksum;
+      p.ticks = ticks() - start;
+      p.ops = p.items = positions.size();
+      return p;
+    };
+    std::string suffix = "_k" + std::to_string(k);
+    runner.run("kmer_word/runtime_k" + suffix, "", "lookup", "k-mers",
+               [&]() { return pass(std::integral_constant<uint32_t, 0>()); });
+    runner.run("kmer_word/fixed_k" + suffix, "", "lookup", "k-mers", [&]() {
+      return pufferfish::util::dispatchOnK(k, pass);
+    });
+  }
+}
+
+// The windows between MEMs of equal read and reference length that PuffAligner scores
+// without DP when the ungapped alignment is provably optimal (see ungappedIsOptimal).  The
+// score has to be that of ksw2, and, where a gapped alignment ties with it, so does the
+// CIGAR (all matches) that alignRead then writes.
+void benchUngapped(BenchRunner& runner, const BenchOpts& opts, std::mt19937_64& gen) {
+  pufferfish::AlignmentOpts mopts;
+  const int32_t mismatchScore = -std::abs(static_cast<int32_t>(mopts.missMatchScore));
+  // at 10% substitutions, many windows have the mismatches that make a gapped alignment tie
+  std::uniform_int_distribution<uint32_t> len(4, 40);
+  std::vector<AlignmentPair> windows(20000);
+  for (size_t i = 0; i < windows.size(); ++i) {
+    auto& w = windows[i];
+    w.target = randomSequence(len(gen), gen);
+    w.query = w.target;
+    addErrors(w.query, std::max(opts.errorRate, 0.1), gen);
+    if (i % 16 == 0) { w.query[gen() % w.query.size()] = 'N'; }
+    if (i % 16 == 8) { w.target[gen() % w.target.size()] = 'n'; }
+  }
+
+  ksw2pp::KSW2Aligner withCigar(mopts.matchScore, mopts.missMatchScore);
+  configureKSW2(withCigar, mopts, false);
+  ksw_extz_t ez;
+  std::memset(&ez, 0, sizeof(ez));
+  size_t ties{0};
+  for (auto& w : windows) {
+    const char* a = w.query.data();
+    const char* b = w.target.data();
+    int32_t L = static_cast<int32_t>(w.query.size());
+    int32_t nmatch{0}, nmismatch{0};
+    for (int32_t i = 0; i < L; ++i) {
+      bool isN = (a[i] == 'N' or a[i] == 'n' or b[i] == 'N' or b[i] == 'n');
+      bool eq = (std::toupper(a[i]) == std::toupper(b[i]));
+      nmatch += (!isN and eq);
+      nmismatch += (!isN and !eq);
+    }
+    int32_t mismatches{0};
+    int32_t ungapped = pufferfish::ungappedScore(a, b, L, mopts.matchScore, mismatchScore, mismatches);
+    if (mismatches != nmismatch or ungapped != mopts.matchScore * nmatch + mismatchScore * nmismatch) {
+      std::cerr << "ungappedScore: " << ungapped << " (" << mismatches << " mismatches) for\n  " << w.query
+                << "\n  " << w.target << "\n";
+      std::exit(1);
+    }
+    if (!pufferfish::ungappedIsOptimal(ungapped, L, false, mopts.matchScore, mopts.gapOpenPenalty,
+                                       mopts.gapExtendPenalty)) {
+      continue;
+    }
+    withCigar(a, L, b, L, &ez, ksw2pp::EnumToType<ksw2pp::KSW2AlignmentType::GLOBAL>());
+    bool tie = !pufferfish::ungappedIsOptimal(ungapped - 1, L, false, mopts.matchScore, mopts.gapOpenPenalty,
+                                              mopts.gapExtendPenalty);
+    ties += tie;
+    bool allMatches = (ez.n_cigar == 1 and (ez.cigar[0] & 0xf) == 0 and (ez.cigar[0] >> 4) == static_cast<uint32_t>(L));
+    if (ez.score != ungapped or !allMatches) {
+      std::cerr << "ungapped window" << (tie ? " (tie)" : "") << ": score " << ungapped << " where ksw2 has "
+                << ez.score << (allMatches ? "" : " and a gapped CIGAR") << " for\n  " << w.query << "\n  "
+                << w.target << "\n";
+      std::exit(1);
+    }
+  }
+  if (ties == 0) {
+    std::cerr << "ungapped windows: no ties with a gapped alignment were checked\n";
+    std::exit(1);
+  }
+
+  runner.run("ungapped/gap_windows", "", "alignment", "bases", [&]() {
+    Pass p;
+    uint64_t start = ticks();
+    for (auto& w : windows) {
+      int32_t L = static_cast<int32_t>(w.query.size());
+      int32_t mismatches{0};
+      int32_t ungapped =
+          pufferfish::ungappedScore(w.query.data(), w.target.data(), L, mopts.matchScore, mismatchScore, mismatches);
+      p.checksum += static_cast<uint32_t>(ungapped) +
+                    pufferfish::ungappedIsOptimal(ungapped, L, false, mopts.matchScore, mopts.gapOpenPenalty,
+                                                  mopts.gapExtendPenalty);
+      p.items += L;
+    }
+    // as for the k-mer words, keep the loop from being moved past the clock read
+    kmerWordSink = p.checksum;
+    p.ticks = ticks() - start;
+    p.ops = windows.size();
+    return p;
+  });
+  // what the windows cost when aligned with ksw2 instead
+  ksw2pp::KSW2Aligner scoreOnly(mopts.matchScore, mopts.missMatchScore);
+  configureKSW2(scoreOnly, mopts, true);
+  runner.run("ksw2/ungapped_windows", "", "alignment", "cells", [&]() {
+    return kswPass<ksw2pp::KSW2AlignmentType::GLOBAL>(scoreOnly, ez, windows);
+  });
+  withCigar.freeCIGAR(&ez);
+}
+
+// Mate rescue, as recoverSingleOrphan does it: the mate is searched for, with up to a
+// quarter of its length in edits, in a window of 2 * maxFragmentLength reference bases;
+// half of the windows hold a copy of it (with errors), the others do not.
+void benchOrphanRescue(BenchRunner& runner, const BenchOpts& opts, std::mt19937_64& gen) {
+  pufferfish::AlignmentOpts mopts;
+  uint32_t L = opts.readLength;
+  uint32_t windowLength = 2 * mopts.maxFragmentLength;
+  std::vector<AlignmentPair> windows(2000);
+  for (size_t i = 0; i < windows.size(); ++i) {
+    auto& w = windows[i];
+    w.target = randomSequence(windowLength, gen);
+    if (i & 0x1) {
+      w.query = w.target.substr(gen() % (windowLength - L), L);
+      addErrors(w.query, opts.errorRate, gen);
+    } else {
+      w.query = randomSequence(L, gen);
+    }
+  }
+  runner.run("edlib/rescue_windows", "", "window", "bases", [&]() {
+    Pass p;
+    uint64_t start = ticks();
+    for (auto& w : windows) {
+      int32_t maxDist = static_cast<int32_t>(w.query.size()) / 4;
+      EdlibAlignResult result =
+          edlibAlign(w.query.data(), static_cast<int>(w.query.size()), w.target.data(),
+                     static_cast<int>(w.target.size()), edlibNewAlignConfig(maxDist, EDLIB_MODE_HW, EDLIB_TASK_LOC));
+      if (result.editDistance > -1) { p.checksum += result.editDistance + result.startLocations[0]; }
+      edlibFreeAlignResult(result);
+      p.items += w.target.size();
+    }
+    p.ticks = ticks() - start;
+    p.ops = windows.size();
+    return p;
+  });
+}
+
+Pass parserPass(const std::string& path) {
+  Pass p;
+  uint64_t start = ticks();
+  std::vector<std::string> files{path};
+  fastx_parser::FastxParser<fastx_parser::ReadSeq> parser(files, 1, 1);
+  parser.start();
+  auto rg = parser.getReadGroup();
+  while (parser.refill(rg)) {
+    for (auto& r : rg) {
+      ++p.ops;
+      p.items += r.seq.size();
+      p.checksum += static_cast<uint8_t>(r.seq.back());
+    }
+  }
+  parser.stop();
+  p.ticks = ticks() - start;
+  return p;
+}
+
+void benchParser(BenchRunner& runner, const BenchOpts& opts, const SyntheticReads& reads) {
+  for (bool gzip : {false, true}) {
+    std::string path = writeFastq(reads.single, opts.parserReads, gzip, opts.scratchDir);
+    if (path.empty()) {
+      std::cerr << "could not write the FASTQ file for the parser benchmark to " << opts.scratchDir << "\n";
+      return;
+    }
+    runner.run(gzip ? "fastx_parser/fastq_gz" : "fastx_parser/fastq", "", "read", "bases",
+               [&]() { return parserPass(path); });
+    std::remove(path.c_str());
+  }
+}
+
+// Has numConsumers threads drain two parsers reading files, as the mapper
+// does; if sleepNsPerRead is set, the consumers sleep that long per read
+// rather than do nothing with it, so that the parsers run ahead of them.
+// Either way, the CPU time that the parsing itself does not account for is
+// spent by threads waiting on each other.
+Pass consumersPass(const std::vector<std::string>& files, uint32_t numConsumers, uint64_t sleepNsPerRead) {
+  Pass p;
+  std::vector<uint64_t> reads(numConsumers, 0);
+  std::vector<uint64_t> checksums(numConsumers, 0);
+  double cpuStart = processCpuSeconds();
+  uint64_t start = ticks();
+  fastx_parser::FastxParser<fastx_parser::ReadSeq> parser(files, numConsumers, 2);
+  parser.start();
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < numConsumers; ++t) {
+    workers.emplace_back([&, t]() {
+      auto rg = parser.getReadGroup();
+      while (parser.refill(rg)) {
+        uint64_t n{0};
+        for (auto& r : rg) {
+          ++n;
+          checksums[t] += static_cast<uint8_t>(r.seq.back());
+        }
+        reads[t] += n;
+        if (sleepNsPerRead > 0) { std::this_thread::sleep_for(std::chrono::nanoseconds(n * sleepNsPerRead)); }
+      }
+    });
+  }
+  for (auto& w : workers) { w.join(); }
+  parser.stop();
+  p.ticks = ticks() - start;
+  p.cpuSeconds = processCpuSeconds() - cpuStart;
+  for (uint32_t t = 0; t < numConsumers; ++t) {
+    p.ops += reads[t];
+    p.checksum += checksums[t];
+  }
+  p.items = p.ops;
+  return p;
+}
+
+// Reads a gzip and a BGZF file with two parsers and many more consumers
+// than cores: the consumers mostly wait for reads (consumers) or, when they
+// are slow, the parsers mostly wait for chunks to fill (slow_consumers).
+// cpus_busy shows how much the waiting costs.
+void benchConsumers(BenchRunner& runner, const BenchOpts& opts, const SyntheticReads& reads) {
+  constexpr uint32_t numConsumers = 8;
+  constexpr uint64_t slowNsPerRead = 20000;
+  std::vector<std::string> files{writeFastq(reads.single, opts.parserReads, true, opts.scratchDir),
+                                 writeBgzfFastq(reads.single, opts.parserReads, opts.scratchDir)};
+  if (!files[0].empty() and !files[1].empty()) {
+    runner.run("fastx_parser/gz_bgzf_consumers", "", "read", "reads",
+               [&]() { return consumersPass(files, numConsumers, 0); });
+    runner.run("fastx_parser/gz_bgzf_slow_consumers", "", "read", "reads",
+               [&]() { return consumersPass(files, numConsumers, slowNsPerRead); });
+  } else {
+    std::cerr << "could not write the FASTQ files for the consumer benchmark to " << opts.scratchDir << "\n";
+  }
+  for (auto& f : files) {
+    if (!f.empty()) { std::remove(f.c_str()); }
+  }
+}
+
+// Busy-waits for ns nanoseconds, standing in for the work on a read.
+void spinFor(uint64_t ns) {
+  auto until = std::chrono::steady_clock::now() + std::chrono::nanoseconds(ns);
+  while (std::chrono::steady_clock::now() < until) {}
+}
+
+// Has numThreads consumers drain the parser of path, as the mapper does,
+// spending the cost of each read on it; measures the time to drain it or,
+// if tail is set, the time from the first consumer running out of reads to
+// the last.
+Pass schedulerPass(const std::string& path, uint32_t numThreads, bool adaptive, bool tail) {
+  constexpr uint64_t cheapNs = 2000;
+  constexpr uint64_t costlyNs = 400000;
+  Pass p;
+  std::vector<std::string> files{path};
+  fastx_parser::FastxParser<fastx_parser::ReadSeq> parser(files, numThreads, 1, 10000);
+  parser.setAdaptiveScheduling(adaptive);
+  std::vector<uint64_t> finished(numThreads, 0);
+  std::vector<uint64_t> reads(numThreads, 0);
+  uint64_t start = ticks();
+  parser.start();
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < numThreads; ++t) {
+    workers.emplace_back([&, t]() {
+      auto rg = parser.getReadGroup();
+      while (parser.refill(rg)) {
+        for (auto& r : rg) {
+          spinFor(r.name[0] == 's' ? costlyNs : cheapNs);
+          ++reads[t];
+        }
+      }
+      finished[t] = ticks();
+    });
+  }
+  for (auto& w : workers) { w.join(); }
+  parser.stop();
+  auto first = *std::min_element(finished.begin(), finished.end());
+  auto last = *std::max_element(finished.begin(), finished.end());
+  for (auto n : reads) { p.items += n; }
+  p.checksum = p.items;
+  p.ops = tail ? 1 : p.items;
+  p.ticks = tail ? last - first : last - start;
+  return p;
+}
+
+// Drains a file of cheap reads holding a few runs of costly ones (as a file
+// sorted by position holds runs of repetitive reads, which cost the mapper
+// orders of magnitude more) with chunks of a fixed size and with adaptive
+// scheduling.
+void benchScheduler(BenchRunner& runner, const BenchOpts& opts, const SyntheticReads& reads) {
+  constexpr uint32_t numRecords = 50000;
+  constexpr uint32_t costlyRun = 250;
+  std::vector<fastx_parser::ReadSeq> records(numRecords);
+  for (uint32_t i = 0; i < numRecords; ++i) {
+    // a run of costly reads every 12500, the last of them at the very end
+    bool costly = (i + costlyRun) % (numRecords / 4) < costlyRun;
+    records[i].name = (costly ? "slow." : "fast.") + std::to_string(i);
+    records[i].seq = reads.single[i % reads.single.size()].seq;
+  }
+  std::string path = writeFastq(records, numRecords, false, opts.scratchDir);
+  if (path.empty()) {
+    std::cerr << "could not write the FASTQ file for the scheduler benchmark to " << opts.scratchDir << "\n";
+    return;
+  }
+  uint32_t numThreads = std::max(2u, std::thread::hardware_concurrency());
+  for (bool adaptive : {false, true}) {
+    std::string name = adaptive ? "scheduler/skewed_adaptive" : "scheduler/skewed_fixed_chunks";
+    runner.run(name, "", "read", "reads", [&]() { return schedulerPass(path, numThreads, adaptive, false); });
+    runner.run(name + "_tail", "", "run", "reads", [&]() { return schedulerPass(path, numThreads, adaptive, true); });
+  }
+  std::remove(path.c_str());
+}
+
+// The output of records [first, first + count) of an input, as handed to
+// OutputWriter::submitInOrder.
+struct OutputPiece {
+  uint64_t first;
+  uint64_t count;
+  std::string data;
+};
+
+// Has numThreads threads submit pieces to a writer in order, each taking the
+// next piece as the mapping threads take runs, and checks that the file
+// holds their output in record order.
+Pass orderedOutputPass(const std::vector<OutputPiece>& pieces, const std::string& expected, uint32_t numThreads,
+                       const std::string& dir) {
+  Pass p;
+  std::string path = dir + "/puffer_bench.XXXXXX.out";
+  int fd = mkstemps(&path[0], 4);
+  if (fd < 0) {
+    std::cerr << "could not create an output file in " << dir << "\n";
+    std::exit(1);
+  }
+  uint64_t start = ticks();
+  {
+    OutputWriter out(fd, true, 2 * numThreads, 1 << 16);
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> workers;
+    for (uint32_t t = 0; t < numThreads; ++t) {
+      workers.emplace_back([&]() {
+        for (size_t i = next++; i < pieces.size(); i = next++) {
+          auto& piece = pieces[i];
+          out.writeInOrder(piece.data.data(), piece.data.size(), piece.first, piece.count);
+        }
+      });
+    }
+    for (auto& w : workers) { w.join(); }
+    out.close();
+  }
+  p.ticks = ticks() - start;
+  std::ifstream in(path, std::ios::binary);
+  std::string written((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  std::remove(path.c_str());
+  if (written != expected) {
+    std::cerr << "output/ordered: the output is not in record order\n";
+    std::exit(1);
+  }
+  p.ops = pieces.size();
+  p.items = written.size();
+  p.checksum = written.size();
+  return p;
+}
+
+// Puts the output of pieces of runs of records back in order: pieces of
+// 1-300 records, of which every fifth has no output and runs of adjacent
+// ones are submitted out of order, as the mapping threads do with --ordered.
+void benchOrderedOutput(BenchRunner& runner, const BenchOpts& opts, std::mt19937_64& gen) {
+  constexpr uint64_t numRecords = 200000;
+  constexpr size_t shuffleWindow = 16;
+  std::vector<OutputPiece> pieces;
+  std::string expected;
+  for (uint64_t first = 0; first < numRecords;) {
+    uint64_t count = std::min<uint64_t>(1 + gen() % 300, numRecords - first);
+    OutputPiece piece{first, count, ""};
+    if (pieces.size() % 5 != 0) {
+      for (uint64_t r = first; r < first + count; ++r) { piece.data.append("record\t").append(std::to_string(r)).append("\n"); }
+    }
+    expected += piece.data;
+    pieces.push_back(std::move(piece));
+    first += count;
+  }
+  for (size_t i = 0; i < pieces.size(); i += shuffleWindow) {
+    std::shuffle(pieces.begin() + i, pieces.begin() + std::min(i + shuffleWindow, pieces.size()), gen);
+  }
+  uint32_t numThreads = std::max(2u, std::thread::hardware_concurrency());
+  runner.run("output/ordered", "", "piece", "bytes",
+             [&]() { return orderedOutputPass(pieces, expected, numThreads, opts.scratchDir); });
+}
+
+//==========
+// Benchmarks against an index
+//==========
+
+template <typename IndexT>
+class IndexBench {
+public:
+  IndexBench(IndexT& pfi, const std::string& type, const BenchOpts& opts)
+      : pfi_(pfi), type_(type), opts_(opts), memCollector_(&pfi_) {
+    memCollector_.configureMemClusterer(mopts_.maxAllowedRefsPerHit);
+    memCollector_.setConsensusFraction(mopts_.consensusFraction);
+    mpol_.noDiscordant = mopts_.noDiscordant;
+    mpol_.noOrphans = mopts_.noOrphan;
+    mpol_.noDovetail = mopts_.noDovetail;
+  }
+
+  // Reads sampled from the indexed references, or none if the index does
+  // not keep their sequence.
+  SyntheticReads sample(std::mt19937_64& gen);
+  void run(BenchRunner& runner, SyntheticReads& reads, std::mt19937_64& gen);
+
+private:
+  void collect(std::string& read, MemClusterMap& hits, pufferfish::util::MateStatus ms, bool isLeft) {
+    memCollector_(read, qc_, isLeft);
+    memCollector_.findChains(read, hits, mopts_.maxSpliceGap, ms, mopts_.heuristicChaining, isLeft);
+  }
+  void benchLookup(BenchRunner& runner, SyntheticReads& reads, std::mt19937_64& gen);
+  void benchChaining(BenchRunner& runner, SyntheticReads& reads);
+  void benchAlignment(BenchRunner& runner, SyntheticReads& reads);
+
+  IndexT& pfi_;
+  std::string type_;
+  const BenchOpts& opts_;
+  pufferfish::AlignmentOpts mopts_;
+  pufferfish::util::MappingConstraintPolicy mpol_;
+  MemCollector<IndexT> memCollector_;
+  pufferfish::util::QueryCache qc_;
+  pufferfish::util::HitCounters hctr_;
+};
+
+template <typename IndexT>
+SyntheticReads IndexBench<IndexT>::sample(std::mt19937_64& gen) {
+  auto& accum = pfi_.refAccumLengths_;
+  // references long enough for the longest fragment
+  std::vector<uint32_t> refs;
+  for (size_t i = 0; i < accum.size(); ++i) {
+    if (accum[i] - (i > 0 ? accum[i - 1] : 0) >= std::max(400u, opts_.readLength)) { refs.push_back(i); }
+  }
+  if (pfi_.refseq_.size() == 0 or refs.empty()) { return SyntheticReads(); }
+  return sampleReads(opts_, gen, [&](uint32_t len) {
+    uint32_t tid = refs[gen() % refs.size()];
+    uint64_t refStart = tid > 0 ? accum[tid - 1] : 0;
+    uint64_t refLen = accum[tid] - refStart;
+    return pfi_.getRefSeqStr(refStart + gen() % (refLen - len + 1), len);
+  });
+}
+
+template <typename IndexT>
+void IndexBench<IndexT>::run(BenchRunner& runner, SyntheticReads& reads, std::mt19937_64& gen) {
+  CanonicalKmer::k(pfi_.k());
+  benchLookup(runner, reads, gen);
+  benchChaining(runner, reads);
+  benchAlignment(runner, reads);
+}
+
+template <typename IndexT>
+void IndexBench<IndexT>::benchLookup(BenchRunner& runner, SyntheticReads& reads, std::mt19937_64& gen) {
+  pufferfish::CanonicalKmerIterator kitEnd;
+  std::vector<CanonicalKmer> kmers;
+  for (auto& r : reads.single) {
+    for (pufferfish::CanonicalKmerIterator kit(r.seq); kit != kitEnd; ++kit) { kmers.push_back(kit->first); }
+  }
+  // in no particular order, each lookup is on its own
+  std::shuffle(kmers.begin(), kmers.end(), gen);
+  runner.run("get_ref_pos/scalar", type_, "lookup", "hits", [&]() {
+    Pass p;
+    uint64_t start = ticks();
+    for (auto& mer : kmers) {
+      auto phits = pfi_.getRefPos(mer);
+      p.items += phits.refRange.size();
+      p.checksum += phits.contigIdx_;
+    }
+    p.ticks = ticks() - start;
+    p.ops = kmers.size();
+    return p;
+  });
+
+  // the k-mers of a read in order, sharing the query cache, as the mapper
+  // looks them up
+  runner.run("get_ref_pos/read_order_cached", type_, "lookup", "hits", [&]() {
+    Pass p;
+    pufferfish::util::QueryCache qc;
+    uint64_t start = ticks();
+    for (auto& r : reads.single) {
+      for (pufferfish::CanonicalKmerIterator kit(r.seq); kit != kitEnd; ++kit) {
+        auto phits = pfi_.getRefPos(kit->first, qc);
+        p.items += phits.refRange.size();
+        p.checksum += phits.contigIdx_;
+        ++p.ops;
+      }
+    }
+    p.ticks = ticks() - start;
+    return p;
+  });
+
+  runner.run("mem_collector/expand_hit_efficient", type_, "expansion", "bases", [&]() {
+    Pass p;
+    pufferfish::util::QueryCache qc;
+    typename MemCollector<IndexT>::ExpansionTerminationType et;
+    for (auto& r : reads.single) {
+      pufferfish::CanonicalKmerIterator kit(r.seq);
+      while (kit != kitEnd) {
+        auto phits = pfi_.getRefPos(kit->first, qc);
+        if (phits.empty()) {
+          ++kit;
+          continue;
+        }
+        uint64_t start = ticks();
+        memCollector_.expandHitEfficient(phits, kit, et);
+        p.ticks += ticks() - start;
+        p.items += phits.k_;
+        p.checksum += phits.globalPos_;
+        ++p.ops;
+      }
+    }
+    return p;
+  });
+}
+
+template <typename IndexT>
+void IndexBench<IndexT>::benchChaining(BenchRunner& runner, SyntheticReads& reads) {
+  MemClusterMap leftHits;
+  MemClusterMap rightHits;
+  std::vector<pufferfish::util::JointMems> jointHits;
+  using pufferfish::util::MateStatus;
+
+  runner.run("mem_clusterer/find_opt_chain", type_, "read", "clusters", [&]() {
+    Pass p;
+    for (auto& r : reads.single) {
+      leftHits.clear();
+      memCollector_.clear();
+      memCollector_(r.seq, qc_, true);
+      uint64_t start = ticks();
+      memCollector_.findChains(r.seq, leftHits, mopts_.maxSpliceGap, MateStatus::SINGLE_END,
+                               mopts_.heuristicChaining, true);
+      p.ticks += ticks() - start;
+      for (auto& kv : leftHits) { p.items += kv.second->size(); }
+      p.checksum += leftHits.size();
+      ++p.ops;
+    }
+    return p;
+  });
+
+  uint64_t firstDecoyIndex = pfi_.firstDecoyIndex();
+  runner.run("join_reads_and_filter", type_, "pair", "joint_hits", [&]() {
+    Pass p;
+    for (auto& rp : reads.pairs) {
+      leftHits.clear();
+      rightHits.clear();
+      jointHits.clear();
+      memCollector_.clear();
+      memCollector_(rp.first.seq, qc_, true);
+      memCollector_(rp.second.seq, qc_, false);
+      memCollector_.findChains(rp.first.seq, leftHits, mopts_.maxSpliceGap, MateStatus::PAIRED_END_LEFT,
+                               mopts_.heuristicChaining, true);
+      memCollector_.findChains(rp.second.seq, rightHits, mopts_.maxSpliceGap, MateStatus::PAIRED_END_RIGHT,
+                               mopts_.heuristicChaining, false);
+      uint32_t totLen = static_cast<uint32_t>(rp.first.seq.length() + rp.second.seq.length());
+      uint64_t start = ticks();
+      auto res = pufferfish::util::joinReadsAndFilter(leftHits, rightHits, jointHits, mopts_.maxFragmentLength,
+                                                      totLen, mopts_.scoreRatio, firstDecoyIndex, mpol_, hctr_);
+      p.ticks += ticks() - start;
+      p.items += jointHits.size();
+      p.checksum += static_cast<uint64_t>(res) + jointHits.size();
+      ++p.ops;
+    }
+    return p;
+  });
+}
+
+template <typename IndexT>
+void IndexBench<IndexT>::benchAlignment(BenchRunner& runner, SyntheticReads& reads) {
+  using pufferfish::util::PuffAlignmentMode;
+  constexpr const int32_t invalidScore = std::numeric_limits<int32_t>::min();
+  MemClusterMap leftHits;
+  std::vector<pufferfish::util::JointMems> jointHits;
+  // the alignments of each read, as the mapper reports them, for the SAM benchmark
+  std::vector<std::vector<pufferfish::util::QuasiAlignment>> alignments(reads.single.size());
+
+  struct Mode {
+    const char* name;
+    PuffAlignmentMode mode;
+    bool kswScoreOnly;
+  };
+  for (auto& m : {Mode{"puff_aligner/align_read_score_only", PuffAlignmentMode::SCORE_ONLY, true},
+                  Mode{"puff_aligner/align_read_approximate_cigar", PuffAlignmentMode::APPROXIMATE_CIGAR, true},
+                  Mode{"puff_aligner/align_read_cigar", PuffAlignmentMode::EXACT_CIGAR, false}}) {
+    ksw2pp::KSW2Aligner aligner(mopts_.matchScore, mopts_.missMatchScore);
+    configureKSW2(aligner, mopts_, m.kswScoreOnly);
+    pufferfish::util::AlignmentConfig aconf;
+    aconf.refExtendLength = mopts_.refExtendLength;
+    aconf.matchScore = mopts_.matchScore;
+    aconf.mismatchScore = mopts_.missMatchScore;
+    aconf.gapExtendPenalty = mopts_.gapExtendPenalty;
+    aconf.gapOpenPenalty = mopts_.gapOpenPenalty;
+    aconf.minScoreFraction = mopts_.minScoreFraction;
+    aconf.maxFragmentLength = mopts_.maxFragmentLength;
+    aconf.allowSoftclip = m.mode != PuffAlignmentMode::SCORE_ONLY;
+    aconf.alignmentMode = m.mode;
+    PuffAligner puffaligner(pfi_.refseq_, pfi_.refAccumLengths_, pfi_.k(), aconf, aligner);
+    bool keep = m.mode == PuffAlignmentMode::EXACT_CIGAR;
+
+    runner.run(m.name, type_, "alignment", "reads", [&]() {
+      Pass p;
+      for (size_t i = 0; i < reads.single.size(); ++i) {
+        auto& r = reads.single[i];
+        leftHits.clear();
+        jointHits.clear();
+        memCollector_.clear();
+        collect(r.seq, leftHits, pufferfish::util::MateStatus::SINGLE_END, true);
+        pufferfish::util::joinReadsAndFilterSingle(leftHits, jointHits, static_cast<uint32_t>(r.seq.length()),
+                                                   mopts_.scoreRatio);
+        puffaligner.clear();
+        bool isMultimapping = jointHits.size() > 1;
+        if (keep) { alignments[i].clear(); }
+        uint64_t start = ticks();
+        for (auto& jointHit : jointHits) {
+          int32_t score = puffaligner.calculateAlignments(r.seq, jointHit, hctr_, isMultimapping, false);
+          p.checksum += static_cast<uint32_t>(score);
+        }
+        p.ticks += ticks() - start;
+        p.ops += jointHits.size();
+        ++p.items;
+        if (keep) {
+          for (auto& jointHit : jointHits) {
+            if (jointHit.alignmentScore == invalidScore) { continue; }
+            uint32_t readLen = static_cast<uint32_t>(r.seq.length());
+            alignments[i].emplace_back(jointHit.tid, jointHit.orphanClust()->getTrFirstHitPos(),
+                                       jointHit.orphanClust()->isFw, readLen, jointHit.orphanClust()->cigar,
+                                       readLen, false);
+          }
+        }
+      }
+      return p;
+    });
+  }
+
+  PairedAlignmentFormatter<IndexT*> formatter(&pfi_);
+  fmt::MemoryWriter sstream;
+  runner.run("sam_writer/format_single", type_, "record", "bytes", [&]() {
+    Pass p;
+    uint64_t start = ticks();
+    for (size_t i = 0; i < reads.single.size(); ++i) {
+      if (alignments[i].empty()) {
+        writeUnalignedSingleToStream(reads.single[i], sstream);
+        ++p.ops;
+      } else {
+        writeAlignmentsToStreamSingle(reads.single[i], formatter, alignments[i], sstream, true);
+        p.ops += alignments[i].size();
+      }
+      // as the mapper hands its buffer to the output writer
+      if (sstream.size() > (1u << 20)) {
+        p.items += sstream.size();
+        sstream.clear();
+      }
+    }
+    p.items += sstream.size();
+    p.checksum += sstream.size();
+    sstream.clear();
+    p.ticks = ticks() - start;
+    return p;
+  });
+}
+
+template <typename IndexT>
+void benchIndex(BenchRunner& runner, const BenchOpts& opts, const std::string& indexDir, const std::string& type) {
+  pufferfish::util::IndexLoadingOpts loadOpts;
+  loadOpts.use_huge_pages = opts.useHugePages;
+  IndexT pfi(indexDir, loadOpts);
+  IndexBench<IndexT> bench(pfi, type, opts);
+  // the same reads for every index of the same references
+  std::mt19937_64 gen(opts.seed);
+  auto reads = bench.sample(gen);
+  if (reads.single.empty()) {
+    std::cerr << "the index in " << indexDir << " has no reference sequence (or none long enough) to sample reads from\n";
+    return;
+  }
+  bench.run(runner, reads, gen);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  BenchOpts opts;
+  CLI::App app{"puffer_bench : microbenchmarks of the pufferfish mapping hot paths"};
+  app.add_option("-i,--index", opts.indexDirs,
+                 "index directories to benchmark the lookup, chaining, alignment and SAM paths against "
+                 "(any of dense, sparse and lossy); without one only the aligner, parser and output benchmarks run");
+  app.add_option("-o,--output", opts.output, "write the results (JSON) here rather than to stdout");
+  app.add_option("-f,--filter", opts.filter, "only run the benchmarks whose name contains this string");
+  app.add_option("-n,--numReads", opts.numReads, "the number of synthetic reads (and read pairs)", true);
+  app.add_option("-l,--readLength", opts.readLength, "the length of the synthetic reads", true);
+  app.add_option("-e,--errorRate", opts.errorRate, "the substitution rate of the synthetic reads", true);
+  app.add_option("--parserReads", opts.parserReads, "the number of records in the FASTQ file the parser reads", true);
+  app.add_option("--minSeconds", opts.minSeconds, "run each benchmark for at least this long", true);
+  app.add_option("--seed", opts.seed, "the seed of the synthetic data", true);
+  app.add_option("--scratchDir", opts.scratchDir, "where to write the temporary FASTQ files", true);
+  app.add_flag("--hugePages", opts.useHugePages, "back the index with transparent huge pages");
+  try {
+    app.parse(argc, argv);
+  } catch (const CLI::ParseError& e) {
+    return app.exit(e);
+  }
+  if (opts.readLength < 32 or opts.numReads == 0) {
+    std::cerr << "--readLength must be at least 32 and --numReads positive\n";
+    return 1;
+  }
+
+  BenchRunner runner(opts);
+  {
+    std::mt19937_64 gen(opts.seed);
+    benchAligners(runner, opts, gen);
+    std::string genome = randomSequence(1000000, gen);
+    auto reads = sampleReads(opts, gen, [&](uint32_t len) { return genome.substr(gen() % (genome.size() - len), len); });
+    benchParser(runner, opts, reads);
+    benchConsumers(runner, opts, reads);
+    benchScheduler(runner, opts, reads);
+    benchOrderedOutput(runner, opts, gen);
+    benchOrphanRescue(runner, opts, gen);
+    benchKmerWords(runner, gen);
+    benchUngapped(runner, opts, gen);
+  }
+
+  for (auto& indexDir : opts.indexDirs) {
+    std::string indexType;
+    {
+      std::ifstream infoStream(indexDir + "/info.json");
+      if (!infoStream) {
+        std::cerr << "could not open " << indexDir << "/info.json\n";
+        return 1;
+      }
+      cereal::JSONInputArchive infoArchive(infoStream);
+      infoArchive(cereal::make_nvp("sampling_type", indexType));
+    }
+    std::cerr << "Index type = " << indexType << "\n";
+    if (indexType == "dense") {
+      benchIndex<PufferfishIndex>(runner, opts, indexDir, indexType);
+    } else if (indexType == "sparse") {
+      benchIndex<PufferfishSparseIndex>(runner, opts, indexDir, indexType);
+    } else if (indexType == "lossy") {
+      benchIndex<PufferfishLossyIndex>(runner, opts, indexDir, indexType);
+    } else {
+      std::cerr << "unknown index type " << indexType << " in " << indexDir << "\n";
+      return 1;
+    }
+  }
+
+  if (opts.output.empty()) {
+    return runner.writeResults(std::cout) ? 0 : 1;
+  }
+  std::ofstream out(opts.output);
+  if (!out or !runner.writeResults(out)) {
+    std::cerr << "could not write the results to " << opts.output << "\n";
+    return 1;
+  }
+  return 0;
+}
@@ -43,13 +43,14 @@ int pufferfishTestLookup(
 int pufferfishAligner(pufferfish::AlignmentOpts& alignmentOpts) ;
 int pufferfishExamine(pufferfish::ExamineOptions& examineOpts);
 int pufferfishStats(pufferfish::StatsOptions& statsOpts);
+int pufferfishWarm(pufferfish::WarmOptions& warmOpts);
 
 int main(int argc, char* argv[]) {
   using namespace clipp;
   using std::cout;
   std::setlocale(LC_ALL, "en_US.UTF-8");
 
-  enum class mode {help, index, validate, lookup, align, examine, stat};
+  enum class mode {help, index, validate, lookup, align, examine, stat, warm};
   mode selected = mode::help;
   pufferfish::AlignmentOpts alignmentOpt ;
   pufferfish::IndexOptions indexOpt;
@@ -58,6 +59,7 @@ int main(int argc, char* argv[]) {
   pufferfish::ValidateOptions lookupOpt;
   pufferfish::ExamineOptions examineOpt;
   pufferfish::StatsOptions statOpt;
+  pufferfish::WarmOptions warmOpt;
 
   auto ensure_file_exists = [](const std::string& s) -> bool {
       bool exists = ghc::filesystem::exists(s);
@@ -172,8 +174,16 @@ int main(int argc, char* argv[]) {
   auto lookupMode = (
                      command("lookup").set(selected, mode::lookup),
                      (required("-i", "--index") & value("index", lookupOpt.indexDir)) % "directory where the pufferfish index is stored",
-                     (required("-r", "--ref") & value("ref", lookupOpt.refFile)) % "fasta file with reference sequences"
+                     (required("-r", "--ref") & value("ref", lookupOpt.refFile)) % "fasta file with reference sequences",
+                     (option("--hugePages").set(lookupOpt.useHugePages, true)) % "back the index arrays with 2MiB (transparent huge) pages",
+                     (option("--runtimeK").set(lookupOpt.runtimeK, true)) % "use the generic (runtime k) lookup code even if the index k has a specialized one; "
+                     "for benchmarking the k specialization"
                      );
+  auto warmMode = (
+                   command("warm").set(selected, mode::warm),
+                   (required("-i", "--index") & value("index", warmOpt.indexDir)) % "directory where the pufferfish index is stored",
+                   (option("-p", "--threads") & value("num threads", warmOpt.numThreads)) % "number of threads reading the index in parallel (default=4)"
+                   );
   std::string statType = "ctab";
   auto statMode = (
                     command("stat").set(selected, mode::stat),
@@ -209,7 +219,9 @@ int main(int argc, char* argv[]) {
                       |
                       ((required("--read").set(alignmentOpt.singleEnd, true) & value("reads", alignmentOpt.unmatedReads)) % "Path to single-end read files")
                     ),
-                    (option("-b", "--batchOfReads").set(alignmentOpt.listOfReads, true)) % "Is each input a file containing the list of reads? (default=false)",
+                    (option("-b", "--batchOfReads").set(alignmentOpt.listOfReads, true)) % "Is each input a file containing the list of reads? (default=false) "
+                    "Each read file (pair) listed is a sample, written to the output name followed by the name of the (left) read file; "
+                    "the samples share one pool of mapping threads, and each is parsed while the one before it finishes",
 
 
                     (option("--coverageScoreRatio") & value("score ratio", alignmentOpt.scoreRatio).call(isValidRatio)) % "Discard mappings with a coverage score < scoreRatio * OPT (default=0.6)",
@@ -229,12 +241,29 @@ int main(int argc, char* argv[]) {
                     (option("--orphanRecovery").set(alignmentOpt.recoverOrphans, true)) % "Recover mappings for the other end of orphans using alignment",
                     (option("--noDiscordant").set(alignmentOpt.noDiscordant, true)) % "Write Orphans flag",
                     (option("--noDovetail").set(alignmentOpt.noDovetail, true)) % "Disallow dovetail alignment for paired end reads",
-		            (option("-z", "--compressedOutput").set(alignmentOpt.compressedOutput, true)) % "Compress (gzip) the output file",
+		            (option("-z", "--compressedOutput").set(alignmentOpt.compressedOutput, true)) % "Compress (gzip) the output file; it is written in BGZF blocks, as bgzip does",
+                    (option("--compressionThreads") & value("threads", alignmentOpt.compressionThreads)) % "The number of threads compressing the output when -z is given "
+                    "(default=0, i.e. one per four mapping threads)",
+                    (option("--decompressionThreads") & value("threads", alignmentOpt.decompressionThreads)) % "The number of threads decompressing each BGZF-compressed read file "
+                    "(default=0, i.e. one per eight mapping threads); plain gzip input is decompressed by one thread ahead of the parser",
+                    (option("--perf-report") & value("file", alignmentOpt.perfReport)) % "Time the stages of mapping on every thread and write "
+                    "their latency histograms, as JSON, to this file",
+                    (option("--fixedChunks").set(alignmentOpt.fixedChunks, true)) % "Hand the mapping threads chunks of a fixed 10000 reads, rather than sizing "
+                    "chunks by the time reads take to map and letting idle threads take reads from busy ones",
+                    (option("--ordered").set(alignmentOpt.orderedOutput, true)) % "Write the output of the reads in the order of the reads in the input; "
+                    "threads keep mapping, up to two chunks each past the oldest read whose output is unwritten, "
+                    "while their output waits for its turn (implies adaptive scheduling, whatever --fixedChunks says)",
                     (
                       (option("-k", "--krakOut").set(alignmentOpt.krakOut, true)) % "Write output in the format required for krakMap"
                       |
                       (option("-p", "--pam").set(alignmentOpt.salmonOut, true)) % "Write output in the format required for salmon"
+                      |
+                      (option("--bam").set(alignmentOpt.bamOut, true)) % "Write the alignments in (BGZF compressed) BAM rather than SAM format"
+                      |
+                      (option("--pamV2").set(alignmentOpt.salmonOut, true).set(alignmentOpt.pamV2, true)) % "Write the --pam output in version 2 of the format: "
+                      "compressed, column-wise blocks with an index, which can be read in parallel"
                     ),
+                    (option("--pamNoNames").set(alignmentOpt.pamNoNames, true)) % "Leave the read names out of --pamV2 output",
 					(option("--verbose").set(alignmentOpt.verbose, true)) % "Print out auxilary information to trace program's flow",
                     (option("--fullAlignment").set(alignmentOpt.fullAlignment, true)) % "Perform full alignment instead of gapped alignment",
                     (option("--heuristicChaining").set(alignmentOpt.heuristicChaining, true)) % "Whether or not perform only 2 rounds of chaining",
@@ -252,11 +281,25 @@ int main(int argc, char* argv[]) {
                     (option("--consensusFraction") & value("consensus fraction", alignmentOpt.consensusFraction)) % "The fraction of mems, relative to the reference with "
                     "the maximum number of mems, that a reference must contain in order "
                     "to move forward with computing an optimal chain score (default=0.65)",
-                    (option("--noAlignmentCache").set(alignmentOpt.useAlignmentCache, false)) % "Do not use the alignment cache during the alignment."
+                    (option("--noAlignmentCache").set(alignmentOpt.useAlignmentCache, false)) % "Do not use the alignment cache during the alignment.",
+                    (option("--duplicateWindow") & value("reads", alignmentOpt.duplicateWindow)) % "Remember the results of the last this many distinct reads "
+                    "(per thread) and copy them to exact duplicates instead of mapping those again (default=0, i.e. off)",
+                    (option("--crossReadCache") & value("entries", alignmentOpt.crossReadCacheSize)) % "Keep up to this many alignment results per thread "
+                    "across reads, so that duplicate reads are not re-aligned (default=0, i.e. off)",
+                    (option("--batchAlignment").set(alignmentOpt.batchAlignment, true)) % "Score the gaps between the MEMs of all hits of a read together, many alignments "
+                    "per vector instruction, rather than one at a time with ksw2 (scores are identical)",
+                    (option("--pinThreads").set(alignmentOpt.pinThreads, true)) % "Pin each mapping thread to a cpu, spreading the threads evenly over the NUMA nodes",
+                    (option("--numaInterleave").set(alignmentOpt.numaInterleave, true)) % "Interleave the pages of the index across all NUMA nodes while loading it",
+                    (option("--numaReplicateRefSeq").set(alignmentOpt.numaReplicateRefSeq, true).set(alignmentOpt.pinThreads, true)) % "Keep one copy of the reference sequence per NUMA node and have each (pinned) "
+                    "mapping thread align against the copy local to its node; the k-mer lookup tables of the index (seq, pos and "
+                    "contig table) are not copied and stay shared.  Costs one extra copy of the reference sequence per additional node",
+                    (option("--hugePages").set(alignmentOpt.useHugePages, true)) % "back the index arrays with 2MiB (transparent huge) pages to reduce TLB misses during lookup",
+                    (option("--backgroundPageIn").set(alignmentOpt.backgroundPageIn, true)) % "Fault the memory-mapped parts of a sparse or lossy index in on background threads while "
+                    "the read parsers start up (see also the warm command); a dense index is read into memory when it is loaded, so this has no effect on it"
   );
 
   auto cli = (
-              (indexMode | validateMode | lookupMode | alignMode | examineMode | statMode | command("help").set(selected,mode::help) ),
+              (indexMode | validateMode | lookupMode | alignMode | examineMode | statMode | warmMode | command("help").set(selected,mode::help) ),
               option("-v", "--version").call([]{std::cout << "version " << pufferfish::version << "\n"; std::exit(0);}).doc("show version"));
 
   decltype(parse(argc, argv, cli)) res;
@@ -278,6 +321,7 @@ int main(int argc, char* argv[]) {
     case mode::align: pufferfishAligner(alignmentOpt); break;
     case mode::examine: pufferfishExamine(examineOpt); break;
     case mode::stat: pufferfishStats(statOpt); break;
+    case mode::warm: return pufferfishWarm(warmOpt);
     case mode::help: std::cout << make_man_page(cli, pufferfish::progname); break;
     }
   } else {
@@ -292,6 +336,8 @@ int main(int argc, char* argv[]) {
         std::cout << make_man_page(lookupMode, pufferfish::progname);
       } else if (b->arg() == "align") {
         std::cout << make_man_page(alignMode, pufferfish::progname);
+      } else if (b->arg() == "warm") {
+        std::cout << make_man_page(warmMode, pufferfish::progname);
       } else {
         std::cout << "There is no command \"" << b->arg() << "\"\n";
         std::cout << usage_lines(cli, pufferfish::progname) << '\n';
@@ -7,6 +7,7 @@
 #include <unordered_map>
 #include <fstream>
 #include <algorithm>
+#include <numeric>
 #include <iterator>
 #include <cstdio>
 #include <cstring>
@@ -20,6 +21,11 @@
 #include <memory>
 #include <cstring>
 #include <queue>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
 
 //we already have timers
 
@@ -54,9 +60,13 @@
 #include "SpinLock.hpp"
 #include "MemCollector.hpp"
 #include "SAMWriter.hpp"
+#include "BAMWriter.hpp"
 #include "RefSeqConstructor.hpp"
 #include "KSW2Aligner.hpp"
-#include "zstr/zstr.hpp"
+#include "NumaUtils.hpp"
+#include "DuplicateReadWindow.hpp"
+#include "PerfTimers.hpp"
+#include "CLI/Timer.hpp"
 
 
 #define MATCH_SCORE 1
@@ -71,11 +81,194 @@ using paired_parser = fastx_parser::FastxParser<fastx_parser::ReadPair>;
 using single_parser = fastx_parser::FastxParser<fastx_parser::ReadSeq>;
 
 using HitCounters = pufferfish::util::HitCounters;
+using ShardedHitCounters = pufferfish::util::ShardedHitCounters;
 using QuasiAlignment = pufferfish::util::QuasiAlignment;
 using MateStatus = pufferfish::util::MateStatus;
 
 using MutexT = std::mutex;
 
+// What a single mapping thread needs to know about where it runs;
+// refseq points either to the index's own reference sequence or to the
+// copy of it that lives on the thread's NUMA node.
+struct MappingThreadContext {
+    pufferfish::numa::ThreadPlacement placement;
+    compact::vector<uint64_t, 2>* refseq{nullptr};
+    uint64_t numReads{0};
+    // stage timings, when --perf-report is given
+    pufferfish::perf::ThreadPerf perf;
+};
+
+// What mapping a read (pair) contributed to the output and to the
+// summary counters; kept for recent reads so that their exact duplicates
+// can be answered without being mapped (see --duplicateWindow).
+struct ReadMappingOutcome {
+    bool dropped{false}; // filtered out (e.g. as decoy or genomic) without any output
+    bool hadKmerHit{false};
+    uint32_t peHits{0};
+    uint32_t seHits{0};
+    uint32_t totHits{0};
+    bool mapped{false};
+    bool orphan{false};
+    bool dovetail{false};
+    std::vector<QuasiAlignment> alignments;
+
+    // The PAM / kraken output is written from the hits and their clusters
+    // rather than from the alignments, so for it the kept hits are stored
+    // too; by cluster index, as the outcome is copied into the window.
+    struct KeptHit {
+        uint32_t tid;
+        int32_t leftClust;
+        int32_t rightClust;
+        size_t fragmentLen;
+        int32_t alignmentScore;
+        int32_t mateAlignmentScore;
+        MateStatus mateStatus;
+    };
+    std::vector<pufferfish::util::MemCluster> clusters;
+    std::vector<KeptHit> hits;
+
+    void keepHits(const std::vector<pufferfish::util::JointMems>& jointHits) {
+        for (auto& jh : jointHits) {
+            int32_t left{-1}, right{-1};
+            if (jh.isLeftAvailable()) { left = static_cast<int32_t>(clusters.size()); clusters.push_back(*jh.leftClust); }
+            if (jh.isRightAvailable()) { right = static_cast<int32_t>(clusters.size()); clusters.push_back(*jh.rightClust); }
+            hits.push_back({jh.tid, left, right, jh.fragmentLen, jh.alignmentScore, jh.mateAlignmentScore, jh.mateStatus});
+        }
+    }
+
+    void keepHits(const std::vector<std::pair<uint32_t, std::vector<pufferfish::util::MemCluster>::iterator>>& validHits) {
+        for (auto& vh : validHits) {
+            hits.push_back({vh.first, static_cast<int32_t>(clusters.size()), -1, 0, 0, 0, MateStatus::SINGLE_END});
+            clusters.push_back(*vh.second);
+        }
+    }
+
+    // Rebuilds the kept hits in jointHits, with their clusters copied to store.
+    void replayHits(std::vector<pufferfish::util::MemCluster>& store,
+                    std::vector<pufferfish::util::JointMems>& jointHits) const {
+        store = clusters;
+        jointHits.clear();
+        for (auto& h : hits) {
+            auto left = h.leftClust < 0 ? store.end() : store.begin() + h.leftClust;
+            auto right = h.rightClust < 0 ? store.end() : store.begin() + h.rightClust;
+            jointHits.emplace_back(h.tid, left, right, h.fragmentLen, h.mateStatus);
+            jointHits.back().alignmentScore = h.alignmentScore;
+            jointHits.back().mateAlignmentScore = h.mateAlignmentScore;
+        }
+    }
+
+    void replayHits(std::vector<pufferfish::util::MemCluster>& store,
+                    std::vector<std::pair<uint32_t, std::vector<pufferfish::util::MemCluster>::iterator>>& validHits) const {
+        store = clusters;
+        validHits.clear();
+        for (auto& h : hits) { validHits.emplace_back(h.tid, store.begin() + h.leftClust); }
+    }
+
+    void replayCounters(HitCounters& hctr) const {
+        hctr.numMappedAtLeastAKmer += hadKmerHit ? 1 : 0;
+        hctr.peHits += peHits;
+        hctr.numDovetails += dovetail ? 1 : 0;
+        if (dropped) { return; }
+        hctr.seHits += seHits;
+        hctr.totHits += totHits;
+        hctr.numMapped += mapped ? 1 : 0;
+        hctr.numOfOrphans += orphan ? 1 : 0;
+        if (alignments.size() > hctr.maxMultimapping) { hctr.maxMultimapping = alignments.size(); }
+        hctr.totAlignment += alignments.size();
+        pufferfish::perf::count(&pufferfish::perf::ThreadPerf::numAlignments, alignments.size());
+    }
+};
+
+// How many of its reads a mapping thread counts between looks at the totals.
+constexpr const uint64_t progressCheckInterval = 1024;
+
+// Prints the progress line if, summed over the threads, another interval
+// reads have been seen since it was last printed.
+void printProgress(ShardedHitCounters& hctrs, uint64_t interval, MutexT* iomutex, bool quiet) {
+    HitCounters total;
+    hctrs.sum(total);
+    uint64_t numReads = total.numReads;
+    uint64_t last = hctrs.lastPrint.load();
+    if (numReads <= last + interval or !hctrs.lastPrint.compare_exchange_strong(last, numReads)) { return; }
+    if (!quiet and iomutex->try_lock()) {
+        if (numReads > 0) {
+            std::cerr << "\r\r";
+        }
+        std::cerr << "saw " << numReads << " reads : "
+                  << "pe / read = " << total.peHits / static_cast<float>(numReads)
+                  << " : se / read = " << total.seHits / static_cast<float>(numReads) << ' ';
+        iomutex->unlock();
+    }
+}
+
+/**
+ * Decide the order in which the hits of a read (pair) are aligned and which of them have their
+ * gaps aligned up front, before any gap is aligned.  Without pruneByBound, every hit is aligned
+ * in order.  With it, the hits are ordered by their score upper bound (best first), and only
+ * those whose bound reaches the best score known without alignment (that of a perfect-chain
+ * hit) are batched; the alignment loop skips the rest, as their bounds fall below the best
+ * score once the hits ahead of them have been aligned.  Hits that share a transcript with
+ * another hit (when dedupByTranscript) take part in the per-transcript dedup, which depends on
+ * the order of the hits and on their scores, so they are never skipped and keep their order.
+ */
+template <typename AlignerT>
+void orderHitsByBound(AlignerT& puffaligner, std::vector<pufferfish::util::JointMems>& jointHits,
+                      uint32_t leftLen, uint32_t rightLen, bool pruneByBound, bool dedupByTranscript,
+                      phmap::flat_hash_map<uint32_t, uint32_t>& hitsPerTranscript,
+                      std::vector<int32_t>& hitBounds, std::vector<size_t>& hitOrder,
+                      std::vector<size_t>& batchHits) {
+    constexpr const int32_t invalidScore = std::numeric_limits<int32_t>::min();
+    hitOrder.resize(jointHits.size());
+    std::iota(hitOrder.begin(), hitOrder.end(), 0);
+    batchHits.clear();
+    if (!pruneByBound) {
+        batchHits.assign(hitOrder.begin(), hitOrder.end());
+        return;
+    }
+    hitsPerTranscript.clear();
+    if (dedupByTranscript) {
+        for (auto& jointHit : jointHits) { ++hitsPerTranscript[jointHit.tid]; }
+    }
+    hitBounds.resize(jointHits.size());
+    int32_t knownScore = invalidScore;
+    for (size_t i = 0; i < jointHits.size(); ++i) {
+        auto& jointHit = jointHits[i];
+        bool shared = dedupByTranscript and hitsPerTranscript[jointHit.tid] > 1;
+        hitBounds[i] = shared ? std::numeric_limits<int32_t>::max()
+                              : puffaligner.alignmentScoreUpperBound(jointHit, leftLen, rightLen);
+        knownScore = std::max(knownScore, puffaligner.alignmentScoreLowerBound(jointHit, leftLen, rightLen));
+    }
+    std::stable_sort(hitOrder.begin(), hitOrder.end(), [&hitBounds](size_t lhs, size_t rhs) {
+        return hitBounds[lhs] > hitBounds[rhs];
+    });
+    for (size_t idx : hitOrder) {
+        if (hitBounds[idx] == invalidScore or hitBounds[idx] < knownScore) { break; }
+        batchHits.push_back(idx);
+    }
+}
+
+// How many reads (pairs) a mapping thread finds the hits of before it aligns any of them;
+// the gaps of the hits of all of them that survive pruning are aligned in one batch
+// (see PuffAligner::runGapBatch).
+constexpr const size_t gapBatchReads = 256;
+
+// What a mapping thread keeps of a read (pair) of the batch between finding its hits
+// and aligning them.
+struct BatchedRead {
+    pufferfish::util::CachedVectorMap<size_t, std::vector<pufferfish::util::MemCluster>, std::hash<size_t>> leftHits;
+    pufferfish::util::CachedVectorMap<size_t, std::vector<pufferfish::util::MemCluster>, std::hash<size_t>> rightHits;
+    std::vector<pufferfish::util::MemCluster> recoveredHits;
+    std::vector<pufferfish::util::JointMems> jointHits;
+    // the order in which the hits are aligned, and the score bound of each (see orderHitsByBound)
+    std::vector<size_t> hitOrder;
+    std::vector<int32_t> hitBounds;
+    bool lh{false};
+    bool rh{false};
+    // an exact duplicate of a recent read (pair), answered with dupOutcome without being mapped
+    bool duplicate{false};
+    uint64_t dupKey{0};
+    ReadMappingOutcome dupOutcome;
+};
 
 //===========
 // PAIRED END
@@ -84,11 +277,17 @@ template<typename PufferfishIndexT>
 void processReadsPair(paired_parser *parser,
                       PufferfishIndexT &pfi,
                       MutexT *iomutex,
-                      std::shared_ptr<spdlog::logger> outQueue,
+                      OutputWriter* outQueue,
                       HitCounters &hctr,
+                      ShardedHitCounters &hctrs,
                       phmap::flat_hash_set<std::string>& gene_names,
                       phmap::flat_hash_set<std::string>& rrna_names,
-                      pufferfish::AlignmentOpts *mopts) {
+                      pufferfish::AlignmentOpts *mopts,
+                      MappingThreadContext *tctx) {
+    if (tctx->placement.cpu >= 0) {
+        pufferfish::numa::pinCurrentThread(static_cast<uint32_t>(tctx->placement.cpu));
+    }
+    if (!mopts->perfReport.empty()) { pufferfish::perf::threadPerf() = &tctx->perf; }
     MemCollector<PufferfishIndexT> memCollector(&pfi);
     memCollector.configureMemClusterer(mopts->maxAllowedRefsPerHit);
     memCollector.setConsensusFraction(mopts->consensusFraction);
@@ -96,18 +295,16 @@ void processReadsPair(paired_parser *parser,
     auto logger = spdlog::get("console");
     fmt::MemoryWriter sstream;
     BinWriter bstream;
+    pam2::BlockEncoder pamBlock(true, !mopts->pamNoNames);
 
     //size_t batchSize{2500} ;
     uint32_t readLen{0}, mateLen{0}, totLen{0};
 
 
-    pufferfish::util::CachedVectorMap<size_t, std::vector<pufferfish::util::MemCluster>, std::hash<size_t>> leftHits;
-    pufferfish::util::CachedVectorMap<size_t, std::vector<pufferfish::util::MemCluster>, std::hash<size_t>> rightHits;
     //phmap::flat_hash_map<size_t, std::vector<pufferfish::util::MemCluster>> leftHits;
     //phmap::flat_hash_map<size_t, std::vector<pufferfish::util::MemCluster>> rightHits;
 
-    std::vector<pufferfish::util::MemCluster> recoveredHits;
-    std::vector<pufferfish::util::JointMems> jointHits;
+    std::vector<BatchedRead> batchReads(gapBatchReads);
     PairedAlignmentFormatter<PufferfishIndexT *> formatter(&pfi);
     pufferfish::util::QueryCache qc;
 
@@ -135,6 +332,9 @@ void processReadsPair(paired_parser *parser,
     auto rg = parser->getReadGroup();
 
     phmap::flat_hash_map<uint32_t, std::pair<int32_t, int32_t>> bestScorePerTranscript;
+    // the hits of a read whose gaps are aligned up front
+    std::vector<size_t> queuedHits;
+    phmap::flat_hash_map<uint32_t, uint32_t> hitsPerTranscript;
 
     pufferfish::util::AlignmentConfig aconf;
     aconf.refExtendLength = mopts->refExtendLength;
@@ -148,10 +348,14 @@ void processReadsPair(paired_parser *parser,
     aconf.allowSoftclip = mopts->allowSoftclip;
     aconf.alignmentMode = mopts->noOutput or !mopts->allowSoftclip ? pufferfish::util::PuffAlignmentMode::SCORE_ONLY : pufferfish::util::PuffAlignmentMode::APPROXIMATE_CIGAR;
     aconf.useAlignmentCache = mopts->useAlignmentCache;
+    aconf.mismatchScore = mopts->missMatchScore;
+    aconf.batchGapAlignment = mopts->batchAlignment;
+    aconf.crossReadCacheSize = mopts->crossReadCacheSize;
     aconf.maxFragmentLength = mopts->maxFragmentLength;
     aconf.noDovetail = mopts->noDovetail;
 
-    PuffAligner puffaligner(pfi.refseq_, pfi.refAccumLengths_, pfi.k(), aconf, aligner);
+    PuffAligner puffaligner(*(tctx->refseq), pfi.refAccumLengths_, pfi.k(), aconf, aligner);
+    uint64_t localReads{0};
 
     std::vector<QuasiAlignment> jointAlignments;
     using pufferfish::util::BestHitReferenceType;
@@ -168,21 +372,140 @@ void processReadsPair(paired_parser *parser,
 //    auto &txpNames = pfi.getRefNames();
     uint32_t alignmentStreamLimit = mopts->alignmentStreamLimit;
     uint32_t alignmentStreamCount{0};
+    bool trackDuplicates = mopts->duplicateWindow > 0;
+    // the PAM / kraken output needs the hits themselves (see ReadMappingOutcome)
+    bool replayHits = mopts->krakOut or mopts->salmonOut or mopts->pamV2;
+    std::vector<pufferfish::util::MemCluster> replayedClusters;
+    DuplicateReadWindow<ReadMappingOutcome> dupWindow(trackDuplicates ? mopts->duplicateWindow : 0);
+
+    // With --ordered, output goes to the writer as that of reads
+    // [pieceFirst, end) of the input, even when there is none.
+    bool ordered = mopts->orderedOutput;
+    uint64_t pieceFirst{0};
+    uint64_t readIdx{0};
+    auto dumpOutput = [&](uint64_t end) {
+        pufferfish::perf::StageTimer queueTimer(pufferfish::perf::Stage::OutputQueue);
+        std::string outBuf;
+        if (mopts->pamV2) {
+            if (pamBlock.numReads() > 0) {
+                outBuf = outQueue->acquire();
+                pamBlock.finish(outBuf);
+            }
+        } else if (mopts->salmonOut) {
+            if (bstream.getBytes() != 0) {
+                BinWriter sbw(sizeof(uint64_t));
+                sbw << bstream.getBytes();
+                outBuf = outQueue->acquire();
+                outBuf.append(sbw.data(), sbw.size());
+                outBuf.append(bstream.data(), bstream.size());
+            }
+        } else if (mopts->krakOut or mopts->bamOut) {
+            if (bstream.size() > 0) {
+                outBuf = outQueue->acquire();
+                outBuf.append(bstream.data(), bstream.size());
+            }
+        } else if (sstream.size() > 0) {
+            outBuf = outQueue->acquire();
+            outBuf.append(sstream.data(), sstream.size());
+        }
+        if (ordered) {
+            if (outBuf.empty()) {
+                outQueue->writeInOrder(nullptr, 0, pieceFirst, end - pieceFirst);
+            } else {
+                outQueue->submitInOrder(std::move(outBuf), pieceFirst, end - pieceFirst);
+            }
+            pieceFirst = end;
+        } else if (!outBuf.empty()) {
+            outQueue->submit(std::move(outBuf));
+        }
+        sstream.clear();
+        bstream.clear();
+        alignmentStreamCount = 0;
+    };
+
+    auto writeReadOutput = [&](fastx_parser::ReadPair& rpair, std::vector<pufferfish::util::JointMems>& jointHits,
+                               bool lastRead) {
+        pufferfish::perf::StageTimer formatTimer(pufferfish::perf::Stage::Formatting);
+        if (!mopts->noOutput) {
+          if (mopts->pamV2) {
+            writeAlignmentsToPAMv2(rpair, formatter, jointHits, pamBlock, mopts->justMap);
+            alignmentStreamCount += jointHits.size();
+          } else if (mopts->krakOut) {
+            writeAlignmentsToKrakenDump(rpair,  formatter,  jointHits, bstream, mopts->justMap);
+            alignmentStreamCount += jointHits.size();
+          } else if (mopts->salmonOut) {
+            writeAlignmentsToKrakenDump(rpair,  formatter,  jointHits, bstream, mopts->justMap, false);
+            alignmentStreamCount += jointHits.size();
+          } else if (mopts->bamOut) {
+            if (jointAlignments.size() > 0) {
+              writeAlignmentsToBAM(rpair, formatter, jointAlignments, bstream, !mopts->noOrphan);
+              alignmentStreamCount += jointAlignments.size();
+            } else {
+              writeUnalignedPairToBAM(rpair, bstream, formatter.cigarOps);
+              alignmentStreamCount += 1;
+            }
+          } else if (jointAlignments.size() > 0) {
+            writeAlignmentsToStream(rpair, formatter, jointAlignments, sstream, !mopts->noOrphan);
+            alignmentStreamCount += jointAlignments.size();
+          } else if (jointAlignments.size() == 0) {
+            writeUnalignedPairToStream(rpair, sstream);
+            alignmentStreamCount += 1;
+          }
+        }
+
+        formatTimer.stop();
+
+        // write them on cmd
+        if (localReads % progressCheckInterval == 0) { printProgress(hctrs, 100000, iomutex, mopts->quiet); }
+        // try dumping the output
+        if (!mopts->noOutput and (alignmentStreamCount > alignmentStreamLimit or (lastRead and !ordered))) {
+            dumpOutput(readIdx + 1);
+        }
+    };
+
+    // with bestStrata only the hits of the best score are kept, so the most promising hits
+    // are aligned first and the others are skipped once their score bound falls below the
+    // best score so far. Not when filtering by reference, which needs the score of every
+    // hit, nor with --primaryAlignment alone, which keeps the first valid hit.
+    bool pruneByBound = mopts->bestStrata and !filterMicrobiom and !filterGenomics and !filterBestScoreMicrobiom;
+
     while (parser->refill(rg)) {
-        for (auto read_it = rg.begin(); read_it != rg.end(); ++read_it) {
+        pieceFirst = rg.firstRead();
+        for (auto batchBegin = rg.begin(); batchBegin != rg.end();) {
+          auto batchEnd = batchBegin + std::min<ptrdiff_t>(gapBatchReads, rg.end() - batchBegin);
+          // find the hits of the reads of the batch, and queue the gaps of those to be aligned
+          puffaligner.clearGapBatch();
+          for (auto read_it = batchBegin; read_it != batchEnd; ++read_it) {
             auto& rpair = *read_it;
+            uint32_t readNum = static_cast<uint32_t>(read_it - batchBegin);
+            auto& br = batchReads[readNum];
+            auto& leftHits = br.leftHits;
+            auto& rightHits = br.rightHits;
+            auto& recoveredHits = br.recoveredHits;
+            auto& jointHits = br.jointHits;
+            auto& dupOutcome = br.dupOutcome;
             readLen = static_cast<uint32_t >(rpair.first.seq.length());
             mateLen = static_cast<uint32_t >(rpair.second.seq.length());
             totLen = readLen + mateLen;
 
-            ++hctr.numReads;
-
             jointHits.clear();
             leftHits.clear();
             rightHits.clear();
             recoveredHits.clear();
             memCollector.clear();
-            jointAlignments.clear();
+
+            br.duplicate = false;
+            if (trackDuplicates) {
+              br.dupKey = dupWindow.hashReads(rpair.first.seq, rpair.second.seq);
+              auto* dup = dupWindow.find(br.dupKey, rpair.first.seq, rpair.second.seq);
+              if (dup != nullptr) {
+                // an exact duplicate of a recent read pair gets that pair's result
+                br.duplicate = true;
+                dupOutcome = *dup;
+                continue;
+              }
+              dupOutcome = ReadMappingOutcome();
+            }
 
             // There is no way to revocer the following case other than aligning indels
             //verbose = rpair.first.seq == "CAGTGAGCCAAGATGGCGCCACTGCACTCCAGCCTGGGCAAAAAGAAACTCCATCTAAAAAAAAAAAAAAAAAAAAAAAAAAGAGAAAACCCTGGTCCCT" or
@@ -193,14 +516,15 @@ void processReadsPair(paired_parser *parser,
             //           rpair.second.seq == "AGCAGGAGGAGGAGGAGGAGGAGGAGGAGGAGGAGGAGGAGGTGGTGGGGGTGGTGGTGGTGGTGGTGGTGGTGGTGGTGGTGGTAGAGAGGCACCAGCA";
 
             //verbose = rpair.first.name == "mason_sample5_primary_1M_random.fasta.000050010/1";
-            bool lh = memCollector(rpair.first.seq,
-                                   qc,
-                                   true, // isLeft
-                                   verbose);
-            bool rh = memCollector(rpair.second.seq,
-                                   qc,
-                                   false, // isLeft
-                                   verbose);
+            br.lh = memCollector(rpair.first.seq,
+                                 qc,
+                                 true, // isLeft
+                                 verbose);
+            br.rh = memCollector(rpair.second.seq,
+                                 qc,
+                                 false, // isLeft
+                                 verbose);
+            pufferfish::perf::StageTimer chainTimer(pufferfish::perf::Stage::FindChains);
             memCollector.findChains(rpair.first.seq,
                                    leftHits,
                                    mopts->maxSpliceGap,
@@ -215,8 +539,10 @@ void processReadsPair(paired_parser *parser,
                                    mopts->heuristicChaining,
                                    false, // isLeft
                                    verbose);
+            chainTimer.stop();
 
             hctr.numMappedAtLeastAKmer += (leftHits.size() > 0 || rightHits.size() > 0) ? 1 : 0;
+            dupOutcome.hadKmerHit = (leftHits.size() > 0 || rightHits.size() > 0);
             //do intersection on the basis of
             //performance, or going towards selective alignment
             //otherwise orphan
@@ -235,12 +561,16 @@ void processReadsPair(paired_parser *parser,
                 ss << "\n\n";
                 std::cerr << ss.str();
             }*/
+            pufferfish::perf::StageTimer joinTimer(pufferfish::perf::Stage::JoinReads);
+            uint64_t prevDovetails = hctr.numDovetails;
             auto mergeRes = pufferfish::util::joinReadsAndFilter(leftHits, rightHits, jointHits,
                                                                  mopts->maxFragmentLength,
                                                                  totLen,
                                                                  mopts->scoreRatio,
                                                                  firstDecoyIndex,
                                                                  mpol, hctr);
+            joinTimer.stop();
+            dupOutcome.dovetail = hctr.numDovetails > prevDovetails;
 
             bool mergeStatusOR = (mergeRes == pufferfish::util::MergeResult::HAD_EMPTY_INTERSECTION or
                                   mergeRes == pufferfish::util::MergeResult::HAD_ONLY_LEFT or
@@ -248,11 +578,52 @@ void processReadsPair(paired_parser *parser,
 
             if ( mopts->recoverOrphans and mergeStatusOR ) {
               // TODO NOTE : do futher testing
+              pufferfish::perf::StageTimer orphanTimer(pufferfish::perf::Stage::OrphanRecovery);
               bool recoveredAny = selective_alignment::utils::recoverOrphans(rpair.first.seq, rpair.second.seq, recoveredHits, jointHits, puffaligner, verbose);
               (void)recoveredAny;
             }
 
             hctr.peHits += jointHits.size();
+            dupOutcome.peHits = jointHits.size();
+
+
+            if (!mopts->justMap) {
+              orderHitsByBound(puffaligner, jointHits, readLen, mateLen, pruneByBound, !mopts->genomicReads,
+                               hitsPerTranscript, br.hitBounds, br.hitOrder, queuedHits);
+              puffaligner.queueGapAlignments(readNum, rpair.first.seq, rpair.second.seq, jointHits, queuedHits);
+            }
+          }
+          puffaligner.runGapBatch();
+
+          // then align and report them, in order
+          for (auto read_it = batchBegin; read_it != batchEnd; ++read_it) {
+            auto& rpair = *read_it;
+            uint32_t readNum = static_cast<uint32_t>(read_it - batchBegin);
+            auto& br = batchReads[readNum];
+            auto& jointHits = br.jointHits;
+            auto& hitOrder = br.hitOrder;
+            auto& hitBounds = br.hitBounds;
+            auto& dupOutcome = br.dupOutcome;
+            readIdx = rg.firstRead() + static_cast<uint64_t>(read_it - rg.begin());
+            readLen = static_cast<uint32_t >(rpair.first.seq.length());
+            mateLen = static_cast<uint32_t >(rpair.second.seq.length());
+            totLen = readLen + mateLen;
+
+            ++hctr.numReads;
+            ++localReads;
+            pufferfish::perf::count(&pufferfish::perf::ThreadPerf::numReads, 1);
+
+            jointAlignments.clear();
+
+            if (br.duplicate) {
+              ++hctr.duplicateReads;
+              dupOutcome.replayCounters(hctr);
+              if (dupOutcome.dropped) { continue; }
+              jointAlignments = dupOutcome.alignments;
+              if (replayHits) { dupOutcome.replayHits(replayedClusters, jointHits); }
+              writeReadOutput(rpair, jointHits, read_it + 1 == rg.end());
+              continue;
+            }
 
 #if ALLOW_VERBOSE
             if (verbose)
@@ -261,9 +632,9 @@ void processReadsPair(paired_parser *parser,
 
             if (!mopts->justMap) {
               puffaligner.clear();
+              puffaligner.useGapBatchRead(readNum);
               int32_t bestScore = invalidScore;
               std::vector<decltype(bestScore)> scores(jointHits.size(), bestScore);
-              size_t idx{0};
 
                 if (!mopts->genomicReads) { bestScorePerTranscript.clear(); }
                 bestHitRefType = BestHitReferenceType::UNKNOWN;
@@ -275,8 +646,16 @@ void processReadsPair(paired_parser *parser,
 //                std::stringstream ss;
 //                if (verbose)
 //                   ss << "\n\n found the read:\n" << rpair.first.name << " " << jointHits.size() <<"\n";
-                for (auto &&jointHit : jointHits) {
-                  auto hitScore = puffaligner.calculateAlignments(rpair.first.seq, rpair.second.seq, jointHit, hctr, isMultimapping, false);
+                for (size_t idx : hitOrder) {
+                  auto& jointHit = jointHits[idx];
+                  int32_t hitScore = invalidScore;
+                  if (pruneByBound and (hitBounds[idx] == invalidScore or hitBounds[idx] < bestScore)) {
+                    jointHit.alignmentScore = jointHit.mateAlignmentScore = invalidScore;
+                    hctr.skippedAlignments_byBound += 1;
+                  } else {
+                    pufferfish::perf::StageTimer alignTimer(pufferfish::perf::Stage::Alignment);
+                    hitScore = puffaligner.calculateAlignments(rpair.first.seq, rpair.second.seq, jointHit, hctr, isMultimapping, false);
+                  }
                   scores[idx] = hitScore;
 //                    if (verbose)
 //                        ss << txpNames[jointHit.tid] << " " << jointHit.alignmentScore << " " << scores[idx] << "\n";
@@ -327,6 +706,7 @@ void processReadsPair(paired_parser *parser,
                     // We should have valid alignment scores at this point as we are inside !justMap if and passed calculating alignment score
                     if (!mopts->genomicReads) {
                         // removing dupplicate hits from a read to the same transcript
+                        // (hits that share a transcript are never pruned and are aligned in order)
                       auto it = bestScorePerTranscript.find(jointHit.tid);
                         if (it == bestScorePerTranscript.end()) {
                           // if we didn't have any alignment for this transcript yet, then
@@ -346,7 +726,6 @@ void processReadsPair(paired_parser *parser,
                           scores[idx] = invalidScore;
                         }
                     }
-                    ++idx;
                 }
 
                 /*if (verbose) {
@@ -365,6 +744,10 @@ void processReadsPair(paired_parser *parser,
                 if (verbose) {std::cerr << ss.str();  verbose = false; std::exit(1);}*/
                 if (filterGenomics and (bestHitRefType == BestHitReferenceType::FILTERED) ) {
                     // This read is likely come from decoy sequence and should be discarded from reference alignments
+                    if (trackDuplicates) {
+                      dupOutcome.dropped = true;
+                      dupWindow.insert(br.dupKey, rpair.first.seq, rpair.second.seq, dupOutcome);
+                    }
                     continue;
                 }
                /* std::stringstream ss;
@@ -382,10 +765,18 @@ void processReadsPair(paired_parser *parser,
                 }
                 std::cerr << ss.str();*/
                 if (filterBestScoreMicrobiom and (bestHitRefType != BestHitReferenceType::NON_FILTERED)) {
+                    if (trackDuplicates) {
+                      dupOutcome.dropped = true;
+                      dupWindow.insert(br.dupKey, rpair.first.seq, rpair.second.seq, dupOutcome);
+                    }
                     continue;
                 }
                 if (filterMicrobiom and (hitRefType == BestHitReferenceType::FILTERED)) {
 //                    std::cerr << "filtered\n";
+                    if (trackDuplicates) {
+                      dupOutcome.dropped = true;
+                      dupWindow.insert(br.dupKey, rpair.first.seq, rpair.second.seq, dupOutcome);
+                    }
                     continue;
                 }
                 // Filter out these alignments with low scores
@@ -419,13 +810,16 @@ void processReadsPair(paired_parser *parser,
                 jointHits.erase(jointHits.begin() + mopts->maxNumHits, jointHits.end());
             }
 
-            hctr.totHits += !jointHits.empty() && !jointHits.back().isOrphan() ? 1 : 0;;
-            hctr.numMapped += !jointHits.empty() ? 1 : 0;
+            dupOutcome.totHits = !jointHits.empty() && !jointHits.back().isOrphan() ? 1 : 0;
+            dupOutcome.mapped = !jointHits.empty();
             if (mopts->noOrphan) {
-                hctr.numOfOrphans += jointHits.empty() && (lh || rh);
+                dupOutcome.orphan = jointHits.empty() && (br.lh || br.rh);
             } else {
-                hctr.numOfOrphans += !jointHits.empty() && (jointHits.back().isOrphan()) ? 1 : 0;
+                dupOutcome.orphan = !jointHits.empty() && (jointHits.back().isOrphan());
             }
+            hctr.totHits += dupOutcome.totHits;
+            hctr.numMapped += dupOutcome.mapped ? 1 : 0;
+            hctr.numOfOrphans += dupOutcome.orphan ? 1 : 0;
 
             if (jointHits.size() > hctr.maxMultimapping) {
                 hctr.maxMultimapping = jointHits.size();
@@ -471,62 +865,25 @@ void processReadsPair(paired_parser *parser,
             }
 
             hctr.totAlignment += jointAlignments.size();
+            pufferfish::perf::count(&pufferfish::perf::ThreadPerf::numAlignments, jointAlignments.size());
 
-            if (!mopts->noOutput) {
-              if (mopts->krakOut) {
-                writeAlignmentsToKrakenDump(rpair,  formatter,  jointHits, bstream, mopts->justMap);
-                alignmentStreamCount += jointHits.size();
-              } else if (mopts->salmonOut) {
-                writeAlignmentsToKrakenDump(rpair,  formatter,  jointHits, bstream, mopts->justMap, false);
-                alignmentStreamCount += jointHits.size();
-              } else if (jointAlignments.size() > 0) {
-                writeAlignmentsToStream(rpair, formatter, jointAlignments, sstream, !mopts->noOrphan);
-                alignmentStreamCount += jointAlignments.size();
-              } else if (jointAlignments.size() == 0) {
-                writeUnalignedPairToStream(rpair, sstream);
-                alignmentStreamCount += 1;
-              }
-            }
-
-            // write them on cmd
-            if (hctr.numReads > hctr.lastPrint + 100000) {
-                hctr.lastPrint.store(hctr.numReads.load());
-                if (!mopts->quiet and iomutex->try_lock()) {
-                    if (hctr.numReads > 0) {
-                        std::cerr << "\r\r";
-                    }
-                    std::cerr << "saw " << hctr.numReads << " reads : "
-                              << "pe / read = " << hctr.peHits / static_cast<float>(hctr.numReads)
-                              << " : se / read = " << hctr.seHits / static_cast<float>(hctr.numReads) << ' ';
-                    iomutex->unlock();
-                }
-            }
-            //puffaligner.clear();
-            // try dumping the output
-            bool last_read = (read_it + 1 == rg.end());
-            if (!mopts->noOutput and (alignmentStreamCount > alignmentStreamLimit or last_read)) {
-                // Get rid of last newline
-                if (mopts->salmonOut) {
-                    if (bstream.getBytes() != 0) {
-                        BinWriter sbw(sizeof(uint64_t));
-                        sbw << bstream.getBytes();
-                        outQueue->info("{}{}", sbw, bstream);
-                    }
-                } else if (mopts->krakOut) {
-                    outQueue->info("{}", bstream);
-                } else {
-                    std::string outStr(sstream.str());
-                    if (!outStr.empty()) {
-                        outStr.pop_back();
-                        outQueue->info(std::move(outStr));
-                    }
-                }
-                sstream.clear();
-                bstream.clear();
-                alignmentStreamCount = 0;
+            if (trackDuplicates) {
+              dupOutcome.alignments = jointAlignments;
+              if (replayHits) { dupOutcome.keepHits(jointHits); }
+              dupWindow.insert(br.dupKey, rpair.first.seq, rpair.second.seq, dupOutcome);
             }
+            writeReadOutput(rpair, jointHits, read_it + 1 == rg.end());
+          } // for all reads in this batch
+          batchBegin = batchEnd;
         } // for all reads in this job
+        // the rest of the run, including reads that were dropped, has its turn
+        // now; unless a flush on its last read already covered it
+        if (ordered and !mopts->noOutput and pieceFirst < rg.firstRead() + rg.size()) {
+            dumpOutput(rg.firstRead() + rg.size());
+        }
     } // processed all reads
+    tctx->numReads += localReads;
+    pufferfish::perf::threadPerf() = nullptr;
 }
 
 //===========
@@ -536,10 +893,16 @@ template<typename PufferfishIndexT>
 void processReadsSingle(single_parser *parser,
                         PufferfishIndexT &pfi,
                         MutexT *iomutex,
-                        std::shared_ptr<spdlog::logger> outQueue,
+                        OutputWriter* outQueue,
                         HitCounters &hctr,
+                        ShardedHitCounters &hctrs,
                         phmap::flat_hash_set<std::string>& gene_names,
-                        pufferfish::AlignmentOpts *mopts) {
+                        pufferfish::AlignmentOpts *mopts,
+                        MappingThreadContext *tctx) {
+    if (tctx->placement.cpu >= 0) {
+        pufferfish::numa::pinCurrentThread(static_cast<uint32_t>(tctx->placement.cpu));
+    }
+    if (!mopts->perfReport.empty()) { pufferfish::perf::threadPerf() = &tctx->perf; }
     MemCollector<PufferfishIndexT> memCollector(&pfi);
     memCollector.configureMemClusterer(mopts->maxAllowedRefsPerHit);
     memCollector.setConsensusFraction(mopts->consensusFraction);
@@ -547,17 +910,21 @@ void processReadsSingle(single_parser *parser,
     using pufferfish::util::BestHitReferenceType;
     BestHitReferenceType bestHitRefType{BestHitReferenceType::UNKNOWN};
     phmap::flat_hash_map<uint32_t, std::pair<int32_t, int32_t>> bestScorePerTranscript;
+    // the hits of a read whose gaps are aligned up front
+    std::vector<size_t> queuedHits;
+    phmap::flat_hash_map<uint32_t, uint32_t> hitsPerTranscript;
 
     auto logger = spdlog::get("console");
     fmt::MemoryWriter sstream;
     BinWriter bstream;
+    pam2::BlockEncoder pamBlock(false, !mopts->pamNoNames);
     //size_t batchSize{2500} ;
     uint32_t readLen{0};
     std::string dummyRead = "";
     //size_t totLen{0};
 
-    pufferfish::util::CachedVectorMap<size_t, std::vector<pufferfish::util::MemCluster>, std::hash<size_t>> leftHits;
-    std::vector<pufferfish::util::JointMems> jointHits;
+    // as for paired-end reads; the rightHits of each are not used
+    std::vector<BatchedRead> batchReads(gapBatchReads);
     PairedAlignmentFormatter<PufferfishIndexT *> formatter(&pfi);
     pufferfish::util::QueryCache qc;
     std::vector<pufferfish::util::MemCluster> all;
@@ -591,34 +958,157 @@ void processReadsSingle(single_parser *parser,
     aconf.allowSoftclip = mopts->allowSoftclip;
     aconf.alignmentMode = mopts->noOutput or !mopts->allowSoftclip ? pufferfish::util::PuffAlignmentMode::SCORE_ONLY : pufferfish::util::PuffAlignmentMode::APPROXIMATE_CIGAR;
     aconf.useAlignmentCache = mopts->useAlignmentCache;
+    aconf.mismatchScore = mopts->missMatchScore;
+    aconf.batchGapAlignment = mopts->batchAlignment;
+    aconf.crossReadCacheSize = mopts->crossReadCacheSize;
 
-    PuffAligner puffaligner(pfi.refseq_, pfi.refAccumLengths_, pfi.k(), aconf, aligner);
+    PuffAligner puffaligner(*(tctx->refseq), pfi.refAccumLengths_, pfi.k(), aconf, aligner);
+    uint64_t localReads{0};
 
     uint32_t alignmentStreamLimit = mopts->alignmentStreamLimit;
     uint32_t alignmentStreamCount{0};
 
+    std::vector<QuasiAlignment> jointAlignments;
+    std::vector<std::pair<uint32_t, std::vector<pufferfish::util::MemCluster>::iterator>> validHits;
+    // as for paired-end reads
+    bool trackDuplicates = mopts->duplicateWindow > 0;
+    bool replayHits = mopts->krakOut or mopts->salmonOut or mopts->pamV2;
+    std::vector<pufferfish::util::MemCluster> replayedClusters;
+    DuplicateReadWindow<ReadMappingOutcome> dupWindow(trackDuplicates ? mopts->duplicateWindow : 0);
+
+    // as for paired-end reads
+    bool ordered = mopts->orderedOutput;
+    uint64_t pieceFirst{0};
+    uint64_t readIdx{0};
+    auto dumpOutput = [&](uint64_t end) {
+        pufferfish::perf::StageTimer queueTimer(pufferfish::perf::Stage::OutputQueue);
+        std::string outBuf;
+        if (mopts->pamV2) {
+            if (pamBlock.numReads() > 0) {
+                outBuf = outQueue->acquire();
+                pamBlock.finish(outBuf);
+            }
+        } else if (mopts->krakOut || mopts->salmonOut || mopts->bamOut) {
+            if (mopts->salmonOut && bstream.getBytes() > 0) {
+                BinWriter sbw(64);
+                sbw << bstream.getBytes();
+                outBuf = outQueue->acquire();
+                outBuf.append(sbw.data(), sbw.size());
+                outBuf.append(bstream.data(), bstream.size());
+            } else if ((mopts->krakOut || mopts->bamOut) && bstream.size() > 0) {
+                outBuf = outQueue->acquire();
+                outBuf.append(bstream.data(), bstream.size());
+            }
+            bstream.clear();
+        } else {
+            if (sstream.size() > 0) {
+                outBuf = outQueue->acquire();
+                outBuf.append(sstream.data(), sstream.size());
+            }
+            sstream.clear();
+        }
+        if (ordered) {
+            if (outBuf.empty()) {
+                outQueue->writeInOrder(nullptr, 0, pieceFirst, end - pieceFirst);
+            } else {
+                outQueue->submitInOrder(std::move(outBuf), pieceFirst, end - pieceFirst);
+            }
+            pieceFirst = end;
+        } else if (!outBuf.empty()) {
+            outQueue->submit(std::move(outBuf));
+        }
+        alignmentStreamCount = 0;
+    };
+
+    auto writeReadOutput = [&](fastx_parser::ReadSeq& read, bool lastRead) {
+        pufferfish::perf::StageTimer formatTimer(pufferfish::perf::Stage::Formatting);
+        // write puffkrak format output
+        if (mopts->pamV2) {
+          writeAlignmentsToPAMv2(read, formatter, validHits, pamBlock);
+          alignmentStreamCount += validHits.size();
+        } else if (mopts->krakOut) {
+          writeAlignmentsToKrakenDump(read, formatter,
+                                      validHits, bstream);
+          alignmentStreamCount += validHits.size();
+        } else if (mopts->salmonOut) {
+          writeAlignmentsToKrakenDump(read, formatter,
+                                        validHits, bstream, false);
+          alignmentStreamCount += validHits.size();
+        } else if (mopts->bamOut and !mopts->noOutput) {
+          if (jointAlignments.size() > 0) {
+            writeAlignmentsToBAMSingle(read, formatter, jointAlignments, bstream);
+            alignmentStreamCount += jointAlignments.size();
+          } else {
+            writeUnalignedSingleToBAM(read, bstream, formatter.cigarOps);
+            alignmentStreamCount += 1;
+          }
+        } else if (jointAlignments.size() > 0 and !mopts->noOutput) {
+            // write sam output for mapped reads
+            writeAlignmentsToStreamSingle(read, formatter, jointAlignments, sstream, !mopts->noOrphan);
+            alignmentStreamCount += jointAlignments.size();
+        } else if (jointAlignments.size() == 0 and !mopts->noOutput) {
+            // write sam output for un-mapped reads
+          writeUnalignedSingleToStream(read, sstream);
+          alignmentStreamCount += 1;
+        }
+
+        formatTimer.stop();
+
+        // write them on cmd
+        if (localReads % progressCheckInterval == 0) { printProgress(hctrs, 1000000, iomutex, mopts->quiet); }
+
+        // try dumping the output
+        if (!mopts->noOutput and (alignmentStreamCount > alignmentStreamLimit or (lastRead and !ordered))) {
+            dumpOutput(readIdx + 1);
+        }
+    };
+
+    bool verbose = false;
+    bool filterGenomics = mopts->filterGenomics;
+    bool filterMicrobiom = mopts->filterMicrobiom;
+    // as for paired-end reads
+    bool pruneByBound = mopts->bestStrata and !filterMicrobiom and !filterGenomics and !mopts->filterMicrobiomBestScore;
+
     auto rg = parser->getReadGroup();
     while (parser->refill(rg)) {
-        for (auto read_it = rg.begin(); read_it != rg.end(); ++read_it) {
+        pieceFirst = rg.firstRead();
+        for (auto batchBegin = rg.begin(); batchBegin != rg.end();) {
+          auto batchEnd = batchBegin + std::min<ptrdiff_t>(gapBatchReads, rg.end() - batchBegin);
+          // find the hits of the reads of the batch, and queue the gaps of those to be aligned
+          puffaligner.clearGapBatch();
+          for (auto read_it = batchBegin; read_it != batchEnd; ++read_it) {
             auto& read = *read_it;
+            uint32_t readNum = static_cast<uint32_t>(read_it - batchBegin);
+            auto& br = batchReads[readNum];
+            auto& leftHits = br.leftHits;
+            auto& jointHits = br.jointHits;
+            auto& dupOutcome = br.dupOutcome;
             readLen = static_cast<uint32_t >(read.seq.length());
             auto totLen = readLen;
-            bool verbose = false;
             //if (verbose) std::cerr << read.name << "\n";
-            ++hctr.numReads;
 
             jointHits.clear();
             leftHits.clear();
             memCollector.clear();
 
-
-            bool filterGenomics = mopts->filterGenomics;
-            bool filterMicrobiom = mopts->filterMicrobiom;
+            br.duplicate = false;
+            if (trackDuplicates) {
+              br.dupKey = dupWindow.hashReads(read.seq, dummyRead);
+              auto* dup = dupWindow.find(br.dupKey, read.seq, dummyRead);
+              if (dup != nullptr) {
+                // an exact duplicate of a recent read gets that read's result
+                br.duplicate = true;
+                dupOutcome = *dup;
+                continue;
+              }
+              dupOutcome = ReadMappingOutcome();
+            }
 
             bool lh = memCollector(read.seq,
                                    qc,
                                    true, // isLeft
                                    verbose);
+            pufferfish::perf::StageTimer chainTimer(pufferfish::perf::Stage::FindChains);
             memCollector.findChains(read.seq,
                                    leftHits,
                                    mopts->maxSpliceGap,
@@ -626,22 +1116,58 @@ void processReadsSingle(single_parser *parser,
                                    mopts->heuristicChaining,
                                    true, // isLeft
                                    verbose);
+            chainTimer.stop();
 
             (void) lh;
             all.clear();
+            pufferfish::perf::StageTimer joinTimer(pufferfish::perf::Stage::JoinReads);
             pufferfish::util::joinReadsAndFilterSingle(leftHits, jointHits,
                                      totLen,
                                      mopts->scoreRatio);
+            joinTimer.stop();
 
-            std::vector<QuasiAlignment> jointAlignments;
-            std::vector<std::pair<uint32_t, std::vector<pufferfish::util::MemCluster>::iterator>> validHits;
+            if (!mopts->justMap) {
+                orderHitsByBound(puffaligner, jointHits, readLen, readLen, pruneByBound, !mopts->genomicReads,
+                                 hitsPerTranscript, br.hitBounds, br.hitOrder, queuedHits);
+                puffaligner.queueGapAlignments(readNum, read.seq, jointHits, queuedHits);
+            }
+          }
+          puffaligner.runGapBatch();
+
+          // then align and report them, in order
+          for (auto read_it = batchBegin; read_it != batchEnd; ++read_it) {
+            auto& read = *read_it;
+            uint32_t readNum = static_cast<uint32_t>(read_it - batchBegin);
+            auto& br = batchReads[readNum];
+            auto& jointHits = br.jointHits;
+            auto& hitOrder = br.hitOrder;
+            auto& hitBounds = br.hitBounds;
+            auto& dupOutcome = br.dupOutcome;
+            readIdx = rg.firstRead() + static_cast<uint64_t>(read_it - rg.begin());
+            readLen = static_cast<uint32_t >(read.seq.length());
+            ++hctr.numReads;
+            ++localReads;
+            pufferfish::perf::count(&pufferfish::perf::ThreadPerf::numReads, 1);
+
+            jointAlignments.clear();
+            validHits.clear();
+
+            if (br.duplicate) {
+              ++hctr.duplicateReads;
+              dupOutcome.replayCounters(hctr);
+              if (dupOutcome.dropped) { continue; }
+              jointAlignments = dupOutcome.alignments;
+              if (replayHits) { dupOutcome.replayHits(replayedClusters, validHits); }
+              writeReadOutput(read, read_it + 1 == rg.end());
+              continue;
+            }
 
             if (!mopts->justMap) {
                 puffaligner.clear();
+                puffaligner.useGapBatchRead(readNum);
 
                 int32_t bestScore = invalidScore;
                 std::vector<decltype(bestScore)> scores(jointHits.size(), bestScore);
-                size_t idx{0};
 
                 bool bestScoreGenomic{false};
                 bool bestScoreTxpomic{false};
@@ -649,8 +1175,16 @@ void processReadsSingle(single_parser *parser,
                 if (!mopts->genomicReads) { bestScorePerTranscript.clear(); }
                 bestHitRefType = BestHitReferenceType::UNKNOWN;
                 bool isMultimapping = (jointHits.size() > 1);
-                for (auto &jointHit : jointHits) {
-                  int32_t hitScore = puffaligner.calculateAlignments(read.seq, jointHit, hctr, isMultimapping, verbose);
+                for (size_t idx : hitOrder) {
+                  auto& jointHit = jointHits[idx];
+                  int32_t hitScore = invalidScore;
+                  if (pruneByBound and (hitBounds[idx] == invalidScore or hitBounds[idx] < bestScore)) {
+                    jointHit.alignmentScore = invalidScore;
+                    hctr.skippedAlignments_byBound += 1;
+                  } else {
+                    pufferfish::perf::StageTimer alignTimer(pufferfish::perf::Stage::Alignment);
+                    hitScore = puffaligner.calculateAlignments(read.seq, jointHit, hctr, isMultimapping, verbose);
+                  }
                     scores[idx] = hitScore;
 
                     const std::string& ref_name = pfi.refName(jointHit.tid);//txpNames[jointHit.tid];
@@ -696,14 +1230,21 @@ void processReadsSingle(single_parser *parser,
                             scores[idx] = invalidScore;
                         }
                     }
-                    ++idx;
                 }
 
                 if (filterGenomics and bestScoreGenomic and !bestScoreTxpomic) {
                     // This read is likely come from the genome and should be discarded from txptomic alignments
+                    if (trackDuplicates) {
+                      dupOutcome.dropped = true;
+                      dupWindow.insert(br.dupKey, read.seq, dummyRead, dupOutcome);
+                    }
                     continue;
                 }
                 if (filterMicrobiom and bestScoreGenomic) {
+                    if (trackDuplicates) {
+                      dupOutcome.dropped = true;
+                      dupWindow.insert(br.dupKey, read.seq, dummyRead, dupOutcome);
+                    }
                     continue;
                 }
 
@@ -742,6 +1283,8 @@ void processReadsSingle(single_parser *parser,
             hctr.totHits += jointHits.size();
             hctr.seHits += jointHits.size();
             hctr.numMapped += !jointHits.empty() ? 1 : 0;
+            dupOutcome.hadKmerHit = dupOutcome.mapped = !jointHits.empty();
+            dupOutcome.totHits = dupOutcome.seHits = jointHits.size();
             if (jointHits.size() > hctr.maxMultimapping) {
                 hctr.maxMultimapping = jointHits.size();
             }
@@ -768,137 +1311,32 @@ void processReadsSingle(single_parser *parser,
             }
 
             hctr.totAlignment += jointHits.size();
-
-            // write puffkrak format output
-            if (mopts->krakOut) {
-              writeAlignmentsToKrakenDump(read, formatter,
-                                          validHits, bstream);
-              alignmentStreamCount += validHits.size();
-            } else if (mopts->salmonOut) {
-              writeAlignmentsToKrakenDump(read, formatter,
-                                            validHits, bstream, false);
-              alignmentStreamCount += validHits.size();
-            } else if (jointHits.size() > 0 and !mopts->noOutput) {
-                // write sam output for mapped reads
-                writeAlignmentsToStreamSingle(read, formatter, jointAlignments, sstream, !mopts->noOrphan);
-                alignmentStreamCount += jointAlignments.size();
-            } else if (jointHits.size() == 0 and !mopts->noOutput) {
-                // write sam output for un-mapped reads
-              writeUnalignedSingleToStream(read, sstream);
-              alignmentStreamCount += 1;
-            }
-
-            // write them on cmd
-            if (hctr.numReads > hctr.lastPrint + 1000000) {
-                hctr.lastPrint.store(hctr.numReads.load());
-                if (!mopts->quiet and iomutex->try_lock()) {
-                    if (hctr.numReads > 0) {
-                        std::cerr << "\r\r";
-                    }
-                    std::cerr << "saw " << hctr.numReads << " reads : "
-                              << "pe / read = "
-                              << hctr.peHits / static_cast<float>(hctr.numReads)
-                              << " : se / read = "
-                              << hctr.seHits / static_cast<float>(hctr.numReads) << ' ';
-                    iomutex->unlock();
-                }
-            }
-
-            // try dumping the output
-            bool last_read = (read_it + 1 == rg.end());
-            if (!mopts->noOutput and (alignmentStreamCount > alignmentStreamLimit or last_read)) {
-                // Get rid of last newline
-                if (mopts->krakOut || mopts->salmonOut) {
-                    if (mopts->salmonOut && bstream.getBytes() > 0) {
-                        BinWriter sbw(64);
-                        sbw << bstream.getBytes();
-                        outQueue->info("{}{}", sbw, bstream);
-                    } else if (mopts->krakOut) {
-                        outQueue->info("{}", bstream);
-                    }
-                    bstream.clear();
-                } else {
-                    std::string outStr(sstream.str());
-                    // Get rid of last newline
-                    if (!outStr.empty()) {
-                        outStr.pop_back();
-                        outQueue->info(std::move(outStr));
-                    }
-                    sstream.clear();
-                }
-                alignmentStreamCount = 0;
+            pufferfish::perf::count(&pufferfish::perf::ThreadPerf::numAlignments, jointHits.size());
+            if (trackDuplicates) {
+              dupOutcome.alignments = jointAlignments;
+              if (replayHits) { dupOutcome.keepHits(validHits); }
+              dupWindow.insert(br.dupKey, read.seq, dummyRead, dupOutcome);
             }
+            writeReadOutput(read, read_it + 1 == rg.end());
+          } // for all reads in this batch
+          batchBegin = batchEnd;
         } // for all reads in this job
+        // the rest of the run, including reads that were dropped, has its turn
+        // now; unless a flush on its last read already covered it
+        if (ordered and !mopts->noOutput and pieceFirst < rg.firstRead() + rg.size()) {
+            dumpOutput(rg.firstRead() + rg.size());
+        }
     } // processed all reads
+    tctx->numReads += localReads;
+    pufferfish::perf::threadPerf() = nullptr;
 }
 
 //===========
 // PAIRED END
 //============
-template<typename PufferfishIndexT>
-bool spawnProcessReadsThreads(
-        uint32_t nthread,
-        paired_parser *parser,
-        PufferfishIndexT &pfi,
-        MutexT &iomutex,
-        std::shared_ptr<spdlog::logger> outQueue,
-        HitCounters &hctr,
-        phmap::flat_hash_set<std::string>& gene_names,
-        phmap::flat_hash_set<std::string>& rrna_names,
-        pufferfish::AlignmentOpts *mopts) {
-
-    std::vector<std::thread> threads;
-
-    for (size_t i = 0; i < nthread; ++i) {
-
-        threads.emplace_back(processReadsPair<PufferfishIndexT>,
-                             parser,
-                             std::ref(pfi),
-                             &iomutex,
-                             outQueue,
-                             std::ref(hctr),
-                             std::ref(gene_names),
-                             std::ref(rrna_names),
-                             mopts);
-    }
-    for (auto &t : threads) { t.join(); }
-
-    return true;
-}
-
-//===========
-// SINGLE END
-//============
-template<typename PufferfishIndexT>
-bool spawnProcessReadsThreads(
-        uint32_t nthread,
-        single_parser *parser,
-        PufferfishIndexT &pfi,
-        MutexT &iomutex,
-        std::shared_ptr<spdlog::logger> outQueue,
-        HitCounters &hctr,
-        phmap::flat_hash_set<std::string>& gene_names,
-        pufferfish::AlignmentOpts *mopts) {
-
-    std::vector<std::thread> threads;
-
-    for (size_t i = 0; i < nthread; ++i) {
-
-        threads.emplace_back(processReadsSingle<PufferfishIndexT>,
-                             parser,
-                             std::ref(pfi),
-                             &iomutex,
-                             outQueue,
-                             std::ref(hctr),
-                             std::ref(gene_names),
-                             mopts);
-    }
-    for (auto &t : threads) { t.join(); }
-
-    return true;
-}
-
-void printAlignmentSummary(HitCounters &hctrs, std::shared_ptr<spdlog::logger> consoleLog) {
+void printAlignmentSummary(ShardedHitCounters &shards, std::shared_ptr<spdlog::logger> consoleLog) {
+    HitCounters hctrs;
+    shards.sum(hctrs);
     consoleLog->info("Done mapping reads.");
     consoleLog->info("\n\n");
     consoleLog->info("=====");
@@ -919,22 +1357,347 @@ void printAlignmentSummary(HitCounters &hctrs, std::shared_ptr<spdlog::logger> c
     consoleLog->info("Total number of alignment attempts : {}", hctrs.totalAlignmentAttempts);
     consoleLog->info("Number of skipped alignments because of cache hits : {}", hctrs.skippedAlignments_byCache);
     consoleLog->info("Number of skipped alignments because of perfect chains : {}", hctrs.skippedAlignments_byCov);
+    consoleLog->info("Number of skipped alignments because of score upper bounds : {}", hctrs.skippedAlignments_byBound);
+    consoleLog->info("Number of between-MEM gaps / read ends scored without DP : {} / {}", hctrs.skippedDP_gaps, hctrs.skippedDP_ends);
+    if (hctrs.duplicateReads > 0) {
+      consoleLog->info("Number of exact duplicate reads answered without mapping : {}", hctrs.duplicateReads);
+    }
+    uint64_t lookups = hctrs.crossReadCacheHits + hctrs.crossReadCacheMisses;
+    if (lookups > 0) {
+      consoleLog->info("Cross-read alignment cache : {} hits, {} misses ({:.2f}% hit rate)", hctrs.crossReadCacheHits,
+                       hctrs.crossReadCacheMisses, (100.0 * hctrs.crossReadCacheHits) / lookups);
+    }
 
     consoleLog->info("Number of cigar strings which are fixed: {}", hctrs.cigar_fixed_count);
     consoleLog->info("=====");
 }
 
+// Decide where each mapping thread runs and which copy of the reference
+// sequence it reads from.  Without --pinThreads nothing is pinned and
+// every thread uses pfi.refseq_.
 template<typename PufferfishIndexT>
-bool alignReads(
+std::vector<MappingThreadContext> makeThreadContexts(
+        PufferfishIndexT &pfi,
+        const pufferfish::numa::Topology& topo,
+        std::vector<std::unique_ptr<compact::vector<uint64_t, 2>>>& replicas,
+        std::shared_ptr<spdlog::logger> consoleLog,
+        pufferfish::AlignmentOpts *mopts) {
+    uint32_t nthread = mopts->numThreads;
+    std::vector<MappingThreadContext> tctxs(nthread);
+    if (mopts->pinThreads) {
+        auto plan = pufferfish::numa::planThreadPlacement(topo, nthread);
+        for (size_t i = 0; i < nthread; ++i) { tctxs[i].placement = plan[i]; }
+        consoleLog->info("pinning {} mapping threads over {} NUMA node(s)", nthread, topo.numNodes());
+    }
+    bool replicate = mopts->numaReplicateRefSeq and topo.numNodes() > 1 and !pfi.refseq_.empty();
+    if (replicate and replicas.empty()) {
+        CLI::AutoTimer timer{"Replicating reference sequence on each NUMA node", CLI::Timer::Big};
+        replicas = pufferfish::numa::replicatePerNode(pfi.refseq_, topo);
+    }
+    for (auto& tc : tctxs) {
+        tc.refseq = (replicate and tc.placement.node >= 0) ? replicas[tc.placement.node].get() : &pfi.refseq_;
+    }
+    return tctxs;
+}
+
+void printNumaSummary(const std::vector<MappingThreadContext>& tctxs,
+                      const pufferfish::numa::Topology& topo,
+                      double seconds,
+                      std::shared_ptr<spdlog::logger> consoleLog) {
+    std::vector<uint64_t> nodeReads(topo.numNodes(), 0);
+    for (auto& tc : tctxs) {
+        if (tc.placement.node >= 0) { nodeReads[tc.placement.node] += tc.numReads; }
+    }
+    for (size_t n = 0; n < nodeReads.size(); ++n) {
+        consoleLog->info("NUMA node {} : {} reads ({:.1f} reads/s)", n, nodeReads[n],
+                         seconds > 0 ? nodeReads[n] / seconds : 0.0);
+    }
+}
+
+// Merges the threads' stage timings and writes them to --perf-report.
+void writePerfReport(const std::vector<MappingThreadContext>& tctxs,
+                     const pufferfish::perf::TickCalibration& calibration,
+                     double seconds,
+                     std::shared_ptr<spdlog::logger> consoleLog,
+                     pufferfish::AlignmentOpts* mopts) {
+    pufferfish::perf::ThreadPerf total;
+    for (auto& tc : tctxs) { total.merge(tc.perf); }
+    if (!pufferfish::perf::writePerfReport(mopts->perfReport, total, static_cast<uint32_t>(tctxs.size()),
+                                           calibration.ticksPerSecond(), seconds)) {
+        consoleLog->error("Could not write the performance report to {}", mopts->perfReport);
+        return;
+    }
+    consoleLog->info("wrote the performance report to {}", mopts->perfReport);
+}
+
+// Writes out what is left of the output, and reports on its compression
+// and on the output held back to write it in input order.
+void closeOutput(OutputWriter* outLog, std::shared_ptr<spdlog::logger> consoleLog, bool ordered) {
+    if (!outLog) { return; }
+    outLog->close();
+    if (ordered) {
+        consoleLog->info("Wrote the output in input order, holding at most {} buffers for their turn "
+                         "({} made beyond the output pool)",
+                         outLog->maxHeld(), outLog->numExtraBuffers());
+    }
+    if (outLog->numCompressionThreads() > 0 and outLog->bytesOut() > 0) {
+        double mb = 1024.0 * 1024.0;
+        double secs = outLog->compressionSeconds();
+        consoleLog->info("Compressed {:.1f} MB of output to {:.1f} MB ({:.2f}x) with {} threads ({:.1f} MB/s per thread)",
+                         outLog->bytesIn() / mb, outLog->bytesOut() / mb,
+                         static_cast<double>(outLog->bytesIn()) / outLog->bytesOut(),
+                         outLog->numCompressionThreads(), secs > 0 ? outLog->bytesIn() / mb / secs : 0.0);
+    }
+}
+
+// Opens the output of a sample, writing its header, or returns null with
+// --noOutput.
+template<typename PufferfishIndexT>
+std::unique_ptr<OutputWriter> openOutput(
         PufferfishIndexT &pfi,
+        const std::string& outname,
+        phmap::flat_hash_set<std::string>& gene_names,
+        phmap::flat_hash_set<std::string>& rrna_names,
         std::shared_ptr<spdlog::logger> consoleLog,
         pufferfish::AlignmentOpts *mopts) {
+    std::unique_ptr<OutputWriter> outLog{nullptr};
+    if (mopts->noOutput) { return outLog; }
+    // two blocks in flight per mapping thread: one being written while the next is formatted
+    uint32_t numOutBuffers = std::max(2 * mopts->numThreads, 4u);
+    size_t outBufferCapacity = 1 << 20;
+    int outFd = STDOUT_FILENO;
+    if (outname != "-") {
+        outFd = ::open(outname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outFd < 0) {
+            consoleLog->error("could not open output file {} : {}", outname, std::strerror(errno));
+            std::exit(1);
+        }
+    }
+    uint32_t compressionThreads{0};
+    // BAM is always compressed; PAM v2 blocks are compressed already
+    if (mopts->pamV2 and mopts->compressedOutput) {
+        consoleLog->info("PAM v2 output is block-compressed; ignoring -z");
+    } else if (mopts->compressedOutput or mopts->bamOut) {
+        compressionThreads = mopts->compressionThreads > 0 ? mopts->compressionThreads
+                                                           : std::max(mopts->numThreads / 4, 1u);
+    }
+    outLog.reset(new OutputWriter(outFd, outFd != STDOUT_FILENO, numOutBuffers, outBufferCapacity,
+                                  compressionThreads));
+    // write the SAM Header
+    // If nothing gets printed by this time we are in trouble
+    if (mopts->pamV2) {
+        writePAMv2Header(pfi, *outLog, mopts);
+    } else if (mopts->krakOut || mopts->salmonOut) {
+        writeKrakOutHeader(pfi, *outLog, mopts);
+    } else if (mopts->bamOut) {
+        writeBAMHeader(pfi, *outLog);
+    } else { //TODO do we need to remove the txp from the list? The ids are then invalid
+        writeSAMHeader(pfi, *outLog,
+                mopts->filterGenomics or mopts->filterMicrobiom or mopts->filterMicrobiomBestScore,
+                gene_names,
+                rrna_names);
+    }
+    // the header must precede the records of every mapping thread
+    outLog->flush();
+    return outLog;
+}
+
+// The read files (comma-separated) of a sample, and where its output goes.
+struct SampleFiles {
+    std::string reads1; // the left, or unpaired, reads
+    std::string reads2;
+    std::string outname;
+};
+
+// A sample being mapped: its parser, output and counters exist from when
+// it is opened until it is closed.
+template<typename ParserT>
+struct Sample {
+    SampleFiles files;
+    std::unique_ptr<ParserT> parser;
+    std::unique_ptr<OutputWriter> out;
+    std::unique_ptr<ShardedHitCounters> hctrs;
+    std::chrono::steady_clock::time_point start;
+};
+
+// With ordered output, one thread parses the files, so that reads are
+// numbered in the order of the files.
+std::unique_ptr<paired_parser> makeParser(const Sample<paired_parser>& s, uint32_t nthread, size_t chunkSize,
+                                          bool ordered) {
+    std::vector<std::string> read1Vec = pufferfish::util::tokenize(s.files.reads1, ',');
+    std::vector<std::string> read2Vec = pufferfish::util::tokenize(s.files.reads2, ',');
+    uint32_t nprod = (read1Vec.size() > 1 and !ordered) ? 2 : 1;
+    return std::unique_ptr<paired_parser>(new paired_parser(read1Vec, read2Vec, nthread, nprod, chunkSize));
+}
+
+std::unique_ptr<single_parser> makeParser(const Sample<single_parser>& s, uint32_t nthread, size_t chunkSize,
+                                          bool ordered) {
+    std::vector<std::string> readVec = pufferfish::util::tokenize(s.files.reads1, ',');
+    uint32_t nprod = (readVec.size() > 1 and !ordered) ? 2 : 1;
+    return std::unique_ptr<single_parser>(new single_parser(readVec, nthread, nprod, chunkSize));
+}
+
+// Hands the samples of a run to one pool of mapping threads.  A thread that
+// runs out of the reads of a sample goes straight on to the next one, whose
+// parser was started (and output opened) while the sample drained; so no
+// thread waits for the slowest one to finish a sample.  The samples are
+// opened ahead of the threads, and closed behind them, by run().
+template<typename ParserT>
+class SamplePipeline {
+public:
+    SamplePipeline(std::vector<Sample<ParserT>>& samples, uint32_t numThreads)
+            : samples_(samples), numThreads_(numThreads), numDone_(samples.size(), 0) {}
+
+    // The s-th sample, once it is open, for a mapping thread that is done
+    // with the ones before it; null if there are only s samples.
+    Sample<ParserT>* next(size_t s) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (s >= samples_.size()) { return nullptr; }
+        furthest_ = std::max(furthest_, s + 1);
+        changed_.notify_all();
+        changed_.wait(lock, [&]() { return opened_ > s; });
+        return &samples_[s];
+    }
+
+    // Called by a mapping thread that has run out of the reads of sample s.
+    void done(size_t s) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (++numDone_[s] == numThreads_) { changed_.notify_all(); }
+    }
+
+    // Opens each sample once a thread has started on the one before it (and
+    // no more than maxOpen are open), and closes each, in order, once every
+    // thread is done with it; returns when all samples are closed.
+    template<typename OpenFn, typename CloseFn>
+    void run(OpenFn&& open, CloseFn&& close) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (closed_ < samples_.size()) {
+            if (opened_ < samples_.size() and opened_ <= furthest_ and opened_ - closed_ < maxOpen) {
+                lock.unlock();
+                open(samples_[opened_]);
+                lock.lock();
+                ++opened_;
+                changed_.notify_all();
+            } else if (numDone_[closed_] == numThreads_) {
+                lock.unlock();
+                close(samples_[closed_]);
+                lock.lock();
+                ++closed_;
+            } else {
+                changed_.wait(lock);
+            }
+        }
+    }
+
+private:
+    // the sample being closed, one being mapped and the next being parsed
+    static constexpr const size_t maxOpen = 3;
+    std::vector<Sample<ParserT>>& samples_;
+    uint32_t numThreads_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::vector<uint32_t> numDone_;
+    size_t opened_{0};
+    size_t closed_{0};
+    // one past the last sample a thread has asked for
+    size_t furthest_{0};
+};
+
+// Maps the reads of every sample with one pool of nthread threads, each
+// calling mapSample(sample, thread index) on one sample after another.
+template<typename ParserT, typename PufferfishIndexT, typename MapSampleFn>
+void mapSamples(
+        PufferfishIndexT &pfi,
+        const std::vector<SampleFiles>& files,
+        phmap::flat_hash_set<std::string>& gene_names,
+        phmap::flat_hash_set<std::string>& rrna_names,
+        std::vector<MappingThreadContext>& tctxs,
+        const pufferfish::numa::Topology& topo,
+        std::shared_ptr<spdlog::logger> consoleLog,
+        pufferfish::AlignmentOpts *mopts,
+        MapSampleFn&& mapSample) {
+    ScopedTimer timer(!mopts->quiet);
+    uint32_t nthread = mopts->numThreads;
+    // the most reads in a chunk; smaller ones are handed out unless --fixedChunks
+    size_t chunkSize{10000};
+    // with --ordered, how far past the oldest read whose output is unwritten
+    // the threads may map; enough for every thread to have a chunk in hand
+    uint64_t orderWindow = 2 * static_cast<uint64_t>(nthread) * chunkSize;
+    // threads inflating the blocks of each BGZF read file
+    uint32_t decompressionThreads = mopts->decompressionThreads > 0 ? mopts->decompressionThreads
+                                                                    : std::max(nthread / 8, 1u);
+    bool batch = files.size() > 1;
+
+    std::vector<Sample<ParserT>> samples(files.size());
+    for (size_t i = 0; i < files.size(); ++i) { samples[i].files = files[i]; }
+    SamplePipeline<ParserT> pipeline(samples, nthread);
+
+    auto open = [&](Sample<ParserT>& s) {
+        s.out = openOutput(pfi, s.files.outname, gene_names, rrna_names, consoleLog, mopts);
+        s.hctrs.reset(new ShardedHitCounters(nthread));
+        s.parser = makeParser(s, nthread, chunkSize, mopts->orderedOutput);
+        s.parser->setDecompressionThreads(decompressionThreads);
+        s.parser->setAdaptiveScheduling(!mopts->fixedChunks);
+        if (mopts->orderedOutput and s.out) {
+            // output waiting for its turn is then at most that of orderWindow reads
+            s.parser->setReadWindow(&s.out->nextRecord(), orderWindow);
+            auto* parser = s.parser.get();
+            s.out->setOnAdvance([parser]() { parser->windowMoved(); });
+        }
+        {
+            // the parsing threads inherit our affinity; keep them on the first node
+            std::unique_ptr<pufferfish::numa::ScopedNodeAffinity> onFirstNode{nullptr};
+            if (mopts->pinThreads) { onFirstNode.reset(new pufferfish::numa::ScopedNodeAffinity(topo, 0)); }
+            s.parser->start();
+        }
+        s.start = std::chrono::steady_clock::now();
+        if (batch) {
+            consoleLog->info("mapping reads of {} to {} ...", s.files.reads1, s.files.outname);
+        } else {
+            consoleLog->info("mapping reads ... \n\n\n");
+        }
+    };
+    auto close = [&](Sample<ParserT>& s) {
+        s.parser->stop();
+        consoleLog->info("flushing output queue.");
+        if (batch) {
+            std::chrono::duration<double> took = std::chrono::steady_clock::now() - s.start;
+            consoleLog->info("done with {} after {:.1f} s", s.files.outname, took.count());
+        }
+        printAlignmentSummary(*s.hctrs, consoleLog);
+        if (s.out and mopts->pamV2) { writePAMv2Index(*s.out); }
+        closeOutput(s.out.get(), consoleLog, mopts->orderedOutput);
+        // let go of the buffers of the sample; later ones need the memory
+        s.parser.reset();
+        s.out.reset();
+        s.hctrs.reset();
+    };
+
+    pufferfish::perf::TickCalibration calibration;
+    auto mapStart = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < nthread; ++i) {
+        threads.emplace_back([&, i]() {
+            for (size_t s = 0; auto* sample = pipeline.next(s); ++s) {
+                mapSample(*sample, i);
+                pipeline.done(s);
+            }
+        });
+    }
+    pipeline.run(open, close);
+    for (auto& t : threads) { t.join(); }
+    std::chrono::duration<double> mapTime = std::chrono::steady_clock::now() - mapStart;
 
-    std::streambuf *outBuf;
-    std::ofstream outFile;
-    std::unique_ptr<std::ostream> outStream{nullptr};
-    //bool haveOutputFile{false} ;
-    std::shared_ptr<spdlog::logger> outLog{nullptr};
+    if (mopts->pinThreads) { printNumaSummary(tctxs, topo, mapTime.count(), consoleLog); }
+    if (!mopts->perfReport.empty()) { writePerfReport(tctxs, calibration, mapTime.count(), consoleLog, mopts); }
+}
+
+template<typename PufferfishIndexT>
+bool alignReads(
+        PufferfishIndexT &pfi,
+        const std::vector<SampleFiles>& files,
+        std::shared_ptr<spdlog::logger> consoleLog,
+        pufferfish::AlignmentOpts *mopts) {
 
     phmap::flat_hash_set<std::string> gene_names;
     if (mopts->filterGenomics or mopts->filterMicrobiomBestScore) {
@@ -973,95 +1736,71 @@ bool alignReads(
     }
 
 
-    if (!mopts->noOutput) {
-        if (mopts->outname == "-") {
-            outBuf = std::cout.rdbuf();
-        } else {
-            outFile.open(mopts->outname);
-            outBuf = outFile.rdbuf();
-            //haveOutputFile = true ;
-        }
+    MutexT iomutex;
+    pufferfish::numa::Topology topo;
+    if (mopts->pinThreads) { topo = pufferfish::numa::detectTopology(); }
+    std::vector<std::unique_ptr<compact::vector<uint64_t, 2>>> refseqReplicas;
+    auto tctxs = makeThreadContexts(pfi, topo, refseqReplicas, consoleLog, mopts);
 
-        // out stream to the buffer
-        // it can be std::cerr or a file
-        if (mopts->compressedOutput) {
-            outStream.reset(new zstr::ostream(outBuf));
-        } else {
-            outStream.reset(new std::ostream(outBuf));
+    if (!mopts->singleEnd) {
+        mapSamples<paired_parser>(pfi, files, gene_names, rrna_names, tctxs, topo, consoleLog, mopts,
+                                  [&](Sample<paired_parser>& s, size_t i) {
+            processReadsPair<PufferfishIndexT>(s.parser.get(), pfi, &iomutex, s.out.get(), s.hctrs->shard(i),
+                                               *s.hctrs, gene_names, rrna_names, mopts, &tctxs[i]);
+        });
+    } else {
+        mapSamples<single_parser>(pfi, files, gene_names, rrna_names, tctxs, topo, consoleLog, mopts,
+                                  [&](Sample<single_parser>& s, size_t i) {
+            processReadsSingle<PufferfishIndexT>(s.parser.get(), pfi, &iomutex, s.out.get(), s.hctrs->shard(i),
+                                                 *s.hctrs, gene_names, mopts, &tctxs[i]);
+        });
+    }
+    return true;
+}
+
+// The samples to map: the reads given or, with --batchOfReads, each of the
+// read files (pairs) listed in the files given, written to the output name
+// followed by the name of the (left) read file.
+std::vector<SampleFiles> listSamples(std::shared_ptr<spdlog::logger> consoleLog, pufferfish::AlignmentOpts *mopts) {
+    std::vector<SampleFiles> samples;
+    if (!mopts->listOfReads) {
+        samples.push_back({mopts->singleEnd ? mopts->unmatedReads : mopts->read1, mopts->read2, mopts->outname});
+    } else if (mopts->singleEnd) {
+        std::ifstream unmatedReadsF(mopts->unmatedReads);
+        std::string reads;
+        while (unmatedReadsF >> reads) {
+            uint64_t start = reads.find_last_of('/');
+            uint64_t end = reads.find_last_of('.');
+            samples.push_back({reads, "", mopts->outname + reads.substr(start + 1, end - start - 1)});
         }
-        // the async queue size must be a power of 2
-        size_t queueSize{2*mopts->numThreads};
-        spdlog::set_async_mode(queueSize);
-
-        if (mopts->krakOut || mopts->salmonOut) {
-            auto outputSink = std::make_shared<ostream_bin_sink_mt>(*outStream);
-            outLog = std::make_shared<spdlog::logger>("puffer::outLog", outputSink);
-            outLog->set_pattern("");
-        } else {
-            auto outputSink = std::make_shared<spdlog::sinks::ostream_sink_mt>(*outStream);
-            outLog = std::make_shared<spdlog::logger>("puffer::outLog", outputSink);
-            outLog->set_pattern("%v");
+    } else {
+        std::ifstream readF1(mopts->read1);
+        std::ifstream readF2(mopts->read2);
+        std::string reads1, reads2;
+        while (readF1 >> reads1) {
+            if (!(readF2 >> reads2)) {
+                consoleLog->error("{} lists more read files than {}", mopts->read1, mopts->read2);
+                std::exit(1);
+            }
+            uint64_t start = reads1.find_last_of('/');
+            uint64_t end = reads1.find_last_of('_');
+            samples.push_back({reads1, reads2, mopts->outname + reads1.substr(start + 1, end - start - 1)});
         }
-        // write the SAM Header
-        // If nothing gets printed by this time we are in trouble
-        if (mopts->krakOut || mopts->salmonOut) {
-            writeKrakOutHeader(pfi, outLog, mopts);
-        } else { //TODO do we need to remove the txp from the list? The ids are then invalid
-            writeSAMHeader(pfi, outLog,
-                    mopts->filterGenomics or mopts->filterMicrobiom or mopts->filterMicrobiomBestScore,
-                    gene_names,
-                    rrna_names);
+        if (readF2 >> reads2) {
+            consoleLog->error("{} lists more read files than {}", mopts->read2, mopts->read1);
+            std::exit(1);
         }
     }
-
-    uint32_t nthread = mopts->numThreads;
-    std::unique_ptr<paired_parser> pairParserPtr{nullptr};
-    std::unique_ptr<single_parser> singleParserPtr{nullptr};
-
-    size_t chunkSize{10000};
-    MutexT iomutex;
-
     if (!mopts->singleEnd) {
-        ScopedTimer timer(!mopts->quiet);
-        HitCounters hctrs;
-        consoleLog->info("mapping reads ... \n\n\n");
-        std::vector<std::string> read1Vec = pufferfish::util::tokenize(mopts->read1, ',');
-        std::vector<std::string> read2Vec = pufferfish::util::tokenize(mopts->read2, ',');
-
-        if (read1Vec.size() != read2Vec.size()) {
-            consoleLog->error("The number of provided files for"
-                              "-1 and -2 are not same!");
-            std::exit(1);
+        for (auto& s : samples) {
+            if (pufferfish::util::tokenize(s.reads1, ',').size() != pufferfish::util::tokenize(s.reads2, ',').size()) {
+                consoleLog->error("The number of provided files for"
+                                  "-1 and -2 are not same!");
+                std::exit(1);
+            }
         }
-
-        uint32_t nprod = (read1Vec.size() > 1) ? 2 : 1;
-        pairParserPtr.reset(new paired_parser(read1Vec, read2Vec, nthread, nprod, chunkSize));
-        pairParserPtr->start();
-        spawnProcessReadsThreads(nthread, pairParserPtr.get(), pfi, iomutex,
-                                 outLog, hctrs, gene_names, rrna_names, mopts);
-        pairParserPtr->stop();
-        consoleLog->info("flushing output queue.");
-        printAlignmentSummary(hctrs, consoleLog);
-        if (outLog) { outLog->flush(); }
-    } else {
-        ScopedTimer timer(!mopts->quiet);
-        HitCounters hctrs;
-        consoleLog->info("mapping reads ... \n\n\n");
-        std::vector<std::string> readVec = pufferfish::util::tokenize(mopts->unmatedReads, ',');
-
-        uint32_t nprod = (readVec.size() > 1) ? 2 : 1;
-        singleParserPtr.reset(new single_parser(readVec, nthread, nprod, chunkSize));
-        singleParserPtr->start();
-
-        spawnProcessReadsThreads(nthread, singleParserPtr.get(), pfi, iomutex,
-                                 outLog, hctrs, gene_names, mopts);
-
-        singleParserPtr->stop();
-        consoleLog->info("flushing output queue.");
-        printAlignmentSummary(hctrs, consoleLog);
-        if (outLog) { outLog->flush(); }
     }
-    return true;
+    return samples;
 }
 
 template<typename PufferfishIndexT>
@@ -1069,38 +1808,62 @@ bool alignReadsWrapper(
         PufferfishIndexT &pfi,
         std::shared_ptr<spdlog::logger> consoleLog,
         pufferfish::AlignmentOpts *mopts) {
-    bool res = true;
-    if (mopts->listOfReads) {
-        if (mopts->singleEnd) {
-            std::string unmatedReadsFile = mopts->unmatedReads;
-            std::ifstream unmatedReadsF(unmatedReadsFile);
-            while (unmatedReadsF.good()) {
-                unmatedReadsF >> mopts->unmatedReads;
-                uint64_t start = mopts->unmatedReads.find_last_of('/');
-                uint64_t end = mopts->unmatedReads.find_last_of('.');
-                mopts->outname += mopts->unmatedReads.substr(start + 1, end - start - 1);
-                res &= alignReads(pfi, consoleLog, mopts);
-            }
-        } else {
-            std::string readFile1 = mopts->read1;
-            std::string readFile2 = mopts->read2;
-            std::ifstream readF1(readFile1);
-            std::ifstream readF2(readFile2);
-            std::string outname = mopts->outname;
-            while (readF1.good() and readF2.good()) {
-                readF1 >> mopts->read1;
-                readF2 >> mopts->read2;
-                uint64_t start = mopts->read1.find_last_of('/');
-                uint64_t end = mopts->read1.find_last_of('_');
-                mopts->outname = outname + mopts->read1.substr(start + 1, end - start - 1);
-//                std::cerr << mopts->read1 << "\n";
-//                std::cerr << mopts->read2 << "\n";
-//                std::cerr << mopts->outname << "\n";
-                res &= alignReads(pfi, consoleLog, mopts);
-            }
-        }
-    } else res &= alignReads(pfi, consoleLog, mopts);
-    return res;
+    auto samples = listSamples(consoleLog, mopts);
+    if (samples.empty()) {
+        consoleLog->error("no reads to map");
+        return false;
+    }
+    return alignReads(pfi, samples, consoleLog, mopts);
+}
+
+// Fault the mmapped parts of the index (the contig and reference
+// sequences of a sparse or lossy index) in on background threads, so that
+// this overlaps with the start-up of the read parsers instead of stalling
+// the first reads on page faults.
+template<typename PufferfishIndexT>
+std::vector<std::thread> startBackgroundPageIn(PufferfishIndexT &pfi, std::shared_ptr<spdlog::logger> consoleLog) {
+    std::vector<std::thread> pagers;
+    auto pageIn = [consoleLog](const compact::vector<uint64_t, 2>* v, std::string name) {
+        auto start = std::chrono::steady_clock::now();
+        volatile uint64_t sink = v->touch_pages();
+        (void)sink;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        consoleLog->info("{} is ready ({:.1f} MiB paged in in {:.2f} s)", name,
+                         v->bytes() / (1024.0 * 1024.0), elapsed.count());
+    };
+    if (pfi.getSeq().is_mmapped()) {
+        pagers.emplace_back(pageIn, &pfi.getSeq(), "contig sequence");
+    }
+    if (pfi.getRefSeq().is_mmapped()) {
+        pagers.emplace_back(pageIn, &pfi.getRefSeq(), "reference sequence");
+    }
+    if (!pagers.empty()) {
+        consoleLog->info("paging in {} index component(s) in the background", pagers.size());
+    } else {
+        consoleLog->warn("--backgroundPageIn has no effect: no part of this index is memory-mapped "
+                         "(a dense index is read into memory when it is loaded)");
+    }
+    return pagers;
+}
+
+template<typename PufferfishIndexT>
+bool loadIndexAndAlign(
+        const std::string& indexDir,
+        pufferfish::util::IndexLoadingOpts loadOpts,
+        const pufferfish::numa::Topology& numaTopo,
+        std::shared_ptr<spdlog::logger> consoleLog,
+        pufferfish::AlignmentOpts *mopts) {
+    std::unique_ptr<PufferfishIndexT> pfi{nullptr};
+    {
+        std::unique_ptr<pufferfish::numa::ScopedInterleavePolicy> interleave{nullptr};
+        if (mopts->numaInterleave) { interleave.reset(new pufferfish::numa::ScopedInterleavePolicy(numaTopo)); }
+        pfi.reset(new PufferfishIndexT(indexDir, loadOpts));
+    }
+    std::vector<std::thread> pagers;
+    if (mopts->backgroundPageIn) { pagers = startBackgroundPageIn(*pfi, consoleLog); }
+    bool success = alignReadsWrapper(*pfi, consoleLog, mopts);
+    for (auto& t : pagers) { t.join(); }
+    return success;
 }
 
 int pufferfishAligner(pufferfish::AlignmentOpts &alnargs) {
@@ -1118,15 +1881,25 @@ int pufferfishAligner(pufferfish::AlignmentOpts &alnargs) {
         infoStream.close();
     }
 
+    pufferfish::util::IndexLoadingOpts loadOpts;
+    loadOpts.use_huge_pages = alnargs.useHugePages;
+
+    // With --numaInterleave the pages of the index are spread over all
+    // nodes so that no single memory controller serves every thread.
+    pufferfish::numa::Topology numaTopo;
+    if (alnargs.numaInterleave) {
+        numaTopo = pufferfish::numa::detectTopology();
+        if (numaTopo.numNodes() < 2) {
+            consoleLog->info("only one NUMA node found; ignoring --numaInterleave");
+        }
+    }
+
     if (indexType == "dense") {
-        PufferfishIndex pfi(indexDir);
-        success = alignReadsWrapper(pfi, consoleLog, &alnargs);
+        success = loadIndexAndAlign<PufferfishIndex>(indexDir, loadOpts, numaTopo, consoleLog, &alnargs);
     } else if (indexType == "sparse") {
-        PufferfishSparseIndex pfi(indexDir);
-        success = alignReadsWrapper(pfi, consoleLog, &alnargs);
+        success = loadIndexAndAlign<PufferfishSparseIndex>(indexDir, loadOpts, numaTopo, consoleLog, &alnargs);
     } else if (indexType == "lossy") {
-        PufferfishLossyIndex pfi(indexDir);
-        success = alignReadsWrapper(pfi, consoleLog, &alnargs);
+        success = loadIndexAndAlign<PufferfishLossyIndex>(indexDir, loadOpts, numaTopo, consoleLog, &alnargs);
     }
 
     if (!success) {
@@ -33,6 +33,7 @@ PufferfishIndex::PufferfishIndex(const std::string& indexDir, pufferfish::util::
     twok_ = 2 * k_;
   }
   haveEdges_ = opts.try_loading_edges and haveEdges_;
+  lookupK_ = (opts.fixed_k_lookup and pufferfish::util::isSpecializedK(k_)) ? k_ : 0;
   haveRefSeq_ = opts.try_loading_ref_seqs and haveRefSeq_;
   haveEqClasses_ = opts.try_loading_eqclasses and haveEqClasses_;
 
@@ -91,7 +92,7 @@ PufferfishIndex::PufferfishIndex(const std::string& indexDir, pufferfish::util::
     std::string hfile = indexDir + "/" + pufferfish::util::MPH;
     std::ifstream hstream(hfile);
     hash_.reset(new boophf_t);
-    hash_->load(hstream);
+    hash_->load(hstream, opts.use_huge_pages);
     hstream.close();
     hash_raw_ = hash_.get();
   }
@@ -114,7 +115,7 @@ PufferfishIndex::PufferfishIndex(const std::string& indexDir, pufferfish::util::
   {
     CLI::AutoTimer timer{"Loading sequence", CLI::Timer::Big};
     std::string sfile = indexDir + "/" + pufferfish::util::SEQ;
-    seq_.deserialize(sfile, false);
+    seq_.deserialize(sfile, false, opts.use_huge_pages);
     lastSeqPos_ = seq_.size() - k_;
   }
 
@@ -123,14 +124,14 @@ PufferfishIndex::PufferfishIndex(const std::string& indexDir, pufferfish::util::
     std::string pfile = indexDir + "/" + pufferfish::util::POS;
     auto bits_per_element = compact::get_bits_per_element(pfile);
     pos_.set_m_bits(bits_per_element);
-    pos_.deserialize(pfile, false);
+    pos_.deserialize(pfile, false, opts.use_huge_pages);
     //auto f = std::async(std::launch::async, &pos_vector_t::touch_all_pages, &pos_, bits_per_element);
   }
 
   if (haveRefSeq_) {
     CLI::AutoTimer timer{"Loading reference sequence", CLI::Timer::Big};
     std::string pfile = indexDir + "/" + pufferfish::util::REFSEQ;
-    refseq_.deserialize(pfile, false);
+    refseq_.deserialize(pfile, false, opts.use_huge_pages);
   }
 
   {
@@ -157,7 +158,8 @@ PufferfishIndex::PufferfishIndex(const std::string& indexDir, pufferfish::util::
  * provided Canonical kmer (including the oritentation of the match).  The provided
  * QueryCache argument will be used to avoid redundant rank / select operations if feasible.
  */
-auto PufferfishIndex::getRefPos(CanonicalKmer& mer, pufferfish::util::QueryCache& qc)
+template <uint32_t K>
+auto PufferfishIndex::getRefPosImpl_(CanonicalKmer& mer, pufferfish::util::QueryCache& qc)
     -> pufferfish::util::ProjectedHits {
   using IterT = std::vector<pufferfish::util::Position>::iterator;
   auto km = mer.getCanonicalWord();
@@ -178,7 +180,7 @@ auto PufferfishIndex::getRefPos(CanonicalKmer& mer, pufferfish::util::QueryCache
           core::range<IterT>{}};
     }
     */
-    uint64_t fk = seq_.get_int(2*pos, 2*k_);
+    uint64_t fk = kmerWordAt<K>(pos);
 
 
     // say how the kmer fk matches mer; either
@@ -243,13 +245,14 @@ auto PufferfishIndex::getRefPos(CanonicalKmer& mer, pufferfish::util::QueryCache
           core::range<IterT>{}};
 }
 
-auto PufferfishIndex::getRefPos(CanonicalKmer& mer) -> pufferfish::util::ProjectedHits {
+template <uint32_t K>
+auto PufferfishIndex::getRefPosImpl_(CanonicalKmer& mer) -> pufferfish::util::ProjectedHits {
   using IterT = std::vector<pufferfish::util::Position>::iterator;
   auto km = mer.getCanonicalWord();
   size_t res = hash_raw_->lookup(km);
   if (res < numKmers_) {
     uint64_t pos = const_cast<const pos_vector_t&>(pos_)[res];
-    uint64_t fk = seq_.get_int(2*pos, 2*k_);
+    uint64_t fk = kmerWordAt<K>(pos);
     // say how the kmer fk matches mer; either
     // identity, twin (i.e. rev-comp), or no match
     auto keq = mer.isEquivalent(fk);
@@ -303,3 +306,16 @@ auto PufferfishIndex::getRefPos(CanonicalKmer& mer) -> pufferfish::util::Project
 }
 
 PufferfishIndex::~PufferfishIndex() { }
+
+auto PufferfishIndex::getRefPos(CanonicalKmer& mer, pufferfish::util::QueryCache& qc)
+    -> pufferfish::util::ProjectedHits {
+  return pufferfish::util::dispatchOnK(lookupK_, [this, &mer, &qc](auto kc) {
+    return this->template getRefPosImpl_<decltype(kc)::value>(mer, qc);
+  });
+}
+
+auto PufferfishIndex::getRefPos(CanonicalKmer& mer) -> pufferfish::util::ProjectedHits {
+  return pufferfish::util::dispatchOnK(lookupK_, [this, &mer](auto kc) {
+    return this->template getRefPosImpl_<decltype(kc)::value>(mer);
+  });
+}
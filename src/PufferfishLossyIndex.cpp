@@ -32,6 +32,7 @@ PufferfishLossyIndex::PufferfishLossyIndex(const std::string& indexDir, pufferfi
     twok_ = 2 * k_;
   } 
   haveEdges_ = opts.try_loading_edges and haveEdges_;
+  lookupK_ = (opts.fixed_k_lookup and pufferfish::util::isSpecializedK(k_)) ? k_ : 0;
   haveRefSeq_ = opts.try_loading_ref_seqs and haveRefSeq_;
   haveEqClasses_ = opts.try_loading_eqclasses and haveEqClasses_;
 
@@ -90,7 +91,7 @@ PufferfishLossyIndex::PufferfishLossyIndex(const std::string& indexDir, pufferfi
     std::string hfile = indexDir + "/" + pufferfish::util::MPH;
     std::ifstream hstream(hfile);
     hash_.reset(new boophf_t);
-    hash_->load(hstream);
+    hash_->load(hstream, opts.use_huge_pages);
     hstream.close();
     hash_raw_ = hash_.get();
   }
@@ -105,7 +106,7 @@ PufferfishLossyIndex::PufferfishLossyIndex(const std::string& indexDir, pufferfi
   {
     CLI::AutoTimer timer{"Loading sequence", CLI::Timer::Big};
     std::string sfile = indexDir + "/" + pufferfish::util::SEQ;
-    seq_.deserialize(sfile, true);
+    seq_.deserialize(sfile, true, opts.use_huge_pages);
     lastSeqPos_ = seq_.size() - k_;
   }
 
@@ -122,13 +123,13 @@ PufferfishLossyIndex::PufferfishLossyIndex(const std::string& indexDir, pufferfi
     std::string pfile = indexDir + "/" + pufferfish::util::SAMPLEPOS;
     auto bits_per_element = compact::get_bits_per_element(pfile);
     sampledPos_.set_m_bits(bits_per_element);
-    sampledPos_.deserialize(pfile, false);
+    sampledPos_.deserialize(pfile, false, opts.use_huge_pages);
   }
 
   if (haveRefSeq_) {
     CLI::AutoTimer timer{"Loading reference sequence", CLI::Timer::Big};
     std::string pfile = indexDir + "/" + pufferfish::util::REFSEQ;
-    refseq_.deserialize(pfile, true);
+    refseq_.deserialize(pfile, true, opts.use_huge_pages);
   }
 
   {
@@ -150,7 +151,8 @@ PufferfishLossyIndex::PufferfishLossyIndex(const std::string& indexDir, pufferfi
  * provided Canonical kmer (including the oritentation of the match).  The provided
  * QueryCache argument will be used to avoid redundant rank / select operations if feasible.
  */
-auto PufferfishLossyIndex::getRefPos(CanonicalKmer& mer, pufferfish::util::QueryCache& qc)
+template <uint32_t K>
+auto PufferfishLossyIndex::getRefPosImpl_(CanonicalKmer& mer, pufferfish::util::QueryCache& qc)
     -> pufferfish::util::ProjectedHits {
   using IterT = std::vector<pufferfish::util::Position>::iterator;
   auto km = mer.getCanonicalWord();
@@ -174,8 +176,7 @@ auto PufferfishLossyIndex::getRefPos(CanonicalKmer& mer, pufferfish::util::Query
           core::range<IterT>{}};
     }
     */
-    uint64_t twopos = pos << 1;
-    uint64_t fk = seq_.get_int(twopos, twok_);
+    uint64_t fk = kmerWordAt<K>(pos);
     // say how the kmer fk matches mer; either
     // identity, twin (i.e. rev-comp), or no match
     auto keq = mer.isEquivalent(fk);
@@ -240,7 +241,8 @@ auto PufferfishLossyIndex::getRefPos(CanonicalKmer& mer, pufferfish::util::Query
           core::range<IterT>{}};
 }
 
-auto PufferfishLossyIndex::getRefPos(CanonicalKmer& mer) -> pufferfish::util::ProjectedHits {
+template <uint32_t K>
+auto PufferfishLossyIndex::getRefPosImpl_(CanonicalKmer& mer) -> pufferfish::util::ProjectedHits {
   using IterT = std::vector<pufferfish::util::Position>::iterator;
   auto km = mer.getCanonicalWord();
   size_t res = hash_raw_->lookup(km);
@@ -250,8 +252,7 @@ auto PufferfishLossyIndex::getRefPos(CanonicalKmer& mer) -> pufferfish::util::Pr
     auto currRank = presenceRank_.rank(res);
     pos = sampledPos_[currRank];
 
-    uint64_t twopos = pos << 1;
-    uint64_t fk = seq_.get_int(twopos, twok_);
+    uint64_t fk = kmerWordAt<K>(pos);
     // say how the kmer fk matches mer; either
     // identity, twin (i.e. rev-comp), or no match
     auto keq = mer.isEquivalent(fk);
@@ -307,3 +308,16 @@ auto PufferfishLossyIndex::getRefPos(CanonicalKmer& mer) -> pufferfish::util::Pr
           k_,
           core::range<IterT>{}};
 }
+
+auto PufferfishLossyIndex::getRefPos(CanonicalKmer& mer, pufferfish::util::QueryCache& qc)
+    -> pufferfish::util::ProjectedHits {
+  return pufferfish::util::dispatchOnK(lookupK_, [this, &mer, &qc](auto kc) {
+    return this->template getRefPosImpl_<decltype(kc)::value>(mer, qc);
+  });
+}
+
+auto PufferfishLossyIndex::getRefPos(CanonicalKmer& mer) -> pufferfish::util::ProjectedHits {
+  return pufferfish::util::dispatchOnK(lookupK_, [this, &mer](auto kc) {
+    return this->template getRefPosImpl_<decltype(kc)::value>(mer);
+  });
+}
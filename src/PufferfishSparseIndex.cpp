@@ -37,6 +37,7 @@ PufferfishSparseIndex::PufferfishSparseIndex(const std::string& indexDir, puffer
     infoStream.close();
   }
   haveEdges_ = opts.try_loading_edges and haveEdges_;
+  lookupK_ = (opts.fixed_k_lookup and pufferfish::util::isSpecializedK(k_)) ? k_ : 0;
   haveRefSeq_ = opts.try_loading_ref_seqs and haveRefSeq_;
   haveEqClasses_ = opts.try_loading_eqclasses and haveEqClasses_;
   
@@ -97,7 +98,7 @@ PufferfishSparseIndex::PufferfishSparseIndex(const std::string& indexDir, puffer
     std::string hfile = indexDir + "/" + pufferfish::util::MPH;
     std::ifstream hstream(hfile);
     hash_.reset(new boophf_t);
-    hash_->load(hstream);
+    hash_->load(hstream, opts.use_huge_pages);
     hstream.close();
   }
 
@@ -111,14 +112,14 @@ PufferfishSparseIndex::PufferfishSparseIndex(const std::string& indexDir, puffer
   {
     CLI::AutoTimer timer{"Loading sequence", CLI::Timer::Big};
     std::string sfile = indexDir + "/" + pufferfish::util::SEQ;
-    seq_.deserialize(sfile, true);
+    seq_.deserialize(sfile, true, opts.use_huge_pages);
     lastSeqPos_ = seq_.size() - k_;
   }
 
   if (haveRefSeq_) {
     CLI::AutoTimer timer{"Loading reference sequence", CLI::Timer::Big};
     std::string pfile = indexDir + "/" + pufferfish::util::REFSEQ;
-    refseq_.deserialize(pfile, true);
+    refseq_.deserialize(pfile, true, opts.use_huge_pages);
   }
 
   {
@@ -159,7 +160,7 @@ PufferfishSparseIndex::PufferfishSparseIndex(const std::string& indexDir, puffer
     std::string pfile = indexDir + "/" + pufferfish::util::SAMPLEPOS;
     auto bits_per_element = compact::get_bits_per_element(pfile);
     sampledPos_.set_m_bits(bits_per_element);
-    sampledPos_.deserialize(pfile, false);
+    sampledPos_.deserialize(pfile, false, opts.use_huge_pages);
   }
 
   {
@@ -181,12 +182,13 @@ PufferfishSparseIndex::PufferfishSparseIndex(const std::string& indexDir, puffer
   }
 }
 
+template <uint32_t K>
 auto PufferfishSparseIndex::getRefPosHelper_(CanonicalKmer& mer, uint64_t pos,
                                              pufferfish::util::QueryCache& qc, bool didWalk)
     -> pufferfish::util::ProjectedHits {
   using IterT = std::vector<pufferfish::util::Position>::iterator;
   if (pos <= lastSeqPos_) {
-    uint64_t fk = seq_.get_int(2*pos, 2*k_);
+    uint64_t fk = kmerWordAt<K>(pos);
     // say how the kmer fk matches mer; either
     // identity, twin (i.e. rev-comp), or no match
     auto keq = mer.isEquivalent(fk);
@@ -263,13 +265,14 @@ auto PufferfishSparseIndex::getRefPosHelper_(CanonicalKmer& mer, uint64_t pos,
           core::range<IterT>{}};
 }
 
+template <uint32_t K>
 auto PufferfishSparseIndex::getRefPosHelper_(CanonicalKmer& mer, uint64_t pos,
                                              bool didWalk)
     -> pufferfish::util::ProjectedHits {
 
   using IterT = std::vector<pufferfish::util::Position>::iterator;
   if (pos <= lastSeqPos_) {
-    uint64_t fk = seq_.get_int(2*pos, 2*k_);
+    uint64_t fk = kmerWordAt<K>(pos);
     // say how the kmer fk matches mer; either
     // identity, twin (i.e. rev-comp), or no match
     auto keq = mer.isEquivalent(fk);
@@ -434,7 +437,9 @@ auto PufferfishSparseIndex::getRefPos(CanonicalKmer mern, pufferfish::util::Quer
     pos = sampledPos + signedShift;
   }
   // end of sampling based pos detection
-  return getRefPosHelper_(mern, pos, qc, didWalk);
+  return pufferfish::util::dispatchOnK(lookupK_, [this, &mern, pos, &qc, didWalk](auto kc) {
+    return this->template getRefPosHelper_<decltype(kc)::value>(mern, pos, qc, didWalk);
+  });
 }
 
 auto PufferfishSparseIndex::getRefPos(CanonicalKmer mern)
@@ -533,5 +538,7 @@ auto PufferfishSparseIndex::getRefPos(CanonicalKmer mern)
     pos = sampledPos + signedShift;
   }
   // end of sampling based pos detection
-  return getRefPosHelper_(mern, pos, didWalk);
+  return pufferfish::util::dispatchOnK(lookupK_, [this, &mern, pos, didWalk](auto kc) {
+    return this->template getRefPosHelper_<decltype(kc)::value>(mern, pos, didWalk);
+  });
 }
@@ -1,4 +1,5 @@
 #include "FastxParser.hpp"
+#include <chrono>
 #include <cmath>
 #include <iostream>
 #include <iterator>
@@ -29,6 +30,7 @@ int doPufferfishTestLookup(IndexT& pi, pufferfish::ValidateOptions& validateOpts
   size_t found = 0;
   size_t notFound = 0;
   size_t totalHits = 0;
+  auto lookupStart = std::chrono::steady_clock::now();
   {
     CLI::AutoTimer timer{"searching kmers", CLI::Timer::Big};
     std::vector<std::string> read_file = {validateOpts.refFile};
@@ -97,6 +99,15 @@ int doPufferfishTestLookup(IndexT& pi, pufferfish::ValidateOptions& validateOpts
   }
   std::cerr << "found = " << found << ", not found = " << notFound << "\n";
   std::cerr << "total hits = " << totalHits << "\n";
+  std::chrono::duration<double> lookupTime = std::chrono::steady_clock::now() - lookupStart;
+  // every lookup is a random access into the mphf, pos and seq arrays, so
+  // this number is dominated by TLB and cache misses; compare runs with
+  // and without --hugePages
+  std::cerr << "lookups / sec = " << static_cast<double>(found + notFound) / lookupTime.count()
+            << " (huge pages " << (validateOpts.useHugePages ? "on" : "off")
+            << ", k = " << pi.k() << " lookup "
+            << ((!validateOpts.runtimeK and pufferfish::util::isSpecializedK(pi.k())) ? "specialized" : "runtime")
+            << ")\n";
   return 0;
 }
 
@@ -111,11 +122,14 @@ int pufferfishTestLookup(pufferfish::ValidateOptions& validateOpts) {
     infoStream.close();
   }
 
+  pufferfish::util::IndexLoadingOpts loadOpts;
+  loadOpts.use_huge_pages = validateOpts.useHugePages;
+  loadOpts.fixed_k_lookup = !validateOpts.runtimeK;
   if (indexType == "sparse") { 
-    PufferfishSparseIndex pi(validateOpts.indexDir);
+    PufferfishSparseIndex pi(validateOpts.indexDir, loadOpts);
     return doPufferfishTestLookup(pi, validateOpts);
   } else if (indexType == "dense") {
-    PufferfishIndex pi(validateOpts.indexDir);
+    PufferfishIndex pi(validateOpts.indexDir, loadOpts);
     return doPufferfishTestLookup(pi, validateOpts);
   }
   return 0;
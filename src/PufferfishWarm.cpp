@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <ghc/filesystem.hpp>
+
+#include "CLI/Timer.hpp"
+#include "PufferFS.hpp"
+#include "ProgOpts.hpp"
+#include "spdlog/spdlog.h"
+
+namespace {
+// A contiguous byte range of one of the index files; the unit of work
+// handed out to the reader threads.
+struct WarmSlice {
+  size_t fileIdx;
+  uint64_t offset;
+  uint64_t length;
+};
+
+constexpr const uint64_t sliceSize = 64 * 1024 * 1024;
+constexpr const uint64_t readBufSize = 4 * 1024 * 1024;
+} // namespace
+
+/**
+ * Fault every file of the index into the page cache, so that a
+ * subsequent `align` (in particular with an mmapped sparse or lossy
+ * index) does not stall on page faults for its first minutes.
+ * The files are cut into fixed-size slices that are read by
+ * warmOpts.numThreads threads in parallel; progress is reported once
+ * per second until every slice has been read.
+ */
+int pufferfishWarm(pufferfish::WarmOptions& warmOpts) {
+  auto console = spdlog::stderr_color_mt("console");
+  auto& indexDir = warmOpts.indexDir;
+  if (!puffer::fs::DirExists(indexDir.c_str())) {
+    console->error("The index directory {} does not exist!", indexDir);
+    std::exit(1);
+  }
+
+  std::vector<std::string> files;
+  std::vector<WarmSlice> slices;
+  uint64_t totalBytes{0};
+  for (auto& entry : ghc::filesystem::directory_iterator(indexDir)) {
+    if (!entry.is_regular_file()) { continue; }
+    uint64_t fsize = entry.file_size();
+    size_t fidx = files.size();
+    files.push_back(entry.path().string());
+    for (uint64_t off = 0; off < fsize; off += sliceSize) {
+      slices.push_back({fidx, off, std::min(sliceSize, fsize - off)});
+    }
+    totalBytes += fsize;
+  }
+  console->info("warming {} files ({:.1f} MiB) of {} with {} threads", files.size(),
+                totalBytes / (1024.0 * 1024.0), indexDir, warmOpts.numThreads);
+
+  std::atomic<size_t> nextSlice{0};
+  // slices read (or given up on) so far; nextSlice only counts those claimed
+  std::atomic<size_t> slicesDone{0};
+  std::atomic<uint64_t> bytesRead{0};
+  std::atomic<uint32_t> failedSlices{0};
+  std::mutex doneMutex;
+  std::condition_variable allDone;
+
+  auto readSlice = [&](const WarmSlice& slice, std::vector<char>& buf) {
+    int fd = open(files[slice.fileIdx].c_str(), O_RDONLY);
+    if (fd < 0) {
+      ++failedSlices;
+      return;
+    }
+#if defined(POSIX_FADV_WILLNEED)
+    // let the kernel start readahead for the whole slice at once
+    posix_fadvise(fd, slice.offset, slice.length, POSIX_FADV_WILLNEED);
+#endif
+    uint64_t done{0};
+    while (done < slice.length) {
+      auto toRead = std::min(readBufSize, slice.length - done);
+      auto r = pread(fd, buf.data(), toRead, slice.offset + done);
+      if (r <= 0) {
+        ++failedSlices;
+        break;
+      }
+      done += r;
+      bytesRead += r;
+    }
+    close(fd);
+  };
+
+  auto reader = [&]() {
+    std::vector<char> buf(readBufSize);
+    size_t si;
+    while ((si = nextSlice++) < slices.size()) {
+      readSlice(slices[si], buf);
+      if (++slicesDone == slices.size()) {
+        std::lock_guard<std::mutex> lock(doneMutex);
+        allDone.notify_all();
+      }
+    }
+  };
+
+  {
+    CLI::AutoTimer timer{"Warming index", CLI::Timer::Big};
+    uint32_t nthreads = std::max(warmOpts.numThreads, 1u);
+    std::vector<std::thread> readers;
+    for (uint32_t i = 0; i < nthreads; ++i) { readers.emplace_back(reader); }
+
+    auto start = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(doneMutex);
+    while (!allDone.wait_for(lock, std::chrono::seconds(1), [&]() { return slicesDone == slices.size(); })) {
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      uint64_t b = bytesRead;
+      console->info("warmed {:.1f} / {:.1f} MiB ({:03.2f}%, {:.1f} MiB/s)", b / (1024.0 * 1024.0),
+                    totalBytes / (1024.0 * 1024.0), totalBytes > 0 ? (100.0 * b) / totalBytes : 100.0,
+                    (b / (1024.0 * 1024.0)) / elapsed.count());
+    }
+    lock.unlock();
+    for (auto& t : readers) { t.join(); }
+  }
+
+  if (failedSlices > 0) {
+    console->warn("{} slices of the index could not be read", failedSlices.load());
+    return 1;
+  }
+  console->info("index is ready: {:.1f} MiB in page cache", bytesRead / (1024.0 * 1024.0));
+  return 0;
+}